@@ -1,18 +1,77 @@
 #include "../Common/RayTracingApplication.h"
-
-struct RenderObject
+#include "../Common/BindlessRegistry.h"
+#include "../Common/Bvh.h"
+#include "../Common/DescriptorUpdateTemplate.h"
+#include "../Common/GeometryRegistry.h"
+#include "../Common/MeshImporter.h"
+#include "../Common/MeshProcessing.h"
+#include "../Common/ProceduralScene.h"
+#include "../Common/SceneCache.h"
+#include "../Common/ShaderHotReloader.h"
+#include "../Common/TaskPool.h"
+#include "../Common/VertexCompression.h"
+#include <chrono>
+#include <functional>
+#include <map>
+#include <thread>
+
+// Compares VkWriteDescriptorSet updates against update templates at startup
+//#define NVVK_DESCRIPTOR_UPDATE_BENCHMARK
+
+// Measures import throughput with different thread counts at startup. Uses the
+// -scene file, or generates a large OBJ when there is none.
+//#define NVVK_IMPORT_BENCHMARK
+
+// Builds CPU BVHs from the same VkGeometryNV arrays as the BLAS of every geometry
+// with different thread counts at startup, and logs their SAH cost and shape
+//#define NVVK_CPU_BVH_BENCHMARK
+
+// Taken during static initialization, the reference for the time to the first trace
+static const auto ProcessStartTime = std::chrono::high_resolution_clock::now();
+
+// Buffers and BLAS of one mesh, shared by all render objects with the same content,
+// see GeometryRegistry
+struct MeshGeometry
 {
-    VkGeometryNV geometry = { };
+    std::vector<VkGeometryNV> geometries; // one per cluster
+    std::vector<MeshCluster> clusters;
     VkAccelerationStructureNV bottomAS = VK_NULL_HANDLE;
     VkDeviceMemory bottomASMemory = VK_NULL_HANDLE;
+    VkDeviceSize bottomASSize = 0;
     std::array<BufferResource, 3> vertexBuffers = { };
-    BufferResource indexBuffer;
-    BufferResource indexBufferCopy;
-    BufferResource uniformBuffer;
-    ImageResource texture;
+    BufferResource positionTransform; // 3x4 dequantization matrix for half positions
+    VkFormat positionFormat = VK_FORMAT_R32G32B32_SFLOAT;
+    VkFormat texcoordFormat = VK_FORMAT_R32G32_SFLOAT;
+    BufferResource indexBuffer; // also read by the hit shaders as a storage buffer
+    std::wstring name;
     uint32_t vertexNum = 0;
-    uint16_t indexNum = 0;
+    uint32_t indexNum = 0;
+    VkIndexType indexType = VK_INDEX_TYPE_UINT16; // picked from vertexNum
+
+    // Bindless slots, the views are owned by the geometry
+    std::vector<VkBufferView> bufferViews;
+    uint32_t vertexBufferSlot = BindlessRegistry::InvalidSlot;
+    uint32_t vertexBufferSlotNum = 0;
+    uint32_t indexBufferSlot = BindlessRegistry::InvalidSlot;
+};
+
+// Vertex streams of a geometry, the layout the hit shader with the same index reads
+enum GeometryLayout : uint32_t
+{
+    GEOMETRY_LAYOUT_TEXCOORDS_NORMALS = 0, // rt_11_box.rchit
+    GEOMETRY_LAYOUT_NORMALS = 1, // rt_11_icosahedron.rchit
+};
+
+// A geometry with a material. Objects get their own object data entry and hit records,
+// so objects sharing a geometry can still be shaded differently.
+struct RenderObject
+{
+    uint32_t geometryIndex = GeometryRegistry::InvalidIndex;
+    ImageResource texture;
+    std::wstring name;
     uint32_t shaderIndex = 0;
+    uint32_t hitRecordOffset = 0; // first hit record in the SBT, one record per cluster of the geometry
+    uint32_t textureSlot = BindlessRegistry::InvalidSlot;
 };
 
 struct VertexPosition
@@ -20,12 +79,100 @@ struct VertexPosition
     float X, Y, Z;
 };
 
-struct UniformBufferContent
+// Several instances can share one object, instanceId selects the object's data
+struct ObjectInstance
+{
+    uint32_t objectIndex = 0;
+    float transform[12] = { }; // row-major 3x4
+};
+
+// One per object in the object data storage buffer, indexed by instanceId
+struct ObjectDataContent
 {
     uint32_t vertexBufferArrayOffset;
     uint32_t indexBufferArrayOffset;
     uint32_t textureArrayOffset;
-    uint32_t padding;
+    uint32_t indexType; // INDEX_TYPE_UINT16 or INDEX_TYPE_UINT32 in rt_11_*.rchit
+};
+
+// Registry tables, bound as descriptor sets 1-3 in rt_11_*.rchit
+enum BindlessTable : uint32_t
+{
+    BINDLESS_TABLE_VERTEX_BUFFERS = 0,
+    BINDLESS_TABLE_INDEX_BUFFERS = 1,
+    BINDLESS_TABLE_TEXTURES = 2,
+};
+
+// Must match layout(constant_id = ...) declarations in rt_11_*.rgen/rchit
+enum SpecializationConstantId : uint32_t
+{
+    SPECIALIZATION_LIGHT_DIRECTION_X = 0,
+    SPECIALIZATION_LIGHT_DIRECTION_Y = 1,
+    SPECIALIZATION_LIGHT_DIRECTION_Z = 2,
+    SPECIALIZATION_ROUGHNESS_BASE = 3,
+    SPECIALIZATION_ROUGHNESS_ALBEDO_SCALE = 4,
+    SPECIALIZATION_TEXTURE_FETCH_ENABLED = 5,
+    SPECIALIZATION_SHADOW_RAY_COUNT = 6,
+    SPECIALIZATION_SHADOW_LIGHT_RADIUS = 7,
+    SPECIALIZATION_SHADOW_RAY_TMIN = 8,
+    SPECIALIZATION_SHADOW_RAY_TMAX = 9,
+    SPECIALIZATION_RAY_TMIN = 10,
+    SPECIALIZATION_RAY_TMAX = 11,
+    SPECIALIZATION_PROGRESSIVE = 12,
+    SPECIALIZATION_PROGRESSIVE_MAX_SAMPLE_COUNT = 13,
+    SPECIALIZATION_PROGRESSIVE_CONVERGENCE_ERROR = 14,
+    SPECIALIZATION_AOVS_ENABLED = 15,
+};
+
+// AOVs in the order of Application::_aovDescs, bound to set 0 at AOV_FIRST_BINDING + index
+// and written by rt_11_shaders.rgen from the primary ray payload
+enum AovIndex : uint32_t
+{
+    AOV_DEPTH = 0, // r32f hit distance, 0 where the ray missed
+    AOV_NORMAL = 1, // rgba16f world space normal
+    AOV_ALBEDO = 2, // rgba8 surface color before lighting, the sky color where the ray missed
+    AOV_INSTANCE_ID = 3, // r32ui gl_InstanceCustomIndexNV, ~0 where the ray missed
+    AOV_COUNT = 4,
+};
+
+const uint32_t AOV_FIRST_BINDING = 5;
+
+// Feature toggles and constants that are compiled into the hit shaders
+// instead of being branched on at runtime
+struct ShadingPermutation
+{
+    float lightDirection[3] = { -0.85f, 0.5f, 1.0f };
+    float roughnessBase = 0.1f;
+    float roughnessAlbedoScale = 0.3f;
+    bool textureFetchEnabled = true;
+    uint32_t shadowRayCount = 0;
+    float shadowLightRadius = 0.05f;
+    float tmin = 0.001f;
+    float tmax = 100.0f;
+
+    // Accumulates jittered samples across frames while nothing changes, pixels
+    // whose mean luminance has a standard error below convergenceError, or that
+    // have maxSampleCount samples, aren't traced anymore
+    bool progressive = false;
+    uint32_t maxSampleCount = 1024;
+    float convergenceError = 0.002f;
+
+    // The AOVs are only written when they're read back, in headless mode
+    bool aovsEnabled = false;
+};
+
+// Binding 4 of set 0, one slot per swapchain image selected with a dynamic offset,
+// see UpdateDataForFrame
+struct FrameUniformContent
+{
+    uint32_t accumulatedFrameNum; // 0 discards the accumulated samples
+    uint32_t padding[3];
+};
+
+struct PipelineVariant
+{
+    VkPipeline pipeline = VK_NULL_HANDLE;
+    BufferResource shaderBindingTable;
 };
 
 class TutorialApplication : public RayTracingApplication
@@ -34,19 +181,57 @@ public:
     VkDeviceMemory _topASMemory = VK_NULL_HANDLE;
     VkAccelerationStructureNV _topAS = VK_NULL_HANDLE;
     VkPipelineLayout _rtPipelineLayout = VK_NULL_HANDLE;
-    VkPipeline _rtPipeline = VK_NULL_HANDLE;
-    BufferResource _shaderBindingTable;
+    VkPipelineCache _rtPipelineCache = VK_NULL_HANDLE;
     VkDescriptorPool _rtDescriptorPool = VK_NULL_HANDLE;
 
+    ShaderResource _rgenShader;
+    ShaderResource _missShader;
+    ShaderResource _shadowMissShader;
+    std::array<ShaderResource, 2> _chitShaders;
+    std::vector<std::pair<std::wstring, ShaderResource*>> _shaderFiles; // .spv name -> shader
+    ShaderHotReloader _shaderHotReloader;
+
+    // Pipelines are created lazily, one per permutation key
+    ShadingPermutation _shadingPermutation;
+    std::map<uint64_t, std::unique_ptr<PipelineVariant>> _pipelineVariants;
+    PipelineVariant* _activePipelineVariant = nullptr;
+
+    // Set 0 is owned by the application, sets 1-3 by the bindless registry
     std::array<VkDescriptorSetLayout, 4> _rtDescriptorSetLayouts = { };
     std::array<VkDescriptorSet, 4> _rtDescriptorSets = { };
-
-    static constexpr uint32_t _objectNum = 5;
-    std::array<RenderObject, _objectNum> _renderObjects = { };
-    std::vector<VkBufferView> _vertexBufferViews = { };
-    std::vector<VkBufferView> _indexBufferViews = { };
-    std::vector<VkImageView> _imageViews = { };
-    std::vector<VkSampler> _samplers = { };
+    BindlessRegistry _bindlessRegistry;
+
+    static constexpr uint32_t _maxClusterTriangles = 1 << 16; // larger meshes get several geometries in their BLAS
+    VkDeviceSize _hitRecordSize = 0;
+    bool _quantizePositions = false; // half positions with per-mesh scale and bias for the BLAS, where precise enough
+    uint32_t _hitRecordNum = 0;
+
+    // Sized once before the first object is created, RenderObject can't be copied
+    std::vector<RenderObject> _renderObjects;
+    BufferResource _objectDataBuffer; // ObjectDataContent per render object, set 0 binding 9
+    std::vector<std::unique_ptr<MeshGeometry>> _geometries; // by GeometryRegistry index, null for free indices
+    GeometryRegistry _geometryRegistry;
+    std::vector<ObjectInstance> _instances;
+
+    // Progressive rendering, only written by the raygen shader of progressive permutations
+    ImageResource _accumulationImageResource; // rgb = mean color, a = sample count
+    ImageResource _varianceImageResource; // summed squared luminance deviations, Welford's M2
+    BufferResource _frameUniformBuffer;
+    VkDeviceSize _frameUniformStride = 0; // FrameUniformContent rounded up to minUniformBufferOffsetAlignment
+    uint32_t _accumulatedFrameNum = 0;
+
+    // Set 0 packed in binding order, see CreateDescriptorSetLayouts
+    struct DescriptorSetContent
+    {
+        VkAccelerationStructureNV topAS;
+        VkDescriptorImageInfo outputImage;
+        VkDescriptorImageInfo accumulationImage;
+        VkDescriptorImageInfo varianceImage;
+        VkDescriptorBufferInfo frameUniformBuffer;
+        std::array<VkDescriptorImageInfo, AOV_COUNT> aovImages;
+        VkDescriptorBufferInfo objectDataBuffer;
+    };
+    DescriptorUpdateTemplate _rtDescriptorUpdateTemplate;
  
 public:
     TutorialApplication();
@@ -54,27 +239,54 @@ public:
 
     virtual void Init() override;
     virtual void RecordCommandBufferForFrame(VkCommandBuffer commandBuffer, uint32_t frameIndex) override;
+    virtual void UpdateDataForFrame(uint32_t frameIndex) override;
+    virtual void OnKeyDown(uint32_t key) override;
+
+    void CreateProceduralScene();
+    void LoadScene(const std::wstring& path);
+    void CreateSceneObjects(const SceneView& scene);
+    void RunImportBenchmark();
+    void RunCpuBvhBenchmark();
 
     void CreateAccelerationStructures();
+    void CreateAccumulationImages();
+    void CreateFrameUniformBuffer();
     void CreateDescriptorSetLayouts();
     void CreatePipeline();
-    void CreateShaderBindingTable();
+    PipelineVariant* GetPipelineVariant(const ShadingPermutation& permutation);
+    void SelectPipelineVariant(const ShadingPermutation& permutation);
+    void DestroyPipelineVariants();
+    void StartShaderHotReload();
+    void ReloadShaders();
+    void CreateShaderBindingTable(PipelineVariant& variant);
     void CreatePoolAndAllocateDescriptorSets();
     void UpdateDescriptorSets();
+    void RunDescriptorUpdateBenchmark();
+
+    void CreateBoxBufferViews(MeshGeometry& geometry);
+    void CreateIcosahedronBufferViews(MeshGeometry& geometry);
 
-    void CreateBox(RenderObject& object, const std::wstring& texturePath);
-    void CreateBoxGeometry(RenderObject& object);
-    void CreateBoxBufferViews(RenderObject& object);
+    void CreateImportedObject(RenderObject& object, const MeshView& mesh, const ImportedMaterial* material);
 
-    void CreateIcosahedron(RenderObject& object);
-    void CreateIcosahedronGeometry(RenderObject& object);
-    void CreateIcosahedronBufferViews(RenderObject& object);
+    uint32_t AcquireGeometry(const std::wstring& name, uint32_t vertexNum, const float* positions, const float* normals,
+        const float* texcoords, const std::vector<uint32_t>& indices);
+    void ReleaseGeometry(uint32_t geometryIndex);
+    void LogGeometrySharing();
+    void CreateGeometryIndexBuffer(MeshGeometry& geometry, const float* positions, std::vector<uint32_t> indices);
+    void CreatePositionBuffer(MeshGeometry& geometry, const float* positions, const std::vector<uint32_t>& indices);
+    void CreateNormalBuffer(MeshGeometry& geometry, BufferResource& buffer, const float* normals);
+    void CreateTexcoordBuffer(MeshGeometry& geometry, BufferResource& buffer, const float* texcoords);
+    void CreateGeometryBottomLevelAS(MeshGeometry& geometry);
+    VkBufferView CreateGeometryBufferView(MeshGeometry& geometry, const BufferResource& buffer, VkFormat format);
+    void DestroyGeometry(MeshGeometry& geometry);
 
-    void LoadObjectTexture(RenderObject& object, const std::wstring& path);
-    void CreateObjectBottomLevelAS(RenderObject& object);
+    void RegisterObjectTexture(RenderObject& object);
+    void CreateObjectDataBuffer();
+    void DestroyObject(RenderObject& object);
 
     void CreateAccelerationStructure(VkAccelerationStructureTypeNV type, uint32_t geometryCount,
-        VkGeometryNV* geometries, uint32_t instanceCount, VkAccelerationStructureNV& AS, VkDeviceMemory& memory);
+        VkGeometryNV* geometries, uint32_t instanceCount, VkAccelerationStructureNV& AS, VkDeviceMemory& memory,
+        VkDeviceSize* memorySize = nullptr);
 };
 
 TutorialApplication::TutorialApplication()
@@ -83,6 +295,12 @@ TutorialApplication::TutorialApplication()
     _deviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
     _deviceExtensions.push_back(VK_NV_RAY_TRACING_EXTENSION_NAME);
     _deviceExtensions.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+
+    _aovDescs.resize(AOV_COUNT);
+    _aovDescs[AOV_DEPTH] = { L"depth", VK_FORMAT_R32_SFLOAT };
+    _aovDescs[AOV_NORMAL] = { L"normal", VK_FORMAT_R16G16B16A16_SFLOAT };
+    _aovDescs[AOV_ALBEDO] = { L"albedo", VK_FORMAT_R8G8B8A8_UNORM };
+    _aovDescs[AOV_INSTANCE_ID] = { L"instance_id", VK_FORMAT_R32_UINT };
 }
 
 TutorialApplication::~TutorialApplication()
@@ -96,57 +314,39 @@ TutorialApplication::~TutorialApplication()
         vkFreeMemory(_device, _topASMemory, nullptr);
     }
 
-    for (auto& bufferView : _vertexBufferViews)
-    {
-        vkDestroyBufferView(_device, bufferView, nullptr);
-    }
-
-    for (auto& bufferView : _indexBufferViews)
-    {
-        vkDestroyBufferView(_device, bufferView, nullptr);
-    }
-
     for (auto& object : _renderObjects)
     {
-        if (object.bottomAS)
-        {
-            vkDestroyAccelerationStructureNV(_device, object.bottomAS, nullptr);
-        }
-        if (object.bottomASMemory)
-        {
-            vkFreeMemory(_device, object.bottomASMemory, nullptr);
-        }
-
-        for (auto& vertexBuffer : object.vertexBuffers)
-        {
-            vertexBuffer.Cleanup();
-        }
-
-        object.indexBuffer.Cleanup();
-        object.indexBufferCopy.Cleanup();
-        object.uniformBuffer.Cleanup();
-        object.texture.Cleanup();
+        DestroyObject(object);
     }
+    _objectDataBuffer.Cleanup();
+
+    _accumulationImageResource.Cleanup();
+    _varianceImageResource.Cleanup();
+    _frameUniformBuffer.Cleanup();
 
     if (_rtDescriptorPool)
     {
         vkDestroyDescriptorPool(_device, _rtDescriptorPool, nullptr);
     }
 
-    _shaderBindingTable.Cleanup();
+    _rtDescriptorUpdateTemplate.Cleanup();
+
+    _shaderHotReloader.Stop();
+
+    DestroyPipelineVariants();
 
-    if (_rtPipeline)
+    if (_rtPipelineCache)
     {
-        vkDestroyPipeline(_device, _rtPipeline, nullptr);
+        vkDestroyPipelineCache(_device, _rtPipelineCache, nullptr);
     }
     if (_rtPipelineLayout)
     {
         vkDestroyPipelineLayout(_device, _rtPipelineLayout, nullptr);
     }
 
-    for (auto& item : _rtDescriptorSetLayouts)
+    if (_rtDescriptorSetLayouts[0])
     {
-        vkDestroyDescriptorSetLayout(_device, item, nullptr);
+        vkDestroyDescriptorSetLayout(_device, _rtDescriptorSetLayouts[0], nullptr);
     }
 }
 
@@ -154,38 +354,160 @@ void TutorialApplication::Init()
 {
     InitRayTracing();
 
-    CreateBox(_renderObjects[0], L"cb0.bmp");
-    CreateIcosahedron(_renderObjects[1]);
-    CreateBox(_renderObjects[2], L"cb1.bmp");
-    CreateBox(_renderObjects[3], L"cb2.bmp");
-    CreateIcosahedron(_renderObjects[4]);
+    // Objects register their resources in the bindless tables as they are created
+    CreateDescriptorSetLayouts();
+
+#ifdef NVVK_IMPORT_BENCHMARK
+    RunImportBenchmark();
+#endif
+
+    if (_settings.ScenePath.empty())
+    {
+        CreateProceduralScene();
+    }
+    else
+    {
+        LoadScene(_settings.ScenePath);
+    }
+    LogGeometrySharing();
+
+#ifdef NVVK_CPU_BVH_BENCHMARK
+    RunCpuBvhBenchmark();
+#endif
 
     CreateAccelerationStructures();
-    CreateDescriptorSetLayouts();
+    CreateAccumulationImages();
+    CreateFrameUniformBuffer();
     CreatePipeline();
-    CreateShaderBindingTable();
+    _shadingPermutation.aovsEnabled = _settings.Headless;
+    SelectPipelineVariant(_shadingPermutation);
     CreatePoolAndAllocateDescriptorSets();
     UpdateDescriptorSets();
+
+#ifdef NVVK_DESCRIPTOR_UPDATE_BENCHMARK
+    RunDescriptorUpdateBenchmark();
+#endif
+
+    StartShaderHotReload();
 }
 
-template< typename T >
-void CreateBufferAndUploadData( BufferResource& buffer, VkBufferUsageFlags usage, const std::vector<T>& content )
+void TutorialApplication::CreateProceduralScene()
 {
-    const VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    ImportedScene scene;
+    GenerateProceduralScene(_basePath + L"/Assets/Textures/", scene);
+    CreateSceneObjects(scene.GetView());
+}
+
+static bool HasSceneCacheExtension(const std::wstring& path)
+{
+    const std::wstring extension = L".vkscene";
+    return path.size() >= extension.size() && _wcsicmp(path.c_str() + path.size() - extension.size(), extension.c_str()) == 0;
+}
+
+// A .vkscene file is mapped directly. Other files are imported once and cached
+// next to the source as <path>.vkscene, which is used as long as the source
+// keeps its size and timestamp.
+void TutorialApplication::LoadScene(const std::wstring& path)
+{
+    TaskPool taskPool;
+    SceneCache cache;
+    ImportedScene importedScene;
+    SceneView scene;
+    std::wstring error;
+
+    const bool isCache = HasSceneCacheExtension(path);
+    const std::wstring cachePath = isCache ? path : path + L".vkscene";
+
+    const auto loadStart = std::chrono::high_resolution_clock::now();
+    if (cache.Load(cachePath, taskPool, true, error) && (isCache || cache.IsUpToDate(path)))
+    {
+        scene = cache.GetView();
+
+        const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - loadStart).count();
+        std::wcout << cachePath << L": " << cache.GetFileSize() / (1024.0 * 1024.0) << L" MB, " << scene.Meshes.size() << L" meshes, "
+            << scene.Instances.size() << L" instances loaded from the cache in " << milliseconds << L" ms\n";
+    }
+    else if (isCache)
+    {
+        ExitError(L"Failed to load " + path + L": " + error);
+    }
+    else
+    {
+        ImportStats stats;
+        if (!ImportScene(path, taskPool, importedScene, stats, error))
+        {
+            ExitError(L"Failed to import " + path + L": " + error);
+        }
+        scene = importedScene.GetView();
+
+        std::wcout << path << L": " << stats.TriangleNum << L" triangles, " << stats.VertexNum << L" vertices, "
+            << scene.Meshes.size() << L" meshes, " << scene.Instances.size() << L" instances imported in " << stats.Milliseconds
+            << L" ms on " << stats.ThreadNum << L" threads (" << stats.GetTrianglesPerSecond() / 1000000.0 << L" Mtris/s)\n";
+
+        // A missing cache only costs the next start the import again
+        if (!WriteSceneCache(cachePath, scene, path, error))
+        {
+            std::wcout << L"Failed to write the scene cache: " << error << L"\n";
+        }
+    }
+
+    if (scene.Meshes.empty() || scene.Instances.empty())
+    {
+        ExitError(path + L" contains no triangle meshes");
+    }
+
+    // Scale and center the scene to the space the procedural objects use in front of the camera
+    scene.FitToSize(2.0f);
+    CreateSceneObjects(scene);
+}
+
+// One render object per mesh, one instance per scene instance
+void TutorialApplication::CreateSceneObjects(const SceneView& scene)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    _renderObjects.resize(scene.Meshes.size());
+    for (size_t i = 0; i < scene.Meshes.size(); i++)
+    {
+        const MeshView& mesh = scene.Meshes[i];
+        const ImportedMaterial* material = mesh.MaterialIndex < scene.Materials.size() ? &scene.Materials[mesh.MaterialIndex] : nullptr;
+        CreateImportedObject(_renderObjects[i], mesh, material);
+    }
+    CreateObjectDataBuffer();
+
+    const auto end = std::chrono::high_resolution_clock::now();
+    std::wcout << L"Uploaded " << scene.Meshes.size() << L" objects in " << std::chrono::duration<double, std::milli>(end - start).count() << L" ms\n";
+
+    _instances.resize(scene.Instances.size());
+    for (size_t i = 0; i < scene.Instances.size(); i++)
+    {
+        _instances[i].objectIndex = scene.Instances[i].MeshIndex;
+        memcpy(_instances[i].transform, scene.Instances[i].Transform, sizeof(_instances[i].transform));
+    }
+}
 
-    const VkDeviceSize size = content.size() * sizeof(T);
+void CreateBufferAndUploadData( BufferResource& buffer, VkBufferUsageFlags usage, const void* data, VkDeviceSize size )
+{
+    const VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
     VkResult code = buffer.Create(size, usage, memoryFlags);
     NVVK_CHECK_ERROR(code, L"rt BufferResource::Create");
 
-    if (!buffer.CopyToBufferUsingMapUnmap(content.data(), size))
+    if (!buffer.CopyToBufferUsingMapUnmap(data, size))
     {
         ExitError(L"Failed to copy data to buffer");
     }
 }
 
+template< typename T >
+void CreateBufferAndUploadData( BufferResource& buffer, VkBufferUsageFlags usage, const std::vector<T>& content )
+{
+    CreateBufferAndUploadData(buffer, usage, content.data(), content.size() * sizeof(T));
+}
+
 void TutorialApplication::CreateAccelerationStructure(VkAccelerationStructureTypeNV type, uint32_t geometryCount,
-    VkGeometryNV* geometries, uint32_t instanceCount, VkAccelerationStructureNV& AS, VkDeviceMemory& memory)
+    VkGeometryNV* geometries, uint32_t instanceCount, VkAccelerationStructureNV& AS, VkDeviceMemory& memory,
+    VkDeviceSize* memorySize)
 {
     VkAccelerationStructureCreateInfoNV accelerationStructureInfo;
     accelerationStructureInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
@@ -220,6 +542,11 @@ void TutorialApplication::CreateAccelerationStructure(VkAccelerationStructureTyp
     code = vkAllocateMemory(_device, &memoryAllocateInfo, nullptr, &memory);
     NVVK_CHECK_ERROR(code, L"rt AS vkAllocateMemory");
 
+    if (memorySize != nullptr)
+    {
+        *memorySize = memoryAllocateInfo.allocationSize;
+    }
+
     VkBindAccelerationStructureMemoryInfoNV bindInfo;
     bindInfo.sType = VK_STRUCTURE_TYPE_BIND_ACCELERATION_STRUCTURE_MEMORY_INFO_NV;
     bindInfo.pNext = nullptr;
@@ -233,290 +560,379 @@ void TutorialApplication::CreateAccelerationStructure(VkAccelerationStructureTyp
     NVVK_CHECK_ERROR(code, L"vkBindAccelerationStructureMemoryNV");
 };
 
-void TutorialApplication::CreateObjectBottomLevelAS(RenderObject& object)
+void TutorialApplication::CreateGeometryBottomLevelAS(MeshGeometry& geometry)
 {
-    VkGeometryNV& geometry = object.geometry;
-    geometry.sType = VK_STRUCTURE_TYPE_GEOMETRY_NV;
-    geometry.pNext = nullptr;
-    geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_NV;
-    geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_GEOMETRY_TRIANGLES_NV;
-    geometry.geometry.triangles.pNext = nullptr;
-    geometry.geometry.triangles.vertexData = object.vertexBuffers[0].Buffer;
-    geometry.geometry.triangles.vertexOffset = 0;
-    geometry.geometry.triangles.vertexCount = object.vertexNum;
-    geometry.geometry.triangles.vertexStride = sizeof(VertexPosition);
-    geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-    geometry.geometry.triangles.indexData = object.indexBuffer.Buffer;
-    geometry.geometry.triangles.indexOffset = 0;
-    geometry.geometry.triangles.indexCount = object.indexNum;
-    geometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT16;
-    geometry.geometry.triangles.transformData = VK_NULL_HANDLE;
-    geometry.geometry.triangles.transformOffset = 0;
-    geometry.geometry.aabbs = { };
-    geometry.geometry.aabbs.sType = VK_STRUCTURE_TYPE_GEOMETRY_AABB_NV;
-    geometry.flags = VK_GEOMETRY_OPAQUE_BIT_NV;
-
-    CreateAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV, 1, &geometry, 0,
-        object.bottomAS, object.bottomASMemory);
-}
-
-void TutorialApplication::CreateIcosahedron(RenderObject& object)
-{
-    object.shaderIndex = 1;
-
-    UniformBufferContent content;
-    content.vertexBufferArrayOffset = (uint32_t)_vertexBufferViews.size();
-    content.indexBufferArrayOffset = (uint32_t)_indexBufferViews.size();
-    content.textureArrayOffset = (uint32_t)_imageViews.size();
+    const VkDeviceSize indexSize = geometry.indexType == VK_INDEX_TYPE_UINT32 ? sizeof(uint32_t) : sizeof(uint16_t);
 
-    const VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    object.uniformBuffer.Create(sizeof(content), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, memoryFlags);
-    object.uniformBuffer.CopyToBufferUsingMapUnmap(&content, sizeof(content));
+    // Clusters share the vertex and index buffers, each one is a range of the index buffer
+    geometry.geometries.resize(geometry.clusters.size());
+    for (size_t i = 0; i < geometry.clusters.size(); i++)
+    {
+        const MeshCluster& cluster = geometry.clusters[i];
+
+        VkGeometryNV& clusterGeometry = geometry.geometries[i];
+        clusterGeometry.sType = VK_STRUCTURE_TYPE_GEOMETRY_NV;
+        clusterGeometry.pNext = nullptr;
+        clusterGeometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_NV;
+        clusterGeometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_GEOMETRY_TRIANGLES_NV;
+        clusterGeometry.geometry.triangles.pNext = nullptr;
+        clusterGeometry.geometry.triangles.vertexData = geometry.vertexBuffers[0].Buffer;
+        clusterGeometry.geometry.triangles.vertexOffset = 0;
+        clusterGeometry.geometry.triangles.vertexCount = geometry.vertexNum;
+        clusterGeometry.geometry.triangles.vertexStride = geometry.positionFormat == VK_FORMAT_R16G16B16_SFLOAT ? sizeof(uint16_t) * 3 : sizeof(VertexPosition);
+        clusterGeometry.geometry.triangles.vertexFormat = geometry.positionFormat;
+        clusterGeometry.geometry.triangles.indexData = geometry.indexBuffer.Buffer;
+        clusterGeometry.geometry.triangles.indexOffset = cluster.FirstTriangle * 3 * indexSize;
+        clusterGeometry.geometry.triangles.indexCount = cluster.TriangleNum * 3;
+        clusterGeometry.geometry.triangles.indexType = geometry.indexType;
+        clusterGeometry.geometry.triangles.transformData = geometry.positionTransform.Buffer; // VK_NULL_HANDLE for float positions
+        clusterGeometry.geometry.triangles.transformOffset = 0;
+        clusterGeometry.geometry.aabbs = { };
+        clusterGeometry.geometry.aabbs.sType = VK_STRUCTURE_TYPE_GEOMETRY_AABB_NV;
+        clusterGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_NV;
+    }
 
-    CreateIcosahedronGeometry(object);
-    CreateIcosahedronBufferViews(object);
-    CreateObjectBottomLevelAS(object);
+    CreateAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV, (uint32_t)geometry.geometries.size(), geometry.geometries.data(), 0,
+        geometry.bottomAS, geometry.bottomASMemory, &geometry.bottomASSize);
 }
 
-void TutorialApplication::CreateBox(RenderObject& object, const std::wstring& texturePath)
+void TutorialApplication::CreateImportedObject(RenderObject& object, const MeshView& mesh, const ImportedMaterial* material)
 {
-    object.shaderIndex = 0;
+    object.name = mesh.Name;
 
-    UniformBufferContent content;
-    content.vertexBufferArrayOffset = (uint32_t)_vertexBufferViews.size();
-    content.indexBufferArrayOffset = (uint32_t)_indexBufferViews.size();
-    content.textureArrayOffset = (uint32_t)_imageViews.size();
+    // Textured meshes use the box hit shader, the rest the untextured icosahedron one
+    bool textured = false;
+    if (material != nullptr && !material->BaseColorTexture.empty() && mesh.Texcoords != nullptr)
+    {
+        VkResult code;
+        textured = object.texture.LoadTexture2DFromPath(material->BaseColorTexture, code);
+        if (!textured)
+        {
+            std::wcout << object.name << L": failed to load " << material->BaseColorTexture << L", drawn untextured\n";
+        }
+    }
 
-    const VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    object.uniformBuffer.Create(sizeof(content), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, memoryFlags);
-    object.uniformBuffer.CopyToBufferUsingMapUnmap(&content, sizeof(content));
+    object.shaderIndex = textured ? 0 : 1;
+    object.geometryIndex = AcquireGeometry(mesh.Name, mesh.VertexNum, mesh.Positions, mesh.Normals, textured ? mesh.Texcoords : nullptr,
+        std::vector<uint32_t>(mesh.Indices, mesh.Indices + mesh.IndexNum));
 
-    CreateBoxGeometry(object);
-    CreateBoxBufferViews(object);
-    LoadObjectTexture(object, texturePath);
-    CreateObjectBottomLevelAS(object);
+    if (textured)
+    {
+        RegisterObjectTexture(object);
+    }
 }
 
-void TutorialApplication::CreateIcosahedronGeometry(RenderObject& object)
+// Returns the geometry with this content, creating buffers and BLAS only the first
+// time. The streams are what the hit shader of the layout reads: texcoords and
+// normals, or only normals when texcoords is null.
+uint32_t TutorialApplication::AcquireGeometry(const std::wstring& name, uint32_t vertexNum, const float* positions, const float* normals,
+    const float* texcoords, const std::vector<uint32_t>& indices)
 {
-    const float scale = 0.25f;
-    const float d = (1.0f + sqrt(5.0f)) * 0.5f * scale;
-
-    std::vector<VertexPosition> positions
-    {
-        { -scale, +d, 0 },
-        { +scale, +d, 0 },
-        { -scale, -d, 0 },
-        { +scale, -d, 0 },
-        { +0, -scale, +d },
-        { +0, +scale, +d },
-        { +0, -scale, -d },
-        { +0, +scale, -d },
-        { +d, 0, -scale },
-        { +d, 0, +scale },
-        { -d, 0, -scale },
-        { -d, 0, +scale }
-    };
-
-    CreateBufferAndUploadData(object.vertexBuffers[0], VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, positions);
-
-    std::vector<float> normals( positions.size() * 3 );
-    for (size_t i = 0; i < positions.size(); i++)
+    GeometryKey key;
+    key.Layout = texcoords != nullptr ? GEOMETRY_LAYOUT_TEXCOORDS_NORMALS : GEOMETRY_LAYOUT_NORMALS;
+    key.VertexNum = vertexNum;
+    key.IndexNum = (uint32_t)indices.size();
+    key.AddStream(positions, vertexNum * sizeof(VertexPosition));
+    key.AddStream(normals, vertexNum * 3 * sizeof(float));
+    if (texcoords != nullptr)
     {
-        const VertexPosition& pos = positions[i];
-        const float invLength = 1.0f / sqrt(pos.X * pos.X + pos.Y * pos.Y + pos.Z * pos.Z);
-        normals[i * 3] = pos.X * invLength;
-        normals[i * 3 + 1] = pos.Y * invLength;
-        normals[i * 3 + 2] = pos.Z * invLength;
+        key.AddStream(texcoords, vertexNum * 2 * sizeof(float));
     }
+    key.AddStream(indices.data(), indices.size() * sizeof(uint32_t));
 
-    CreateBufferAndUploadData(object.vertexBuffers[1], VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT, normals);
+    bool created;
+    const uint32_t geometryIndex = _geometryRegistry.Acquire(key, created);
+    if (!created)
+    {
+        return geometryIndex;
+    }
 
-    std::vector<uint16_t> indices
+    if (geometryIndex >= _geometries.size())
     {
-        0, 11, 5, 0, 5, 1, 0, 1, 7, 0, 7, 10, 0, 10, 11,
-        1, 5, 9, 5, 11, 4, 11, 10, 2, 10, 7, 6, 7, 1, 8,
-        3, 9, 4, 3, 4, 2, 3, 2, 6, 3, 6, 8, 3, 8, 9,
-        4, 9, 5, 2, 4, 11, 6, 2, 10, 8, 6, 7, 9, 8, 1
-    };
+        _geometries.resize(geometryIndex + 1);
+    }
+    _geometries[geometryIndex].reset(new MeshGeometry());
 
-    CreateBufferAndUploadData(object.indexBuffer, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, indices);
+    MeshGeometry& geometry = *_geometries[geometryIndex];
+    geometry.name = name;
+    geometry.vertexNum = vertexNum;
 
-    // Convert to R16G16B16A16_UINT
-    std::vector<uint16_t> indicesWithPadding;
-    for( size_t i = 0; i < indices.size(); i += 3 )
+    CreatePositionBuffer(geometry, positions, indices);
+    if (texcoords != nullptr)
     {
-        indicesWithPadding.push_back(indices[i]);
-        indicesWithPadding.push_back(indices[i + 1]);
-        indicesWithPadding.push_back(indices[i + 2]);
-        indicesWithPadding.push_back(0);
+        CreateTexcoordBuffer(geometry, geometry.vertexBuffers[1], texcoords);
+        CreateNormalBuffer(geometry, geometry.vertexBuffers[2], normals);
+        CreateBoxBufferViews(geometry);
+    }
+    else
+    {
+        CreateNormalBuffer(geometry, geometry.vertexBuffers[1], normals);
+        CreateIcosahedronBufferViews(geometry);
     }
 
-    CreateBufferAndUploadData(object.indexBufferCopy, VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT, indicesWithPadding);
-
-    object.vertexNum = (uint32_t)positions.size();
-    object.indexNum = (uint16_t)indices.size();
+    CreateGeometryIndexBuffer(geometry, positions, indices);
+    CreateGeometryBottomLevelAS(geometry);
+    return geometryIndex;
 }
 
-void TutorialApplication::CreateBoxGeometry(RenderObject& object)
+void TutorialApplication::ReleaseGeometry(uint32_t geometryIndex)
 {
-    const float boxHalfSize = 0.25f;
-
-    std::vector<VertexPosition> positions
-    {
-        { -boxHalfSize, -boxHalfSize, -boxHalfSize }, { -boxHalfSize, -boxHalfSize,  boxHalfSize },
-        { -boxHalfSize,  boxHalfSize, -boxHalfSize }, { -boxHalfSize,  boxHalfSize,  boxHalfSize },
-        {  boxHalfSize, -boxHalfSize, -boxHalfSize }, {  boxHalfSize, -boxHalfSize,  boxHalfSize },
-        {  boxHalfSize,  boxHalfSize, -boxHalfSize }, {  boxHalfSize,  boxHalfSize,  boxHalfSize },
-        { -boxHalfSize, -boxHalfSize, -boxHalfSize }, { -boxHalfSize, -boxHalfSize,  boxHalfSize },
-        {  boxHalfSize, -boxHalfSize, -boxHalfSize }, {  boxHalfSize, -boxHalfSize,  boxHalfSize },
-        { -boxHalfSize,  boxHalfSize, -boxHalfSize }, { -boxHalfSize,  boxHalfSize,  boxHalfSize },
-        {  boxHalfSize,  boxHalfSize, -boxHalfSize }, {  boxHalfSize,  boxHalfSize,  boxHalfSize },
-        { -boxHalfSize, -boxHalfSize, -boxHalfSize }, { -boxHalfSize,  boxHalfSize, -boxHalfSize },
-        {  boxHalfSize, -boxHalfSize, -boxHalfSize }, {  boxHalfSize,  boxHalfSize, -boxHalfSize },
-        { -boxHalfSize, -boxHalfSize,  boxHalfSize }, { -boxHalfSize,  boxHalfSize,  boxHalfSize },
-        {  boxHalfSize, -boxHalfSize,  boxHalfSize }, {  boxHalfSize,  boxHalfSize,  boxHalfSize },
-    };
+    if (geometryIndex != GeometryRegistry::InvalidIndex && _geometryRegistry.Release(geometryIndex))
+    {
+        DestroyGeometry(*_geometries[geometryIndex]);
+        _geometries[geometryIndex].reset();
+    }
+}
 
-    CreateBufferAndUploadData(object.vertexBuffers[0], VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, positions);
+void TutorialApplication::LogGeometrySharing()
+{
+    VkDeviceSize bottomASBytes = 0;
+    VkDeviceSize bufferBytes = 0;
+    VkDeviceSize savedBottomASBytes = 0;
+    VkDeviceSize savedBufferBytes = 0;
 
-    std::vector<float> texcoords
+    for (uint32_t i = 0; i < _geometries.size(); i++)
     {
-        0.0f, 0.0f, 2.0f, 0.0f, 0.0f, 2.0f, 2.0f, 2.0f,
-        0.0f, 0.0f, 2.0f, 0.0f, 0.0f, 2.0f, 2.0f, 2.0f,
-        0.0f, 0.0f, 2.0f, 0.0f, 0.0f, 2.0f, 2.0f, 2.0f,
-        0.0f, 0.0f, 2.0f, 0.0f, 0.0f, 2.0f, 2.0f, 2.0f,
-        0.0f, 0.0f, 2.0f, 0.0f, 0.0f, 2.0f, 2.0f, 2.0f,
-        0.0f, 0.0f, 2.0f, 0.0f, 0.0f, 2.0f, 2.0f, 2.0f,
-    };
-
-    CreateBufferAndUploadData(object.vertexBuffers[1], VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT, texcoords);
-
-    std::vector<float> normals
-    {
-        -1.0f,  0.0f,  0.0f,
-        -1.0f,  0.0f,  0.0f,
-        -1.0f,  0.0f,  0.0f,
-        -1.0f,  0.0f,  0.0f,
-        1.0f,  0.0f,  0.0f,
-        1.0f,  0.0f,  0.0f,
-        1.0f,  0.0f,  0.0f,
-        1.0f,  0.0f,  0.0f,
-        0.0f, -1.0f,  0.0f,
-        0.0f, -1.0f,  0.0f,
-        0.0f, -1.0f,  0.0f,
-        0.0f, -1.0f,  0.0f,
-        0.0f,  1.0f,  0.0f,
-        0.0f,  1.0f,  0.0f,
-        0.0f,  1.0f,  0.0f,
-        0.0f,  1.0f,  0.0f,
-        0.0f,  0.0f, -1.0f,
-        0.0f,  0.0f, -1.0f,
-        0.0f,  0.0f, -1.0f,
-        0.0f,  0.0f, -1.0f,
-        0.0f,  0.0f,  1.0f,
-        0.0f,  0.0f,  1.0f,
-        0.0f,  0.0f,  1.0f,
-        0.0f,  0.0f,  1.0f,
-    };
+        if (!_geometries[i])
+        {
+            continue;
+        }
 
-    CreateBufferAndUploadData(object.vertexBuffers[2], VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT, normals);
+        const MeshGeometry& geometry = *_geometries[i];
+        VkDeviceSize geometryBufferBytes = geometry.indexBuffer.Size + geometry.positionTransform.Size;
+        for (const BufferResource& vertexBuffer : geometry.vertexBuffers)
+        {
+            geometryBufferBytes += vertexBuffer.Size;
+        }
 
-    std::vector<uint16_t> indices
-    {
-        0, 1, 2, 1, 2, 3,
-        4, 5, 6, 5, 6, 7,
-        8, 9, 10, 9, 10, 11,
-        12, 13, 14, 13, 14, 15,
-        16, 17, 18, 17, 18, 19,
-        20, 21, 22, 21, 22, 23
-    };
+        const uint32_t sharedNum = _geometryRegistry.GetReferenceNum(i) - 1;
+        bottomASBytes += geometry.bottomASSize;
+        bufferBytes += geometryBufferBytes;
+        savedBottomASBytes += geometry.bottomASSize * sharedNum;
+        savedBufferBytes += geometryBufferBytes * sharedNum;
+    }
 
-    CreateBufferAndUploadData(object.indexBuffer, VK_BUFFER_USAGE_INDEX_BUFFER_BIT, indices);
+    std::wcout << _renderObjects.size() << L" objects share " << _geometryRegistry.GetGeometryNum() << L" geometries: "
+        << bottomASBytes << L" bytes of BLAS memory and " << bufferBytes << L" bytes of buffers, "
+        << savedBottomASBytes << L" and " << savedBufferBytes << L" bytes saved by sharing\n";
+}
 
-    // Convert to R16G16B16A16_UINT
-    std::vector<uint16_t> indicesWithPadding;
-    for( size_t i = 0; i < indices.size(); i += 3 )
+// A single storage buffer rather than a uniform buffer per object, so the
+// number of objects isn't bounded by the per-stage uniform buffer limit
+void TutorialApplication::CreateObjectDataBuffer()
+{
+    // Slots are stable for the lifetime of the objects, so this never has to be rewritten
+    std::vector<ObjectDataContent> content(_renderObjects.size());
+    for (size_t i = 0; i < _renderObjects.size(); i++)
     {
-        indicesWithPadding.push_back(indices[i]);
-        indicesWithPadding.push_back(indices[i + 1]);
-        indicesWithPadding.push_back(indices[i + 2]);
-        indicesWithPadding.push_back(0);
-    }
+        const RenderObject& object = _renderObjects[i];
+        const MeshGeometry& geometry = *_geometries[object.geometryIndex];
 
-    CreateBufferAndUploadData(object.indexBufferCopy, VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT, indicesWithPadding);
+        content[i].vertexBufferArrayOffset = geometry.vertexBufferSlot;
+        content[i].indexBufferArrayOffset = geometry.indexBufferSlot;
+        content[i].textureArrayOffset = object.textureSlot;
+        content[i].indexType = geometry.indexType == VK_INDEX_TYPE_UINT32 ? 1 : 0;
+    }
 
-    object.vertexNum = (uint32_t)positions.size();
-    object.indexNum = (uint16_t)indices.size();
+    CreateBufferAndUploadData(_objectDataBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, content);
 }
 
-void TutorialApplication::CreateIcosahedronBufferViews(RenderObject& object)
+VkBufferView TutorialApplication::CreateGeometryBufferView(MeshGeometry& geometry, const BufferResource& buffer, VkFormat format)
 {
     VkBufferViewCreateInfo bufferViewInfo;
     bufferViewInfo.sType = VK_STRUCTURE_TYPE_BUFFER_VIEW_CREATE_INFO;
     bufferViewInfo.pNext = nullptr;
     bufferViewInfo.flags = 0;
-    bufferViewInfo.buffer = object.vertexBuffers[1].Buffer;
-    bufferViewInfo.format = VK_FORMAT_R32G32B32_SFLOAT; // Normals
+    bufferViewInfo.buffer = buffer.Buffer;
+    bufferViewInfo.format = format;
     bufferViewInfo.offset = 0;
     bufferViewInfo.range = VK_WHOLE_SIZE;
 
-    VkBufferView vertexBufferView;
-    VkResult code = vkCreateBufferView(_device, &bufferViewInfo, nullptr, &vertexBufferView);
+    VkBufferView bufferView;
+    VkResult code = vkCreateBufferView(_device, &bufferViewInfo, nullptr, &bufferView);
     NVVK_CHECK_ERROR(code, L"vkCreateBufferView");
 
-    bufferViewInfo.buffer = object.indexBufferCopy.Buffer;
-    bufferViewInfo.format = VK_FORMAT_R16G16B16A16_UINT; // Indices
+    geometry.bufferViews.push_back(bufferView);
+    return bufferView;
+}
 
-    VkBufferView indexBufferView;
-    code = vkCreateBufferView(_device, &bufferViewInfo, nullptr, &indexBufferView);
-    NVVK_CHECK_ERROR(code, L"vkCreateBufferView");
+// Normals only, the layout rt_11_icosahedron.rchit reads
+void TutorialApplication::CreateIcosahedronBufferViews(MeshGeometry& geometry)
+{
+    geometry.vertexBufferSlotNum = 1;
+    geometry.vertexBufferSlot = _bindlessRegistry.AllocateSlots(BINDLESS_TABLE_VERTEX_BUFFERS, geometry.vertexBufferSlotNum);
+    if (geometry.vertexBufferSlot == BindlessRegistry::InvalidSlot)
+    {
+        ExitError(L"Bindless vertex buffer table is full");
+    }
 
-    _vertexBufferViews.push_back(vertexBufferView);
-    _indexBufferViews.push_back(indexBufferView);
+    _bindlessRegistry.WriteBufferView(BINDLESS_TABLE_VERTEX_BUFFERS, geometry.vertexBufferSlot,
+        CreateGeometryBufferView(geometry, geometry.vertexBuffers[1], VK_FORMAT_R16G16_SNORM)); // Octahedral normals
 }
 
-void TutorialApplication::CreateBoxBufferViews(RenderObject& object)
+// Texcoords and normals, the layout rt_11_box.rchit reads
+void TutorialApplication::CreateBoxBufferViews(MeshGeometry& geometry)
 {
-    VkBufferViewCreateInfo bufferViewInfo;
-    bufferViewInfo.sType = VK_STRUCTURE_TYPE_BUFFER_VIEW_CREATE_INFO;
-    bufferViewInfo.pNext = nullptr;
-    bufferViewInfo.flags = 0;
-    bufferViewInfo.buffer = object.vertexBuffers[1].Buffer;
-    bufferViewInfo.format = VK_FORMAT_R32G32_SFLOAT; // Texcoords
-    bufferViewInfo.offset = 0;
-    bufferViewInfo.range = VK_WHOLE_SIZE;
+    // The hit shader expects both vertex buffers in consecutive slots
+    geometry.vertexBufferSlotNum = 2;
+    geometry.vertexBufferSlot = _bindlessRegistry.AllocateSlots(BINDLESS_TABLE_VERTEX_BUFFERS, geometry.vertexBufferSlotNum);
+    if (geometry.vertexBufferSlot == BindlessRegistry::InvalidSlot)
+    {
+        ExitError(L"Bindless vertex buffer table is full");
+    }
 
-    VkBufferView vertexBufferViews[2];
-    VkResult code = vkCreateBufferView(_device, &bufferViewInfo, nullptr, &vertexBufferViews[0]);
-    NVVK_CHECK_ERROR(code, L"vkCreateBufferView");
+    _bindlessRegistry.WriteBufferView(BINDLESS_TABLE_VERTEX_BUFFERS, geometry.vertexBufferSlot,
+        CreateGeometryBufferView(geometry, geometry.vertexBuffers[1], geometry.texcoordFormat)); // Texcoords
+    _bindlessRegistry.WriteBufferView(BINDLESS_TABLE_VERTEX_BUFFERS, geometry.vertexBufferSlot + 1,
+        CreateGeometryBufferView(geometry, geometry.vertexBuffers[2], VK_FORMAT_R16G16_SNORM)); // Octahedral normals
+}
 
-    bufferViewInfo.buffer = object.vertexBuffers[2].Buffer;
-    bufferViewInfo.format = VK_FORMAT_R32G32B32_SFLOAT; // Normals
+// ============================================================
+// Vertex compression. The texel buffer formats do the unpacking,
+// the hit shaders only decode the octahedral normals. Every stream
+// is decoded again on the CPU to check the error.
+// ============================================================
 
-    code = vkCreateBufferView(_device, &bufferViewInfo, nullptr, &vertexBufferViews[1]);
-    NVVK_CHECK_ERROR(code, L"vkCreateBufferView");
+static void CheckEncodingError(const std::wstring& name, const wchar_t* stream, float error, float tolerance)
+{
+    std::wcout << name << L": " << stream << L" max round trip error " << error << L"\n";
+    if (!(error <= tolerance))
+    {
+        ExitError(name + L": " + stream + L" encoding error " + std::to_wstring(error) + L" exceeds " + std::to_wstring(tolerance));
+    }
+}
 
-    bufferViewInfo.buffer = object.indexBufferCopy.Buffer;
-    bufferViewInfo.format = VK_FORMAT_R16G16B16A16_UINT; // Indices
+// xyz per vertex, geometry.vertexNum of them. Half positions are only used when
+// the rounding error is well below the shortest edge, otherwise nearby vertices
+// could collapse and open cracks in the BLAS.
+void TutorialApplication::CreatePositionBuffer(MeshGeometry& geometry, const float* positions, const std::vector<uint32_t>& indices)
+{
+    const size_t vertexNum = geometry.vertexNum;
 
-    VkBufferView indexBufferView;
-    code = vkCreateBufferView(_device, &bufferViewInfo, nullptr, &indexBufferView);
-    NVVK_CHECK_ERROR(code, L"vkCreateBufferView");
+    std::vector<uint16_t> encoded;
+    PositionQuantization quantization;
+    if (_quantizePositions)
+    {
+        quantization = ComputePositionQuantization(positions, vertexNum);
+        encoded.resize(vertexNum * 3);
+        EncodePositionsHalf(positions, vertexNum, quantization, encoded.data());
+
+        const float error = MeasurePositionError(positions, encoded.data(), vertexNum, quantization);
+        const float tolerance = ComputeShortestEdge(positions, indices.data(), indices.size()) / 8.0f;
+        std::wcout << geometry.name << L": half positions max round trip error " << error << L", tolerance " << tolerance << L"\n";
+        if (!(error <= tolerance))
+        {
+            std::wcout << geometry.name << L": half positions too coarse for the shortest edge, keeping float positions\n";
+            encoded.clear();
+        }
+    }
+
+    if (encoded.empty())
+    {
+        geometry.positionFormat = VK_FORMAT_R32G32B32_SFLOAT;
+        CreateBufferAndUploadData(geometry.vertexBuffers[0], VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, positions, vertexNum * sizeof(VertexPosition));
+        return;
+    }
+
+    geometry.positionFormat = VK_FORMAT_R16G16B16_SFLOAT;
+    CreateBufferAndUploadData(geometry.vertexBuffers[0], VK_BUFFER_USAGE_VERTEX_BUFFER_BIT, encoded);
+
+    // The BLAS build applies the scale and bias, so nothing changes for the shaders
+    const std::vector<float> transform
+    {
+        quantization.Scale[0], 0.0f, 0.0f, quantization.Bias[0],
+        0.0f, quantization.Scale[1], 0.0f, quantization.Bias[1],
+        0.0f, 0.0f, quantization.Scale[2], quantization.Bias[2],
+    };
+    CreateBufferAndUploadData(geometry.positionTransform, VK_BUFFER_USAGE_RAY_TRACING_BIT_NV, transform);
+}
+
+void TutorialApplication::CreateNormalBuffer(MeshGeometry& geometry, BufferResource& buffer, const float* normals)
+{
+    const size_t normalNum = geometry.vertexNum;
+
+    std::vector<int16_t> encoded(normalNum * 2);
+    EncodeNormalsOctahedral(normals, normalNum, encoded.data());
+    CheckEncodingError(geometry.name, L"octahedral normals", MeasureNormalError(normals, encoded.data(), normalNum), 0.002f);
+
+    CreateBufferAndUploadData(buffer, VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT, encoded);
+}
+
+void TutorialApplication::CreateTexcoordBuffer(MeshGeometry& geometry, BufferResource& buffer, const float* texcoords)
+{
+    const size_t texcoordNum = geometry.vertexNum * 2;
+    std::vector<uint16_t> encoded(texcoordNum);
+
+    // Unorm16 is exact to 1/65535 but only covers [0, 1], tiled texcoords need halves
+    if (IsUnitRange(texcoords, texcoordNum))
+    {
+        geometry.texcoordFormat = VK_FORMAT_R16G16_UNORM;
+        EncodeUnorm16(texcoords, texcoordNum, encoded.data());
+        CheckEncodingError(geometry.name, L"unorm16 texcoords", MeasureUnorm16Error(texcoords, encoded.data(), texcoordNum), 1.0f / 65535.0f);
+    }
+    else
+    {
+        float maxValue = 0.0f;
+        for (size_t i = 0; i < texcoordNum; i++)
+        {
+            maxValue = std::max(maxValue, std::fabs(texcoords[i]));
+        }
+
+        geometry.texcoordFormat = VK_FORMAT_R16G16_SFLOAT;
+        EncodeHalf(texcoords, texcoordNum, encoded.data());
+        CheckEncodingError(geometry.name, L"half texcoords", MeasureHalfError(texcoords, encoded.data(), texcoordNum), std::max(maxValue, 1.0f) / 1024.0f);
+    }
 
-    _vertexBufferViews.push_back(vertexBufferViews[0]);
-    _vertexBufferViews.push_back(vertexBufferViews[1]);
-    _indexBufferViews.push_back(indexBufferView);
+    CreateBufferAndUploadData(buffer, VK_BUFFER_USAGE_UNIFORM_TEXEL_BUFFER_BIT, encoded);
 }
 
-void TutorialApplication::LoadObjectTexture(RenderObject& object, const std::wstring& path)
+void TutorialApplication::CreateGeometryIndexBuffer(MeshGeometry& geometry, const float* positions, std::vector<uint32_t> indices)
 {
-    VkResult code;
-    if (!object.texture.LoadTexture2DFromFile(path, code))
+    geometry.clusters = SplitMeshIntoClusters(positions, indices, _maxClusterTriangles);
+    geometry.indexNum = (uint32_t)indices.size();
+
+    // The same buffer feeds the BLAS build and the hit shaders, which read it as an array of uints
+    const VkBufferUsageFlags usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+    if (CanUse16BitIndices(geometry.vertexNum))
+    {
+        geometry.indexType = VK_INDEX_TYPE_UINT16;
+
+        std::vector<uint16_t> narrowIndices = NarrowIndicesTo16Bit(indices);
+        if (narrowIndices.size() % 2 != 0)
+        {
+            narrowIndices.push_back(0); // pad to a whole uint
+        }
+        CreateBufferAndUploadData(geometry.indexBuffer, usage, narrowIndices);
+    }
+    else
     {
-        ExitError(L"Failed to load texture. VkResult: " + std::to_wstring(code));
+        geometry.indexType = VK_INDEX_TYPE_UINT32;
+        CreateBufferAndUploadData(geometry.indexBuffer, usage, indices);
     }
 
+    geometry.indexBufferSlot = _bindlessRegistry.AllocateSlots(BINDLESS_TABLE_INDEX_BUFFERS);
+    if (geometry.indexBufferSlot == BindlessRegistry::InvalidSlot)
+    {
+        ExitError(L"Bindless index buffer table is full");
+    }
+
+    VkDescriptorBufferInfo bufferInfo;
+    bufferInfo.buffer = geometry.indexBuffer.Buffer;
+    bufferInfo.offset = 0;
+    bufferInfo.range = geometry.indexBuffer.Size;
+
+    _bindlessRegistry.WriteBuffer(BINDLESS_TABLE_INDEX_BUFFERS, geometry.indexBufferSlot, bufferInfo);
+
+    // Previously every triangle was also stored as R16G16B16A16_UINT for texel fetch
+    const VkDeviceSize indexBytes = geometry.indexBuffer.Size;
+    const VkDeviceSize paddedCopyBytes = (indices.size() / 3) * 4 * sizeof(uint16_t);
+    std::wcout << geometry.name << L": " << indices.size() << L" indices, " << indexBytes << L" bytes of index data, "
+        << paddedCopyBytes << L" bytes saved by dropping the padded copy, " << geometry.clusters.size() << L" cluster(s)\n";
+}
+
+void TutorialApplication::RegisterObjectTexture(RenderObject& object)
+{
     VkImageSubresourceRange subresourceRange;
     subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
     subresourceRange.baseMipLevel = 0;
@@ -524,14 +940,70 @@ void TutorialApplication::LoadObjectTexture(RenderObject& object, const std::wst
     subresourceRange.baseArrayLayer = 0;
     subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
 
-    code = object.texture.CreateImageView(VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R8G8B8A8_SRGB, subresourceRange);
+    VkResult code = object.texture.CreateImageView(VK_IMAGE_VIEW_TYPE_2D, VK_FORMAT_R8G8B8A8_SRGB, subresourceRange);
     NVVK_CHECK_ERROR(code, L"Failed to create image view.");
 
     code = object.texture.CreateSampler(VK_FILTER_NEAREST, VK_FILTER_LINEAR, VK_SAMPLER_MIPMAP_MODE_LINEAR, VK_SAMPLER_ADDRESS_MODE_REPEAT);
     NVVK_CHECK_ERROR(code, L"Failed to create sampler.");
 
-    _imageViews.push_back(object.texture.ImageView);
-    _samplers.push_back(object.texture.Sampler);
+    object.textureSlot = _bindlessRegistry.AllocateSlots(BINDLESS_TABLE_TEXTURES);
+    if (object.textureSlot == BindlessRegistry::InvalidSlot)
+    {
+        ExitError(L"Bindless texture table is full");
+    }
+
+    VkDescriptorImageInfo imageInfo;
+    imageInfo.sampler = object.texture.Sampler;
+    imageInfo.imageView = object.texture.ImageView;
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+    _bindlessRegistry.WriteImage(BINDLESS_TABLE_TEXTURES, object.textureSlot, imageInfo);
+}
+
+void TutorialApplication::DestroyObject(RenderObject& object)
+{
+    // The caller makes sure the GPU is done with the object, slots are reused right away
+    _bindlessRegistry.FreeSlots(BINDLESS_TABLE_TEXTURES, object.textureSlot);
+    object.textureSlot = BindlessRegistry::InvalidSlot;
+
+    ReleaseGeometry(object.geometryIndex);
+    object.geometryIndex = GeometryRegistry::InvalidIndex;
+
+    object.texture.Cleanup();
+}
+
+void TutorialApplication::DestroyGeometry(MeshGeometry& geometry)
+{
+    _bindlessRegistry.FreeSlots(BINDLESS_TABLE_VERTEX_BUFFERS, geometry.vertexBufferSlot, geometry.vertexBufferSlotNum);
+    _bindlessRegistry.FreeSlots(BINDLESS_TABLE_INDEX_BUFFERS, geometry.indexBufferSlot);
+    geometry.vertexBufferSlot = BindlessRegistry::InvalidSlot;
+    geometry.vertexBufferSlotNum = 0;
+    geometry.indexBufferSlot = BindlessRegistry::InvalidSlot;
+
+    for (auto& bufferView : geometry.bufferViews)
+    {
+        vkDestroyBufferView(_device, bufferView, nullptr);
+    }
+    geometry.bufferViews.clear();
+
+    if (geometry.bottomAS)
+    {
+        vkDestroyAccelerationStructureNV(_device, geometry.bottomAS, nullptr);
+        geometry.bottomAS = VK_NULL_HANDLE;
+    }
+    if (geometry.bottomASMemory)
+    {
+        vkFreeMemory(_device, geometry.bottomASMemory, nullptr);
+        geometry.bottomASMemory = VK_NULL_HANDLE;
+    }
+
+    for (auto& vertexBuffer : geometry.vertexBuffers)
+    {
+        vertexBuffer.Cleanup();
+    }
+
+    geometry.indexBuffer.Cleanup();
+    geometry.positionTransform.Cleanup();
 }
 
 void TutorialApplication::CreateAccelerationStructures()
@@ -548,45 +1020,42 @@ void TutorialApplication::CreateAccelerationStructures()
         uint64_t accelerationStructureHandle;
         VkResult code;
  
-        VkGeometryInstance instances[_objectNum] = { };
-
-        const float width = 4.0f;
-        const float height = 0.75f;
-        const float depth = 0.75f;
-        const float stepX = width / ( _objectNum );
-        const float stepY = height / ( _objectNum );
-        const float stepZ = depth / ( _objectNum );
-        const float biasX = -stepX * float(_objectNum - 1.0f) * 0.5f;
-        const float biasY = -stepY * float(_objectNum - 1.0f) * 0.5f - 0.75f;
-        const float biasZ = -stepZ * float(_objectNum - 1.0f) * 0.5f;
-
-        for (uint32_t i = 0; i < _objectNum; i++)
+        std::vector<VkGeometryInstance> instances(_instances.size());
+
+        // Every cluster has its own hit record, so the records of an instance start
+        // after the ones of all the previous objects
+        _hitRecordNum = 0;
+        for (auto& object : _renderObjects)
         {
-            code = vkGetAccelerationStructureHandleNV(_device, _renderObjects[i].bottomAS, sizeof(uint64_t), &accelerationStructureHandle);
-            NVVK_CHECK_ERROR(code, L"vkGetAccelerationStructureHandleNV");
+            object.hitRecordOffset = _hitRecordNum;
+            _hitRecordNum += (uint32_t)_geometries[object.geometryIndex]->clusters.size();
+        }
+
+        // Objects sharing a geometry reference the same BLAS, instanceId and
+        // instanceOffset select the object's data and hit records
+        for (size_t i = 0; i < _instances.size(); i++)
+        {
+            const RenderObject& object = _renderObjects[_instances[i].objectIndex];
+            const MeshGeometry& geometry = *_geometries[object.geometryIndex];
+
+            code = vkGetAccelerationStructureHandleNV(_device, geometry.bottomAS, sizeof(uint64_t), &accelerationStructureHandle);
+            NVVK_CHECK_ERROR(code, L"vkGetAccelerationStructureHandleNV");
 
             VkGeometryInstance& instance = instances[i];
-            instance.instanceId = i;
+            instance.instanceId = _instances[i].objectIndex;
             instance.mask = 0xff;
-            instance.instanceOffset = _renderObjects[i].shaderIndex;
+            instance.instanceOffset = object.hitRecordOffset;
             instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_CULL_DISABLE_BIT_NV;
             instance.accelerationStructureHandle = accelerationStructureHandle;
-
-            float transform[12] =
-            {
-                1.0f, 0.0f, 0.0f, biasX + stepX * i,
-                0.0f, 1.0f, 0.0f, biasY + stepY * i,
-                0.0f, 0.0f, 1.0f, biasZ + stepZ * i,
-            };
-            memcpy(instance.transform, transform, sizeof(instance.transform));
+            memcpy(instance.transform, _instances[i].transform, sizeof(instance.transform));
         }
  
-        const VkDeviceSize instanceBufferSize = _objectNum * sizeof(VkGeometryInstance);
+        const VkDeviceSize instanceBufferSize = instances.size() * sizeof(VkGeometryInstance);
         const VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
 
         code = instanceBuffer.Create(instanceBufferSize, VK_BUFFER_USAGE_RAY_TRACING_BIT_NV, memoryFlags);
         NVVK_CHECK_ERROR(code, L"rt instanceBuffer.Create");
-        instanceBuffer.CopyToBufferUsingMapUnmap(instances, instanceBufferSize);
+        instanceBuffer.CopyToBufferUsingMapUnmap(instances.data(), instanceBufferSize);
     }
 
     // ============================================================
@@ -595,7 +1064,7 @@ void TutorialApplication::CreateAccelerationStructures()
     // ============================================================
 
     CreateAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_NV,
-        0, nullptr, _objectNum, _topAS, _topASMemory);
+        0, nullptr, (uint32_t)_instances.size(), _topAS, _topASMemory);
 
     // ============================================================
     // 3. BUILD ACCELERATION STRUCTURES
@@ -620,8 +1089,13 @@ void TutorialApplication::CreateAccelerationStructures()
     {
         VkDeviceSize bottomAccelerationStructureBufferSize = 0; 
         
-        for (size_t i = 0; i < _renderObjects.size(); i++)
-            bottomAccelerationStructureBufferSize = std::max(bottomAccelerationStructureBufferSize, GetScratchBufferSize(_renderObjects[i].bottomAS));
+        for (const auto& geometry : _geometries)
+        {
+            if (geometry)
+            {
+                bottomAccelerationStructureBufferSize = std::max(bottomAccelerationStructureBufferSize, GetScratchBufferSize(geometry->bottomAS));
+            }
+        }
 
         VkDeviceSize topAccelerationStructureBufferSize = GetScratchBufferSize(_topAS);
         VkDeviceSize scratchBufferSize = std::max(bottomAccelerationStructureBufferSize, topAccelerationStructureBufferSize);
@@ -654,8 +1128,14 @@ void TutorialApplication::CreateAccelerationStructures()
         memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV;
         memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV;
 
-        for (size_t i = 0; i < _renderObjects.size(); i++)
+        // One build per shared geometry, not per object
+        for (const auto& geometry : _geometries)
         {
+            if (!geometry)
+            {
+                continue;
+            }
+
             {
                 VkAccelerationStructureInfoNV asInfo;
                 asInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
@@ -663,10 +1143,10 @@ void TutorialApplication::CreateAccelerationStructures()
                 asInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
                 asInfo.flags = 0;
                 asInfo.instanceCount = 0;
-                asInfo.geometryCount = 1;
-                asInfo.pGeometries = &_renderObjects[i].geometry;
+                asInfo.geometryCount = (uint32_t)geometry->geometries.size();
+                asInfo.pGeometries = geometry->geometries.data();
 
-                vkCmdBuildAccelerationStructureNV(commandBuffer, &asInfo, VK_NULL_HANDLE, 0, VK_FALSE, _renderObjects[i].bottomAS, VK_NULL_HANDLE, scratchBuffer.Buffer, 0);
+                vkCmdBuildAccelerationStructureNV(commandBuffer, &asInfo, VK_NULL_HANDLE, 0, VK_FALSE, geometry->bottomAS, VK_NULL_HANDLE, scratchBuffer.Buffer, 0);
             }
 
             vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, 0, 1, &memoryBarrier, 0, 0, 0, 0);
@@ -678,7 +1158,7 @@ void TutorialApplication::CreateAccelerationStructures()
             asInfo.pNext = NULL;
             asInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_NV;
             asInfo.flags = 0;
-            asInfo.instanceCount = _objectNum;
+            asInfo.instanceCount = (uint32_t)_instances.size();
             asInfo.geometryCount = 0;
             asInfo.pGeometries = nullptr;
 
@@ -705,6 +1185,89 @@ void TutorialApplication::CreateAccelerationStructures()
     }
 }
 
+void TutorialApplication::CreateAccumulationImages()
+{
+    // Full float precision, a half mean stops moving after a few thousand samples
+    const VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    const std::array<std::pair<ImageResource*, VkFormat>, 2> images =
+    {{
+        { &_accumulationImageResource, VK_FORMAT_R32G32B32A32_SFLOAT },
+        { &_varianceImageResource, VK_FORMAT_R32_SFLOAT },
+    }};
+
+    for (const auto& image : images)
+    {
+        VkResult code = image.first->CreateImage(VK_IMAGE_TYPE_2D, image.second, { _actualWindowWidth, _actualWindowHeight, 1 },
+            VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        NVVK_CHECK_ERROR(code, L"Accumulation CreateImage");
+
+        code = image.first->CreateImageView(VK_IMAGE_VIEW_TYPE_2D, image.second, subresourceRange);
+        NVVK_CHECK_ERROR(code, L"Accumulation CreateImageView");
+    }
+
+    // The images stay in the general layout, unlike the output image they are
+    // read back in the next frame and can't start out undefined every frame
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo;
+    commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferAllocateInfo.pNext = nullptr;
+    commandBufferAllocateInfo.commandPool = _commandPool;
+    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferAllocateInfo.commandBufferCount = 1;
+
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    VkResult code = vkAllocateCommandBuffers(_device, &commandBufferAllocateInfo, &commandBuffer);
+    NVVK_CHECK_ERROR(code, L"Accumulation vkAllocateCommandBuffers");
+
+    VkCommandBufferBeginInfo beginInfo;
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.pNext = nullptr;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = nullptr;
+    vkBeginCommandBuffer(commandBuffer, &beginInfo);
+
+    VkImageSubresourceRange barrierRange = subresourceRange;
+    for (const auto& image : images)
+    {
+        ImageBarrier(commandBuffer, image.first->Image, barrierRange,
+            0, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+    }
+
+    vkEndCommandBuffer(commandBuffer);
+
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = nullptr;
+    submitInfo.waitSemaphoreCount = 0;
+    submitInfo.pWaitSemaphores = nullptr;
+    submitInfo.pWaitDstStageMask = nullptr;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    submitInfo.signalSemaphoreCount = 0;
+    submitInfo.pSignalSemaphores = nullptr;
+
+    vkQueueSubmit(_queuesInfo.Graphics.Queue, 1, &submitInfo, VK_NULL_HANDLE);
+    vkQueueWaitIdle(_queuesInfo.Graphics.Queue);
+    vkFreeCommandBuffers(_device, _commandPool, 1, &commandBuffer);
+}
+
+void TutorialApplication::CreateFrameUniformBuffer()
+{
+    // Command buffers are recorded once per swapchain image, each one binds its
+    // own slot, so a slot is only written while its command buffer isn't pending
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(_physicalDevice, &properties);
+
+    const VkDeviceSize alignment = properties.limits.minUniformBufferOffsetAlignment;
+    _frameUniformStride = (sizeof(FrameUniformContent) + alignment - 1) / alignment * alignment;
+
+    const VkMemoryPropertyFlags memoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+    VkResult code = _frameUniformBuffer.Create(_frameUniformStride * _commandBuffers.size(), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, memoryFlags);
+    NVVK_CHECK_ERROR(code, L"_frameUniformBuffer.Create");
+
+    std::vector<uint8_t> content((size_t)_frameUniformBuffer.Size, 0);
+    _frameUniformBuffer.CopyToBufferUsingMapUnmap(content.data(), content.size());
+}
+
 void TutorialApplication::CreateDescriptorSetLayouts()
 {
     {
@@ -722,29 +1285,47 @@ void TutorialApplication::CreateDescriptorSetLayouts()
         outputImageLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
         outputImageLayoutBinding.pImmutableSamplers = nullptr;
 
-        VkDescriptorSetLayoutBinding uniformBufferLayoutBinding;
-        uniformBufferLayoutBinding.binding = 2;
-        uniformBufferLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-        uniformBufferLayoutBinding.descriptorCount = _objectNum; // _instanceNum is an upper bound
-        uniformBufferLayoutBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
-        uniformBufferLayoutBinding.pImmutableSamplers = nullptr;
+        VkDescriptorSetLayoutBinding accumulationImageLayoutBinding;
+        accumulationImageLayoutBinding.binding = 2;
+        accumulationImageLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        accumulationImageLayoutBinding.descriptorCount = 1;
+        accumulationImageLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
+        accumulationImageLayoutBinding.pImmutableSamplers = nullptr;
+
+        VkDescriptorSetLayoutBinding varianceImageLayoutBinding = accumulationImageLayoutBinding;
+        varianceImageLayoutBinding.binding = 3;
+
+        // The hit shaders vary their shadow rays per frame in progressive permutations
+        VkDescriptorSetLayoutBinding frameUniformBufferLayoutBinding;
+        frameUniformBufferLayoutBinding.binding = 4;
+        frameUniformBufferLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+        frameUniformBufferLayoutBinding.descriptorCount = 1;
+        frameUniformBufferLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV | VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
+        frameUniformBufferLayoutBinding.pImmutableSamplers = nullptr;
 
         std::vector<VkDescriptorSetLayoutBinding> bindings({ accelerationStructureLayoutBinding, outputImageLayoutBinding,
-            uniformBufferLayoutBinding });
+            accumulationImageLayoutBinding, varianceImageLayoutBinding, frameUniformBufferLayoutBinding });
 
-        // Variable number of uniform buffers
-        std::array<VkDescriptorBindingFlagsEXT, 3> flags =
-            { 0, 0, VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT };
+        for (uint32_t i = 0; i < AOV_COUNT; i++)
+        {
+            VkDescriptorSetLayoutBinding aovImageLayoutBinding = outputImageLayoutBinding;
+            aovImageLayoutBinding.binding = AOV_FIRST_BINDING + i;
+            bindings.push_back(aovImageLayoutBinding);
+        }
 
-        VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlags;
-        bindingFlags.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
-        bindingFlags.pNext = nullptr;
-        bindingFlags.pBindingFlags = flags.data();
-        bindingFlags.bindingCount = (uint32_t)flags.size();
+        // Per-object data of all objects, indexed by gl_InstanceCustomIndexNV
+        VkDescriptorSetLayoutBinding objectDataLayoutBinding;
+        objectDataLayoutBinding.binding = AOV_FIRST_BINDING + AOV_COUNT;
+        objectDataLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        objectDataLayoutBinding.descriptorCount = 1;
+        objectDataLayoutBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
+        objectDataLayoutBinding.pImmutableSamplers = nullptr;
+
+        bindings.push_back(objectDataLayoutBinding);
 
         VkDescriptorSetLayoutCreateInfo layoutInfo;
         layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-        layoutInfo.pNext = &bindingFlags;
+        layoutInfo.pNext = nullptr;
         layoutInfo.flags = 0;
         layoutInfo.bindingCount = (uint32_t)bindings.size();
         layoutInfo.pBindings = bindings.data();
@@ -754,62 +1335,29 @@ void TutorialApplication::CreateDescriptorSetLayouts()
     }
 
     {
-        const VkDescriptorBindingFlagsEXT flag = VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT;
-
-        VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlags;
-        bindingFlags.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
-        bindingFlags.pNext = nullptr;
-        bindingFlags.pBindingFlags = &flag;
-        bindingFlags.bindingCount = 1;
-
-        VkDescriptorSetLayoutBinding texelBufferBinding;
-        texelBufferBinding.binding = 0;
-        texelBufferBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
-        texelBufferBinding.descriptorCount = _objectNum * 2; // 2 vertex buffers per object
-        texelBufferBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
-        texelBufferBinding.pImmutableSamplers = nullptr;
-
-        VkDescriptorSetLayoutCreateInfo layoutInfo;
-        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-        layoutInfo.pNext = &bindingFlags;
-        layoutInfo.flags = 0;
-        layoutInfo.bindingCount = 1;
-        layoutInfo.pBindings = &texelBufferBinding;
-
-        VkResult code = vkCreateDescriptorSetLayout(_device, &layoutInfo, nullptr, &_rtDescriptorSetLayouts[1]);
-        NVVK_CHECK_ERROR(code, L"vkCreateDescriptorSetLayout");
- 
-        texelBufferBinding.descriptorCount = _objectNum; // 1 index buffer per object
-
-        code = vkCreateDescriptorSetLayout(_device, &layoutInfo, nullptr, &_rtDescriptorSetLayouts[2]);
-        NVVK_CHECK_ERROR(code, L"vkCreateDescriptorSetLayout");
-    }
-
-    {
-        const VkDescriptorBindingFlagsEXT flag = VK_DESCRIPTOR_BINDING_VARIABLE_DESCRIPTOR_COUNT_BIT_EXT;
+        // Slots are written while command buffers that bind these sets are pending
+        if (!_descriptorIndexingFeatures.descriptorBindingUniformTexelBufferUpdateAfterBind ||
+            !_descriptorIndexingFeatures.descriptorBindingStorageBufferUpdateAfterBind ||
+            !_descriptorIndexingFeatures.descriptorBindingSampledImageUpdateAfterBind ||
+            !_descriptorIndexingFeatures.descriptorBindingUpdateUnusedWhilePending ||
+            !_descriptorIndexingFeatures.descriptorBindingPartiallyBound)
+        {
+            ExitError(L"Device doesn't support update after bind descriptors");
+        }
 
-        VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlags;
-        bindingFlags.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
-        bindingFlags.pNext = nullptr;
-        bindingFlags.pBindingFlags = &flag;
-        bindingFlags.bindingCount = 1;
+        // Capacities only bound the number of resident resources, not the number of objects
+        const std::vector<BindlessRegistry::TableDesc> tables
+        {
+            { VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER, 4096, VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV }, // BINDLESS_TABLE_VERTEX_BUFFERS
+            { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2048, VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV }, // BINDLESS_TABLE_INDEX_BUFFERS
+            { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1024, VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV }, // BINDLESS_TABLE_TEXTURES
+        };
 
-        VkDescriptorSetLayoutBinding textureBinding;
-        textureBinding.binding = 0;
-        textureBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-        textureBinding.descriptorCount = _objectNum; // 1 texture per object
-        textureBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
-        textureBinding.pImmutableSamplers = nullptr;
+        VkResult code = _bindlessRegistry.Create(tables);
+        NVVK_CHECK_ERROR(code, L"BindlessRegistry::Create");
 
-        VkDescriptorSetLayoutCreateInfo layoutInfo;
-        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-        layoutInfo.pNext = &bindingFlags;
-        layoutInfo.flags = 0;
-        layoutInfo.bindingCount = 1;
-        layoutInfo.pBindings = &textureBinding;
-
-        VkResult code = vkCreateDescriptorSetLayout(_device, &layoutInfo, nullptr, &_rtDescriptorSetLayouts[3]);
-        NVVK_CHECK_ERROR(code, L"vkCreateDescriptorSetLayout");
+        const std::vector<VkDescriptorSetLayout>& layouts = _bindlessRegistry.GetLayouts();
+        std::copy(layouts.begin(), layouts.end(), _rtDescriptorSetLayouts.begin() + 1);
     }
 }
 
@@ -826,23 +1374,21 @@ void TutorialApplication::CreatePipeline()
         NVVK_CHECK_ERROR(code, shaderName);
     };
 
-    ShaderResource rgenShader;
-    ShaderResource missShader;
-    std::array<ShaderResource, 2> chitShaders;
-
-    LoadShader(rgenShader, L"rt_11_shaders.rgen.spv");
-    LoadShader(missShader, L"rt_11_shaders.rmiss.spv");
-    LoadShader(chitShaders[0], L"rt_11_box.rchit.spv");
-    LoadShader(chitShaders[1], L"rt_11_icosahedron.rchit.spv");
- 
-    std::vector<VkPipelineShaderStageCreateInfo> shaderStages
+    // Shader modules are kept alive, every permutation specializes the same modules
+    _shaderFiles =
     {
-        rgenShader.GetShaderStage(VK_SHADER_STAGE_RAYGEN_BIT_NV),
-        missShader.GetShaderStage(VK_SHADER_STAGE_MISS_BIT_NV),
-        chitShaders[0].GetShaderStage(VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV),
-        chitShaders[1].GetShaderStage(VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV),
+        { L"rt_11_shaders.rgen.spv", &_rgenShader },
+        { L"rt_11_shaders.rmiss.spv", &_missShader },
+        { L"rt_11_shadow.rmiss.spv", &_shadowMissShader },
+        { L"rt_11_box.rchit.spv", &_chitShaders[0] },
+        { L"rt_11_icosahedron.rchit.spv", &_chitShaders[1] },
     };
 
+    for (auto& shaderFile : _shaderFiles)
+    {
+        LoadShader(*shaderFile.second, shaderFile.first);
+    }
+
     VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo;
     pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutCreateInfo.pNext = nullptr;
@@ -855,15 +1401,75 @@ void TutorialApplication::CreatePipeline()
     VkResult code = vkCreatePipelineLayout(_device, &pipelineLayoutCreateInfo, nullptr, &_rtPipelineLayout);
     NVVK_CHECK_ERROR(code, L"rt vkCreatePipelineLayout");
 
+    // Permutations share most of the shader code, the pipeline cache lets
+    // the driver reuse the compilation results between them
+    VkPipelineCacheCreateInfo pipelineCacheCreateInfo;
+    pipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    pipelineCacheCreateInfo.pNext = nullptr;
+    pipelineCacheCreateInfo.flags = 0;
+    pipelineCacheCreateInfo.initialDataSize = 0;
+    pipelineCacheCreateInfo.pInitialData = nullptr;
+
+    code = vkCreatePipelineCache(_device, &pipelineCacheCreateInfo, nullptr, &_rtPipelineCache);
+    NVVK_CHECK_ERROR(code, L"rt vkCreatePipelineCache");
+}
+
+PipelineVariant* TutorialApplication::GetPipelineVariant(const ShadingPermutation& permutation)
+{
+    SpecializationConstants rgenConstants;
+    rgenConstants
+        .SetFloat(SPECIALIZATION_RAY_TMIN, permutation.tmin)
+        .SetFloat(SPECIALIZATION_RAY_TMAX, permutation.tmax)
+        .SetBool(SPECIALIZATION_PROGRESSIVE, permutation.progressive)
+        .SetUInt(SPECIALIZATION_PROGRESSIVE_MAX_SAMPLE_COUNT, permutation.maxSampleCount)
+        .SetFloat(SPECIALIZATION_PROGRESSIVE_CONVERGENCE_ERROR, permutation.convergenceError)
+        .SetBool(SPECIALIZATION_AOVS_ENABLED, permutation.aovsEnabled);
+
+    // Both hit shaders use the same set, constants that a shader
+    // doesn't declare are ignored
+    SpecializationConstants chitConstants;
+    chitConstants
+        .SetFloat(SPECIALIZATION_LIGHT_DIRECTION_X, permutation.lightDirection[0])
+        .SetFloat(SPECIALIZATION_LIGHT_DIRECTION_Y, permutation.lightDirection[1])
+        .SetFloat(SPECIALIZATION_LIGHT_DIRECTION_Z, permutation.lightDirection[2])
+        .SetFloat(SPECIALIZATION_ROUGHNESS_BASE, permutation.roughnessBase)
+        .SetFloat(SPECIALIZATION_ROUGHNESS_ALBEDO_SCALE, permutation.roughnessAlbedoScale)
+        .SetBool(SPECIALIZATION_TEXTURE_FETCH_ENABLED, permutation.textureFetchEnabled)
+        .SetUInt(SPECIALIZATION_SHADOW_RAY_COUNT, permutation.shadowRayCount)
+        .SetFloat(SPECIALIZATION_SHADOW_LIGHT_RADIUS, permutation.shadowLightRadius)
+        .SetFloat(SPECIALIZATION_SHADOW_RAY_TMIN, permutation.tmin)
+        .SetFloat(SPECIALIZATION_SHADOW_RAY_TMAX, permutation.tmax)
+        .SetBool(SPECIALIZATION_PROGRESSIVE, permutation.progressive);
+
+    const uint64_t chitKey = chitConstants.GetKey();
+    const uint64_t permutationKey = HashBytes(&chitKey, sizeof(chitKey), rgenConstants.GetKey());
+
+    auto found = _pipelineVariants.find(permutationKey);
+    if (found != _pipelineVariants.end())
+    {
+        return found->second.get();
+    }
+
+    std::vector<VkPipelineShaderStageCreateInfo> shaderStages
+    {
+        _rgenShader.GetShaderStage(VK_SHADER_STAGE_RAYGEN_BIT_NV, &rgenConstants),
+        _missShader.GetShaderStage(VK_SHADER_STAGE_MISS_BIT_NV),
+        _shadowMissShader.GetShaderStage(VK_SHADER_STAGE_MISS_BIT_NV),
+        _chitShaders[0].GetShaderStage(VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV, &chitConstants),
+        _chitShaders[1].GetShaderStage(VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV, &chitConstants),
+    };
+
     std::vector<VkRayTracingShaderGroupCreateInfoNV> shaderGroups({
         // group0 = [ raygen ]
         { VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_NV, nullptr, VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_NV, 0, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV },
         // group1 = [ miss ]
         { VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_NV, nullptr, VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_NV, 1, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV },
-        // group2 = [ chit ]
-        { VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_NV, nullptr, VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_NV, VK_SHADER_UNUSED_NV, 2, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV },
+        // group2 = [ shadow miss ]
+        { VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_NV, nullptr, VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_NV, 2, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV },
         // group3 = [ chit ]
         { VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_NV, nullptr, VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_NV, VK_SHADER_UNUSED_NV, 3, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV },
+        // group4 = [ chit ]
+        { VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_NV, nullptr, VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_NV, VK_SHADER_UNUSED_NV, 4, VK_SHADER_UNUSED_NV, VK_SHADER_UNUSED_NV },
     });
 
     VkRayTracingPipelineCreateInfoNV rayPipelineInfo;
@@ -874,213 +1480,697 @@ void TutorialApplication::CreatePipeline()
     rayPipelineInfo.pStages = shaderStages.data();
     rayPipelineInfo.groupCount = (uint32_t)shaderGroups.size();
     rayPipelineInfo.pGroups = shaderGroups.data();
-    rayPipelineInfo.maxRecursionDepth = 1;
+    rayPipelineInfo.maxRecursionDepth = permutation.shadowRayCount > 0 ? 2 : 1;
     rayPipelineInfo.layout = _rtPipelineLayout;
     rayPipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
     rayPipelineInfo.basePipelineIndex = 0;
 
-    code = vkCreateRayTracingPipelinesNV(_device, nullptr, 1, &rayPipelineInfo, nullptr, &_rtPipeline);
+    std::unique_ptr<PipelineVariant> variant(new PipelineVariant());
+
+    VkResult code = vkCreateRayTracingPipelinesNV(_device, _rtPipelineCache, 1, &rayPipelineInfo, nullptr, &variant->pipeline);
     NVVK_CHECK_ERROR(code, L"vkCreateRayTracingPipelinesNV");
+
+    CreateShaderBindingTable(*variant);
+
+    PipelineVariant* result = variant.get();
+    _pipelineVariants[permutationKey] = std::move(variant);
+    return result;
 }
 
-void TutorialApplication::CreateShaderBindingTable()
+void TutorialApplication::SelectPipelineVariant(const ShadingPermutation& permutation)
 {
-    const uint32_t groupNum = 4;
-    const VkDeviceSize shaderBindingTableSize = _rayTracingProperties.shaderGroupHandleSize * groupNum;
+    PipelineVariant* variant = GetPipelineVariant(permutation);
+    if (variant == _activePipelineVariant)
+    {
+        return;
+    }
 
-    VkResult code = _shaderBindingTable.Create(shaderBindingTableSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
-    NVVK_CHECK_ERROR(code, L"_shaderBindingTable.Create");
+    // Samples of another permutation don't belong in the same mean
+    _accumulatedFrameNum = 0;
+
+    // Command buffers reference the pipeline and the shader binding table,
+    // so they have to be recorded again once nothing is in flight
+    if (_activePipelineVariant != nullptr)
+    {
+        vkDeviceWaitIdle(_device);
+        _activePipelineVariant = variant;
+        FillCommandBuffers();
+    }
+    else
+    {
+        _activePipelineVariant = variant;
+    }
+}
+
+void TutorialApplication::DestroyPipelineVariants()
+{
+    for (auto& item : _pipelineVariants)
+    {
+        item.second->shaderBindingTable.Cleanup();
+        if (item.second->pipeline)
+        {
+            vkDestroyPipeline(_device, item.second->pipeline, nullptr);
+        }
+    }
+    _pipelineVariants.clear();
+    _activePipelineVariant = nullptr;
+}
+
+void TutorialApplication::StartShaderHotReload()
+{
+    // Only works when running from the source tree, Bin/../Source/Shaders
+    const std::wstring sourceFolder = _basePath + L"/../Source/Shaders/";
+
+    std::vector<std::wstring> sourceFileNames;
+    for (auto& shaderFile : _shaderFiles)
+    {
+        sourceFileNames.push_back(shaderFile.first.substr(0, shaderFile.first.size() - 4)); // strip .spv
+    }
+
+    std::wstring error;
+    if (!_shaderHotReloader.Start(sourceFolder, _basePath + L"/Assets/Shaders/", sourceFolder + L"glslangValidator.exe", sourceFileNames, error))
+    {
+        std::wcout << L"Shader hot reload disabled: " << error << L"\n";
+    }
+}
+
+void TutorialApplication::ReloadShaders()
+{
+    std::vector<ShaderHotReloader::CompiledShader> compiledShaders = _shaderHotReloader.TakeCompiledShaders();
+    if (compiledShaders.empty())
+    {
+        return;
+    }
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    // Frames in flight still use the old pipeline and shader binding table
+    vkDeviceWaitIdle(_device);
+
+    for (auto& compiledShader : compiledShaders)
+    {
+        for (auto& shaderFile : _shaderFiles)
+        {
+            if (shaderFile.first == compiledShader.SpirvFileName)
+            {
+                VkResult code = shaderFile.second->LoadFromMemory(compiledShader.Bytecode.data(), compiledShader.Bytecode.size() * sizeof(uint32_t));
+                NVVK_CHECK_ERROR(code, L"Shader hot reload: " + compiledShader.SpirvFileName);
+            }
+        }
+    }
 
-    uint8_t* mappedMemory = (uint8_t*)_shaderBindingTable.Map(shaderBindingTableSize);
+    // Every permutation specializes all of the shaders above, so all of them are
+    // stale now. Only the active one is rebuilt here, the rest are created again
+    // when they are selected.
+    DestroyPipelineVariants();
+    _activePipelineVariant = GetPipelineVariant(_shadingPermutation);
+    FillCommandBuffers();
+    _accumulatedFrameNum = 0;
 
-    code = vkGetRayTracingShaderGroupHandlesNV(_device, _rtPipeline, 0, groupNum, shaderBindingTableSize, mappedMemory);
+    const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    std::wcout << L"Shader hot reload: pipeline rebuilt in " << milliseconds << L" ms\n";
+}
+
+void TutorialApplication::CreateShaderBindingTable(PipelineVariant& variant)
+{
+    const uint32_t groupNum = 5;
+    const uint32_t handleSize = _rayTracingProperties.shaderGroupHandleSize;
+
+    // Hit records carry the first triangle of their cluster, read through shaderRecordNV
+    constexpr VkDeviceSize inlineDataSize = sizeof(uint32_t) * 4;
+    _hitRecordSize = handleSize + inlineDataSize;
+
+    const VkDeviceSize raygenAndMissSize = handleSize * 3;
+    const VkDeviceSize shaderBindingTableSize = raygenAndMissSize + _hitRecordSize * _hitRecordNum;
+
+    std::vector<uint8_t> handles(handleSize * groupNum);
+    VkResult code = vkGetRayTracingShaderGroupHandlesNV(_device, variant.pipeline, 0, groupNum, handles.size(), handles.data());
+    NVVK_CHECK_ERROR(code, L"vkGetRayTracingShaderGroupHandlesNV");
+
+    code = variant.shaderBindingTable.Create(shaderBindingTableSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT);
     NVVK_CHECK_ERROR(code, L"_shaderBindingTable.Create");
 
-    _shaderBindingTable.Unmap();
+    uint8_t* mappedMemory = (uint8_t*)variant.shaderBindingTable.Map(shaderBindingTableSize);
+
+    // Raygen, miss and shadow miss groups
+    memcpy(mappedMemory, handles.data(), raygenAndMissSize);
+    mappedMemory += raygenAndMissSize;
+
+    for (auto& object : _renderObjects)
+    {
+        const uint8_t* hitGroupHandle = handles.data() + handleSize * (3 + object.shaderIndex);
+
+        for (auto& cluster : _geometries[object.geometryIndex]->clusters)
+        {
+            memcpy(mappedMemory, hitGroupHandle, handleSize);
+
+            uint32_t* inlineData = (uint32_t*)(mappedMemory + handleSize);
+            inlineData[0] = cluster.FirstTriangle;
+            inlineData[1] = 0;
+            inlineData[2] = 0;
+            inlineData[3] = 0;
+
+            mappedMemory += _hitRecordSize;
+        }
+    }
+
+    variant.shaderBindingTable.Unmap();
 }
 
 void TutorialApplication::CreatePoolAndAllocateDescriptorSets()
 {
     std::vector<VkDescriptorPoolSize> poolSizes
     ({
-        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
+        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 3 + AOV_COUNT },
         { VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV, 1 },
-        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, _objectNum },
-        { VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER, _objectNum * 3 }, // 2 vertex buffers + index buffer
-        { VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, _objectNum }
+        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1 },
+        { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1 }
     });
 
     VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
     descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
     descriptorPoolCreateInfo.pNext = nullptr;
     descriptorPoolCreateInfo.flags = 0;
-    descriptorPoolCreateInfo.maxSets = (uint32_t)_rtDescriptorSetLayouts.size();
+    descriptorPoolCreateInfo.maxSets = 1;
     descriptorPoolCreateInfo.poolSizeCount = (uint32_t)poolSizes.size();
     descriptorPoolCreateInfo.pPoolSizes = poolSizes.data();
 
     VkResult code = vkCreateDescriptorPool(_device, &descriptorPoolCreateInfo, nullptr, &_rtDescriptorPool);
     NVVK_CHECK_ERROR(code, L"vkCreateDescriptorPool");
 
-    const uint32_t variableDescriptorCounts[4] = {
-        _objectNum, // uniform buffers
-        (uint32_t)_vertexBufferViews.size(), // vertex buffers
-        (uint32_t)_indexBufferViews.size(), // index buffers
-        (uint32_t)_imageViews.size() // combined image samplers
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = nullptr;
+    descriptorSetAllocateInfo.descriptorPool = _rtDescriptorPool;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &_rtDescriptorSetLayouts[0];
+
+    code = vkAllocateDescriptorSets(_device, &descriptorSetAllocateInfo, &_rtDescriptorSets[0]);
+    NVVK_CHECK_ERROR(code, L"vkAllocateDescriptorSets");
+
+    // Bindless sets live as long as the registry and are never reallocated
+    const std::vector<VkDescriptorSet>& bindlessSets = _bindlessRegistry.GetSets();
+    std::copy(bindlessSets.begin(), bindlessSets.end(), _rtDescriptorSets.begin() + 1);
+
+    // Offsets are computed once, updates only fill DescriptorSetContent
+    std::vector<VkDescriptorUpdateTemplateEntry> entries
+    {
+        DescriptorUpdateTemplate::Entry(0, VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV, 1,
+            offsetof(DescriptorSetContent, topAS)),
+        DescriptorUpdateTemplate::Entry(1, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
+            offsetof(DescriptorSetContent, outputImage)),
+        DescriptorUpdateTemplate::Entry(2, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
+            offsetof(DescriptorSetContent, accumulationImage)),
+        DescriptorUpdateTemplate::Entry(3, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
+            offsetof(DescriptorSetContent, varianceImage)),
+        DescriptorUpdateTemplate::Entry(4, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, 1,
+            offsetof(DescriptorSetContent, frameUniformBuffer)),
+        DescriptorUpdateTemplate::Entry(AOV_FIRST_BINDING + AOV_COUNT, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1,
+            offsetof(DescriptorSetContent, objectDataBuffer)),
     };
+    for (uint32_t i = 0; i < AOV_COUNT; i++)
+    {
+        entries.push_back(DescriptorUpdateTemplate::Entry(AOV_FIRST_BINDING + i, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1,
+            offsetof(DescriptorSetContent, aovImages) + sizeof(VkDescriptorImageInfo) * i));
+    }
+
+    code = _rtDescriptorUpdateTemplate.Create(_rtDescriptorSetLayouts[0], entries);
+    NVVK_CHECK_ERROR(code, L"vkCreateDescriptorUpdateTemplate");
+}
+
+void TutorialApplication::UpdateDescriptorSets()
+{
+    // Has to run again whenever the TLAS or the output image is recreated
+    DescriptorSetContent content;
+    content.topAS = _topAS;
+
+    content.outputImage.sampler = nullptr;
+    content.outputImage.imageView = _offsreenImageResource.ImageView;
+    content.outputImage.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    content.accumulationImage.sampler = nullptr;
+    content.accumulationImage.imageView = _accumulationImageResource.ImageView;
+    content.accumulationImage.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    content.varianceImage.sampler = nullptr;
+    content.varianceImage.imageView = _varianceImageResource.ImageView;
+    content.varianceImage.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    // The slot of the frame is selected by the dynamic offset when the set is bound
+    content.frameUniformBuffer.buffer = _frameUniformBuffer.Buffer;
+    content.frameUniformBuffer.offset = 0;
+    content.frameUniformBuffer.range = sizeof(FrameUniformContent);
 
-    VkDescriptorSetVariableDescriptorCountAllocateInfoEXT variableDescriptorCountInfo;
-    variableDescriptorCountInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_VARIABLE_DESCRIPTOR_COUNT_ALLOCATE_INFO_EXT;
-    variableDescriptorCountInfo.pNext = nullptr;
-    variableDescriptorCountInfo.descriptorSetCount = (uint32_t)_rtDescriptorSetLayouts.size();
-    variableDescriptorCountInfo.pDescriptorCounts = variableDescriptorCounts; // actual number of descriptors
+    for (uint32_t i = 0; i < AOV_COUNT; i++)
+    {
+        content.aovImages[i].sampler = nullptr;
+        content.aovImages[i].imageView = _aovImageResources[i]->ImageView;
+        content.aovImages[i].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+
+    content.objectDataBuffer.buffer = _objectDataBuffer.Buffer;
+    content.objectDataBuffer.offset = 0;
+    content.objectDataBuffer.range = VK_WHOLE_SIZE;
+
+    _rtDescriptorUpdateTemplate.Update(_rtDescriptorSets[0], &content);
+}
+
+void TutorialApplication::RunDescriptorUpdateBenchmark()
+{
+    const uint32_t descriptorNum = 10000;
+    const uint32_t iterationNum = 100;
+
+    // A plain set, so the numbers aren't skewed by update after bind
+    VkDescriptorSetLayoutBinding texelBufferBinding;
+    texelBufferBinding.binding = 0;
+    texelBufferBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+    texelBufferBinding.descriptorCount = descriptorNum;
+    texelBufferBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
+    texelBufferBinding.pImmutableSamplers = nullptr;
+
+    VkDescriptorSetLayoutCreateInfo layoutInfo;
+    layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layoutInfo.pNext = nullptr;
+    layoutInfo.flags = 0;
+    layoutInfo.bindingCount = 1;
+    layoutInfo.pBindings = &texelBufferBinding;
+
+    VkDescriptorSetLayout layout;
+    VkResult code = vkCreateDescriptorSetLayout(_device, &layoutInfo, nullptr, &layout);
+    NVVK_CHECK_ERROR(code, L"vkCreateDescriptorSetLayout");
+
+    const VkDescriptorPoolSize poolSize = { VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER, descriptorNum };
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.pNext = nullptr;
+    descriptorPoolCreateInfo.flags = 0;
+    descriptorPoolCreateInfo.maxSets = 1;
+    descriptorPoolCreateInfo.poolSizeCount = 1;
+    descriptorPoolCreateInfo.pPoolSizes = &poolSize;
+
+    VkDescriptorPool pool;
+    code = vkCreateDescriptorPool(_device, &descriptorPoolCreateInfo, nullptr, &pool);
+    NVVK_CHECK_ERROR(code, L"vkCreateDescriptorPool");
 
     VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
     descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descriptorSetAllocateInfo.pNext = &variableDescriptorCountInfo;
-    descriptorSetAllocateInfo.descriptorPool = _rtDescriptorPool;
-    descriptorSetAllocateInfo.descriptorSetCount = (uint32_t)_rtDescriptorSetLayouts.size();
-    descriptorSetAllocateInfo.pSetLayouts = _rtDescriptorSetLayouts.data();
+    descriptorSetAllocateInfo.pNext = nullptr;
+    descriptorSetAllocateInfo.descriptorPool = pool;
+    descriptorSetAllocateInfo.descriptorSetCount = 1;
+    descriptorSetAllocateInfo.pSetLayouts = &layout;
 
-    code = vkAllocateDescriptorSets(_device, &descriptorSetAllocateInfo, _rtDescriptorSets.data());
+    VkDescriptorSet descriptorSet;
+    code = vkAllocateDescriptorSets(_device, &descriptorSetAllocateInfo, &descriptorSet);
     NVVK_CHECK_ERROR(code, L"vkAllocateDescriptorSets");
+
+    DescriptorUpdateTemplate updateTemplate;
+    code = updateTemplate.Create(layout, { DescriptorUpdateTemplate::Entry(0, VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER,
+        descriptorNum, 0, sizeof(VkBufferView)) });
+    NVVK_CHECK_ERROR(code, L"vkCreateDescriptorUpdateTemplate");
+
+    // Every descriptor points to the same view, only the CPU side cost matters here
+    const VkBufferView bufferView = _geometries[_renderObjects[0].geometryIndex]->bufferViews[0];
+
+    std::vector<VkWriteDescriptorSet> descriptorWrites(descriptorNum);
+    std::vector<VkBufferView> bufferViews(descriptorNum);
+
+    auto Measure = [&](const wchar_t* name, const std::function<void()>& update)
+    {
+        update(); // warm up
+
+        const auto start = std::chrono::high_resolution_clock::now();
+        for (uint32_t i = 0; i < iterationNum; i++)
+        {
+            update();
+        }
+        const double microseconds = std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count() / iterationNum;
+
+        std::wcout << L"Descriptor update benchmark: " << name << L": " << microseconds << L" us per update, "
+            << microseconds * 1000.0 / descriptorNum << L" ns per descriptor\n";
+    };
+
+    // The current path, one write per resource built field by field
+    Measure(L"VkWriteDescriptorSet per descriptor", [&]()
+    {
+        for (uint32_t i = 0; i < descriptorNum; i++)
+        {
+            bufferViews[i] = bufferView;
+
+            VkWriteDescriptorSet& write = descriptorWrites[i];
+            write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            write.pNext = nullptr;
+            write.dstSet = descriptorSet;
+            write.dstBinding = 0;
+            write.dstArrayElement = i;
+            write.descriptorCount = 1;
+            write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+            write.pImageInfo = nullptr;
+            write.pBufferInfo = nullptr;
+            write.pTexelBufferView = &bufferViews[i];
+        }
+        vkUpdateDescriptorSets(_device, descriptorNum, descriptorWrites.data(), 0, nullptr);
+    });
+
+    // Best case for writes, only possible when the descriptors are contiguous
+    Measure(L"single VkWriteDescriptorSet", [&]()
+    {
+        for (uint32_t i = 0; i < descriptorNum; i++)
+        {
+            bufferViews[i] = bufferView;
+        }
+
+        VkWriteDescriptorSet& write = descriptorWrites[0];
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.pNext = nullptr;
+        write.dstSet = descriptorSet;
+        write.dstBinding = 0;
+        write.dstArrayElement = 0;
+        write.descriptorCount = descriptorNum;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+        write.pImageInfo = nullptr;
+        write.pBufferInfo = nullptr;
+        write.pTexelBufferView = bufferViews.data();
+
+        vkUpdateDescriptorSets(_device, 1, &write, 0, nullptr);
+    });
+
+    Measure(L"update template", [&]()
+    {
+        for (uint32_t i = 0; i < descriptorNum; i++)
+        {
+            bufferViews[i] = bufferView;
+        }
+        updateTemplate.Update(descriptorSet, bufferViews.data());
+    });
+
+    updateTemplate.Cleanup();
+    vkDestroyDescriptorPool(_device, pool, nullptr);
+    vkDestroyDescriptorSetLayout(_device, layout, nullptr);
 }
 
-void TutorialApplication::UpdateDescriptorSets()
+// ============================================================
+// Import benchmark. Every run gets a fresh task pool, so thread
+// startup is part of the measured time, like in LoadScene.
+// ============================================================
+
+static void WriteBenchmarkObj(const std::wstring& path, uint32_t gridSize)
+{
+    FILE* file;
+    if (_wfopen_s(&file, path.c_str(), L"wb") != 0)
+    {
+        ExitError(L"Failed to create " + path);
+    }
+
+    // A displaced grid with texcoords and normals, two triangles per quad
+    std::string text;
+    char line[128];
+    for (uint32_t y = 0; y <= gridSize; y++)
+    {
+        for (uint32_t x = 0; x <= gridSize; x++)
+        {
+            const float u = x / float(gridSize);
+            const float v = y / float(gridSize);
+            const float height = 0.05f * sinf(u * 40.0f) * cosf(v * 40.0f);
+            snprintf(line, sizeof(line), "v %.6f %.6f %.6f\nvt %.6f %.6f\nvn %.6f %.6f 1.0\n", u, v, height, u, v, -height, height);
+            text += line;
+        }
+
+        if (text.size() > (1 << 24))
+        {
+            fwrite(text.data(), 1, text.size(), file);
+            text.clear();
+        }
+    }
+
+    for (uint32_t y = 0; y < gridSize; y++)
+    {
+        for (uint32_t x = 0; x < gridSize; x++)
+        {
+            const uint32_t a = y * (gridSize + 1) + x + 1;
+            const uint32_t b = a + 1;
+            const uint32_t c = a + gridSize + 2;
+            const uint32_t d = a + gridSize + 1;
+            snprintf(line, sizeof(line), "f %u/%u/%u %u/%u/%u %u/%u/%u %u/%u/%u\n", a, a, a, b, b, b, c, c, c, d, d, d);
+            text += line;
+        }
+
+        if (text.size() > (1 << 24))
+        {
+            fwrite(text.data(), 1, text.size(), file);
+            text.clear();
+        }
+    }
+
+    fwrite(text.data(), 1, text.size(), file);
+    fclose(file);
+}
+
+void TutorialApplication::RunImportBenchmark()
 {
-    VkWriteDescriptorSetAccelerationStructureNV descriptorAccelerationStructureInfo;
-    descriptorAccelerationStructureInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_NV;
-    descriptorAccelerationStructureInfo.pNext = nullptr;
-    descriptorAccelerationStructureInfo.accelerationStructureCount = 1;
-    descriptorAccelerationStructureInfo.pAccelerationStructures = &_topAS;
-
-    VkWriteDescriptorSet accelerationStructureWrite;
-    accelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    accelerationStructureWrite.pNext = &descriptorAccelerationStructureInfo; // Notice that pNext is assigned here!
-    accelerationStructureWrite.dstSet = _rtDescriptorSets[0];
-    accelerationStructureWrite.dstBinding = 0;
-    accelerationStructureWrite.dstArrayElement = 0;
-    accelerationStructureWrite.descriptorCount = 1;
-    accelerationStructureWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV;
-    accelerationStructureWrite.pImageInfo = nullptr;
-    accelerationStructureWrite.pBufferInfo = nullptr;
-    accelerationStructureWrite.pTexelBufferView = nullptr;
-
-    VkDescriptorImageInfo descriptorOutputImageInfo;
-    descriptorOutputImageInfo.sampler = nullptr;
-    descriptorOutputImageInfo.imageView = _offsreenImageResource.ImageView;
-    descriptorOutputImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-
-    VkWriteDescriptorSet outputImageWrite;
-    outputImageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    outputImageWrite.pNext = nullptr;
-    outputImageWrite.dstSet = _rtDescriptorSets[0];
-    outputImageWrite.dstBinding = 1;
-    outputImageWrite.dstArrayElement = 0;
-    outputImageWrite.descriptorCount = 1;
-    outputImageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    outputImageWrite.pImageInfo = &descriptorOutputImageInfo;
-    outputImageWrite.pBufferInfo = nullptr;
-    outputImageWrite.pTexelBufferView = nullptr;
-
-    std::array<VkDescriptorBufferInfo, _objectNum> bufferInfo;
-
-    for (uint32_t i = 0; i < _renderObjects.size(); i++)
-    {
-        bufferInfo[i].buffer = _renderObjects[i].uniformBuffer.Buffer;
-        bufferInfo[i].offset = 0;
-        bufferInfo[i].range = _renderObjects[i].uniformBuffer.Size;
-    }
-
-    VkWriteDescriptorSet uniformBuffers;
-    uniformBuffers.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    uniformBuffers.pNext = nullptr;
-    uniformBuffers.dstSet = _rtDescriptorSets[0];
-    uniformBuffers.dstBinding = 2;
-    uniformBuffers.dstArrayElement = 0;
-    uniformBuffers.descriptorCount = (uint32_t)bufferInfo.size();
-    uniformBuffers.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    uniformBuffers.pImageInfo = nullptr;
-    uniformBuffers.pBufferInfo = bufferInfo.data();
-    uniformBuffers.pTexelBufferView = nullptr;
-
-    VkWriteDescriptorSet vertexBuffers;
-    vertexBuffers.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    vertexBuffers.pNext = nullptr;
-    vertexBuffers.dstSet = _rtDescriptorSets[1];
-    vertexBuffers.dstBinding = 0;
-    vertexBuffers.dstArrayElement = 0;
-    vertexBuffers.descriptorCount = (uint32_t)_vertexBufferViews.size();
-    vertexBuffers.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
-    vertexBuffers.pImageInfo = nullptr;
-    vertexBuffers.pBufferInfo = nullptr;
-    vertexBuffers.pTexelBufferView = _vertexBufferViews.data();
-
-    VkWriteDescriptorSet indexBuffers;
-    indexBuffers.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    indexBuffers.pNext = nullptr;
-    indexBuffers.dstSet = _rtDescriptorSets[2];
-    indexBuffers.dstBinding = 0;
-    indexBuffers.dstArrayElement = 0;
-    indexBuffers.descriptorCount = (uint32_t)_indexBufferViews.size();
-    indexBuffers.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
-    indexBuffers.pImageInfo = nullptr;
-    indexBuffers.pBufferInfo = nullptr;
-    indexBuffers.pTexelBufferView = _indexBufferViews.data();
-
-    std::vector<VkDescriptorImageInfo> imageInfoArray;
-    for (size_t i = 0; i < _imageViews.size(); i++)
-    {
-        VkDescriptorImageInfo info;
-        info.sampler = _samplers[i];
-        info.imageView = _imageViews[i];
-        info.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-        imageInfoArray.push_back(info);
-    }
-
-    VkWriteDescriptorSet imageWrite;
-    imageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    imageWrite.pNext = nullptr;
-    imageWrite.dstSet = _rtDescriptorSets[3];
-    imageWrite.dstBinding = 0;
-    imageWrite.dstArrayElement = 0;
-    imageWrite.descriptorCount = (uint32_t)imageInfoArray.size();
-    imageWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-    imageWrite.pImageInfo = imageInfoArray.data();
-    imageWrite.pBufferInfo = nullptr;
-    imageWrite.pTexelBufferView = nullptr;
-
-    const std::vector<VkWriteDescriptorSet> descriptorWrites
-    {
-        accelerationStructureWrite,
-        outputImageWrite,
-        uniformBuffers,
-        vertexBuffers,
-        indexBuffers,
-        imageWrite
+    std::wstring path = _settings.ScenePath;
+    if (path.empty())
+    {
+        path = _basePath + L"/ImportBenchmark.obj";
+        WriteBenchmarkObj(path, 1500); // 4.5M triangles
+    }
+
+    const uint32_t maxThreadNum = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint32_t> threadNums;
+    for (uint32_t threadNum = 1; threadNum < maxThreadNum; threadNum *= 2)
+    {
+        threadNums.push_back(threadNum);
+    }
+    threadNums.push_back(maxThreadNum);
+
+    for (uint32_t threadNum : threadNums)
+    {
+        ImportedScene scene;
+        ImportStats stats;
+        std::wstring error;
+
+        TaskPool taskPool(threadNum);
+        if (!ImportScene(path, taskPool, scene, stats, error))
+        {
+            ExitError(L"Import benchmark: " + error);
+        }
+
+        std::wcout << L"Import benchmark, " << threadNum << L" threads: " << stats.TriangleNum << L" triangles in " << stats.Milliseconds << L" ms, "
+            << stats.GetTrianglesPerSecond() / 1000000.0 << L" Mtris/s, " << stats.SourceBytes / 1000.0 / stats.Milliseconds << L" MB/s\n";
+    }
+}
+
+// ============================================================
+// CPU BVH benchmark. The geometry buffers are host visible, they
+// are copied out once so the builds don't read uncached memory.
+// The CPU builder then reads the copies at the offsets, strides
+// and formats of the VkGeometryNV the BLAS is built from.
+// ============================================================
+
+static std::wstring FormatHistogram(const std::vector<uint32_t>& histogram)
+{
+    std::wstring text;
+    for (size_t i = 0; i < histogram.size(); i++)
+    {
+        if (histogram[i] > 0)
+        {
+            text += L" " + std::to_wstring(i) + L":" + std::to_wstring(histogram[i]);
+        }
+    }
+    return text;
+}
+
+static std::vector<uint8_t> ReadBuffer(const BufferResource& buffer)
+{
+    std::vector<uint8_t> content;
+    if (buffer.Buffer != VK_NULL_HANDLE)
+    {
+        content.resize(buffer.Size);
+        memcpy(content.data(), buffer.Map(buffer.Size), buffer.Size);
+        buffer.Unmap();
+    }
+    return content;
+}
+
+void TutorialApplication::RunCpuBvhBenchmark()
+{
+    struct HostGeometry
+    {
+        const MeshGeometry* geometry;
+        std::vector<uint8_t> vertexData;
+        std::vector<uint8_t> indexData;
+        std::vector<uint8_t> transformData;
+        std::vector<BvhGeometryInput> inputs;
     };
 
-    vkUpdateDescriptorSets(_device, (uint32_t)descriptorWrites.size(), descriptorWrites.data(), 0, nullptr);
+    std::vector<HostGeometry> hostGeometries;
+    for (const std::unique_ptr<MeshGeometry>& geometry : _geometries)
+    {
+        if (!geometry)
+        {
+            continue;
+        }
+
+        hostGeometries.push_back(HostGeometry());
+        HostGeometry& host = hostGeometries.back();
+        host.geometry = geometry.get();
+        host.vertexData = ReadBuffer(geometry->vertexBuffers[0]);
+        host.indexData = ReadBuffer(geometry->indexBuffer);
+        host.transformData = ReadBuffer(geometry->positionTransform);
+
+        host.inputs.resize(geometry->geometries.size());
+        for (size_t i = 0; i < host.inputs.size(); i++)
+        {
+            host.inputs[i].Geometry = geometry->geometries[i];
+            host.inputs[i].VertexData = host.vertexData.data();
+            host.inputs[i].IndexData = host.indexData.data();
+            host.inputs[i].TransformData = host.transformData.empty() ? nullptr : host.transformData.data();
+        }
+    }
+
+    const uint32_t maxThreadNum = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<uint32_t> threadNums;
+    for (uint32_t threadNum = 1; threadNum < maxThreadNum; threadNum *= 2)
+    {
+        threadNums.push_back(threadNum);
+    }
+    threadNums.push_back(maxThreadNum);
+
+    const BvhBuildSettings settings;
+    for (uint32_t threadNum : threadNums)
+    {
+        TaskPool taskPool(threadNum);
+        uint64_t triangleNum = 0;
+        double milliseconds = 0.0;
+
+        for (const HostGeometry& host : hostGeometries)
+        {
+            Bvh bvh;
+            BvhStats stats;
+            std::wstring error;
+            if (!BuildBvh(taskPool, host.inputs, settings, bvh, error, &stats))
+            {
+                ExitError(L"CPU BVH benchmark, " + host.geometry->name + L": " + error);
+            }
+
+            triangleNum += stats.TriangleNum;
+            milliseconds += stats.BuildMilliseconds;
+
+            // Shape and quality don't depend on the thread count, log them once
+            if (threadNum == threadNums.back())
+            {
+                if (!ValidateBvh(bvh, error))
+                {
+                    ExitError(L"CPU BVH benchmark, " + host.geometry->name + L": " + error);
+                }
+
+                std::wcout << L"CPU BVH " << host.geometry->name << L": " << stats.TriangleNum << L" triangles, " << stats.NodeNum
+                    << L" nodes, SAH cost " << stats.SahCost << L", depth " << stats.MaxDepth << L" max " << stats.AverageLeafDepth
+                    << L" average, " << host.geometry->bottomASSize << L" bytes of BLAS memory\n"
+                    << L"  leaves per depth:" << FormatHistogram(stats.DepthHistogram) << L"\n"
+                    << L"  leaves per size:" << FormatHistogram(stats.LeafSizeHistogram) << L"\n";
+            }
+        }
+
+        std::wcout << L"CPU BVH benchmark, " << threadNum << L" threads: " << triangleNum << L" triangles in " << milliseconds << L" ms, "
+            << (milliseconds > 0.0 ? triangleNum / (milliseconds * 1000.0) : 0.0) << L" Mtris/s\n";
+    }
 }
 
 void TutorialApplication::RecordCommandBufferForFrame(VkCommandBuffer commandBuffer, uint32_t frameIndex)
 {
-    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, _rtPipeline);
+    const VkBuffer shaderBindingTable = _activePipelineVariant->shaderBindingTable.Buffer;
+
+    // The previous frame reads and writes the accumulation images too
+    VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    for (const ImageResource* image : { &_accumulationImageResource, &_varianceImageResource })
+    {
+        ImageBarrier(commandBuffer, image->Image, subresourceRange,
+            VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+            VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL);
+    }
+
+    const uint32_t frameUniformOffset = (uint32_t)(_frameUniformStride * frameIndex);
+
+    vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, _activePipelineVariant->pipeline);
     vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, _rtPipelineLayout, 0,
-        (uint32_t)_rtDescriptorSets.size(), _rtDescriptorSets.data(), 0, 0);
+        (uint32_t)_rtDescriptorSets.size(), _rtDescriptorSets.data(), 1, &frameUniformOffset);
 
     // Here's how the shader binding table looks like in this tutorial:
-    // |[ raygen shader ]|[ miss shader ]|[ hit shader ][ hit shader ]|
-    // |                 |               |                            |
-    // | 0               | 1             | 2                          | 4
+    // |[ raygen shader ]|[ miss shader ][ shadow miss shader ]|[ hit shader + cluster data ]...|
+    // |                 |                                     |  one record per cluster        |
+    // | 0               | 1                                   | 3                              |
 
     vkCmdTraceRaysNV(commandBuffer,
-        _shaderBindingTable.Buffer, 0,
-        _shaderBindingTable.Buffer, 1 * _rayTracingProperties.shaderGroupHandleSize, _rayTracingProperties.shaderGroupHandleSize,
-        _shaderBindingTable.Buffer, 2 * _rayTracingProperties.shaderGroupHandleSize, _rayTracingProperties.shaderGroupHandleSize,
+        shaderBindingTable, 0,
+        shaderBindingTable, 1 * _rayTracingProperties.shaderGroupHandleSize, _rayTracingProperties.shaderGroupHandleSize,
+        shaderBindingTable, 3 * _rayTracingProperties.shaderGroupHandleSize, _hitRecordSize,
         VK_NULL_HANDLE, 0, 0,
         _actualWindowWidth, _actualWindowHeight, 1);
 }
 
+void TutorialApplication::UpdateDataForFrame(uint32_t frameIndex)
+{
+    // Called right before the frame is submitted
+    static bool firstFrame = true;
+    if (firstFrame)
+    {
+        firstFrame = false;
+        const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - ProcessStartTime).count();
+        std::wcout << L"First trace submitted " << milliseconds << L" ms after process start\n";
+    }
+
+    // May reset the accumulation, so it runs before the frame data is written
+    ReloadShaders();
+
+    // The fence of this swapchain image was waited for, the command buffer
+    // that reads the slot isn't pending anymore
+    FrameUniformContent* content = (FrameUniformContent*)((uint8_t*)_frameUniformBuffer.Map(VK_WHOLE_SIZE) +
+        _frameUniformStride * frameIndex);
+    content->accumulatedFrameNum = _accumulatedFrameNum;
+    _frameUniformBuffer.Unmap();
+
+    if (_shadingPermutation.progressive)
+    {
+        _accumulatedFrameNum++;
+        if (_accumulatedFrameNum == _shadingPermutation.maxSampleCount)
+        {
+            std::wcout << L"Progressive: " << _accumulatedFrameNum << L" samples per pixel accumulated, nothing is traced anymore\n";
+        }
+    }
+}
+
+void TutorialApplication::OnKeyDown(uint32_t key)
+{
+    if (_activePipelineVariant == nullptr)
+    {
+        return;
+    }
+
+    // T toggles texture fetch, 0-4 select the number of shadow rays, P toggles
+    // progressive rendering
+    ShadingPermutation permutation = _shadingPermutation;
+    if (key == 'T')
+    {
+        permutation.textureFetchEnabled = !permutation.textureFetchEnabled;
+    }
+    else if (key == 'P')
+    {
+        permutation.progressive = !permutation.progressive;
+    }
+    else if (key >= '0' && key <= '4')
+    {
+        permutation.shadowRayCount = key - '0';
+    }
+    else
+    {
+        return;
+    }
+
+    _shadingPermutation = permutation;
+    SelectPipelineVariant(_shadingPermutation);
+}
+
 
 void main(int argc, const char* argv[])
 {
@@ -1,6 +1,14 @@
 #include "Application.h"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cwchar>
+#include <cwctype>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb\stb_image.h"
+#ifdef NVVK_EMBED_SHADERS
+#include "../Shaders/Generated/EmbeddedShaders.h"
+#endif
 
 std::wstring ToString(VkResult value)
 {
@@ -22,6 +30,43 @@ void ExitError(const std::wstring& message, bool silent)
     exit(1);
 }
 
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed)
+{
+    // FNV-1a
+    const uint8_t* bytes = (const uint8_t*)data;
+    uint64_t hash = seed;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+uint32_t GetFormatTexelSize(VkFormat format)
+{
+    switch (format)
+    {
+    case VK_FORMAT_R16_SFLOAT:
+        return 2;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_R16G16_SFLOAT:
+    case VK_FORMAT_R32_SFLOAT:
+    case VK_FORMAT_R32_UINT:
+        return 4;
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+    case VK_FORMAT_R32G32_SFLOAT:
+    case VK_FORMAT_R32G32_UINT:
+        return 8;
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+    case VK_FORMAT_R32G32B32A32_UINT:
+        return 16;
+    default:
+        return 0;
+    }
+}
+
 
 VkPhysicalDevice ResourceBase::_physicalDevice;
 VkDevice ResourceBase::_device;
@@ -30,6 +75,7 @@ VkCommandPool ResourceBase::_commandPool;
 VkQueue ResourceBase::_transferQueue;
 
 std::wstring ShaderResource::_folderPath;
+std::unordered_map<uint64_t, ShaderResource::CachedModule> ShaderResource::_moduleCache;
 std::wstring ImageResource::_folderPath;
 
 Application* Application::_applicationInstance = nullptr;
@@ -56,6 +102,7 @@ Application::~Application()
         vkDestroyCommandPool(_device, _commandPool, nullptr);
     }
     _offsreenImageResource.Cleanup();
+    _aovImageResources.clear();
 
     for (auto& fence : _frameReadinessFences)
     {
@@ -123,6 +170,9 @@ void Application::HandleMessages(MsgInfo* info)
         case VK_ESCAPE:
             PostQuitMessage(0);
             break;
+        default:
+            OnKeyDown((uint32_t)info->wParam);
+            break;
         }
         break;
     }
@@ -175,15 +225,30 @@ LRESULT CALLBACK WndProc(HWND hWnd, UINT uMsg, WPARAM wParam, LPARAM lParam)
 void Application::Initialize()
 {
     InitCommon();
-    CreateApplicationWindow();
     GetSettings();
+    if (_settings.Headless)
+    {
+        _actualWindowWidth = _settings.DesiredWindowWidth;
+        _actualWindowHeight = _settings.DesiredWindowHeight;
+    }
+    else
+    {
+        CreateApplicationWindow();
+    }
     CreateInstance();
     CreateDebugReportCallback();
     FindDeviceAndQueues();
     CreateDevice();
     PostCreateDevice();
-    CreateSurface();
-    CreateSwapchain();
+    if (_settings.Headless)
+    {
+        _surfaceFormat.format = _settings.DesiredSurfaceFormat;
+    }
+    else
+    {
+        CreateSurface();
+        CreateSwapchain();
+    }
     CreateFences();
     CreateCommandPool();
     ResourceBase::Init(_physicalDevice, _device, _commandPool, _queuesInfo.Graphics.Queue);
@@ -195,12 +260,25 @@ void Application::Initialize()
 
     FillCommandBuffers();
 
-    NVVK_RESOLVE_DEVICE_FUNCTION_ADDRESS(_device, vkAcquireNextImageKHR);
-    NVVK_RESOLVE_DEVICE_FUNCTION_ADDRESS(_device, vkQueuePresentKHR);
+    if (!_settings.Headless)
+    {
+        NVVK_RESOLVE_DEVICE_FUNCTION_ADDRESS(_device, vkAcquireNextImageKHR);
+        NVVK_RESOLVE_DEVICE_FUNCTION_ADDRESS(_device, vkQueuePresentKHR);
+    }
 }
 
 void Application::Loop()
 {
+    if (_settings.Headless)
+    {
+        for (uint32_t i = 0; i < _settings.HeadlessFrameNum; i++)
+        {
+            DrawFrameHeadless();
+        }
+        ReadBackOutputImages();
+        return;
+    }
+
     MSG msg;
     bool quitMessageReceived = false;
     while (!quitMessageReceived)
@@ -309,6 +387,58 @@ void Application::GetSettings()
 #ifdef NVVK_FORCE_VALIDATION
     _settings.ValidationEnabled = true;
 #endif
+
+    int argumentNum = 0;
+    LPWSTR* arguments = CommandLineToArgvW(GetCommandLineW(), &argumentNum);
+    if (arguments == nullptr)
+    {
+        return;
+    }
+
+    std::wstring usageError; // the first bad argument, reported once -headless is known
+    for (int i = 1; i < argumentNum; i++)
+    {
+        const std::wstring argument = arguments[i];
+        if (argument == L"-validation")
+        {
+            _settings.ValidationEnabled = true;
+        }
+        else if (argument == L"-scene" && i + 1 < argumentNum)
+        {
+            _settings.ScenePath = arguments[++i];
+        }
+        else if (argument == L"-headless" && i + 1 < argumentNum)
+        {
+            _settings.Headless = true;
+            _settings.HeadlessOutputFolder = arguments[++i];
+        }
+        else if (argument == L"-frames")
+        {
+            const std::wstring value = i + 1 < argumentNum ? arguments[++i] : L"";
+
+            // wcstoul skips spaces and takes signs, only plain digits are frame counts
+            wchar_t* end = nullptr;
+            errno = 0;
+            const unsigned long frameNum = !value.empty() && iswdigit(value[0]) ? wcstoul(value.c_str(), &end, 10) : 0;
+            if (end == nullptr || *end != L'\0' || errno == ERANGE || frameNum == 0)
+            {
+                if (usageError.empty())
+                {
+                    usageError = L"-frames expects a number of frames of at least 1, got \"" + value + L"\"";
+                }
+                continue;
+            }
+            _settings.HeadlessFrameNum = (uint32_t)frameNum;
+        }
+    }
+
+    LocalFree(arguments);
+
+    if (!usageError.empty())
+    {
+        // No message box in headless runs, nobody would close it
+        ExitError(usageError + L"\nUsage: " + _appName + L" [-validation] [-scene path] [-headless output folder] [-frames N]", _settings.Headless);
+    }
 }
 
 void Application::CreateInstance()
@@ -636,7 +766,8 @@ void Application::CreateFences()
     fenceCreateInfo.pNext = nullptr;
     fenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-    _frameReadinessFences.resize(_swapchainImageViews.size());
+    // Headless frames are drawn one after the other with a single command buffer
+    _frameReadinessFences.resize(_settings.Headless ? 1 : _swapchainImageViews.size());
     for (auto& fence : _frameReadinessFences)
         vkCreateFence(_device, &fenceCreateInfo, nullptr, &fence);
 
@@ -657,6 +788,38 @@ void Application::CreateOffsreenBuffers()
         { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
 
     NVVK_CHECK_ERROR(code, L"_offsreenImageResource.CreateImageView");
+
+    for (const AovDesc& desc : _aovDescs)
+    {
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(_physicalDevice, desc.Format, &formatProperties);
+        if (GetFormatTexelSize(desc.Format) == 0 || !(formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT))
+        {
+            ExitError(L"AOV " + desc.Name + L": format " + std::to_wstring(desc.Format) + L" can't be written by shaders");
+        }
+
+        std::unique_ptr<ImageResource> image(new ImageResource());
+        code = image->CreateImage(VK_IMAGE_TYPE_2D, desc.Format, { _actualWindowWidth, _actualWindowHeight, 1 },
+            VK_IMAGE_TILING_OPTIMAL, usageFlags, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        NVVK_CHECK_ERROR(code, L"AOV " + desc.Name + L" CreateImage");
+
+        code = image->CreateImageView(VK_IMAGE_VIEW_TYPE_2D, desc.Format, { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 });
+        NVVK_CHECK_ERROR(code, L"AOV " + desc.Name + L" CreateImageView");
+
+        _aovImageResources.push_back(std::move(image));
+    }
+
+    if (!_aovImageResources.empty())
+    {
+        VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        const VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
+        for (const std::unique_ptr<ImageResource>& image : _aovImageResources)
+        {
+            ImageBarrier(commandBuffer, image->Image, subresourceRange,
+                0, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+        }
+        EndSingleTimeCommands(commandBuffer);
+    }
 }
 
 void Application::CreateCommandPool()
@@ -673,14 +836,14 @@ void Application::CreateCommandPool()
 
 void Application::CreateCommandBuffers()
 {
-    _commandBuffers.resize(_swapchainImages.size());
+    _commandBuffers.resize(_bufferedFrameMaxNum);
 
     VkCommandBufferAllocateInfo commandBufferAllocateInfo;
     commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     commandBufferAllocateInfo.pNext = nullptr;
     commandBufferAllocateInfo.commandPool = _commandPool;
     commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    commandBufferAllocateInfo.commandBufferCount = (uint32_t)_swapchainImages.size();
+    commandBufferAllocateInfo.commandBufferCount = (uint32_t)_commandBuffers.size();
 
     const VkResult code = vkAllocateCommandBuffers(_device, &commandBufferAllocateInfo, _commandBuffers.data());
     NVVK_CHECK_ERROR(code, L"vkAllocateCommandBuffers");
@@ -719,6 +882,52 @@ void Application::ImageBarrier(VkCommandBuffer commandBuffer, VkImage image, VkI
         0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
 }
 
+VkCommandBuffer Application::BeginSingleTimeCommands()
+{
+    VkCommandBufferAllocateInfo commandBufferAllocateInfo;
+    commandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    commandBufferAllocateInfo.pNext = nullptr;
+    commandBufferAllocateInfo.commandPool = _commandPool;
+    commandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    commandBufferAllocateInfo.commandBufferCount = 1;
+
+    VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+    VkResult code = vkAllocateCommandBuffers(_device, &commandBufferAllocateInfo, &commandBuffer);
+    NVVK_CHECK_ERROR(code, L"vkAllocateCommandBuffers");
+
+    VkCommandBufferBeginInfo beginInfo;
+    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    beginInfo.pNext = nullptr;
+    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    beginInfo.pInheritanceInfo = nullptr;
+
+    code = vkBeginCommandBuffer(commandBuffer, &beginInfo);
+    NVVK_CHECK_ERROR(code, L"vkBeginCommandBuffer");
+    return commandBuffer;
+}
+
+void Application::EndSingleTimeCommands(VkCommandBuffer commandBuffer)
+{
+    VkResult code = vkEndCommandBuffer(commandBuffer);
+    NVVK_CHECK_ERROR(code, L"vkEndCommandBuffer");
+
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = nullptr;
+    submitInfo.waitSemaphoreCount = 0;
+    submitInfo.pWaitSemaphores = nullptr;
+    submitInfo.pWaitDstStageMask = nullptr;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &commandBuffer;
+    submitInfo.signalSemaphoreCount = 0;
+    submitInfo.pSignalSemaphores = nullptr;
+
+    code = vkQueueSubmit(_queuesInfo.Graphics.Queue, 1, &submitInfo, VK_NULL_HANDLE);
+    NVVK_CHECK_ERROR(code, L"vkQueueSubmit");
+    vkQueueWaitIdle(_queuesInfo.Graphics.Queue);
+    vkFreeCommandBuffers(_device, _commandPool, 1, &commandBuffer);
+}
+
 void Application::FillCommandBuffers()
 {
     VkCommandBufferBeginInfo commandBufferBeginInfo;
@@ -744,8 +953,24 @@ void Application::FillCommandBuffers()
         ImageBarrier(commandBuffer, _offsreenImageResource.Image, subresourceRange,
             0, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
 
+        // The previous frame or a readback may still use the AOVs
+        for (const std::unique_ptr<ImageResource>& image : _aovImageResources)
+        {
+            ImageBarrier(commandBuffer, image->Image, subresourceRange,
+                VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+                VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL);
+        }
+
         RecordCommandBufferForFrame(commandBuffer, i); // user draw code
 
+        // Headless the output image stays in the general layout until it's read back
+        if (_settings.Headless)
+        {
+            code = vkEndCommandBuffer(commandBuffer);
+            NVVK_CHECK_ERROR(code, L"vkEndCommandBuffer");
+            continue;
+        }
+
         ImageBarrier(commandBuffer, _swapchainImages[i], subresourceRange,
             0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
 
@@ -812,6 +1037,151 @@ void Application::DrawFrame()
     NVVK_CHECK_ERROR(code, L"vkQueuePresentKHR");
 }
 
+void Application::DrawFrameHeadless()
+{
+    const VkFence fence = _frameReadinessFences[0];
+    VkResult code = vkWaitForFences(_device, 1, &fence, VK_TRUE, UINT64_MAX);
+    NVVK_CHECK_ERROR(code, L"Failed to wait for fence");
+    vkResetFences(_device, 1, &fence);
+
+    UpdateDataForFrame(0);
+
+    VkSubmitInfo submitInfo;
+    submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submitInfo.pNext = nullptr;
+    submitInfo.waitSemaphoreCount = 0;
+    submitInfo.pWaitSemaphores = nullptr;
+    submitInfo.pWaitDstStageMask = nullptr;
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &_commandBuffers[0];
+    submitInfo.signalSemaphoreCount = 0;
+    submitInfo.pSignalSemaphores = nullptr;
+
+    code = vkQueueSubmit(_queuesInfo.Graphics.Queue, 1, &submitInfo, fence);
+    NVVK_CHECK_ERROR(code, L"vkQueueSubmit");
+}
+
+// The output image and every AOV are copied into one host cached buffer with a
+// single submit, which is mapped once, instead of a staging buffer and a wait
+// per image. Each image is written tightly packed, rows top to bottom, to
+// <folder>/<name>.raw.
+void Application::ReadBackOutputImages()
+{
+    struct ReadbackImage
+    {
+        std::wstring Name;
+        VkImage Image;
+        VkFormat Format;
+        VkDeviceSize Offset;
+        VkDeviceSize Size;
+    };
+
+    std::vector<ReadbackImage> images;
+    images.push_back({ L"color", _offsreenImageResource.Image, _surfaceFormat.format, 0, 0 });
+    for (size_t i = 0; i < _aovDescs.size(); i++)
+    {
+        images.push_back({ _aovDescs[i].Name, _aovImageResources[i]->Image, _aovDescs[i].Format, 0, 0 });
+    }
+
+    // Offsets stay multiples of every texel size
+    VkDeviceSize bufferSize = 0;
+    for (ReadbackImage& image : images)
+    {
+        if (GetFormatTexelSize(image.Format) == 0)
+        {
+            ExitError(L"Can't read back " + image.Name + L", format " + std::to_wstring(image.Format));
+        }
+        image.Offset = bufferSize;
+        image.Size = VkDeviceSize(_actualWindowWidth) * _actualWindowHeight * GetFormatTexelSize(image.Format);
+        bufferSize += (image.Size + 15) & ~VkDeviceSize(15);
+    }
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    BufferResource readbackBuffer;
+    VkResult code = readbackBuffer.Create(bufferSize, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+    NVVK_CHECK_ERROR(code, L"Readback buffer Create");
+
+    // Follows the last frame in submission order, the barriers wait for it
+    VkImageSubresourceRange subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    const VkCommandBuffer commandBuffer = BeginSingleTimeCommands();
+    for (const ReadbackImage& image : images)
+    {
+        ImageBarrier(commandBuffer, image.Image, subresourceRange,
+            VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+
+        VkBufferImageCopy region;
+        region.bufferOffset = image.Offset;
+        region.bufferRowLength = 0;
+        region.bufferImageHeight = 0;
+        region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+        region.imageOffset = { 0, 0, 0 };
+        region.imageExtent = { _actualWindowWidth, _actualWindowHeight, 1 };
+        vkCmdCopyImageToBuffer(commandBuffer, image.Image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, readbackBuffer.Buffer, 1, &region);
+
+        ImageBarrier(commandBuffer, image.Image, subresourceRange,
+            VK_ACCESS_TRANSFER_READ_BIT, VK_ACCESS_SHADER_WRITE_BIT, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
+    }
+
+    VkBufferMemoryBarrier bufferBarrier;
+    bufferBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+    bufferBarrier.pNext = nullptr;
+    bufferBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+    bufferBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+    bufferBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    bufferBarrier.buffer = readbackBuffer.Buffer;
+    bufferBarrier.offset = 0;
+    bufferBarrier.size = VK_WHOLE_SIZE;
+    vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+        0, 0, nullptr, 1, &bufferBarrier, 0, nullptr);
+
+    EndSingleTimeCommands(commandBuffer);
+
+    const uint8_t* mappedMemory = (const uint8_t*)readbackBuffer.Map(VK_WHOLE_SIZE);
+    if (mappedMemory == nullptr)
+    {
+        ExitError(L"Failed to map the readback buffer");
+    }
+
+    // Cached memory doesn't have to be coherent
+    VkMappedMemoryRange range;
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.pNext = nullptr;
+    range.memory = readbackBuffer.Memory;
+    range.offset = 0;
+    range.size = VK_WHOLE_SIZE;
+    vkInvalidateMappedMemoryRanges(_device, 1, &range);
+
+    CreateDirectory(_settings.HeadlessOutputFolder.c_str(), nullptr);
+    for (const ReadbackImage& image : images)
+    {
+        const std::wstring path = _settings.HeadlessOutputFolder + L"/" + image.Name + L".raw";
+
+        FILE* file;
+        if (_wfopen_s(&file, path.c_str(), L"wb") != 0)
+        {
+            ExitError(L"Failed to create " + path);
+        }
+        const bool written = fwrite(mappedMemory + image.Offset, 1, (size_t)image.Size, file) == image.Size;
+        fclose(file);
+        if (!written)
+        {
+            ExitError(L"Failed to write " + path);
+        }
+
+        std::wcout << path << L": " << _actualWindowWidth << L"x" << _actualWindowHeight << L", VkFormat " << image.Format << L", "
+            << image.Size << L" bytes\n";
+    }
+
+    readbackBuffer.Unmap();
+
+    const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    std::wcout << images.size() << L" images, " << bufferSize / (1024.0 * 1024.0) << L" MB read back and written in " << milliseconds
+        << L" ms after " << _settings.HeadlessFrameNum << L" frames\n";
+}
+
 
 void Application::Init()
 {
@@ -825,6 +1195,10 @@ void Application::UpdateDataForFrame(uint32_t frameIndex)
 {
 }
 
+void Application::OnKeyDown(uint32_t key)
+{
+}
+
 // ============================================================
 // Resource base
 // ============================================================
@@ -928,10 +1302,14 @@ VkResult ImageResource::CreateImage(VkImageType imageType, VkFormat format, VkEx
 }
 
 bool ImageResource::LoadTexture2DFromFile(const std::wstring& fileName, VkResult& code)
+{
+    return LoadTexture2DFromPath(_folderPath + fileName, code);
+}
+
+bool ImageResource::LoadTexture2DFromPath(const std::wstring& filePath, VkResult& code)
 {
     code = VK_SUCCESS;
 
-    const std::wstring filePath = _folderPath + fileName;
     FILE *file;
     if (_wfopen_s(&file, filePath.c_str(), L"rb") != 0)
     {
@@ -1156,6 +1534,16 @@ VkResult ShaderResource::LoadFromFile(const std::wstring& fileName, bool& cantOp
 {
     cantOpenFile = false;
 
+#ifdef NVVK_EMBED_SHADERS
+    for (const EmbeddedShader& shader : EmbeddedShaders)
+    {
+        if (fileName == shader.Name)
+        {
+            return LoadFromMemory(shader.Code, shader.Size);
+        }
+    }
+#endif
+
     const std::wstring filePath = _folderPath + fileName;
     std::ifstream fileStream(filePath, std::ios::binary | std::ios::in | std::ios::ate);
     if (!fileStream.is_open())
@@ -1165,27 +1553,49 @@ VkResult ShaderResource::LoadFromFile(const std::wstring& fileName, bool& cantOp
     }
     const size_t shaderSize = fileStream.tellg();
     fileStream.seekg(0, std::ios::beg);
-    std::vector<char> bytecode(shaderSize);
-    fileStream.read(bytecode.data(), shaderSize);
+    std::vector<uint32_t> bytecode((shaderSize + sizeof(uint32_t) - 1) / sizeof(uint32_t));
+    fileStream.read((char*)bytecode.data(), shaderSize);
     fileStream.close();
 
+    return LoadFromMemory(bytecode.data(), shaderSize);
+}
+
+VkResult ShaderResource::LoadFromMemory(const uint32_t* bytecode, size_t bytecodeSize)
+{
+    Cleanup();
+
+    const uint64_t key = HashBytes(bytecode, bytecodeSize, HashBytes(&bytecodeSize, sizeof(bytecodeSize)));
+
+    auto found = _moduleCache.find(key);
+    if (found != _moduleCache.end())
+    {
+        found->second.ReferenceCount++;
+        _module = found->second.Module;
+        _moduleKey = key;
+        return VK_SUCCESS;
+    }
+
     VkShaderModuleCreateInfo shaderModuleCreateInfo;
     shaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     shaderModuleCreateInfo.pNext = nullptr;
-    shaderModuleCreateInfo.codeSize = shaderSize;
-    shaderModuleCreateInfo.pCode = (uint32_t*)bytecode.data();
+    shaderModuleCreateInfo.codeSize = bytecodeSize;
+    shaderModuleCreateInfo.pCode = bytecode;
     shaderModuleCreateInfo.flags = 0;
 
     const VkResult code = vkCreateShaderModule(_device, &shaderModuleCreateInfo, nullptr, &_module);
     if (code != VK_SUCCESS)
     {
         _module = VK_NULL_HANDLE;
+        return code;
     }
 
+    _moduleCache[key] = { _module, 1 };
+    _moduleKey = key;
+
     return code;
 }
 
-VkPipelineShaderStageCreateInfo ShaderResource::GetShaderStage(VkShaderStageFlagBits stage)
+VkPipelineShaderStageCreateInfo ShaderResource::GetShaderStage(VkShaderStageFlagBits stage, const SpecializationConstants* constants)
 {
     VkPipelineShaderStageCreateInfo result;
     result.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -1194,7 +1604,7 @@ VkPipelineShaderStageCreateInfo ShaderResource::GetShaderStage(VkShaderStageFlag
     result.module = _module;
     result.pName = "main";
     result.flags = 0;
-    result.pSpecializationInfo = nullptr;
+    result.pSpecializationInfo = (constants != nullptr && !constants->IsEmpty()) ? constants->GetInfo() : nullptr;
     return result;
 }
 
@@ -1202,9 +1612,92 @@ void ShaderResource::Cleanup()
 {
     if (_module)
     {
-        vkDestroyShaderModule(_device, _module, nullptr);
+        auto found = _moduleCache.find(_moduleKey);
+        if (found != _moduleCache.end() && --found->second.ReferenceCount == 0)
+        {
+            vkDestroyShaderModule(_device, _module, nullptr);
+            _moduleCache.erase(found);
+        }
         _module = VK_NULL_HANDLE;
+        _moduleKey = 0;
+    }
+}
+
+// ============================================================
+// Specialization constants
+// ============================================================
+
+SpecializationConstants& SpecializationConstants::SetBool(uint32_t constantId, bool value)
+{
+    Set(constantId, value ? VK_TRUE : VK_FALSE);
+    return *this;
+}
+
+SpecializationConstants& SpecializationConstants::SetInt(uint32_t constantId, int32_t value)
+{
+    uint32_t rawValue;
+    memcpy(&rawValue, &value, sizeof(rawValue));
+    Set(constantId, rawValue);
+    return *this;
+}
+
+SpecializationConstants& SpecializationConstants::SetUInt(uint32_t constantId, uint32_t value)
+{
+    Set(constantId, value);
+    return *this;
+}
+
+SpecializationConstants& SpecializationConstants::SetFloat(uint32_t constantId, float value)
+{
+    uint32_t rawValue;
+    memcpy(&rawValue, &value, sizeof(rawValue));
+    Set(constantId, rawValue);
+    return *this;
+}
+
+void SpecializationConstants::Set(uint32_t constantId, uint32_t rawValue)
+{
+    // Entries are kept sorted by constant id so equal sets produce equal keys
+    // regardless of the order in which the values were assigned
+    size_t position = 0;
+    while (position < _entries.size() && _entries[position].constantID < constantId)
+    {
+        ++position;
+    }
+
+    if (position < _entries.size() && _entries[position].constantID == constantId)
+    {
+        _data[position] = rawValue;
+        return;
     }
+
+    _entries.insert(_entries.begin() + position, { constantId, 0, sizeof(uint32_t) });
+    _data.insert(_data.begin() + position, rawValue);
+
+    for (size_t i = 0; i < _entries.size(); ++i)
+    {
+        _entries[i].offset = (uint32_t)(i * sizeof(uint32_t));
+    }
+}
+
+bool SpecializationConstants::IsEmpty() const
+{
+    return _entries.empty();
+}
+
+uint64_t SpecializationConstants::GetKey() const
+{
+    uint64_t key = HashBytes(_entries.data(), _entries.size() * sizeof(VkSpecializationMapEntry));
+    return HashBytes(_data.data(), _data.size() * sizeof(uint32_t), key);
+}
+
+const VkSpecializationInfo* SpecializationConstants::GetInfo() const
+{
+    _info.mapEntryCount = (uint32_t)_entries.size();
+    _info.pMapEntries = _entries.data();
+    _info.dataSize = _data.size() * sizeof(uint32_t);
+    _info.pData = _data.data();
+    return &_info;
 }
 
 // ============================================================
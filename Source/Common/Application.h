@@ -8,6 +8,7 @@
 #include <string>
 #include <vector>
 #include <array>
+#include <unordered_map>
 
 #define NOMINMAX
 #include <Windows.h>
@@ -19,6 +20,7 @@
 std::wstring ToString(VkResult value);
 void LogError(const std::wstring& message, bool silent = false);
 void ExitError(const std::wstring& message, bool silent = false);
+uint64_t HashBytes(const void* data, size_t size, uint64_t seed = 14695981039346656037ull);
 
 struct Settings
 {
@@ -26,8 +28,29 @@ struct Settings
     uint32_t DesiredWindowWidth = 1280;
     uint32_t DesiredWindowHeight = 720;
     VkFormat DesiredSurfaceFormat = VK_FORMAT_B8G8R8A8_UNORM;
+    std::wstring ScenePath; // -scene <file> on the command line, samples that load models use it
+
+    // -headless <folder> runs without a window or swapchain: -frames N frames, 1 by
+    // default, are traced and the output image and the AOVs of the last one are
+    // written to the folder, see ReadBackOutputImages
+    bool Headless = false;
+    std::wstring HeadlessOutputFolder;
+    uint32_t HeadlessFrameNum = 1;
 };
 
+// An output image the raygen shader writes next to the color, like depth, normals
+// or instance ids for denoising, compositing and debugging. Applications list them
+// in their constructor, CreateOffsreenBuffers creates them with the size of the
+// window. Unlike the output image they stay in the general layout, pixels a frame
+// doesn't write keep their values.
+struct AovDesc
+{
+    std::wstring Name; // file name of the headless readback
+    VkFormat Format; // needs storage image support and a size from GetFormatTexelSize
+};
+
+uint32_t GetFormatTexelSize(VkFormat format); // 0 for formats output images can't have
+
 struct WindowInfo
 {
     HWND Window;
@@ -91,6 +114,7 @@ public:
         VkImageUsageFlags usage, VkMemoryPropertyFlags memoryProperties);
 
     bool LoadTexture2DFromFile(const std::wstring& fileName, VkResult& vkResult);
+    bool LoadTexture2DFromPath(const std::wstring& filePath, VkResult& vkResult); // not relative to the textures folder
 
     VkResult CreateImageView(VkImageViewType viewType, VkFormat format, VkImageSubresourceRange subresourceRange);
 
@@ -99,11 +123,42 @@ public:
     void Cleanup();
 };
 
+// Typed specialization constant values for a single shader stage.
+// Every supported type is 32 bits wide, booleans are stored as VkBool32.
+class SpecializationConstants
+{
+private:
+    std::vector<VkSpecializationMapEntry> _entries;
+    std::vector<uint32_t> _data;
+    mutable VkSpecializationInfo _info = { };
+
+public:
+    SpecializationConstants& SetBool(uint32_t constantId, bool value);
+    SpecializationConstants& SetInt(uint32_t constantId, int32_t value);
+    SpecializationConstants& SetUInt(uint32_t constantId, uint32_t value);
+    SpecializationConstants& SetFloat(uint32_t constantId, float value);
+
+    bool IsEmpty() const;
+    uint64_t GetKey() const; // identifies the permutation, equal for equal constant sets
+    const VkSpecializationInfo* GetInfo() const; // valid until the next Set* call
+
+private:
+    void Set(uint32_t constantId, uint32_t rawValue);
+};
+
 class ShaderResource : public ResourceBase
 {
 private:
+    struct CachedModule
+    {
+        VkShaderModule Module;
+        uint32_t ReferenceCount;
+    };
+
     static std::wstring _folderPath;
+    static std::unordered_map<uint64_t, CachedModule> _moduleCache; // keyed by bytecode hash
     VkShaderModule _module = VK_NULL_HANDLE;
+    uint64_t _moduleKey = 0;
 
 public:
     ~ShaderResource();
@@ -111,10 +166,13 @@ public:
 public:
     static void SetFolderPath(const std::wstring& folderPath);
 
+    // Uses the embedded copy of the file when NVVK_EMBED_SHADERS is defined.
+    // Shaders with identical bytecode share one VkShaderModule.
     VkResult LoadFromFile(const std::wstring& fileName, bool& cantOpenFile);
+    VkResult LoadFromMemory(const uint32_t* bytecode, size_t bytecodeSize);
     void Cleanup();
 
-    VkPipelineShaderStageCreateInfo GetShaderStage(VkShaderStageFlagBits stage);
+    VkPipelineShaderStageCreateInfo GetShaderStage(VkShaderStageFlagBits stage, const SpecializationConstants* constants = nullptr);
 };
 
 class BufferResource : public ResourceBase
@@ -162,6 +220,8 @@ protected:
     PFN_vkAcquireNextImageKHR vkAcquireNextImageKHR = VK_NULL_HANDLE;
     PFN_vkQueuePresentKHR vkQueuePresentKHR = VK_NULL_HANDLE;
     ImageResource _offsreenImageResource;
+    std::vector<AovDesc> _aovDescs;
+    std::vector<std::unique_ptr<ImageResource>> _aovImageResources; // in the order of _aovDescs
     VkCommandPool _commandPool = VK_NULL_HANDLE;
     std::vector<VkCommandBuffer> _commandBuffers;
     VkSemaphore _imageAcquiredSemaphore = VK_NULL_HANDLE;
@@ -200,8 +260,12 @@ protected:
     void CreateSynchronization();
     void ImageBarrier(VkCommandBuffer commandBuffer, VkImage image, VkImageSubresourceRange& subresourceRange,
         VkAccessFlags srcAccessMask, VkAccessFlags dstAccessMask, VkImageLayout oldLayout, VkImageLayout newLayout);
+    VkCommandBuffer BeginSingleTimeCommands();
+    void EndSingleTimeCommands(VkCommandBuffer commandBuffer); // submits and waits until the queue is idle
     void FillCommandBuffers();
     void DrawFrame();
+    void DrawFrameHeadless();
+    void ReadBackOutputImages();
 
     // ============================================================
     // Inherited application class can override the following methods
@@ -211,6 +275,7 @@ protected:
     virtual void Init();
     virtual void RecordCommandBufferForFrame(VkCommandBuffer commandBuffer, uint32_t frameIndex);
     virtual void UpdateDataForFrame(uint32_t frameIndex);
+    virtual void OnKeyDown(uint32_t key);
 };
 
 template <class T>
@@ -222,6 +287,8 @@ void RunApplication()
 
 //#define NVVK_FORCE_VALIDATION
 //#define NVVK_DISABLE_VSYNC
+// NVVK_EMBED_SHADERS is defined by the projects when the EmbedShaders property in Projects/Shaders.props is true,
+// together with a pre-build step that generates Source/Shaders/Generated/EmbeddedShaders.h
 
 #define NVVK_RESOLVE_INSTANCE_FUNCTION_ADDRESS(instance, funcName) \
     { \
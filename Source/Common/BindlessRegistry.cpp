@@ -0,0 +1,227 @@
+#include "BindlessRegistry.h"
+
+#include <algorithm>
+
+BindlessRegistry::~BindlessRegistry()
+{
+    Cleanup();
+}
+
+VkResult BindlessRegistry::Create(const std::vector<TableDesc>& tables)
+{
+    Cleanup();
+
+    _tables.resize(tables.size());
+
+    std::vector<VkDescriptorPoolSize> poolSizes;
+    for (size_t i = 0; i < tables.size(); ++i)
+    {
+        Table& table = _tables[i];
+        table.Desc = tables[i];
+        table.FreeRanges.push_back({ 0, table.Desc.Capacity });
+
+        // Slots are written while the set is bound and most of them are empty
+        const VkDescriptorBindingFlagsEXT bindingFlags = VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT |
+            VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT | VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT;
+
+        VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsInfo;
+        bindingFlagsInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+        bindingFlagsInfo.pNext = nullptr;
+        bindingFlagsInfo.bindingCount = 1;
+        bindingFlagsInfo.pBindingFlags = &bindingFlags;
+
+        VkDescriptorSetLayoutBinding binding;
+        binding.binding = 0;
+        binding.descriptorType = table.Desc.Type;
+        binding.descriptorCount = table.Desc.Capacity;
+        binding.stageFlags = table.Desc.Stages;
+        binding.pImmutableSamplers = nullptr;
+
+        VkDescriptorSetLayoutCreateInfo layoutInfo;
+        layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+        layoutInfo.pNext = &bindingFlagsInfo;
+        layoutInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+        layoutInfo.bindingCount = 1;
+        layoutInfo.pBindings = &binding;
+
+        VkResult code = vkCreateDescriptorSetLayout(_device, &layoutInfo, nullptr, &table.Layout);
+        if (code != VK_SUCCESS)
+        {
+            table.Layout = VK_NULL_HANDLE;
+            Cleanup();
+            return code;
+        }
+        _layouts.push_back(table.Layout);
+
+        poolSizes.push_back({ table.Desc.Type, table.Desc.Capacity });
+    }
+
+    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo;
+    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    descriptorPoolCreateInfo.pNext = nullptr;
+    descriptorPoolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+    descriptorPoolCreateInfo.maxSets = (uint32_t)_tables.size();
+    descriptorPoolCreateInfo.poolSizeCount = (uint32_t)poolSizes.size();
+    descriptorPoolCreateInfo.pPoolSizes = poolSizes.data();
+
+    VkResult code = vkCreateDescriptorPool(_device, &descriptorPoolCreateInfo, nullptr, &_pool);
+    if (code != VK_SUCCESS)
+    {
+        _pool = VK_NULL_HANDLE;
+        Cleanup();
+        return code;
+    }
+
+    _sets.resize(_tables.size());
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo;
+    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    descriptorSetAllocateInfo.pNext = nullptr;
+    descriptorSetAllocateInfo.descriptorPool = _pool;
+    descriptorSetAllocateInfo.descriptorSetCount = (uint32_t)_layouts.size();
+    descriptorSetAllocateInfo.pSetLayouts = _layouts.data();
+
+    code = vkAllocateDescriptorSets(_device, &descriptorSetAllocateInfo, _sets.data());
+    if (code != VK_SUCCESS)
+    {
+        Cleanup();
+        return code;
+    }
+
+    for (size_t i = 0; i < _tables.size(); ++i)
+    {
+        _tables[i].Set = _sets[i];
+    }
+
+    return VK_SUCCESS;
+}
+
+void BindlessRegistry::Cleanup()
+{
+    if (_pool)
+    {
+        vkDestroyDescriptorPool(_device, _pool, nullptr);
+        _pool = VK_NULL_HANDLE;
+    }
+    for (auto& table : _tables)
+    {
+        if (table.Layout)
+        {
+            vkDestroyDescriptorSetLayout(_device, table.Layout, nullptr);
+        }
+    }
+    _tables.clear();
+    _layouts.clear();
+    _sets.clear();
+}
+
+uint32_t BindlessRegistry::AllocateSlots(uint32_t table, uint32_t count)
+{
+    std::vector<FreeRange>& freeRanges = _tables[table].FreeRanges;
+
+    // First fit keeps the low indices dense
+    for (size_t i = 0; i < freeRanges.size(); ++i)
+    {
+        FreeRange& range = freeRanges[i];
+        if (range.Count >= count)
+        {
+            const uint32_t firstSlot = range.First;
+            range.First += count;
+            range.Count -= count;
+            if (range.Count == 0)
+            {
+                freeRanges.erase(freeRanges.begin() + i);
+            }
+            _tables[table].AllocatedCount += count;
+            return firstSlot;
+        }
+    }
+
+    return InvalidSlot;
+}
+
+void BindlessRegistry::FreeSlots(uint32_t table, uint32_t firstSlot, uint32_t count)
+{
+    if (firstSlot == InvalidSlot || count == 0)
+    {
+        return;
+    }
+
+    std::vector<FreeRange>& freeRanges = _tables[table].FreeRanges;
+
+    auto next = std::lower_bound(freeRanges.begin(), freeRanges.end(), firstSlot,
+        [](const FreeRange& range, uint32_t slot) { return range.First < slot; });
+
+    // Merge with the neighbours so the list doesn't fragment
+    const bool mergePrevious = next != freeRanges.begin() && (next - 1)->First + (next - 1)->Count == firstSlot;
+    const bool mergeNext = next != freeRanges.end() && firstSlot + count == next->First;
+
+    if (mergePrevious && mergeNext)
+    {
+        (next - 1)->Count += count + next->Count;
+        freeRanges.erase(next);
+    }
+    else if (mergePrevious)
+    {
+        (next - 1)->Count += count;
+    }
+    else if (mergeNext)
+    {
+        next->First = firstSlot;
+        next->Count += count;
+    }
+    else
+    {
+        freeRanges.insert(next, { firstSlot, count });
+    }
+
+    _tables[table].AllocatedCount -= count;
+}
+
+uint32_t BindlessRegistry::GetAllocatedCount(uint32_t table) const
+{
+    return _tables[table].AllocatedCount;
+}
+
+void BindlessRegistry::WriteBufferView(uint32_t table, uint32_t slot, VkBufferView bufferView)
+{
+    Write(table, slot, nullptr, nullptr, &bufferView);
+}
+
+void BindlessRegistry::WriteBuffer(uint32_t table, uint32_t slot, const VkDescriptorBufferInfo& bufferInfo)
+{
+    Write(table, slot, nullptr, &bufferInfo, nullptr);
+}
+
+void BindlessRegistry::WriteImage(uint32_t table, uint32_t slot, const VkDescriptorImageInfo& imageInfo)
+{
+    Write(table, slot, &imageInfo, nullptr, nullptr);
+}
+
+const std::vector<VkDescriptorSetLayout>& BindlessRegistry::GetLayouts() const
+{
+    return _layouts;
+}
+
+const std::vector<VkDescriptorSet>& BindlessRegistry::GetSets() const
+{
+    return _sets;
+}
+
+void BindlessRegistry::Write(uint32_t table, uint32_t slot, const VkDescriptorImageInfo* imageInfo,
+    const VkDescriptorBufferInfo* bufferInfo, const VkBufferView* bufferView)
+{
+    VkWriteDescriptorSet descriptorWrite;
+    descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrite.pNext = nullptr;
+    descriptorWrite.dstSet = _tables[table].Set;
+    descriptorWrite.dstBinding = 0;
+    descriptorWrite.dstArrayElement = slot;
+    descriptorWrite.descriptorCount = 1;
+    descriptorWrite.descriptorType = _tables[table].Desc.Type;
+    descriptorWrite.pImageInfo = imageInfo;
+    descriptorWrite.pBufferInfo = bufferInfo;
+    descriptorWrite.pTexelBufferView = bufferView;
+
+    vkUpdateDescriptorSets(_device, 1, &descriptorWrite, 0, nullptr);
+}
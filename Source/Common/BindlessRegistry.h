@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Application.h"
+
+// Owns one descriptor set per table, each with a single unbounded array binding.
+// Resources get stable array indices from a per-table free list and are written
+// right away; thanks to UPDATE_AFTER_BIND and PARTIALLY_BOUND the sets never have
+// to be reallocated and recorded command buffers stay valid while resources are
+// streamed in and out. Slots must not be freed while the GPU may still read them.
+class BindlessRegistry : public ResourceBase
+{
+public:
+    static constexpr uint32_t InvalidSlot = ~0u;
+
+    struct TableDesc
+    {
+        VkDescriptorType Type;
+        uint32_t Capacity;
+        VkShaderStageFlags Stages;
+    };
+
+private:
+    struct FreeRange
+    {
+        uint32_t First;
+        uint32_t Count;
+    };
+
+    struct Table
+    {
+        TableDesc Desc;
+        VkDescriptorSetLayout Layout = VK_NULL_HANDLE;
+        VkDescriptorSet Set = VK_NULL_HANDLE;
+        std::vector<FreeRange> FreeRanges; // sorted by First, never adjacent
+        uint32_t AllocatedCount = 0;
+    };
+
+    VkDescriptorPool _pool = VK_NULL_HANDLE;
+    std::vector<Table> _tables;
+    std::vector<VkDescriptorSetLayout> _layouts;
+    std::vector<VkDescriptorSet> _sets;
+
+public:
+    ~BindlessRegistry();
+
+public:
+    VkResult Create(const std::vector<TableDesc>& tables);
+    void Cleanup();
+
+    // Returns the first of count consecutive slots or InvalidSlot if the table is full
+    uint32_t AllocateSlots(uint32_t table, uint32_t count = 1);
+    void FreeSlots(uint32_t table, uint32_t firstSlot, uint32_t count = 1);
+    uint32_t GetAllocatedCount(uint32_t table) const;
+
+    void WriteBufferView(uint32_t table, uint32_t slot, VkBufferView bufferView);
+    void WriteBuffer(uint32_t table, uint32_t slot, const VkDescriptorBufferInfo& bufferInfo);
+    void WriteImage(uint32_t table, uint32_t slot, const VkDescriptorImageInfo& imageInfo);
+
+    // One entry per table, in the order passed to Create
+    const std::vector<VkDescriptorSetLayout>& GetLayouts() const;
+    const std::vector<VkDescriptorSet>& GetSets() const;
+
+private:
+    void Write(uint32_t table, uint32_t slot, const VkDescriptorImageInfo* imageInfo,
+        const VkDescriptorBufferInfo* bufferInfo, const VkBufferView* bufferView);
+};
@@ -0,0 +1,1523 @@
+#include "Bvh.h"
+#include "TaskPool.h"
+#include "VertexCompression.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <xmmintrin.h>
+
+namespace
+{
+    struct Aabb
+    {
+        float Min[3];
+        float Max[3];
+
+        void Reset()
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                Min[axis] = std::numeric_limits<float>::max();
+                Max[axis] = -std::numeric_limits<float>::max();
+            }
+        }
+
+        void Grow(const float* point)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                Min[axis] = std::min(Min[axis], point[axis]);
+                Max[axis] = std::max(Max[axis], point[axis]);
+            }
+        }
+
+        void Grow(const Aabb& other)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                Min[axis] = std::min(Min[axis], other.Min[axis]);
+                Max[axis] = std::max(Max[axis], other.Max[axis]);
+            }
+        }
+
+        // Half the surface area, the factor cancels out in every SAH ratio
+        float GetHalfArea() const
+        {
+            const float x = Max[0] - Min[0];
+            const float y = Max[1] - Min[1];
+            const float z = Max[2] - Min[2];
+            return (x < 0.0f || y < 0.0f || z < 0.0f) ? 0.0f : x * y + y * z + z * x;
+        }
+    };
+
+    Aabb GetNodeBounds(const BvhNode& node)
+    {
+        Aabb bounds;
+        memcpy(bounds.Min, node.BoundsMin, sizeof(bounds.Min));
+        memcpy(bounds.Max, node.BoundsMax, sizeof(bounds.Max));
+        return bounds;
+    }
+
+    void SetNodeBounds(BvhNode& node, const Aabb& bounds)
+    {
+        memcpy(node.BoundsMin, bounds.Min, sizeof(node.BoundsMin));
+        memcpy(node.BoundsMax, bounds.Max, sizeof(node.BoundsMax));
+    }
+
+    struct BuildReference
+    {
+        Aabb Bounds;
+        float Centroid[3];
+        uint32_t Index; // of the triangle or box
+    };
+
+    struct Bin
+    {
+        Aabb Bounds;
+        uint32_t Count;
+    };
+
+    // A node waiting to be split, its bounds come from the bins of the parent
+    struct BuildRange
+    {
+        Aabb Bounds;
+        Aabb CentroidBounds;
+        uint32_t First;
+        uint32_t Count;
+        uint32_t NodeIndex;
+        uint32_t Depth;
+    };
+
+    // Below this depth every split is a median split, which bounds the depth of
+    // the tree for traversal stacks, see BvhMaxDepth
+    const uint32_t MedianSplitDepth = BvhMaxDepth - 32;
+
+    struct Split
+    {
+        uint32_t Axis = 0;
+        uint32_t LastLeftBin = 0; // bins [0, LastLeftBin] go left
+        float Cost = std::numeric_limits<float>::max(); // unnormalized, see FindSplit
+        Aabb LeftBounds;
+        Aabb RightBounds;
+        uint32_t LeftCount = 0;
+    };
+
+    // Maps centroids to bins, the same mapping is used for binning and partitioning
+    // so both always agree on the side of every reference
+    struct BinMapping
+    {
+        float Min[3];
+        float Scale[3]; // 0 for axes without extent
+        uint32_t BinNum;
+
+        BinMapping(const Aabb& centroidBounds, uint32_t binNum)
+            : BinNum(binNum)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const float extent = centroidBounds.Max[axis] - centroidBounds.Min[axis];
+                Min[axis] = centroidBounds.Min[axis];
+                Scale[axis] = extent > 0.0f ? (float)binNum * (1.0f - 1e-6f) / extent : 0.0f;
+            }
+        }
+
+        uint32_t GetBin(uint32_t axis, const float* centroid) const
+        {
+            const int bin = (int)((centroid[axis] - Min[axis]) * Scale[axis]);
+            return (uint32_t)std::min(std::max(bin, 0), (int)BinNum - 1);
+        }
+    };
+
+    void ResetBins(Bin* bins, uint32_t binNum)
+    {
+        for (uint32_t i = 0; i < binNum * 3; i++)
+        {
+            bins[i].Bounds.Reset();
+            bins[i].Count = 0;
+        }
+    }
+
+    // bins holds binNum bins for each of the three axes
+    void BinReferences(const BuildReference* references, uint32_t count, const BinMapping& mapping, Bin* bins)
+    {
+        for (uint32_t i = 0; i < count; i++)
+        {
+            const BuildReference& reference = references[i];
+            for (uint32_t axis = 0; axis < 3; axis++)
+            {
+                Bin& bin = bins[axis * mapping.BinNum + mapping.GetBin(axis, reference.Centroid)];
+                bin.Bounds.Grow(reference.Bounds);
+                bin.Count++;
+            }
+        }
+    }
+
+    // Sweeps the bins of every axis from both sides. The cost is the SAH cost times
+    // the half area of the node: leaf cost is count * area, split cost is
+    // traversalCost * area + leftArea * leftCount + rightArea * rightCount.
+    Split FindSplit(const Bin* bins, const BinMapping& mapping)
+    {
+        const uint32_t binNum = mapping.BinNum;
+        Split best;
+
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            if (mapping.Scale[axis] == 0.0f)
+            {
+                continue;
+            }
+
+            const Bin* axisBins = bins + axis * binNum;
+            float rightCosts[BvhBuildSettings::MaxBinNum];
+            uint32_t rightCounts[BvhBuildSettings::MaxBinNum];
+            Aabb bounds;
+            bounds.Reset();
+            uint32_t count = 0;
+            for (uint32_t i = binNum - 1; i > 0; i--)
+            {
+                bounds.Grow(axisBins[i].Bounds);
+                count += axisBins[i].Count;
+                rightCosts[i] = count > 0 ? bounds.GetHalfArea() * (float)count : 0.0f;
+                rightCounts[i] = count;
+            }
+
+            bounds.Reset();
+            count = 0;
+            for (uint32_t i = 0; i < binNum - 1; i++)
+            {
+                bounds.Grow(axisBins[i].Bounds);
+                count += axisBins[i].Count;
+                if (count == 0 || rightCounts[i + 1] == 0)
+                {
+                    continue;
+                }
+
+                const float cost = bounds.GetHalfArea() * (float)count + rightCosts[i + 1];
+                if (cost < best.Cost)
+                {
+                    best.Axis = axis;
+                    best.LastLeftBin = i;
+                    best.Cost = cost;
+                }
+            }
+        }
+
+        if (best.Cost == std::numeric_limits<float>::max())
+        {
+            return best;
+        }
+
+        const Bin* axisBins = bins + best.Axis * binNum;
+        best.LeftBounds.Reset();
+        best.RightBounds.Reset();
+        for (uint32_t i = 0; i < binNum; i++)
+        {
+            if (i <= best.LastLeftBin)
+            {
+                best.LeftBounds.Grow(axisBins[i].Bounds);
+                best.LeftCount += axisBins[i].Count;
+            }
+            else
+            {
+                best.RightBounds.Grow(axisBins[i].Bounds);
+            }
+        }
+        return best;
+    }
+
+    bool IsValidSplit(const Split& split, uint32_t count)
+    {
+        return split.Cost != std::numeric_limits<float>::max() && split.LeftCount > 0 && split.LeftCount < count;
+    }
+
+    bool ShouldMakeLeaf(const BuildRange& range, const Split& split, const BvhBuildSettings& settings)
+    {
+        if (range.Count <= 1)
+        {
+            return true;
+        }
+        if (range.Count > settings.MaxLeafSize)
+        {
+            return false;
+        }
+        if (!IsValidSplit(split, range.Count))
+        {
+            return true;
+        }
+
+        const float area = range.Bounds.GetHalfArea();
+        return (float)range.Count * area <= settings.TraversalCost * area + split.Cost;
+    }
+
+    // Splits a range whose centroids all coincide in the middle, the bounds of both
+    // halves are computed from the references
+    void SplitAtMedian(const BuildReference* references, const BuildRange& range, Split& split)
+    {
+        split.LeftCount = range.Count / 2;
+        split.LeftBounds.Reset();
+        split.RightBounds.Reset();
+        for (uint32_t i = 0; i < range.Count; i++)
+        {
+            (i < split.LeftCount ? split.LeftBounds : split.RightBounds).Grow(references[range.First + i].Bounds);
+        }
+    }
+
+    void MakeLeaf(BvhNode& node, const BuildRange& range)
+    {
+        SetNodeBounds(node, range.Bounds);
+        node.FirstChildOrTriangle = range.First;
+        node.TriangleNum = range.Count;
+    }
+
+    void MakeChildRanges(const BuildRange& range, const Split& split, const Aabb& leftCentroidBounds,
+        const Aabb& rightCentroidBounds, uint32_t leftNodeIndex, BuildRange& left, BuildRange& right)
+    {
+        left.Bounds = split.LeftBounds;
+        left.CentroidBounds = leftCentroidBounds;
+        left.First = range.First;
+        left.Count = split.LeftCount;
+        left.NodeIndex = leftNodeIndex;
+        left.Depth = range.Depth + 1;
+
+        right.Bounds = split.RightBounds;
+        right.CentroidBounds = rightCentroidBounds;
+        right.First = range.First + split.LeftCount;
+        right.Count = range.Count - split.LeftCount;
+        right.NodeIndex = leftNodeIndex + 1;
+        right.Depth = range.Depth + 1;
+    }
+
+    // Small ranges have fewer centroids than bins, sweeping all of them would cost
+    // more than the binning itself
+    uint32_t GetBinNum(uint32_t count, const BvhBuildSettings& settings)
+    {
+        return std::min(settings.BinNum, std::max(count, 4u));
+    }
+
+    // Builds one subtree on the calling thread. Nodes are laid out depth first with
+    // siblings next to each other, the subtree root is nodes[0]. Partitioning is
+    // stable through the scratch references, like in the parallel upper levels.
+    void BuildSubtree(BuildReference* references, BuildReference* scratch, const BuildRange& root,
+        const BvhBuildSettings& settings, std::vector<BvhNode>& nodes)
+    {
+        Bin bins[BvhBuildSettings::MaxBinNum * 3];
+
+        nodes.clear();
+        nodes.push_back(BvhNode());
+
+        std::vector<BuildRange> stack;
+        stack.push_back(root);
+        stack.back().NodeIndex = 0;
+
+        while (!stack.empty())
+        {
+            const BuildRange range = stack.back();
+            stack.pop_back();
+
+            const BinMapping mapping(range.CentroidBounds, GetBinNum(range.Count, settings));
+            Split split;
+            if (range.Count > 1 && range.Depth < MedianSplitDepth)
+            {
+                ResetBins(bins, mapping.BinNum);
+                BinReferences(references + range.First, range.Count, mapping, bins);
+                split = FindSplit(bins, mapping);
+            }
+
+            if (ShouldMakeLeaf(range, split, settings))
+            {
+                MakeLeaf(nodes[range.NodeIndex], range);
+                continue;
+            }
+
+            Aabb leftCentroidBounds;
+            Aabb rightCentroidBounds;
+            leftCentroidBounds.Reset();
+            rightCentroidBounds.Reset();
+
+            if (IsValidSplit(split, range.Count))
+            {
+                uint32_t leftNum = 0;
+                uint32_t rightNum = 0;
+                for (uint32_t i = range.First; i < range.First + range.Count; i++)
+                {
+                    const BuildReference& reference = references[i];
+                    if (mapping.GetBin(split.Axis, reference.Centroid) <= split.LastLeftBin)
+                    {
+                        scratch[range.First + leftNum++] = reference;
+                        leftCentroidBounds.Grow(reference.Centroid);
+                    }
+                    else
+                    {
+                        scratch[range.First + split.LeftCount + rightNum++] = reference;
+                        rightCentroidBounds.Grow(reference.Centroid);
+                    }
+                }
+                memcpy(references + range.First, scratch + range.First, range.Count * sizeof(BuildReference));
+            }
+            else
+            {
+                SplitAtMedian(references, range, split);
+                leftCentroidBounds = range.CentroidBounds;
+                rightCentroidBounds = range.CentroidBounds;
+            }
+
+            const uint32_t leftNodeIndex = (uint32_t)nodes.size();
+            nodes.resize(nodes.size() + 2);
+
+            BvhNode& node = nodes[range.NodeIndex];
+            SetNodeBounds(node, range.Bounds);
+            node.FirstChildOrTriangle = leftNodeIndex;
+            node.TriangleNum = 0;
+
+            BuildRange left;
+            BuildRange right;
+            MakeChildRanges(range, split, leftCentroidBounds, rightCentroidBounds, leftNodeIndex, left, right);
+
+            // Left is popped first, so the left subtree is laid out before the right one
+            stack.push_back(right);
+            stack.push_back(left);
+        }
+    }
+
+    // Ranges above this size are split with all threads, each smaller one becomes a
+    // task of its own. It only depends on the triangle count so the tree is the same
+    // for any number of threads.
+    uint32_t GetSubtreeTaskSize(uint32_t triangleNum)
+    {
+        return std::max(triangleNum / 128, 8192u);
+    }
+
+    const uint32_t ChunkSize = 16 * 1024;
+
+    // Splits a range that is large enough to spread over all threads. Binning and
+    // partitioning are done in fixed chunks whose results are combined in chunk
+    // order, which keeps the result independent of the thread count.
+    void SplitLargeRange(TaskPool& taskPool, BuildReference* references, BuildReference* scratch,
+        const BuildRange& range, const BvhBuildSettings& settings, std::vector<BvhNode>& nodes,
+        BuildRange& left, BuildRange& right)
+    {
+        const uint32_t binNum = settings.BinNum;
+        const uint32_t chunkNum = (range.Count + ChunkSize - 1) / ChunkSize;
+        const BinMapping mapping(range.CentroidBounds, binNum);
+
+        std::vector<Bin> chunkBins(chunkNum * binNum * 3);
+        taskPool.Run(chunkNum, [&](uint32_t chunk, uint32_t)
+        {
+            const uint32_t begin = chunk * ChunkSize;
+            const uint32_t end = std::min(begin + ChunkSize, range.Count);
+            Bin* bins = chunkBins.data() + chunk * binNum * 3;
+            ResetBins(bins, binNum);
+            BinReferences(references + range.First + begin, end - begin, mapping, bins);
+        });
+
+        std::vector<Bin> bins(binNum * 3);
+        ResetBins(bins.data(), binNum);
+        for (uint32_t chunk = 0; chunk < chunkNum; chunk++)
+        {
+            for (uint32_t i = 0; i < binNum * 3; i++)
+            {
+                bins[i].Bounds.Grow(chunkBins[chunk * binNum * 3 + i].Bounds);
+                bins[i].Count += chunkBins[chunk * binNum * 3 + i].Count;
+            }
+        }
+
+        Split split = range.Depth < MedianSplitDepth ? FindSplit(bins.data(), mapping) : Split();
+        Aabb leftCentroidBounds;
+        Aabb rightCentroidBounds;
+        leftCentroidBounds.Reset();
+        rightCentroidBounds.Reset();
+
+        if (IsValidSplit(split, range.Count))
+        {
+            // Count the left references of every chunk first, then every chunk knows
+            // where to put its references for a stable partition
+            struct ChunkPartition
+            {
+                uint32_t LeftNum;
+                uint32_t LeftOffset;
+                uint32_t RightOffset;
+                Aabb LeftCentroidBounds;
+                Aabb RightCentroidBounds;
+            };
+            std::vector<ChunkPartition> chunks(chunkNum);
+
+            taskPool.Run(chunkNum, [&](uint32_t chunk, uint32_t)
+            {
+                const uint32_t begin = chunk * ChunkSize;
+                const uint32_t end = std::min(begin + ChunkSize, range.Count);
+                ChunkPartition& partition = chunks[chunk];
+                partition.LeftNum = 0;
+                partition.LeftCentroidBounds.Reset();
+                partition.RightCentroidBounds.Reset();
+                for (uint32_t i = range.First + begin; i < range.First + end; i++)
+                {
+                    if (mapping.GetBin(split.Axis, references[i].Centroid) <= split.LastLeftBin)
+                    {
+                        partition.LeftNum++;
+                        partition.LeftCentroidBounds.Grow(references[i].Centroid);
+                    }
+                    else
+                    {
+                        partition.RightCentroidBounds.Grow(references[i].Centroid);
+                    }
+                }
+            });
+
+            uint32_t leftOffset = 0;
+            uint32_t rightOffset = split.LeftCount;
+            for (uint32_t chunk = 0; chunk < chunkNum; chunk++)
+            {
+                ChunkPartition& partition = chunks[chunk];
+                const uint32_t chunkCount = std::min(ChunkSize, range.Count - chunk * ChunkSize);
+                partition.LeftOffset = leftOffset;
+                partition.RightOffset = rightOffset;
+                leftOffset += partition.LeftNum;
+                rightOffset += chunkCount - partition.LeftNum;
+                leftCentroidBounds.Grow(partition.LeftCentroidBounds);
+                rightCentroidBounds.Grow(partition.RightCentroidBounds);
+            }
+
+            taskPool.Run(chunkNum, [&](uint32_t chunk, uint32_t)
+            {
+                const uint32_t begin = chunk * ChunkSize;
+                const uint32_t end = std::min(begin + ChunkSize, range.Count);
+                uint32_t leftIndex = range.First + chunks[chunk].LeftOffset;
+                uint32_t rightIndex = range.First + chunks[chunk].RightOffset;
+                for (uint32_t i = range.First + begin; i < range.First + end; i++)
+                {
+                    const bool isLeft = mapping.GetBin(split.Axis, references[i].Centroid) <= split.LastLeftBin;
+                    scratch[isLeft ? leftIndex++ : rightIndex++] = references[i];
+                }
+            });
+
+            taskPool.Run(chunkNum, [&](uint32_t chunk, uint32_t)
+            {
+                const uint32_t begin = range.First + chunk * ChunkSize;
+                const uint32_t end = std::min(begin + ChunkSize, range.First + range.Count);
+                memcpy(references + begin, scratch + begin, (end - begin) * sizeof(BuildReference));
+            });
+        }
+        else
+        {
+            SplitAtMedian(references, range, split);
+            leftCentroidBounds = range.CentroidBounds;
+            rightCentroidBounds = range.CentroidBounds;
+        }
+
+        const uint32_t leftNodeIndex = (uint32_t)nodes.size();
+        nodes.resize(nodes.size() + 2);
+
+        BvhNode& node = nodes[range.NodeIndex];
+        SetNodeBounds(node, range.Bounds);
+        node.FirstChildOrTriangle = leftNodeIndex;
+        node.TriangleNum = 0;
+
+        MakeChildRanges(range, split, leftCentroidBounds, rightCentroidBounds, leftNodeIndex, left, right);
+    }
+
+    float DecodeSnorm16(int16_t value)
+    {
+        return std::max(value / 32767.0f, -1.0f);
+    }
+
+    // Returns the number of components, 0 for formats BLAS builds do not accept
+    uint32_t GetVertexComponentNum(VkFormat format)
+    {
+        switch (format)
+        {
+        case VK_FORMAT_R32G32B32_SFLOAT:
+        case VK_FORMAT_R16G16B16_SFLOAT:
+        case VK_FORMAT_R16G16B16_SNORM:
+            return 3;
+        case VK_FORMAT_R32G32_SFLOAT:
+        case VK_FORMAT_R16G16_SFLOAT:
+        case VK_FORMAT_R16G16_SNORM:
+            return 2;
+        default:
+            return 0;
+        }
+    }
+
+    void DecodeVertex(VkFormat format, const uint8_t* data, float* position)
+    {
+        const uint32_t componentNum = GetVertexComponentNum(format);
+        position[2] = 0.0f;
+
+        for (uint32_t i = 0; i < componentNum; i++)
+        {
+            switch (format)
+            {
+            case VK_FORMAT_R32G32B32_SFLOAT:
+            case VK_FORMAT_R32G32_SFLOAT:
+                memcpy(&position[i], data + i * sizeof(float), sizeof(float));
+                break;
+            case VK_FORMAT_R16G16B16_SFLOAT:
+            case VK_FORMAT_R16G16_SFLOAT:
+            {
+                uint16_t half;
+                memcpy(&half, data + i * sizeof(uint16_t), sizeof(uint16_t));
+                position[i] = HalfToFloat(half);
+                break;
+            }
+            default:
+            {
+                int16_t snorm;
+                memcpy(&snorm, data + i * sizeof(int16_t), sizeof(int16_t));
+                position[i] = DecodeSnorm16(snorm);
+                break;
+            }
+            }
+        }
+    }
+
+    // transform is a row-major 3x4 matrix like VkGeometryTrianglesNV::transformData
+    void TransformPoint(const float* transform, float* point)
+    {
+        float result[3];
+        for (int row = 0; row < 3; row++)
+        {
+            const float* m = transform + row * 4;
+            result[row] = m[0] * point[0] + m[1] * point[1] + m[2] * point[2] + m[3];
+        }
+        memcpy(point, result, sizeof(result));
+    }
+
+    // Host side view of one triangle geometry of a build
+    struct GeometryReader
+    {
+        const VkGeometryTrianglesNV* Source;
+        const uint8_t* Vertices;
+        const uint8_t* Indices;
+        const float* Transform; // null without transformData
+        uint32_t GeometryIndex;
+        uint32_t GeometryFlags;
+        uint32_t TriangleNum;
+    };
+
+    bool SetupGeometryReader(const BvhGeometryInput& input, uint32_t geometryIndex, GeometryReader& reader, std::wstring& error)
+    {
+        const std::wstring name = L"Geometry " + std::to_wstring(geometryIndex);
+
+        if (input.Geometry.geometryType != VK_GEOMETRY_TYPE_TRIANGLES_NV)
+        {
+            error = name + L" is not a triangle geometry";
+            return false;
+        }
+
+        const VkGeometryTrianglesNV& source = input.Geometry.geometry.triangles;
+        if (GetVertexComponentNum(source.vertexFormat) == 0)
+        {
+            error = name + L" has an unsupported vertex format " + std::to_wstring(source.vertexFormat);
+            return false;
+        }
+        if (source.indexType != VK_INDEX_TYPE_UINT16 && source.indexType != VK_INDEX_TYPE_UINT32 &&
+            source.indexType != VK_INDEX_TYPE_NONE_NV)
+        {
+            error = name + L" has an unsupported index type " + std::to_wstring(source.indexType);
+            return false;
+        }
+        if (input.VertexData == nullptr || (source.indexType != VK_INDEX_TYPE_NONE_NV && input.IndexData == nullptr))
+        {
+            error = name + L" has no host data";
+            return false;
+        }
+
+        reader.Source = &source;
+        reader.Vertices = (const uint8_t*)input.VertexData + source.vertexOffset;
+        reader.Indices = (const uint8_t*)input.IndexData + (input.IndexData != nullptr ? source.indexOffset : 0);
+        reader.Transform = input.TransformData != nullptr ?
+            (const float*)((const uint8_t*)input.TransformData + source.transformOffset) : nullptr;
+        reader.GeometryIndex = geometryIndex;
+        reader.GeometryFlags = input.Geometry.flags;
+        reader.TriangleNum = (source.indexType == VK_INDEX_TYPE_NONE_NV ? source.vertexCount : source.indexCount) / 3;
+        return true;
+    }
+
+    // Triangles with a NaN vertex are inactive. Returns false with error when an
+    // index is out of range.
+    bool ReadTriangle(const GeometryReader& reader, uint32_t primitiveIndex, BvhTriangle& triangle, bool& isActive,
+        std::wstring& error)
+    {
+        const VkGeometryTrianglesNV& source = *reader.Source;
+        float* vertexPositions[3] = { triangle.V0, triangle.V1, triangle.V2 };
+        isActive = true;
+
+        for (uint32_t corner = 0; corner < 3; corner++)
+        {
+            uint32_t vertex = primitiveIndex * 3 + corner;
+            if (source.indexType == VK_INDEX_TYPE_UINT16)
+            {
+                uint16_t index;
+                memcpy(&index, reader.Indices + vertex * sizeof(uint16_t), sizeof(uint16_t));
+                vertex = index;
+            }
+            else if (source.indexType == VK_INDEX_TYPE_UINT32)
+            {
+                memcpy(&vertex, reader.Indices + vertex * sizeof(uint32_t), sizeof(uint32_t));
+            }
+
+            if (vertex >= source.vertexCount)
+            {
+                error = L"Geometry " + std::to_wstring(reader.GeometryIndex) + L" triangle " + std::to_wstring(primitiveIndex) +
+                    L" references vertex " + std::to_wstring(vertex) + L" of " + std::to_wstring(source.vertexCount);
+                return false;
+            }
+
+            float* position = vertexPositions[corner];
+            DecodeVertex(source.vertexFormat, reader.Vertices + (VkDeviceSize)vertex * source.vertexStride, position);
+            if (reader.Transform != nullptr)
+            {
+                TransformPoint(reader.Transform, position);
+            }
+            isActive &= !std::isnan(position[0]) && !std::isnan(position[1]) && !std::isnan(position[2]);
+        }
+
+        triangle.GeometryIndex = reader.GeometryIndex;
+        triangle.PrimitiveIndex = primitiveIndex;
+        triangle.GeometryFlags = reader.GeometryFlags;
+        return true;
+    }
+
+    // Builds the nodes over references with their bounds, centroids and indices set,
+    // the references end up in leaf order
+    void BuildNodes(TaskPool& taskPool, std::vector<BuildReference>& references, const BvhBuildSettings& settings,
+        std::vector<BvhNode>& nodes)
+    {
+        const uint32_t referenceNum = (uint32_t)references.size();
+
+        BvhBuildSettings clampedSettings = settings;
+        const uint32_t maxBinNum = BvhBuildSettings::MaxBinNum;
+        clampedSettings.BinNum = std::min(std::max(settings.BinNum, 2u), maxBinNum);
+        clampedSettings.MaxLeafSize = std::max(settings.MaxLeafSize, 1u);
+
+        std::vector<BuildReference> scratch(referenceNum);
+
+        const uint32_t chunkNum = (referenceNum + ChunkSize - 1) / ChunkSize;
+        std::vector<Aabb> chunkBounds(chunkNum * 2);
+        taskPool.Run(chunkNum, [&](uint32_t chunk, uint32_t)
+        {
+            Aabb& bounds = chunkBounds[chunk * 2];
+            Aabb& centroidBounds = chunkBounds[chunk * 2 + 1];
+            bounds.Reset();
+            centroidBounds.Reset();
+
+            const uint32_t end = std::min((chunk + 1) * ChunkSize, referenceNum);
+            for (uint32_t i = chunk * ChunkSize; i < end; i++)
+            {
+                bounds.Grow(references[i].Bounds);
+                centroidBounds.Grow(references[i].Centroid);
+            }
+        });
+
+        BuildRange root;
+        root.Bounds.Reset();
+        root.CentroidBounds.Reset();
+        for (uint32_t chunk = 0; chunk < chunkNum; chunk++)
+        {
+            root.Bounds.Grow(chunkBounds[chunk * 2]);
+            root.CentroidBounds.Grow(chunkBounds[chunk * 2 + 1]);
+        }
+        root.First = 0;
+        root.Count = referenceNum;
+        root.NodeIndex = 0;
+        root.Depth = 0;
+
+        // Upper levels, one range at a time with all threads. A binary tree over
+        // n references has at most 2n - 1 nodes.
+        nodes.reserve(referenceNum * 2 - 1);
+        nodes.push_back(BvhNode());
+
+        const uint32_t subtreeTaskSize = GetSubtreeTaskSize(referenceNum);
+        std::vector<BuildRange> subtrees;
+        std::vector<BuildRange> pending;
+        pending.push_back(root);
+
+        while (!pending.empty())
+        {
+            const BuildRange range = pending.back();
+            pending.pop_back();
+
+            if (range.Count <= subtreeTaskSize)
+            {
+                subtrees.push_back(range);
+                continue;
+            }
+
+            BuildRange left;
+            BuildRange right;
+            SplitLargeRange(taskPool, references.data(), scratch.data(), range, clampedSettings, nodes, left, right);
+            pending.push_back(right);
+            pending.push_back(left);
+        }
+
+        // Subtrees as tasks, largest first so the long ones do not start last
+        std::vector<uint32_t> taskOrder(subtrees.size());
+        for (uint32_t i = 0; i < (uint32_t)taskOrder.size(); i++)
+        {
+            taskOrder[i] = i;
+        }
+        std::stable_sort(taskOrder.begin(), taskOrder.end(), [&](uint32_t a, uint32_t b)
+        {
+            return subtrees[a].Count > subtrees[b].Count;
+        });
+
+        std::vector<std::vector<BvhNode>> subtreeNodes(subtrees.size());
+        taskPool.Run((uint32_t)subtrees.size(), [&](uint32_t taskIndex, uint32_t)
+        {
+            const uint32_t subtree = taskOrder[taskIndex];
+            BuildSubtree(references.data(), scratch.data(), subtrees[subtree], clampedSettings, subtreeNodes[subtree]);
+        });
+
+        // Append the subtrees in the order they were found, the root of each one
+        // replaces the node its range was waiting in
+        for (uint32_t subtree = 0; subtree < (uint32_t)subtrees.size(); subtree++)
+        {
+            std::vector<BvhNode>& localNodes = subtreeNodes[subtree];
+            const uint32_t offset = (uint32_t)nodes.size() - 1; // local index 1 goes to nodes.size()
+            for (BvhNode& node : localNodes)
+            {
+                if (!node.IsLeaf())
+                {
+                    node.FirstChildOrTriangle += offset;
+                }
+            }
+
+            nodes[subtrees[subtree].NodeIndex] = localNodes[0];
+            nodes.insert(nodes.end(), localNodes.begin() + 1, localNodes.end());
+            std::vector<BvhNode>().swap(localNodes);
+        }
+    }
+
+    void SetCentroid(BuildReference& reference)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            reference.Centroid[axis] = (reference.Bounds.Min[axis] + reference.Bounds.Max[axis]) * 0.5f;
+        }
+    }
+
+    // Spreads the low 10 bits of value to every third bit
+    uint32_t ExpandMortonBits(uint32_t value)
+    {
+        value &= 0x3FF;
+        value = (value | (value << 16)) & 0x030000FF;
+        value = (value | (value << 8)) & 0x0300F00F;
+        value = (value | (value << 4)) & 0x030C30C3;
+        value = (value | (value << 2)) & 0x09249249;
+        return value;
+    }
+
+    // First position in [begin, end) of the right child of a Morton sorted range:
+    // where the highest bit the codes of the range differ in turns on, or the
+    // middle when all codes are the same
+    uint32_t FindMortonSplit(const uint32_t* codes, uint32_t begin, uint32_t end)
+    {
+        const uint32_t first = codes[begin];
+        const uint32_t last = codes[end - 1];
+        if (first == last)
+        {
+            return (begin + end) / 2;
+        }
+
+        uint32_t bit = 31;
+        while (((first ^ last) & (1u << bit)) == 0)
+        {
+            bit--;
+        }
+
+        uint32_t low = begin + 1;
+        uint32_t high = end - 1;
+        while (low < high)
+        {
+            const uint32_t middle = (low + high) / 2;
+            if ((codes[middle] & (1u << bit)) != 0)
+            {
+                high = middle;
+            }
+            else
+            {
+                low = middle + 1;
+            }
+        }
+        return low;
+    }
+
+    // Expected cost of a random ray hitting the root, see BvhStats::SahCost
+    double GetSahCost(const std::vector<BvhNode>& nodes, float traversalCost)
+    {
+        if (nodes.empty())
+        {
+            return 0.0;
+        }
+
+        const double rootArea = GetNodeBounds(nodes[0]).GetHalfArea();
+        double cost = 0.0;
+        for (const BvhNode& node : nodes)
+        {
+            const double areaRatio = rootArea > 0.0 ? GetNodeBounds(node).GetHalfArea() / rootArea : 1.0;
+            cost += areaRatio * (node.IsLeaf() ? (double)node.TriangleNum : (double)traversalCost);
+        }
+        return cost;
+    }
+
+    // Triangles per task of a refit
+    const uint32_t RefitGrainSize = 4 * 1024;
+
+    // Stores the first three lanes, the float after them keeps its value. Bounds
+    // of nodes and triangles are loaded with whatever follows them in the fourth
+    // lane, it never gets written back.
+    void StoreFloat3(float* destination, __m128 value)
+    {
+        const __m128 old = _mm_loadu_ps(destination);
+        const __m128 zw = _mm_shuffle_ps(value, old, _MM_SHUFFLE(3, 3, 2, 2));
+        _mm_storeu_ps(destination, _mm_shuffle_ps(value, zw, _MM_SHUFFLE(2, 0, 1, 0)));
+    }
+
+    // Reads a triangle of the build again, it must still exist and be active
+    bool RefitTriangle(const std::vector<GeometryReader>& readers, BvhTriangle& triangle, std::wstring& error)
+    {
+        if (triangle.GeometryIndex >= readers.size() || triangle.PrimitiveIndex >= readers[triangle.GeometryIndex].TriangleNum)
+        {
+            error = L"Geometry " + std::to_wstring(triangle.GeometryIndex) + L" triangle " + std::to_wstring(triangle.PrimitiveIndex) +
+                L" of the build is missing";
+            return false;
+        }
+
+        bool isActive;
+        if (!ReadTriangle(readers[triangle.GeometryIndex], triangle.PrimitiveIndex, triangle, isActive, error))
+        {
+            return false;
+        }
+        if (!isActive)
+        {
+            error = L"Geometry " + std::to_wstring(triangle.GeometryIndex) + L" triangle " + std::to_wstring(triangle.PrimitiveIndex) +
+                L" became inactive, updates can't change which triangles are active";
+            return false;
+        }
+        return true;
+    }
+}
+
+bool GatherBvhTriangles(const std::vector<BvhGeometryInput>& geometries, std::vector<BvhTriangle>& triangles,
+    std::wstring& error)
+{
+    triangles.clear();
+
+    for (uint32_t geometryIndex = 0; geometryIndex < (uint32_t)geometries.size(); geometryIndex++)
+    {
+        GeometryReader reader;
+        if (!SetupGeometryReader(geometries[geometryIndex], geometryIndex, reader, error))
+        {
+            return false;
+        }
+
+        triangles.reserve(triangles.size() + reader.TriangleNum);
+        for (uint32_t primitiveIndex = 0; primitiveIndex < reader.TriangleNum; primitiveIndex++)
+        {
+            BvhTriangle triangle;
+            bool isActive;
+            if (!ReadTriangle(reader, primitiveIndex, triangle, isActive, error))
+            {
+                return false;
+            }
+            if (isActive)
+            {
+                triangles.push_back(triangle);
+            }
+        }
+    }
+
+    return true;
+}
+
+void BuildBvh(TaskPool& taskPool, std::vector<BvhTriangle> triangles, const BvhBuildSettings& settings, Bvh& bvh,
+    BvhStats* stats)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+    const uint32_t triangleNum = (uint32_t)triangles.size();
+
+    bvh.Nodes.clear();
+    bvh.Triangles.clear();
+    bvh.BuildSahCost = 0.0;
+    if (triangleNum == 0)
+    {
+        if (stats != nullptr)
+        {
+            *stats = BvhStats();
+            stats->ThreadNum = taskPool.GetThreadNum();
+        }
+        return;
+    }
+
+    std::vector<BuildReference> references(triangleNum);
+    taskPool.ParallelFor(triangleNum, ChunkSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            const BvhTriangle& triangle = triangles[i];
+            BuildReference& reference = references[i];
+            reference.Bounds.Reset();
+            reference.Bounds.Grow(triangle.V0);
+            reference.Bounds.Grow(triangle.V1);
+            reference.Bounds.Grow(triangle.V2);
+            SetCentroid(reference);
+            reference.Index = i;
+        }
+    });
+
+    BuildNodes(taskPool, references, settings, bvh.Nodes);
+
+    bvh.Triangles.resize(triangleNum);
+    taskPool.ParallelFor(triangleNum, ChunkSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            bvh.Triangles[i] = triangles[references[i].Index];
+        }
+    });
+    bvh.BuildSahCost = GetSahCost(bvh.Nodes, settings.TraversalCost);
+
+    if (stats != nullptr)
+    {
+        stats->BuildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        stats->ThreadNum = taskPool.GetThreadNum();
+        ComputeBvhStats(bvh, settings, *stats);
+    }
+}
+
+void BuildBoxBvh(TaskPool& taskPool, const std::vector<BvhBox>& boxes, const BvhBuildSettings& settings, std::vector<BvhNode>& nodes,
+    std::vector<uint32_t>& order)
+{
+    const uint32_t boxNum = (uint32_t)boxes.size();
+    nodes.clear();
+    order.resize(boxNum);
+    if (boxNum == 0)
+    {
+        return;
+    }
+
+    std::vector<BuildReference> references(boxNum);
+    taskPool.ParallelFor(boxNum, ChunkSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            BuildReference& reference = references[i];
+            memcpy(reference.Bounds.Min, boxes[i].Min, sizeof(reference.Bounds.Min));
+            memcpy(reference.Bounds.Max, boxes[i].Max, sizeof(reference.Bounds.Max));
+            SetCentroid(reference);
+            reference.Index = i;
+        }
+    });
+
+    BuildNodes(taskPool, references, settings, nodes);
+
+    for (uint32_t i = 0; i < boxNum; i++)
+    {
+        order[i] = references[i].Index;
+    }
+}
+
+void BuildBoxBvhMorton(TaskPool& taskPool, const std::vector<BvhBox>& boxes, const BvhBuildSettings& settings, std::vector<BvhNode>& nodes,
+    std::vector<uint32_t>& order)
+{
+    const uint32_t boxNum = (uint32_t)boxes.size();
+    nodes.clear();
+    order.resize(boxNum);
+    if (boxNum == 0)
+    {
+        return;
+    }
+
+    // Centroid bounds, merged in chunk order
+    const uint32_t chunkNum = (boxNum + ChunkSize - 1) / ChunkSize;
+    std::vector<Aabb> chunkBounds(chunkNum);
+    taskPool.Run(chunkNum, [&](uint32_t chunk, uint32_t)
+    {
+        Aabb& bounds = chunkBounds[chunk];
+        bounds.Reset();
+        for (uint32_t i = chunk * ChunkSize; i < std::min(boxNum, (chunk + 1) * ChunkSize); i++)
+        {
+            float centroid[3];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                centroid[axis] = (boxes[i].Min[axis] + boxes[i].Max[axis]) * 0.5f;
+            }
+            bounds.Grow(centroid);
+        }
+    });
+    Aabb centroidBounds;
+    centroidBounds.Reset();
+    for (const Aabb& bounds : chunkBounds)
+    {
+        centroidBounds.Grow(bounds);
+    }
+
+    // 30-bit codes in the high half, box index in the low one
+    std::vector<uint64_t> keys(boxNum);
+    taskPool.ParallelFor(boxNum, ChunkSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        float scale[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float extent = centroidBounds.Max[axis] - centroidBounds.Min[axis];
+            scale[axis] = extent > 0.0f ? 1023.0f / extent : 0.0f;
+        }
+
+        for (uint32_t i = begin; i < end; i++)
+        {
+            uint32_t code = 0;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const float centroid = (boxes[i].Min[axis] + boxes[i].Max[axis]) * 0.5f;
+                const uint32_t cell = (uint32_t)std::min(std::max((centroid - centroidBounds.Min[axis]) * scale[axis], 0.0f), 1023.0f);
+                code |= ExpandMortonBits(cell) << (2 - axis);
+            }
+            keys[i] = ((uint64_t)code << 32) | i;
+        }
+    });
+
+    // Three stable radix passes of 10 bits over the codes, equal codes keep the index order
+    std::vector<uint64_t> scratch(boxNum);
+    for (uint32_t shift = 32; shift < 62; shift += 10)
+    {
+        uint32_t offsets[1024] = { };
+        for (uint64_t key : keys)
+        {
+            offsets[(key >> shift) & 0x3FF]++;
+        }
+        uint32_t sum = 0;
+        for (uint32_t& offset : offsets)
+        {
+            const uint32_t count = offset;
+            offset = sum;
+            sum += count;
+        }
+        for (uint64_t key : keys)
+        {
+            scratch[offsets[(key >> shift) & 0x3FF]++] = key;
+        }
+        keys.swap(scratch);
+    }
+
+    // Split apart for the passes below, each reads only one of them
+    std::vector<uint32_t> codes(boxNum);
+    std::vector<BvhBox> sortedBoxes(boxNum);
+    taskPool.ParallelFor(boxNum, ChunkSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            codes[i] = (uint32_t)(keys[i] >> 32);
+            order[i] = (uint32_t)keys[i];
+            sortedBoxes[i] = boxes[order[i]];
+        }
+    });
+    std::vector<uint64_t>().swap(keys);
+    std::vector<uint64_t>().swap(scratch);
+
+    // Top down, a node's children are added when it is split, so they come after it
+    const uint32_t maxLeafSize = std::max(settings.MaxLeafSize, 1u);
+    nodes.reserve((size_t)boxNum * 2);
+    nodes.push_back(BvhNode());
+    struct PendingNode
+    {
+        uint32_t NodeIndex;
+        uint32_t Begin;
+        uint32_t End;
+    };
+    std::vector<PendingNode> stack(1, PendingNode { 0, 0, boxNum });
+    while (!stack.empty())
+    {
+        const PendingNode pending = stack.back();
+        stack.pop_back();
+
+        if (pending.End - pending.Begin <= maxLeafSize)
+        {
+            nodes[pending.NodeIndex].FirstChildOrTriangle = pending.Begin;
+            nodes[pending.NodeIndex].TriangleNum = pending.End - pending.Begin;
+            continue;
+        }
+
+        const uint32_t split = FindMortonSplit(codes.data(), pending.Begin, pending.End);
+        const uint32_t childIndex = (uint32_t)nodes.size();
+        nodes[pending.NodeIndex].FirstChildOrTriangle = childIndex;
+        nodes[pending.NodeIndex].TriangleNum = 0;
+        nodes.push_back(BvhNode());
+        nodes.push_back(BvhNode());
+        stack.push_back(PendingNode { childIndex + 1, split, pending.End });
+        stack.push_back(PendingNode { childIndex, pending.Begin, split });
+    }
+
+    // Children come after their parents, so one backwards pass sets all bounds
+    for (uint32_t i = (uint32_t)nodes.size(); i-- > 0;)
+    {
+        BvhNode& node = nodes[i];
+        Aabb bounds;
+        bounds.Reset();
+        if (node.IsLeaf())
+        {
+            for (uint32_t position = node.FirstChildOrTriangle; position < node.FirstChildOrTriangle + node.TriangleNum; position++)
+            {
+                const BvhBox& box = sortedBoxes[position];
+                bounds.Grow(box.Min);
+                bounds.Grow(box.Max);
+            }
+        }
+        else
+        {
+            bounds = GetNodeBounds(nodes[node.FirstChildOrTriangle]);
+            bounds.Grow(GetNodeBounds(nodes[node.FirstChildOrTriangle + 1]));
+        }
+        SetNodeBounds(node, bounds);
+    }
+}
+
+bool BuildBvh(TaskPool& taskPool, const std::vector<BvhGeometryInput>& geometries, const BvhBuildSettings& settings,
+    Bvh& bvh, std::wstring& error, BvhStats* stats)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<BvhTriangle> triangles;
+    if (!GatherBvhTriangles(geometries, triangles, error))
+    {
+        return false;
+    }
+
+    BuildBvh(taskPool, std::move(triangles), settings, bvh, stats);
+    if (stats != nullptr)
+    {
+        // Decoding the inputs is part of the build
+        stats->BuildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+    return true;
+}
+
+bool RefitBvh(TaskPool& taskPool, const std::vector<BvhGeometryInput>& geometries, const BvhBuildSettings& settings, Bvh& bvh,
+    std::wstring& error, BvhRefitStats* stats)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    std::vector<GeometryReader> readers(geometries.size());
+    for (uint32_t geometryIndex = 0; geometryIndex < (uint32_t)geometries.size(); geometryIndex++)
+    {
+        if (!SetupGeometryReader(geometries[geometryIndex], geometryIndex, readers[geometryIndex], error))
+        {
+            return false;
+        }
+    }
+
+    std::vector<BvhNode>& nodes = bvh.Nodes;
+    const uint32_t nodeNum = (uint32_t)nodes.size();
+    const uint32_t threadNum = taskPool.GetThreadNum();
+    double sahCost = 0.0;
+
+    if (nodeNum != 0)
+    {
+        // Children of every inner node that are done, the second one to finish
+        // merges the parent. The increment releases the bounds of the first child
+        // to the thread that reads them.
+        std::vector<std::atomic<uint32_t>> doneChildren(nodeNum);
+        std::vector<uint32_t> parents(nodeNum, 0);
+        taskPool.ParallelFor(nodeNum, ChunkSize, [&](uint32_t begin, uint32_t end, uint32_t)
+        {
+            for (uint32_t i = begin; i < end; i++)
+            {
+                doneChildren[i].store(0, std::memory_order_relaxed);
+                if (!nodes[i].IsLeaf())
+                {
+                    parents[nodes[i].FirstChildOrTriangle] = i;
+                    parents[nodes[i].FirstChildOrTriangle + 1] = i;
+                }
+            }
+        });
+
+        // The failure of the lowest triangle wins, like in a serial refit
+        std::vector<uint32_t> failedTriangles(threadNum, std::numeric_limits<uint32_t>::max());
+        std::vector<std::wstring> errors(threadNum);
+        std::vector<double> threadCosts(threadNum, 0.0);
+
+        const float maxFloat = std::numeric_limits<float>::max();
+        taskPool.ParallelFor(nodeNum, RefitGrainSize, [&](uint32_t begin, uint32_t end, uint32_t threadIndex)
+        {
+            double cost = 0.0;
+            for (uint32_t i = begin; i < end; i++)
+            {
+                BvhNode& leaf = nodes[i];
+                if (!leaf.IsLeaf())
+                {
+                    continue;
+                }
+
+                __m128 boundsMin = _mm_set1_ps(maxFloat);
+                __m128 boundsMax = _mm_set1_ps(-maxFloat);
+                for (uint32_t triangleIndex = leaf.FirstChildOrTriangle; triangleIndex < leaf.FirstChildOrTriangle + leaf.TriangleNum;
+                    triangleIndex++)
+                {
+                    BvhTriangle& triangle = bvh.Triangles[triangleIndex];
+                    if (!RefitTriangle(readers, triangle, errors[threadIndex]) && triangleIndex < failedTriangles[threadIndex])
+                    {
+                        failedTriangles[threadIndex] = triangleIndex;
+                    }
+
+                    // The fourth lanes read V1[0], V2[0] and GeometryIndex
+                    const __m128 v0 = _mm_loadu_ps(triangle.V0);
+                    const __m128 v1 = _mm_loadu_ps(triangle.V1);
+                    const __m128 v2 = _mm_loadu_ps(triangle.V2);
+                    boundsMin = _mm_min_ps(boundsMin, _mm_min_ps(v0, _mm_min_ps(v1, v2)));
+                    boundsMax = _mm_max_ps(boundsMax, _mm_max_ps(v0, _mm_max_ps(v1, v2)));
+                }
+                StoreFloat3(leaf.BoundsMin, boundsMin);
+                StoreFloat3(leaf.BoundsMax, boundsMax);
+                cost += (double)GetNodeBounds(leaf).GetHalfArea() * leaf.TriangleNum;
+
+                for (uint32_t child = i; child != 0;)
+                {
+                    const uint32_t parent = parents[child];
+                    if (doneChildren[parent].fetch_add(1, std::memory_order_acq_rel) == 0)
+                    {
+                        break;
+                    }
+
+                    BvhNode& node = nodes[parent];
+                    const BvhNode& left = nodes[node.FirstChildOrTriangle];
+                    const BvhNode& right = nodes[node.FirstChildOrTriangle + 1];
+                    StoreFloat3(node.BoundsMin, _mm_min_ps(_mm_loadu_ps(left.BoundsMin), _mm_loadu_ps(right.BoundsMin)));
+                    StoreFloat3(node.BoundsMax, _mm_max_ps(_mm_loadu_ps(left.BoundsMax), _mm_loadu_ps(right.BoundsMax)));
+                    cost += (double)GetNodeBounds(node).GetHalfArea() * settings.TraversalCost;
+                    child = parent;
+                }
+            }
+            threadCosts[threadIndex] += cost;
+        });
+
+        uint32_t failedThread = threadNum;
+        for (uint32_t thread = 0; thread < threadNum; thread++)
+        {
+            if (failedTriangles[thread] != std::numeric_limits<uint32_t>::max() &&
+                (failedThread == threadNum || failedTriangles[thread] < failedTriangles[failedThread]))
+            {
+                failedThread = thread;
+            }
+        }
+        if (failedThread != threadNum)
+        {
+            // Each thread kept the error of its last failure, read the lowest one again
+            BvhTriangle& triangle = bvh.Triangles[failedTriangles[failedThread]];
+            RefitTriangle(readers, triangle, error);
+            return false;
+        }
+
+        const double rootArea = GetNodeBounds(nodes[0]).GetHalfArea();
+        if (rootArea > 0.0)
+        {
+            for (double threadCost : threadCosts)
+            {
+                sahCost += threadCost;
+            }
+            sahCost /= rootArea;
+        }
+        else
+        {
+            sahCost = GetSahCost(nodes, settings.TraversalCost);
+        }
+    }
+
+    if (stats != nullptr)
+    {
+        stats->TriangleNum = (uint32_t)bvh.Triangles.size();
+        stats->SahCost = sahCost;
+        stats->SahRatio = bvh.BuildSahCost > 0.0 ? sahCost / bvh.BuildSahCost : 1.0;
+        stats->Rebuilt = false;
+        stats->Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        stats->ThreadNum = threadNum;
+    }
+    return true;
+}
+
+bool UpdateBvh(TaskPool& taskPool, const std::vector<BvhGeometryInput>& geometries, const BvhBuildSettings& settings, Bvh& bvh,
+    std::wstring& error, BvhRefitStats* stats)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    BvhRefitStats refitStats;
+    if (!RefitBvh(taskPool, geometries, settings, bvh, error, &refitStats))
+    {
+        return false;
+    }
+
+    // The refit already read the triangles, the build only sorts them anew
+    if (refitStats.SahRatio > settings.RebuildSahRatio)
+    {
+        BuildBvh(taskPool, std::move(bvh.Triangles), settings, bvh);
+        refitStats.SahCost = bvh.BuildSahCost;
+        refitStats.Rebuilt = true;
+    }
+
+    if (stats != nullptr)
+    {
+        *stats = refitStats;
+        stats->Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+    }
+    return true;
+}
+
+void ComputeBvhStats(const Bvh& bvh, const BvhBuildSettings& settings, BvhStats& stats)
+{
+    stats.TriangleNum = (uint32_t)bvh.Triangles.size();
+    stats.NodeNum = (uint32_t)bvh.Nodes.size();
+    stats.LeafNum = 0;
+    stats.MaxDepth = 0;
+    stats.AverageLeafDepth = 0.0;
+    stats.SahCost = 0.0;
+    stats.DepthHistogram.clear();
+    stats.LeafSizeHistogram.clear();
+
+    if (bvh.Nodes.empty())
+    {
+        return;
+    }
+
+    stats.SahCost = GetSahCost(bvh.Nodes, settings.TraversalCost);
+    uint64_t leafDepthSum = 0;
+
+    std::vector<std::pair<uint32_t, uint32_t>> stack; // node, depth
+    stack.push_back(std::make_pair(0u, 0u));
+    while (!stack.empty())
+    {
+        const uint32_t nodeIndex = stack.back().first;
+        const uint32_t depth = stack.back().second;
+        stack.pop_back();
+
+        const BvhNode& node = bvh.Nodes[nodeIndex];
+        if (node.IsLeaf())
+        {
+            stats.LeafNum++;
+            stats.MaxDepth = std::max(stats.MaxDepth, depth);
+            leafDepthSum += depth;
+
+            if (stats.DepthHistogram.size() <= depth)
+            {
+                stats.DepthHistogram.resize(depth + 1, 0);
+            }
+            stats.DepthHistogram[depth]++;
+
+            if (stats.LeafSizeHistogram.size() <= node.TriangleNum)
+            {
+                stats.LeafSizeHistogram.resize(node.TriangleNum + 1, 0);
+            }
+            stats.LeafSizeHistogram[node.TriangleNum]++;
+        }
+        else
+        {
+            stack.push_back(std::make_pair(node.FirstChildOrTriangle + 1, depth + 1));
+            stack.push_back(std::make_pair(node.FirstChildOrTriangle, depth + 1));
+        }
+    }
+
+    stats.AverageLeafDepth = stats.LeafNum > 0 ? (double)leafDepthSum / stats.LeafNum : 0.0;
+}
+
+bool ValidateBvh(const Bvh& bvh, std::wstring& error)
+{
+    const uint32_t nodeNum = (uint32_t)bvh.Nodes.size();
+    const uint32_t triangleNum = (uint32_t)bvh.Triangles.size();
+    if (nodeNum == 0)
+    {
+        if (triangleNum != 0)
+        {
+            error = L"Triangles without nodes";
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> triangleReferences(triangleNum, 0);
+    std::vector<uint8_t> nodeReferences(nodeNum, 0);
+    nodeReferences[0] = 1;
+
+    auto contains = [](const Aabb& outer, const float* point)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            if (!(point[axis] >= outer.Min[axis] && point[axis] <= outer.Max[axis]))
+            {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    std::vector<uint32_t> stack;
+    stack.push_back(0);
+    while (!stack.empty())
+    {
+        const uint32_t nodeIndex = stack.back();
+        stack.pop_back();
+
+        const BvhNode& node = bvh.Nodes[nodeIndex];
+        const Aabb bounds = GetNodeBounds(node);
+        const std::wstring name = L"Node " + std::to_wstring(nodeIndex);
+
+        if (node.IsLeaf())
+        {
+            if (node.FirstChildOrTriangle > triangleNum || node.TriangleNum > triangleNum - node.FirstChildOrTriangle)
+            {
+                error = name + L" references triangles outside the BVH";
+                return false;
+            }
+
+            for (uint32_t i = node.FirstChildOrTriangle; i < node.FirstChildOrTriangle + node.TriangleNum; i++)
+            {
+                const BvhTriangle& triangle = bvh.Triangles[i];
+                if (!contains(bounds, triangle.V0) || !contains(bounds, triangle.V1) || !contains(bounds, triangle.V2))
+                {
+                    error = name + L" does not enclose triangle " + std::to_wstring(i);
+                    return false;
+                }
+                if (triangleReferences[i]++ != 0)
+                {
+                    error = L"Triangle " + std::to_wstring(i) + L" is in more than one leaf";
+                    return false;
+                }
+            }
+            continue;
+        }
+
+        const uint32_t left = node.FirstChildOrTriangle;
+        if (left == 0 || left + 1 >= nodeNum)
+        {
+            error = name + L" references children outside the BVH";
+            return false;
+        }
+
+        for (uint32_t child = left; child < left + 2; child++)
+        {
+            const BvhNode& childNode = bvh.Nodes[child];
+            if (!contains(bounds, childNode.BoundsMin) || !contains(bounds, childNode.BoundsMax))
+            {
+                error = name + L" does not enclose its child " + std::to_wstring(child);
+                return false;
+            }
+            if (nodeReferences[child]++ != 0)
+            {
+                error = L"Node " + std::to_wstring(child) + L" has more than one parent";
+                return false;
+            }
+            stack.push_back(child);
+        }
+    }
+
+    for (uint32_t i = 0; i < triangleNum; i++)
+    {
+        if (triangleReferences[i] == 0)
+        {
+            error = L"Triangle " + std::to_wstring(i) + L" is not in any leaf";
+            return false;
+        }
+    }
+
+    return true;
+}
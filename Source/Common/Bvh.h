@@ -0,0 +1,152 @@
+#pragma once
+
+#include "vulkan/vulkan.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TaskPool;
+
+// CPU side bounding volume hierarchy over the same triangle geometry that is
+// handed to vkCmdBuildAccelerationStructureNV. It is the reference to compare
+// the driver's BLAS against and the acceleration structure of the CPU tracer.
+
+// One VkGeometryNV of a BLAS build, exactly as it is passed to the driver, with
+// host pointers standing in for the buffers it references. Offsets, strides,
+// formats and counts are read from the geometry, so the CPU build sees the same
+// triangles the driver does.
+struct BvhGeometryInput
+{
+    VkGeometryNV Geometry = { };
+    const void* VertexData = nullptr; // replaces triangles.vertexData
+    const void* IndexData = nullptr; // replaces triangles.indexData, unused for VK_INDEX_TYPE_NONE_NV
+    const void* TransformData = nullptr; // replaces triangles.transformData, may be null
+};
+
+// Leaves are never deeper than this, traversal stacks of this size can't overflow
+const uint32_t BvhMaxDepth = 128;
+
+// 32 bytes, two nodes share a cache line. Children of an inner node are adjacent.
+struct BvhNode
+{
+    float BoundsMin[3];
+    uint32_t FirstChildOrTriangle; // left child of an inner node, the right one follows it; first triangle of a leaf
+    float BoundsMax[3];
+    uint32_t TriangleNum; // 0 for inner nodes
+
+    bool IsLeaf() const { return TriangleNum != 0; }
+};
+
+// Decoded and transformed at build time, stored in leaf order
+struct BvhTriangle
+{
+    float V0[3];
+    float V1[3];
+    float V2[3];
+    uint32_t GeometryIndex; // index into the geometry array of the build
+    uint32_t PrimitiveIndex; // gl_PrimitiveID
+    uint32_t GeometryFlags; // VkGeometryFlagsNV
+};
+
+struct Bvh
+{
+    std::vector<BvhNode> Nodes; // root first
+    std::vector<BvhTriangle> Triangles;
+    double BuildSahCost = 0.0; // right after the last build, refits are measured against it
+
+    bool IsEmpty() const { return Triangles.empty(); }
+};
+
+struct BvhBuildSettings
+{
+    uint32_t BinNum = 32; // per axis, at most MaxBinNum
+    uint32_t MaxLeafSize = 8;
+    float TraversalCost = 1.0f; // of one node visit, relative to one triangle test
+    float RebuildSahRatio = 1.5f; // UpdateBvh rebuilds once a refit is this much worse than the build
+
+    static constexpr uint32_t MaxBinNum = 64;
+};
+
+struct BvhStats
+{
+    uint32_t TriangleNum = 0;
+    uint32_t NodeNum = 0;
+    uint32_t LeafNum = 0;
+    uint32_t MaxDepth = 0;
+    double AverageLeafDepth = 0.0;
+    double SahCost = 0.0; // expected cost of a random ray hitting the root, in triangle tests
+    std::vector<uint32_t> DepthHistogram; // leaves per depth, the root is depth 0
+    std::vector<uint32_t> LeafSizeHistogram; // leaves per triangle count
+    double BuildMilliseconds = 0.0;
+    uint32_t ThreadNum = 0;
+
+    double GetMegaTrianglesPerSecond() const { return BuildMilliseconds > 0.0 ? TriangleNum / (BuildMilliseconds * 1000.0) : 0.0; }
+};
+
+// Decodes the triangles of the geometries. Supports the vertex formats BLAS builds
+// accept for positions (three or two float, half or snorm16 components) and 16-bit,
+// 32-bit or no indices. Triangles with a NaN vertex are inactive and skipped like
+// the driver does. Returns false with error for anything else.
+bool GatherBvhTriangles(const std::vector<BvhGeometryInput>& geometries, std::vector<BvhTriangle>& triangles,
+    std::wstring& error);
+
+// Binned SAH build. The upper levels split one node at a time with the binning
+// spread over all threads, the subtrees below are then built as independent tasks.
+// The result does not depend on the thread count.
+void BuildBvh(TaskPool& taskPool, std::vector<BvhTriangle> triangles, const BvhBuildSettings& settings, Bvh& bvh,
+    BvhStats* stats = nullptr);
+
+bool BuildBvh(TaskPool& taskPool, const std::vector<BvhGeometryInput>& geometries, const BvhBuildSettings& settings,
+    Bvh& bvh, std::wstring& error, BvhStats* stats = nullptr);
+
+struct BvhRefitStats
+{
+    uint32_t TriangleNum = 0;
+    double SahCost = 0.0; // after the update
+    double SahRatio = 0.0; // SahCost of the refit over the one of the last build
+    bool Rebuilt = false;
+    double Milliseconds = 0.0;
+    uint32_t ThreadNum = 0;
+
+    double GetMegaTrianglesPerSecond() const { return Milliseconds > 0.0 ? TriangleNum / (Milliseconds * 1000.0) : 0.0; }
+};
+
+// The CPU side of a BLAS update with VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_NV:
+// the triangles are read again from geometries, which must have the layout of the
+// build and the same triangles active, and the bounds are refit bottom up. Leaves
+// are spread over the threads, a parent is merged by whichever thread finishes
+// its second child, so the walk up never waits. Returns false with error when the
+// geometries don't match the build, bvh has to be rebuilt then.
+bool RefitBvh(TaskPool& taskPool, const std::vector<BvhGeometryInput>& geometries, const BvhBuildSettings& settings, Bvh& bvh,
+    std::wstring& error, BvhRefitStats* stats = nullptr);
+
+// RefitBvh, followed by a full build when the refit made the SAH cost more than
+// settings.RebuildSahRatio times the one of the last build
+bool UpdateBvh(TaskPool& taskPool, const std::vector<BvhGeometryInput>& geometries, const BvhBuildSettings& settings, Bvh& bvh,
+    std::wstring& error, BvhRefitStats* stats = nullptr);
+
+// Bounds of one primitive of a box BVH
+struct BvhBox
+{
+    float Min[3];
+    float Max[3];
+};
+
+// The same build over boxes, for top levels over instance bounds. order receives
+// the box indices in leaf order, FirstChildOrTriangle of a leaf indexes it.
+void BuildBoxBvh(TaskPool& taskPool, const std::vector<BvhBox>& boxes, const BvhBuildSettings& settings, std::vector<BvhNode>& nodes,
+    std::vector<uint32_t>& order);
+
+// Linear BVH over the box centroids: 30-bit Morton codes, a radix sort and splits
+// where the highest differing code bit changes. Several times faster than
+// BuildBoxBvh for large box counts, at the price of worse trees, for top levels
+// that are rebuilt every frame. Only settings.MaxLeafSize is used.
+void BuildBoxBvhMorton(TaskPool& taskPool, const std::vector<BvhBox>& boxes, const BvhBuildSettings& settings,
+    std::vector<BvhNode>& nodes, std::vector<uint32_t>& order);
+
+// Fills everything but the build time and thread count
+void ComputeBvhStats(const Bvh& bvh, const BvhBuildSettings& settings, BvhStats& stats);
+
+// Checks that every node encloses its children and triangles and that every
+// triangle is referenced by exactly one leaf, returns false with error otherwise
+bool ValidateBvh(const Bvh& bvh, std::wstring& error);
@@ -0,0 +1,1084 @@
+#include "Bvh8.h"
+#include "CpuFeatures.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <limits>
+#include <emmintrin.h>
+#include <immintrin.h>
+#include <smmintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace
+{
+    // ============================================================
+    // Collapse
+    // ============================================================
+
+    float GetHalfArea(const BvhNode& node)
+    {
+        const float x = node.BoundsMax[0] - node.BoundsMin[0];
+        const float y = node.BoundsMax[1] - node.BoundsMin[1];
+        const float z = node.BoundsMax[2] - node.BoundsMin[2];
+        return x * y + y * z + z * x;
+    }
+
+    // Quantizes the child boxes of one axis. The scale leaves one step of headroom,
+    // so rounding the maximum outwards never needs a 257th step.
+    void QuantizeAxis(const BvhNode* const* children, uint32_t childNum, int axis, Bvh8Node& node)
+    {
+        float origin = std::numeric_limits<float>::max();
+        float end = -std::numeric_limits<float>::max();
+        for (uint32_t i = 0; i < childNum; i++)
+        {
+            origin = std::min(origin, children[i]->BoundsMin[axis]);
+            end = std::max(end, children[i]->BoundsMax[axis]);
+        }
+
+        int exponent = 0;
+        frexpf((end - origin) / 254.0f, &exponent);
+        const float scale = end > origin ? ldexpf(1.0f, exponent) : 1.0f;
+        node.Origin[axis] = origin;
+        node.Scale[axis] = scale;
+
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            if (i >= childNum)
+            {
+                node.QuantizedMin[axis][i] = 255;
+                node.QuantizedMax[axis][i] = 0;
+                continue;
+            }
+
+            const float childMin = children[i]->BoundsMin[axis];
+            const float childMax = children[i]->BoundsMax[axis];
+            int low = std::max((int)floorf((childMin - origin) / scale), 0);
+            while (low > 0 && origin + (float)low * scale > childMin)
+            {
+                low--;
+            }
+            int high = std::min((int)ceilf((childMax - origin) / scale), 255);
+            while (high < 255 && origin + (float)high * scale < childMax)
+            {
+                high++;
+            }
+
+            node.QuantizedMin[axis][i] = (uint8_t)low;
+            node.QuantizedMax[axis][i] = (uint8_t)high;
+        }
+    }
+
+    // Depth first, returns the index of the wide node made from the binary one
+    uint32_t CollapseNode(const Bvh& bvh, uint32_t binaryIndex, Bvh8& wide)
+    {
+        const BvhNode* nodes = bvh.Nodes.data();
+
+        const BvhNode* children[8];
+        uint32_t childNum = 0;
+        if (nodes[binaryIndex].IsLeaf())
+        {
+            children[childNum++] = &nodes[binaryIndex];
+        }
+        else
+        {
+            children[childNum++] = &nodes[nodes[binaryIndex].FirstChildOrTriangle];
+            children[childNum++] = &nodes[nodes[binaryIndex].FirstChildOrTriangle + 1];
+        }
+
+        // Open the inner child with the largest area, it's the one rays hit most often
+        while (childNum < 8)
+        {
+            uint32_t largest = childNum;
+            float largestArea = -1.0f;
+            for (uint32_t i = 0; i < childNum; i++)
+            {
+                const float area = GetHalfArea(*children[i]);
+                if (!children[i]->IsLeaf() && area > largestArea)
+                {
+                    largest = i;
+                    largestArea = area;
+                }
+            }
+            if (largest == childNum)
+            {
+                break;
+            }
+
+            const uint32_t left = children[largest]->FirstChildOrTriangle;
+            children[largest] = &nodes[left];
+            children[childNum++] = &nodes[left + 1];
+        }
+
+        const uint32_t wideIndex = (uint32_t)wide.Nodes.size();
+        wide.Nodes.push_back(Bvh8Node());
+        {
+            Bvh8Node& node = wide.Nodes[wideIndex];
+            for (int axis = 0; axis < 3; axis++)
+            {
+                QuantizeAxis(children, childNum, axis, node);
+            }
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                node.Children[i] = i < childNum && children[i]->IsLeaf() ? children[i]->FirstChildOrTriangle : 0;
+                node.TriangleNum[i] = i < childNum && children[i]->IsLeaf() ? (uint8_t)children[i]->TriangleNum : 0;
+            }
+        }
+
+        // The vector grows while the subtrees are added, so no reference is kept over it
+        for (uint32_t i = 0; i < childNum; i++)
+        {
+            if (!children[i]->IsLeaf())
+            {
+                const uint32_t childIndex = CollapseNode(bvh, (uint32_t)(children[i] - nodes), wide);
+                wide.Nodes[wideIndex].Children[i] = childIndex;
+            }
+        }
+
+        return wideIndex;
+    }
+
+    // ============================================================
+    // Traversal
+    // ============================================================
+
+    // Far plane distances are pushed out by a few ulps, so rounding in the box test
+    // can't cull a box the ray just grazes
+    const float FarPlaneRoundUp = 1.0f + 4.0f * std::numeric_limits<float>::epsilon();
+
+    // Every level pushes at most eight children and pops one of them
+    const uint32_t TraversalStackSize = BvhMaxDepth * 7 + 1;
+
+    struct TraversalRay
+    {
+        float Origin[3];
+        float InverseDirection[3]; // zero components replaced by tiny ones, so no 0 * infinity NaNs
+        uint32_t NearOffset[3]; // byte offset of QuantizedMin or QuantizedMax of the axis in the node
+        uint32_t FarOffset[3];
+
+        // Watertight triangle test: the axis the ray is most aligned with is z, the
+        // other two are sheared so the ray becomes (0, 0, 1) from the origin
+        uint32_t Kx, Ky, Kz;
+        float Shear[3];
+
+        float TMin;
+        float TMax;
+    };
+
+    void SetupTraversalRay(const Bvh8Ray& input, TraversalRay& ray)
+    {
+        uint32_t kz = 0;
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            const float direction = input.Direction[axis];
+            const float safeDirection = fabsf(direction) < 1e-18f ? (direction < 0.0f ? -1e-18f : 1e-18f) : direction;
+            ray.Origin[axis] = input.Origin[axis];
+            ray.InverseDirection[axis] = 1.0f / safeDirection;
+
+            const uint32_t minOffset = (uint32_t)(offsetof(Bvh8Node, QuantizedMin) + axis * 8);
+            const uint32_t maxOffset = (uint32_t)(offsetof(Bvh8Node, QuantizedMax) + axis * 8);
+            ray.NearOffset[axis] = safeDirection >= 0.0f ? minOffset : maxOffset;
+            ray.FarOffset[axis] = safeDirection >= 0.0f ? maxOffset : minOffset;
+
+            if (fabsf(direction) > fabsf(input.Direction[kz]))
+            {
+                kz = axis;
+            }
+        }
+
+        // Swapping x and y for a negative z keeps the winding seen from the origin
+        ray.Kz = kz;
+        ray.Kx = kz == 2 ? 0 : kz + 1;
+        ray.Ky = ray.Kx == 2 ? 0 : ray.Kx + 1;
+        if (input.Direction[kz] < 0.0f)
+        {
+            std::swap(ray.Kx, ray.Ky);
+        }
+        ray.Shear[0] = input.Direction[ray.Kx] / input.Direction[kz];
+        ray.Shear[1] = input.Direction[ray.Ky] / input.Direction[kz];
+        ray.Shear[2] = 1.0f / input.Direction[kz];
+
+        ray.TMin = input.TMin;
+        ray.TMax = input.TMax;
+    }
+
+    // Woop, Benthin, Wald: Watertight Ray/Triangle Intersection. The edge functions
+    // are recomputed in double when one of them is exactly zero.
+    bool IntersectTriangle(const TraversalRay& ray, const BvhTriangle& triangle, uint32_t cullFlags, float& t, float& u, float& v,
+        bool& counterclockwise)
+    {
+        const uint32_t kx = ray.Kx;
+        const uint32_t ky = ray.Ky;
+        const uint32_t kz = ray.Kz;
+
+        const float a[3] = { triangle.V0[0] - ray.Origin[0], triangle.V0[1] - ray.Origin[1], triangle.V0[2] - ray.Origin[2] };
+        const float b[3] = { triangle.V1[0] - ray.Origin[0], triangle.V1[1] - ray.Origin[1], triangle.V1[2] - ray.Origin[2] };
+        const float c[3] = { triangle.V2[0] - ray.Origin[0], triangle.V2[1] - ray.Origin[1], triangle.V2[2] - ray.Origin[2] };
+
+        const float ax = a[kx] - ray.Shear[0] * a[kz];
+        const float ay = a[ky] - ray.Shear[1] * a[kz];
+        const float bx = b[kx] - ray.Shear[0] * b[kz];
+        const float by = b[ky] - ray.Shear[1] * b[kz];
+        const float cx = c[kx] - ray.Shear[0] * c[kz];
+        const float cy = c[ky] - ray.Shear[1] * c[kz];
+
+        float edgeU = cx * by - cy * bx;
+        float edgeV = ax * cy - ay * cx;
+        float edgeW = bx * ay - by * ax;
+        if (edgeU == 0.0f || edgeV == 0.0f || edgeW == 0.0f)
+        {
+            edgeU = (float)((double)cx * (double)by - (double)cy * (double)bx);
+            edgeV = (float)((double)ax * (double)cy - (double)ay * (double)cx);
+            edgeW = (float)((double)bx * (double)ay - (double)by * (double)ax);
+        }
+
+        if ((edgeU < 0.0f || edgeV < 0.0f || edgeW < 0.0f) && (edgeU > 0.0f || edgeV > 0.0f || edgeW > 0.0f))
+        {
+            return false;
+        }
+
+        const float determinant = edgeU + edgeV + edgeW;
+        if (determinant == 0.0f)
+        {
+            return false;
+        }
+
+        counterclockwise = determinant > 0.0f;
+        if ((cullFlags & (counterclockwise ? BVH8_CULL_COUNTERCLOCKWISE : BVH8_CULL_CLOCKWISE)) != 0)
+        {
+            return false;
+        }
+
+        const float az = ray.Shear[2] * a[kz];
+        const float bz = ray.Shear[2] * b[kz];
+        const float cz = ray.Shear[2] * c[kz];
+        const float inverseDeterminant = 1.0f / determinant;
+        t = (edgeU * az + edgeV * bz + edgeW * cz) * inverseDeterminant;
+        if (!(t >= ray.TMin && t <= ray.TMax))
+        {
+            return false;
+        }
+
+        u = edgeV * inverseDeterminant;
+        v = edgeW * inverseDeterminant;
+        return true;
+    }
+
+    uint32_t FindLowestBit(uint32_t mask)
+    {
+#if defined(_MSC_VER)
+        unsigned long index;
+        _BitScanForward(&index, mask);
+        return (uint32_t)index;
+#else
+        return (uint32_t)__builtin_ctz(mask);
+#endif
+    }
+
+    const uint8_t* GetQuantized(const Bvh8Node& node, uint32_t offset)
+    {
+        return (const uint8_t*)&node + offset;
+    }
+
+    // Box tests: entry distances of all eight children into distances, returns the
+    // mask of the hit ones. The traversal loop calls them per node, only they are
+    // compiled for the instruction set, so nothing else needs a CPU check.
+
+    uint32_t IntersectChildrenScalar(const Bvh8Node& node, const TraversalRay& ray, float* distances)
+    {
+        float tnear[8];
+        float tfar[8];
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            tnear[i] = ray.TMin;
+            tfar[i] = ray.TMax;
+        }
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float scale = node.Scale[axis] * ray.InverseDirection[axis];
+            const float offset = (node.Origin[axis] - ray.Origin[axis]) * ray.InverseDirection[axis];
+            const uint8_t* nearPlanes = GetQuantized(node, ray.NearOffset[axis]);
+            const uint8_t* farPlanes = GetQuantized(node, ray.FarOffset[axis]);
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                tnear[i] = std::max(tnear[i], (float)nearPlanes[i] * scale + offset);
+                tfar[i] = std::min(tfar[i], (float)farPlanes[i] * scale + offset);
+            }
+        }
+
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            distances[i] = tnear[i];
+            mask |= tnear[i] <= tfar[i] * FarPlaneRoundUp ? 1u << i : 0u;
+        }
+        return mask;
+    }
+
+    // SSE4.1 for the byte to int conversion, in two halves of four children
+    NVVK_TARGET_SSE41 uint32_t IntersectChildrenSSE41(const Bvh8Node& node, const TraversalRay& ray, float* distances)
+    {
+        uint32_t mask = 0;
+        for (uint32_t half = 0; half < 2; half++)
+        {
+            __m128 tnear = _mm_set1_ps(ray.TMin);
+            __m128 tfar = _mm_set1_ps(ray.TMax);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const __m128 scale = _mm_set1_ps(node.Scale[axis] * ray.InverseDirection[axis]);
+                const __m128 offset = _mm_set1_ps((node.Origin[axis] - ray.Origin[axis]) * ray.InverseDirection[axis]);
+
+                int32_t nearBytes, farBytes;
+                memcpy(&nearBytes, GetQuantized(node, ray.NearOffset[axis]) + half * 4, sizeof(nearBytes));
+                memcpy(&farBytes, GetQuantized(node, ray.FarOffset[axis]) + half * 4, sizeof(farBytes));
+                const __m128 nearPlanes = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(nearBytes)));
+                const __m128 farPlanes = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(farBytes)));
+
+                tnear = _mm_max_ps(tnear, _mm_add_ps(_mm_mul_ps(nearPlanes, scale), offset));
+                tfar = _mm_min_ps(tfar, _mm_add_ps(_mm_mul_ps(farPlanes, scale), offset));
+            }
+
+            tfar = _mm_mul_ps(tfar, _mm_set1_ps(FarPlaneRoundUp));
+            _mm_storeu_ps(distances + half * 4, tnear);
+            mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(tnear, tfar)) << (half * 4);
+        }
+        return mask;
+    }
+
+    NVVK_TARGET_AVX2 uint32_t IntersectChildrenAVX2(const Bvh8Node& node, const TraversalRay& ray, float* distances)
+    {
+        __m256 tnear = _mm256_set1_ps(ray.TMin);
+        __m256 tfar = _mm256_set1_ps(ray.TMax);
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const __m256 scale = _mm256_set1_ps(node.Scale[axis] * ray.InverseDirection[axis]);
+            const __m256 offset = _mm256_set1_ps((node.Origin[axis] - ray.Origin[axis]) * ray.InverseDirection[axis]);
+
+            const __m128i nearBytes = _mm_loadl_epi64((const __m128i*)GetQuantized(node, ray.NearOffset[axis]));
+            const __m128i farBytes = _mm_loadl_epi64((const __m128i*)GetQuantized(node, ray.FarOffset[axis]));
+            const __m256 nearPlanes = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(nearBytes));
+            const __m256 farPlanes = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(farBytes));
+
+            tnear = _mm256_max_ps(tnear, _mm256_fmadd_ps(nearPlanes, scale, offset));
+            tfar = _mm256_min_ps(tfar, _mm256_fmadd_ps(farPlanes, scale, offset));
+        }
+
+        tfar = _mm256_mul_ps(tfar, _mm256_set1_ps(FarPlaneRoundUp));
+        _mm256_storeu_ps(distances, tnear);
+        return (uint32_t)_mm256_movemask_ps(_mm256_cmp_ps(tnear, tfar, _CMP_LE_OQ));
+    }
+
+#if defined(NVVK_AVX512_INTRINSICS)
+    // Near planes in the low eight lanes, far planes negated in the high eight, so
+    // one FMA and one max per axis handle both sides of all eight slabs
+    NVVK_TARGET_AVX512 uint32_t IntersectChildrenAVX512(const Bvh8Node& node, const TraversalRay& ray, float* distances)
+    {
+        const __m512 farSign = _mm512_castsi512_ps(_mm512_inserti64x4(_mm512_setzero_si512(), _mm256_set1_epi32((int)0x80000000), 1));
+
+        __m512 planes = _mm512_castsi512_ps(_mm512_inserti64x4(_mm512_castsi256_si512(_mm256_castps_si256(_mm256_set1_ps(ray.TMin))),
+            _mm256_castps_si256(_mm256_set1_ps(-ray.TMax)), 1));
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const __m512 scale = _mm512_castsi512_ps(_mm512_xor_si512(
+                _mm512_castps_si512(_mm512_set1_ps(node.Scale[axis] * ray.InverseDirection[axis])), _mm512_castps_si512(farSign)));
+            const __m512 offset = _mm512_castsi512_ps(_mm512_xor_si512(
+                _mm512_castps_si512(_mm512_set1_ps((node.Origin[axis] - ray.Origin[axis]) * ray.InverseDirection[axis])),
+                _mm512_castps_si512(farSign)));
+
+            const __m128i bytes = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)GetQuantized(node, ray.NearOffset[axis])),
+                _mm_loadl_epi64((const __m128i*)GetQuantized(node, ray.FarOffset[axis])));
+            const __m512 quantized = _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(bytes));
+
+            planes = _mm512_max_ps(planes, _mm512_fmadd_ps(quantized, scale, offset));
+        }
+
+        const __m256 tnear = _mm512_castps512_ps256(planes);
+        const __m256 negativeTfar = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(planes), 1));
+        const __m256 tfar = _mm256_mul_ps(negativeTfar, _mm256_set1_ps(-FarPlaneRoundUp));
+        _mm256_storeu_ps(distances, tnear);
+        return (uint32_t)_mm256_cmp_ps_mask(tnear, tfar, _CMP_LE_OQ);
+    }
+#endif
+
+    // Triangles that share an edge or a vertex can be hit at exactly the same
+    // distance, the lower index wins, so the result doesn't depend on the order
+    // leaves are visited in
+    bool IsCloserHit(float t, uint32_t triangleIndex, float closestT, bool found, const Bvh8Hit& closest)
+    {
+        return !found || t < closestT || triangleIndex < closest.TriangleIndex;
+    }
+
+    struct StackEntry
+    {
+        uint32_t NodeIndex;
+        float Distance;
+    };
+
+    template <uint32_t (*IntersectChildren)(const Bvh8Node&, const TraversalRay&, float*)>
+    bool Traverse(const Bvh8& bvh, Bvh8Ray& input, uint32_t cullFlags, bool anyHit, Bvh8Hit& hit)
+    {
+        if (bvh.IsEmpty())
+        {
+            return false;
+        }
+
+        TraversalRay ray;
+        SetupTraversalRay(input, ray);
+
+        StackEntry stack[TraversalStackSize];
+        uint32_t stackSize = 0;
+        uint32_t nodeIndex = 0;
+        bool found = false;
+
+        for (;;)
+        {
+            const Bvh8Node& node = bvh.Nodes[nodeIndex];
+            float distances[8];
+            uint32_t mask = IntersectChildren(node, ray, distances);
+
+            // Insertion sort of the hit children by entry distance
+            uint32_t order[8];
+            uint32_t hitNum = 0;
+            while (mask != 0)
+            {
+                const uint32_t child = FindLowestBit(mask);
+                mask &= mask - 1;
+
+                uint32_t position = hitNum++;
+                while (position > 0 && distances[order[position - 1]] > distances[child])
+                {
+                    order[position] = order[position - 1];
+                    position--;
+                }
+                order[position] = child;
+            }
+
+            // Leaves are intersected right away, near to far, every hit shortens
+            // the ray for the children after them
+            uint32_t innerChildren[8];
+            uint32_t innerNum = 0;
+            for (uint32_t i = 0; i < hitNum && distances[order[i]] <= ray.TMax; i++)
+            {
+                const uint32_t child = order[i];
+                if (node.TriangleNum[child] == 0)
+                {
+                    innerChildren[innerNum++] = child;
+                    continue;
+                }
+
+                const uint32_t first = node.Children[child];
+                for (uint32_t triangleIndex = first; triangleIndex < first + node.TriangleNum[child]; triangleIndex++)
+                {
+                    float t, u, v;
+                    bool counterclockwise;
+                    if (IntersectTriangle(ray, bvh.Triangles[triangleIndex], cullFlags, t, u, v, counterclockwise) &&
+                        IsCloserHit(t, triangleIndex, ray.TMax, found, hit))
+                    {
+                        ray.TMax = t;
+                        hit.Barycentrics[0] = u;
+                        hit.Barycentrics[1] = v;
+                        hit.TriangleIndex = triangleIndex;
+                        hit.Counterclockwise = counterclockwise;
+                        found = true;
+                        if (anyHit)
+                        {
+                            input.TMax = t;
+                            return true;
+                        }
+                    }
+                }
+            }
+
+            // Far children first, so the nearest one is on top
+            for (uint32_t i = innerNum; i-- > 0;)
+            {
+                const uint32_t child = innerChildren[i];
+                if (distances[child] <= ray.TMax)
+                {
+                    stack[stackSize].NodeIndex = node.Children[child];
+                    stack[stackSize].Distance = distances[child];
+                    stackSize++;
+                }
+            }
+
+            for (;;)
+            {
+                if (stackSize == 0)
+                {
+                    input.TMax = ray.TMax;
+                    return found;
+                }
+
+                const StackEntry& entry = stack[--stackSize];
+                if (entry.Distance <= ray.TMax)
+                {
+                    nodeIndex = entry.NodeIndex;
+                    break;
+                }
+            }
+        }
+    }
+
+    bool TraverseScalar(const Bvh8& bvh, Bvh8Ray& ray, uint32_t cullFlags, bool anyHit, Bvh8Hit& hit)
+    {
+        return Traverse<IntersectChildrenScalar>(bvh, ray, cullFlags, anyHit, hit);
+    }
+
+    bool TraverseSSE41(const Bvh8& bvh, Bvh8Ray& ray, uint32_t cullFlags, bool anyHit, Bvh8Hit& hit)
+    {
+        return Traverse<IntersectChildrenSSE41>(bvh, ray, cullFlags, anyHit, hit);
+    }
+
+    bool TraverseAVX2(const Bvh8& bvh, Bvh8Ray& ray, uint32_t cullFlags, bool anyHit, Bvh8Hit& hit)
+    {
+        return Traverse<IntersectChildrenAVX2>(bvh, ray, cullFlags, anyHit, hit);
+    }
+
+#if defined(NVVK_AVX512_INTRINSICS)
+    bool TraverseAVX512(const Bvh8& bvh, Bvh8Ray& ray, uint32_t cullFlags, bool anyHit, Bvh8Hit& hit)
+    {
+        return Traverse<IntersectChildrenAVX512>(bvh, ray, cullFlags, anyHit, hit);
+    }
+#endif
+
+    // Occlusion has no closest hit to keep, the ray never gets shorter, so the
+    // children are neither sorted nor stacked with their distances. The leaves of
+    // a node are tested before any of its inner children: they are the cheapest
+    // way to end the ray.
+    template <uint32_t (*IntersectChildren)(const Bvh8Node&, const TraversalRay&, float*)>
+    bool Occluded(const Bvh8& bvh, const Bvh8Ray& input, uint32_t cullFlags)
+    {
+        if (bvh.IsEmpty())
+        {
+            return false;
+        }
+
+        TraversalRay ray;
+        SetupTraversalRay(input, ray);
+
+        uint32_t stack[TraversalStackSize];
+        uint32_t stackSize = 0;
+        uint32_t nodeIndex = 0;
+
+        for (;;)
+        {
+            const Bvh8Node& node = bvh.Nodes[nodeIndex];
+            float distances[8];
+            for (uint32_t mask = IntersectChildren(node, ray, distances); mask != 0; mask &= mask - 1)
+            {
+                const uint32_t child = FindLowestBit(mask);
+                if (node.TriangleNum[child] == 0)
+                {
+                    stack[stackSize++] = node.Children[child];
+                    continue;
+                }
+
+                const uint32_t first = node.Children[child];
+                for (uint32_t triangleIndex = first; triangleIndex < first + node.TriangleNum[child]; triangleIndex++)
+                {
+                    float t, u, v;
+                    bool counterclockwise;
+                    if (IntersectTriangle(ray, bvh.Triangles[triangleIndex], cullFlags, t, u, v, counterclockwise))
+                    {
+                        return true;
+                    }
+                }
+            }
+
+            if (stackSize == 0)
+            {
+                return false;
+            }
+            nodeIndex = stack[--stackSize];
+        }
+    }
+
+    bool OccludedScalar(const Bvh8& bvh, const Bvh8Ray& ray, uint32_t cullFlags)
+    {
+        return Occluded<IntersectChildrenScalar>(bvh, ray, cullFlags);
+    }
+
+    bool OccludedSSE41(const Bvh8& bvh, const Bvh8Ray& ray, uint32_t cullFlags)
+    {
+        return Occluded<IntersectChildrenSSE41>(bvh, ray, cullFlags);
+    }
+
+    bool OccludedAVX2(const Bvh8& bvh, const Bvh8Ray& ray, uint32_t cullFlags)
+    {
+        return Occluded<IntersectChildrenAVX2>(bvh, ray, cullFlags);
+    }
+
+#if defined(NVVK_AVX512_INTRINSICS)
+    bool OccludedAVX512(const Bvh8& bvh, const Bvh8Ray& ray, uint32_t cullFlags)
+    {
+        return Occluded<IntersectChildrenAVX512>(bvh, ray, cullFlags);
+    }
+#endif
+
+    // ============================================================
+    // Packet traversal
+    // ============================================================
+
+    // A packet that reaches more leaves than this has fanned out over geometry finer
+    // than its rays, the frustum no longer saves work and the rays finish one by
+    // one. Small, because the leaves visited so far are wasted work then.
+    const uint32_t PacketLeafBudget = 4;
+
+    // The frustum is kept as intervals: with a common origin and direction signs,
+    // the distance of every ray to a plane lies between the distances along the
+    // smallest and the largest inverse direction of the packet, so a box none of the
+    // intervals overlap can't be hit by any of the rays
+    struct PacketFrustum
+    {
+        float Origin[3];
+        float InverseMin[3];
+        float InverseMax[3];
+        uint32_t NearOffset[3];
+        uint32_t FarOffset[3];
+        float TMin; // smallest of the packet
+        float TMax; // largest of the packet
+    };
+
+    // Returns false when the rays don't share the origin and direction signs
+    bool SetupPacketFrustum(const TraversalRay* rays, uint32_t rayNum, PacketFrustum& frustum)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            frustum.Origin[axis] = rays[0].Origin[axis];
+            frustum.InverseMin[axis] = rays[0].InverseDirection[axis];
+            frustum.InverseMax[axis] = rays[0].InverseDirection[axis];
+            frustum.NearOffset[axis] = rays[0].NearOffset[axis];
+            frustum.FarOffset[axis] = rays[0].FarOffset[axis];
+        }
+        frustum.TMin = rays[0].TMin;
+        frustum.TMax = rays[0].TMax;
+
+        for (uint32_t i = 1; i < rayNum; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                if (rays[i].Origin[axis] != frustum.Origin[axis] || rays[i].NearOffset[axis] != frustum.NearOffset[axis])
+                {
+                    return false;
+                }
+                frustum.InverseMin[axis] = std::min(frustum.InverseMin[axis], rays[i].InverseDirection[axis]);
+                frustum.InverseMax[axis] = std::max(frustum.InverseMax[axis], rays[i].InverseDirection[axis]);
+            }
+            frustum.TMin = std::min(frustum.TMin, rays[i].TMin);
+            frustum.TMax = std::max(frustum.TMax, rays[i].TMax);
+        }
+        return true;
+    }
+
+    // Like the single ray box tests, but the near distances are the smallest and the
+    // far ones the largest of both interval ends. Plain loops, the compiler
+    // vectorizes them for the baseline instruction set. The intervals can overlap
+    // for the inverted boxes of unused slots, those are masked out explicitly.
+    uint32_t IntersectChildrenFrustum(const Bvh8Node& node, const PacketFrustum& frustum, float* distances)
+    {
+        float tnear[8];
+        float tfar[8];
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            tnear[i] = frustum.TMin;
+            tfar[i] = frustum.TMax;
+        }
+
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float scaleMin = node.Scale[axis] * frustum.InverseMin[axis];
+            const float scaleMax = node.Scale[axis] * frustum.InverseMax[axis];
+            const float offsetMin = (node.Origin[axis] - frustum.Origin[axis]) * frustum.InverseMin[axis];
+            const float offsetMax = (node.Origin[axis] - frustum.Origin[axis]) * frustum.InverseMax[axis];
+            const uint8_t* nearPlanes = GetQuantized(node, frustum.NearOffset[axis]);
+            const uint8_t* farPlanes = GetQuantized(node, frustum.FarOffset[axis]);
+            for (uint32_t i = 0; i < 8; i++)
+            {
+                const float nearPlane = (float)nearPlanes[i];
+                const float farPlane = (float)farPlanes[i];
+                tnear[i] = std::max(tnear[i], std::min(nearPlane * scaleMin + offsetMin, nearPlane * scaleMax + offsetMax));
+                tfar[i] = std::min(tfar[i], std::max(farPlane * scaleMin + offsetMin, farPlane * scaleMax + offsetMax));
+            }
+        }
+
+        uint32_t mask = 0;
+        for (uint32_t i = 0; i < 8; i++)
+        {
+            distances[i] = tnear[i];
+            const bool used = node.QuantizedMin[0][i] <= node.QuantizedMax[0][i];
+            mask |= used && tnear[i] <= tfar[i] * FarPlaneRoundUp ? 1u << i : 0u;
+        }
+        return mask;
+    }
+
+    // The rays of a packet as arrays, so the loops over them vectorize
+    struct PacketRays
+    {
+        float InverseDirection[3][Bvh8PacketMaxRayNum];
+        float TMin[Bvh8PacketMaxRayNum];
+        float TMax[Bvh8PacketMaxRayNum];
+    };
+
+    // Which rays of the packet enter a child box. The rays share the origin, so the
+    // planes are moved to it once for all of them.
+    void IntersectChildRays(const Bvh8Node& node, uint32_t child, const PacketFrustum& frustum, const PacketRays& rays,
+        uint32_t rayNum, uint8_t* entered)
+    {
+        float nearPlanes[3];
+        float farPlanes[3];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float offset = node.Origin[axis] - frustum.Origin[axis];
+            nearPlanes[axis] = (float)GetQuantized(node, frustum.NearOffset[axis])[child] * node.Scale[axis] + offset;
+            farPlanes[axis] = (float)GetQuantized(node, frustum.FarOffset[axis])[child] * node.Scale[axis] + offset;
+        }
+
+        for (uint32_t i = 0; i < rayNum; i++)
+        {
+            const float tnear = std::max(std::max(rays.TMin[i], nearPlanes[0] * rays.InverseDirection[0][i]),
+                std::max(nearPlanes[1] * rays.InverseDirection[1][i], nearPlanes[2] * rays.InverseDirection[2][i]));
+            const float tfar = std::min(std::min(rays.TMax[i], farPlanes[0] * rays.InverseDirection[0][i]),
+                std::min(farPlanes[1] * rays.InverseDirection[1][i], farPlanes[2] * rays.InverseDirection[2][i]));
+            entered[i] = tnear <= tfar * FarPlaneRoundUp ? 1 : 0;
+        }
+    }
+
+    // Returns false when the packet ran over its leaf budget, the rays keep the
+    // closest hits found so far
+    bool TraversePacket(const Bvh8& bvh, TraversalRay* rays, uint32_t rayNum, uint32_t cullFlags, PacketFrustum& frustum,
+        Bvh8Hit* hits, uint64_t& found)
+    {
+        StackEntry stack[TraversalStackSize];
+        uint32_t stackSize = 0;
+        uint32_t nodeIndex = 0;
+        uint32_t leafNum = 0;
+
+        PacketRays packetRays;
+        for (uint32_t i = 0; i < rayNum; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                packetRays.InverseDirection[axis][i] = rays[i].InverseDirection[axis];
+            }
+            packetRays.TMin[i] = rays[i].TMin;
+            packetRays.TMax[i] = rays[i].TMax;
+        }
+
+        for (;;)
+        {
+            const Bvh8Node& node = bvh.Nodes[nodeIndex];
+            float distances[8];
+            uint32_t mask = IntersectChildrenFrustum(node, frustum, distances);
+
+            uint32_t order[8];
+            uint32_t hitNum = 0;
+            while (mask != 0)
+            {
+                const uint32_t child = FindLowestBit(mask);
+                mask &= mask - 1;
+
+                uint32_t position = hitNum++;
+                while (position > 0 && distances[order[position - 1]] > distances[child])
+                {
+                    order[position] = order[position - 1];
+                    position--;
+                }
+                order[position] = child;
+            }
+
+            uint32_t innerChildren[8];
+            uint32_t innerNum = 0;
+            for (uint32_t i = 0; i < hitNum && distances[order[i]] <= frustum.TMax; i++)
+            {
+                const uint32_t child = order[i];
+                if (node.TriangleNum[child] == 0)
+                {
+                    innerChildren[innerNum++] = child;
+                    continue;
+                }
+
+                if (++leafNum > PacketLeafBudget)
+                {
+                    return false;
+                }
+
+                uint8_t entered[Bvh8PacketMaxRayNum];
+                IntersectChildRays(node, child, frustum, packetRays, rayNum, entered);
+
+                bool shortened = false;
+                const uint32_t first = node.Children[child];
+                for (uint32_t rayIndex = 0; rayIndex < rayNum; rayIndex++)
+                {
+                    if (entered[rayIndex] == 0)
+                    {
+                        continue;
+                    }
+
+                    TraversalRay& ray = rays[rayIndex];
+
+                    for (uint32_t triangleIndex = first; triangleIndex < first + node.TriangleNum[child]; triangleIndex++)
+                    {
+                        float t, u, v;
+                        bool counterclockwise;
+                        if (IntersectTriangle(ray, bvh.Triangles[triangleIndex], cullFlags, t, u, v, counterclockwise) &&
+                            IsCloserHit(t, triangleIndex, ray.TMax, (found & (1ull << rayIndex)) != 0, hits[rayIndex]))
+                        {
+                            ray.TMax = t;
+                            packetRays.TMax[rayIndex] = t;
+                            hits[rayIndex].Barycentrics[0] = u;
+                            hits[rayIndex].Barycentrics[1] = v;
+                            hits[rayIndex].TriangleIndex = triangleIndex;
+                            hits[rayIndex].Counterclockwise = counterclockwise;
+                            found |= 1ull << rayIndex;
+                            shortened = true;
+                        }
+                    }
+                }
+
+                // The frustum ends at the farthest closest hit
+                if (shortened)
+                {
+                    frustum.TMax = rays[0].TMax;
+                    for (uint32_t rayIndex = 1; rayIndex < rayNum; rayIndex++)
+                    {
+                        frustum.TMax = std::max(frustum.TMax, rays[rayIndex].TMax);
+                    }
+                }
+            }
+
+            for (uint32_t i = innerNum; i-- > 0;)
+            {
+                const uint32_t child = innerChildren[i];
+                if (distances[child] <= frustum.TMax)
+                {
+                    stack[stackSize].NodeIndex = node.Children[child];
+                    stack[stackSize].Distance = distances[child];
+                    stackSize++;
+                }
+            }
+
+            for (;;)
+            {
+                if (stackSize == 0)
+                {
+                    return true;
+                }
+
+                const StackEntry& entry = stack[--stackSize];
+                if (entry.Distance <= frustum.TMax)
+                {
+                    nodeIndex = entry.NodeIndex;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+bool CollapseBvh8(const Bvh& bvh, Bvh8& wide, std::wstring& error)
+{
+    wide.Nodes.clear();
+    wide.Triangles = bvh.Triangles.data();
+    if (bvh.IsEmpty())
+    {
+        return true;
+    }
+
+    for (const BvhNode& node : bvh.Nodes)
+    {
+        if (node.TriangleNum > 255)
+        {
+            error = L"A BVH leaf has " + std::to_wstring(node.TriangleNum) + L" triangles, wide BVHs support up to 255";
+            return false;
+        }
+    }
+
+    // Every wide node but the root replaces at least two binary inner nodes
+    wide.Nodes.reserve(bvh.Nodes.size() / 4 + 1);
+    CollapseNode(bvh, 0, wide);
+    return true;
+}
+
+bool RefitBvh8(const Bvh& bvh, Bvh8& wide, std::wstring& error)
+{
+    wide.Triangles = bvh.Triangles.data();
+    const uint32_t triangleNum = (uint32_t)bvh.Triangles.size();
+
+    // Children come after their parents, so one backwards pass has the exact
+    // bounds of every child before its parent is quantized again
+    std::vector<BvhNode> bounds(wide.Nodes.size());
+    for (size_t nodeIndex = wide.Nodes.size(); nodeIndex-- > 0;)
+    {
+        Bvh8Node& node = wide.Nodes[nodeIndex];
+
+        BvhNode childBounds[8];
+        const BvhNode* children[8];
+        uint32_t childNum = 0;
+        while (childNum < 8 && node.QuantizedMin[0][childNum] <= node.QuantizedMax[0][childNum]) // unused slots are last
+        {
+            BvhNode& child = childBounds[childNum];
+            if (node.TriangleNum[childNum] == 0)
+            {
+                child = bounds[node.Children[childNum]];
+            }
+            else
+            {
+                const uint32_t first = node.Children[childNum];
+                if (first + node.TriangleNum[childNum] > triangleNum)
+                {
+                    error = L"The BVH has fewer triangles than when it was collapsed, it has to be collapsed again";
+                    return false;
+                }
+
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    child.BoundsMin[axis] = std::numeric_limits<float>::max();
+                    child.BoundsMax[axis] = -std::numeric_limits<float>::max();
+                }
+                for (uint32_t i = first; i < first + node.TriangleNum[childNum]; i++)
+                {
+                    const BvhTriangle& triangle = bvh.Triangles[i];
+                    for (int axis = 0; axis < 3; axis++)
+                    {
+                        child.BoundsMin[axis] = std::min(std::min(child.BoundsMin[axis], triangle.V0[axis]), std::min(triangle.V1[axis], triangle.V2[axis]));
+                        child.BoundsMax[axis] = std::max(std::max(child.BoundsMax[axis], triangle.V0[axis]), std::max(triangle.V1[axis], triangle.V2[axis]));
+                    }
+                }
+            }
+            children[childNum] = &child;
+            childNum++;
+        }
+
+        BvhNode& nodeBounds = bounds[nodeIndex];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            QuantizeAxis(children, childNum, axis, node);
+
+            nodeBounds.BoundsMin[axis] = std::numeric_limits<float>::max();
+            nodeBounds.BoundsMax[axis] = -std::numeric_limits<float>::max();
+            for (uint32_t i = 0; i < childNum; i++)
+            {
+                nodeBounds.BoundsMin[axis] = std::min(nodeBounds.BoundsMin[axis], children[i]->BoundsMin[axis]);
+                nodeBounds.BoundsMax[axis] = std::max(nodeBounds.BoundsMax[axis], children[i]->BoundsMax[axis]);
+            }
+        }
+    }
+
+    return true;
+}
+
+const wchar_t* GetBvh8KernelName(Bvh8Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Bvh8Kernel::Scalar: return L"scalar";
+    case Bvh8Kernel::SSE41: return L"SSE4.1";
+    case Bvh8Kernel::AVX2: return L"AVX2";
+    case Bvh8Kernel::AVX512: return L"AVX-512";
+    }
+    return L"unknown";
+}
+
+bool IsBvh8KernelSupported(Bvh8Kernel kernel)
+{
+    const CpuFeatures& features = CpuFeatures::Get();
+    switch (kernel)
+    {
+    case Bvh8Kernel::Scalar: return true;
+    case Bvh8Kernel::SSE41: return features.SSE41;
+    case Bvh8Kernel::AVX2: return features.AVX2 && features.FMA;
+#if defined(NVVK_AVX512_INTRINSICS)
+    case Bvh8Kernel::AVX512: return features.AVX512F && features.AVX512VL && features.AVX2 && features.FMA;
+#else
+    case Bvh8Kernel::AVX512: return false;
+#endif
+    }
+    return false;
+}
+
+Bvh8Kernel GetBestBvh8Kernel()
+{
+    const Bvh8Kernel kernels[] = { Bvh8Kernel::AVX512, Bvh8Kernel::AVX2, Bvh8Kernel::SSE41 };
+    for (Bvh8Kernel kernel : kernels)
+    {
+        if (IsBvh8KernelSupported(kernel))
+        {
+            return kernel;
+        }
+    }
+    return Bvh8Kernel::Scalar;
+}
+
+Bvh8TraverseFunction GetBvh8TraverseFunction(Bvh8Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Bvh8Kernel::SSE41: return TraverseSSE41;
+    case Bvh8Kernel::AVX2: return TraverseAVX2;
+#if defined(NVVK_AVX512_INTRINSICS)
+    case Bvh8Kernel::AVX512: return TraverseAVX512;
+#endif
+    default: return TraverseScalar;
+    }
+}
+
+Bvh8OccludedFunction GetBvh8OccludedFunction(Bvh8Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Bvh8Kernel::SSE41: return OccludedSSE41;
+    case Bvh8Kernel::AVX2: return OccludedAVX2;
+#if defined(NVVK_AVX512_INTRINSICS)
+    case Bvh8Kernel::AVX512: return OccludedAVX512;
+#endif
+    default: return OccludedScalar;
+    }
+}
+
+uint64_t TraverseBvh8Packet(const Bvh8& bvh, Bvh8Ray* rays, uint32_t rayNum, uint32_t cullFlags, Bvh8TraverseFunction singleRay,
+    Bvh8Hit* hits)
+{
+    if (bvh.IsEmpty() || rayNum == 0)
+    {
+        return 0;
+    }
+
+    rayNum = std::min(rayNum, Bvh8PacketMaxRayNum);
+    TraversalRay traversalRays[Bvh8PacketMaxRayNum];
+    for (uint32_t i = 0; i < rayNum; i++)
+    {
+        SetupTraversalRay(rays[i], traversalRays[i]);
+    }
+
+    uint64_t found = 0;
+    PacketFrustum frustum;
+    const bool coherent = SetupPacketFrustum(traversalRays, rayNum, frustum);
+    if (coherent && TraversePacket(bvh, traversalRays, rayNum, cullFlags, frustum, hits, found))
+    {
+        for (uint32_t i = 0; i < rayNum; i++)
+        {
+            rays[i].TMax = traversalRays[i].TMax;
+        }
+        return found;
+    }
+
+    // Divergent: every ray searches below the closest hit the packet found for it
+    for (uint32_t i = 0; i < rayNum; i++)
+    {
+        rays[i].TMax = traversalRays[i].TMax;
+        Bvh8Hit hit;
+        const bool packetFound = (found & (1ull << i)) != 0;
+        if (singleRay(bvh, rays[i], cullFlags, false, hit) &&
+            IsCloserHit(rays[i].TMax, hit.TriangleIndex, traversalRays[i].TMax, packetFound, hits[i]))
+        {
+            hits[i] = hit;
+            found |= 1ull << i;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "Bvh.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Eight-wide BVH for CPU traversal, collapsed from a binary Bvh. One node holds
+// the boxes of all its children quantized to 8 bits, so a single SIMD pass over
+// 112 bytes tests a ray against eight boxes. Triangles stay in the Bvh the wide
+// one was collapsed from, leaves reference them by index.
+
+// 112 bytes. Child bounds are Origin + Quantized * Scale per axis, rounded outwards,
+// so they always enclose the exact ones. Unused slots have min > max and never hit.
+struct Bvh8Node
+{
+    float Origin[3]; // bounds minimum of the node
+    float Scale[3]; // powers of two
+    uint32_t Children[8]; // node index of an inner child, first triangle of a leaf
+    uint8_t TriangleNum[8]; // 0 for inner children and unused slots
+    uint8_t QuantizedMin[3][8]; // per axis, then per child, so one load covers all children
+    uint8_t QuantizedMax[3][8];
+};
+
+struct Bvh8
+{
+    std::vector<Bvh8Node> Nodes; // root first
+    // Of the source Bvh, which has to stay alive. A rebuild in UpdateBvh replaces the
+    // triangle array and a refit moves the triangles out of the quantized boxes, so
+    // after either one RefitBvh8 or CollapseBvh8 has to run before the next traversal.
+    const BvhTriangle* Triangles = nullptr;
+
+    bool IsEmpty() const { return Nodes.empty(); }
+};
+
+// Leaves of the binary Bvh become leaf children, inner nodes are pulled up,
+// largest surface area first, until every wide node has eight children or only
+// leaves left. Returns false with error when a leaf has more than 255 triangles.
+bool CollapseBvh8(const Bvh& bvh, Bvh8& wide, std::wstring& error);
+
+// Quantizes the boxes of wide again from the triangles of bvh and points
+// Triangles at them, without collapsing it anew. Only for a bvh that was refit
+// since the collapse, a rebuilt one has a different tree and needs CollapseBvh8.
+// Returns false with error when the leaves reference missing triangles.
+bool RefitBvh8(const Bvh& bvh, Bvh8& wide, std::wstring& error);
+
+// Instruction sets the traversal is compiled for, best last
+enum class Bvh8Kernel
+{
+    Scalar,
+    SSE41,
+    AVX2,
+    AVX512,
+};
+
+const wchar_t* GetBvh8KernelName(Bvh8Kernel kernel);
+
+bool IsBvh8KernelSupported(Bvh8Kernel kernel);
+
+// The best kernel CpuFeatures reports support for
+Bvh8Kernel GetBestBvh8Kernel();
+
+// Faces to skip, seen from the ray origin
+enum Bvh8CullFlags : uint32_t
+{
+    BVH8_CULL_NONE = 0,
+    BVH8_CULL_COUNTERCLOCKWISE = 1,
+    BVH8_CULL_CLOCKWISE = 2,
+};
+
+struct Bvh8Ray
+{
+    float Origin[3];
+    float Direction[3];
+    float TMin;
+    float TMax; // the closest hit is searched below it, lowered to the hit distance
+};
+
+struct Bvh8Hit
+{
+    float Barycentrics[2]; // weights of the second and third vertex
+    uint32_t TriangleIndex; // into Bvh8::Triangles
+    bool Counterclockwise; // seen from the ray origin
+};
+
+// Closest hit in [TMin, TMax], or the first one found with anyHit. Boxes are
+// visited near to far with a stack of (node, entry distance) pairs, popped nodes
+// that start behind the closest hit so far are skipped. Triangles use the
+// watertight test of Woop et al., rays can't slip through the shared edges and
+// vertices of a closed mesh. Of triangles hit at the same distance the one with
+// the lower index wins, whatever order the leaves are visited in.
+typedef bool (*Bvh8TraverseFunction)(const Bvh8& bvh, Bvh8Ray& ray, uint32_t cullFlags, bool anyHit, Bvh8Hit& hit);
+
+// kernel has to be supported
+Bvh8TraverseFunction GetBvh8TraverseFunction(Bvh8Kernel kernel);
+
+// Whether anything is hit in [TMin, TMax], for shadow rays. Cheaper than a
+// traversal with anyHit: nothing about the hit is kept and children are visited
+// in the order they are stored, leaves first.
+typedef bool (*Bvh8OccludedFunction)(const Bvh8& bvh, const Bvh8Ray& ray, uint32_t cullFlags);
+
+// kernel has to be supported
+Bvh8OccludedFunction GetBvh8OccludedFunction(Bvh8Kernel kernel);
+
+// Packets of coherent rays, like the camera rays of an 8x8 tile
+const uint32_t Bvh8PacketMaxRayNum = 64;
+
+// Traces up to Bvh8PacketMaxRayNum rays with a common origin together for the
+// closest hit. Nodes are culled against the frustum of the whole packet, one box
+// test per node instead of one per ray, and leaves test only the rays that enter
+// them. Packets whose rays don't share the origin and direction signs, or that
+// fan out over too many leaves, finish with singleRay per ray instead. Returns a
+// mask of the rays that hit, their TMax and hits are set like in single ray traversal.
+uint64_t TraverseBvh8Packet(const Bvh8& bvh, Bvh8Ray* rays, uint32_t rayNum, uint32_t cullFlags, Bvh8TraverseFunction singleRay,
+    Bvh8Hit* hits);
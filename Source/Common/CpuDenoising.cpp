@@ -0,0 +1,305 @@
+#include "CpuDenoising.h"
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+
+namespace
+{
+    const uint32_t ColorChannelNum = 3;
+    const uint32_t GuideChannelNum = 7; // albedo rgb, normal xyz, depth
+    const uint32_t RowGrainSize = 4;
+
+    // B3 spline, applied along both axes
+    const float Kernel[5] = { 1.0f / 16.0f, 1.0f / 4.0f, 3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f };
+
+    const float Log2E = 1.44269504f;
+
+    // Weights below 2^MinExponent are 0. Products of smaller ones with the kernel
+    // and the colors would be denormals, which are slower than the whole filter.
+    const float MinExponent = -64.0f;
+
+    // 2^x for x <= 0 with the Taylor series of 2^f on the fractional part, good to
+    // about 1e-4 relative, plenty for weights. Both versions round the same way.
+    float Exp2(float x)
+    {
+        if (x < MinExponent)
+        {
+            return 0.0f;
+        }
+        const float whole = floorf(x);
+        const float f = x - whole;
+        const float p = ((((0.00133336f * f + 0.00961813f) * f + 0.05550411f) * f + 0.24022651f) * f + 0.69314718f) * f + 1.0f;
+
+        const int32_t bits = ((int32_t)whole + 127) << 23;
+        float scale;
+        memcpy(&scale, &bits, sizeof(scale));
+        return p * scale;
+    }
+
+    __m128 Exp2(__m128 x)
+    {
+        const __m128 inRange = _mm_cmpge_ps(x, _mm_set1_ps(MinExponent));
+        x = _mm_max_ps(x, _mm_set1_ps(MinExponent));
+
+        // Truncation rounds negative values up, floor is one less there
+        __m128i whole = _mm_cvttps_epi32(x);
+        __m128 wholeFloat = _mm_cvtepi32_ps(whole);
+        const __m128 roundedUp = _mm_cmpgt_ps(wholeFloat, x);
+        whole = _mm_add_epi32(whole, _mm_castps_si128(roundedUp));
+        wholeFloat = _mm_sub_ps(wholeFloat, _mm_and_ps(roundedUp, _mm_set1_ps(1.0f)));
+        const __m128 f = _mm_sub_ps(x, wholeFloat);
+
+        __m128 p = _mm_set1_ps(0.00133336f);
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.00961813f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.05550411f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.24022651f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(0.69314718f));
+        p = _mm_add_ps(_mm_mul_ps(p, f), _mm_set1_ps(1.0f));
+
+        const __m128 scale = _mm_castsi128_ps(_mm_slli_epi32(_mm_add_epi32(whole, _mm_set1_epi32(127)), 23));
+        return _mm_and_ps(_mm_mul_ps(p, scale), inRange);
+    }
+
+    // One iteration over the planes. The squared differences of color, albedo,
+    // normal and depth are scaled by log2(e) / sigma^2 and summed, so a tap costs
+    // a single Exp2.
+    struct FilterPass
+    {
+        uint32_t Width;
+        uint32_t Height;
+        int32_t Step;
+        const float* Colors[ColorChannelNum];
+        const float* Guides[GuideChannelNum];
+        float* Output[ColorChannelNum];
+        float ColorScale;
+        float AlbedoScale;
+        float NormalScale;
+        float DepthScale;
+    };
+
+    // Taps outside the image are clamped to the border
+    void FilterPixel(const FilterPass& pass, uint32_t x, uint32_t y)
+    {
+        const uint32_t center = y * pass.Width + x;
+
+        float centerColor[ColorChannelNum];
+        for (uint32_t c = 0; c < ColorChannelNum; c++)
+        {
+            centerColor[c] = pass.Colors[c][center];
+        }
+        float centerGuide[GuideChannelNum];
+        for (uint32_t g = 0; g < GuideChannelNum; g++)
+        {
+            centerGuide[g] = pass.Guides[g][center];
+        }
+
+        float sum[ColorChannelNum] = { };
+        float weightSum = 0.0f;
+        for (int32_t ky = 0; ky < 5; ky++)
+        {
+            const int32_t tapY = std::min(std::max((int32_t)y + (ky - 2) * pass.Step, 0), (int32_t)pass.Height - 1);
+            for (int32_t kx = 0; kx < 5; kx++)
+            {
+                const int32_t tapX = std::min(std::max((int32_t)x + (kx - 2) * pass.Step, 0), (int32_t)pass.Width - 1);
+                const uint32_t tap = (uint32_t)tapY * pass.Width + (uint32_t)tapX;
+
+                float color[ColorChannelNum];
+                float colorDistance = 0.0f;
+                for (uint32_t c = 0; c < ColorChannelNum; c++)
+                {
+                    color[c] = pass.Colors[c][tap];
+                    colorDistance += (color[c] - centerColor[c]) * (color[c] - centerColor[c]);
+                }
+
+                float guideDistance[3] = { };
+                for (uint32_t g = 0; g < GuideChannelNum; g++)
+                {
+                    const float difference = pass.Guides[g][tap] - centerGuide[g];
+                    guideDistance[g / 3] += difference * difference;
+                }
+
+                const float exponent = colorDistance * pass.ColorScale + guideDistance[0] * pass.AlbedoScale +
+                    guideDistance[1] * pass.NormalScale + guideDistance[2] * pass.DepthScale;
+                const float weight = Kernel[ky] * Kernel[kx] * Exp2(-exponent);
+
+                for (uint32_t c = 0; c < ColorChannelNum; c++)
+                {
+                    sum[c] += color[c] * weight;
+                }
+                weightSum += weight;
+            }
+        }
+
+        // The center tap always has a weight
+        for (uint32_t c = 0; c < ColorChannelNum; c++)
+        {
+            pass.Output[c][center] = sum[c] / weightSum;
+        }
+    }
+
+    // Pixels x to x + 3, whose taps are all inside the row
+    void FilterPixels4(const FilterPass& pass, uint32_t x, uint32_t y)
+    {
+        const uint32_t center = y * pass.Width + x;
+
+        __m128 centerColor[ColorChannelNum];
+        for (uint32_t c = 0; c < ColorChannelNum; c++)
+        {
+            centerColor[c] = _mm_loadu_ps(pass.Colors[c] + center);
+        }
+        __m128 centerGuide[GuideChannelNum];
+        for (uint32_t g = 0; g < GuideChannelNum; g++)
+        {
+            centerGuide[g] = _mm_loadu_ps(pass.Guides[g] + center);
+        }
+
+        const __m128 colorScale = _mm_set1_ps(-pass.ColorScale);
+        const __m128 albedoScale = _mm_set1_ps(-pass.AlbedoScale);
+        const __m128 normalScale = _mm_set1_ps(-pass.NormalScale);
+        const __m128 depthScale = _mm_set1_ps(-pass.DepthScale);
+
+        __m128 sum[ColorChannelNum] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+        __m128 weightSum = _mm_setzero_ps();
+        for (int32_t ky = 0; ky < 5; ky++)
+        {
+            const int32_t tapY = std::min(std::max((int32_t)y + (ky - 2) * pass.Step, 0), (int32_t)pass.Height - 1);
+            const uint32_t tapRow = (uint32_t)tapY * pass.Width + x;
+            for (int32_t kx = 0; kx < 5; kx++)
+            {
+                const uint32_t tap = (uint32_t)((int32_t)tapRow + (kx - 2) * pass.Step);
+
+                __m128 color[ColorChannelNum];
+                __m128 colorDistance = _mm_setzero_ps();
+                for (uint32_t c = 0; c < ColorChannelNum; c++)
+                {
+                    color[c] = _mm_loadu_ps(pass.Colors[c] + tap);
+                    const __m128 difference = _mm_sub_ps(color[c], centerColor[c]);
+                    colorDistance = _mm_add_ps(colorDistance, _mm_mul_ps(difference, difference));
+                }
+
+                __m128 guideDistance[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+                for (uint32_t g = 0; g < GuideChannelNum; g++)
+                {
+                    const __m128 difference = _mm_sub_ps(_mm_loadu_ps(pass.Guides[g] + tap), centerGuide[g]);
+                    guideDistance[g / 3] = _mm_add_ps(guideDistance[g / 3], _mm_mul_ps(difference, difference));
+                }
+
+                __m128 exponent = _mm_mul_ps(colorDistance, colorScale);
+                exponent = _mm_add_ps(exponent, _mm_mul_ps(guideDistance[0], albedoScale));
+                exponent = _mm_add_ps(exponent, _mm_mul_ps(guideDistance[1], normalScale));
+                exponent = _mm_add_ps(exponent, _mm_mul_ps(guideDistance[2], depthScale));
+                const __m128 weight = _mm_mul_ps(Exp2(exponent), _mm_set1_ps(Kernel[ky] * Kernel[kx]));
+
+                for (uint32_t c = 0; c < ColorChannelNum; c++)
+                {
+                    sum[c] = _mm_add_ps(sum[c], _mm_mul_ps(color[c], weight));
+                }
+                weightSum = _mm_add_ps(weightSum, weight);
+            }
+        }
+
+        for (uint32_t c = 0; c < ColorChannelNum; c++)
+        {
+            _mm_storeu_ps(pass.Output[c] + center, _mm_div_ps(sum[c], weightSum));
+        }
+    }
+
+    void FilterRow(const FilterPass& pass, uint32_t y)
+    {
+        // Four at a time where no tap reaches over the left or right border
+        const uint32_t reach = 2 * (uint32_t)pass.Step;
+        uint32_t x = 0;
+        for (; x < std::min(reach, pass.Width); x++)
+        {
+            FilterPixel(pass, x, y);
+        }
+        for (; x + 4 + reach <= pass.Width; x += 4)
+        {
+            FilterPixels4(pass, x, y);
+        }
+        for (; x < pass.Width; x++)
+        {
+            FilterPixel(pass, x, y);
+        }
+    }
+}
+
+void CpuDenoiser::Denoise(TaskPool& taskPool, const CpuDenoiserInput& input, const CpuDenoiserSettings& settings, float* output)
+{
+    const uint32_t width = input.Width;
+    const uint32_t height = input.Height;
+    const size_t pixelNum = size_t(width) * height;
+    if (pixelNum == 0)
+    {
+        return;
+    }
+
+    _guides.resize(pixelNum * GuideChannelNum);
+    _colors[0].resize(pixelNum * ColorChannelNum);
+    _colors[1].resize(pixelNum * ColorChannelNum);
+
+    // Planes, so four neighbouring pixels of a channel are one load
+    taskPool.ParallelFor(height, RowGrainSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (size_t i = size_t(begin) * width; i < size_t(end) * width; i++)
+        {
+            for (uint32_t c = 0; c < ColorChannelNum; c++)
+            {
+                _colors[0][c * pixelNum + i] = input.Color[i * 3 + c];
+                _guides[c * pixelNum + i] = input.Albedo[i * 3 + c];
+                _guides[(3 + c) * pixelNum + i] = input.Normal[i * 3 + c];
+            }
+            _guides[6 * pixelNum + i] = input.Depth[i];
+        }
+    });
+
+    FilterPass pass;
+    pass.Width = width;
+    pass.Height = height;
+    for (uint32_t g = 0; g < GuideChannelNum; g++)
+    {
+        pass.Guides[g] = _guides.data() + g * pixelNum;
+    }
+    pass.AlbedoScale = Log2E / (settings.AlbedoSigma * settings.AlbedoSigma);
+    pass.NormalScale = Log2E / (settings.NormalSigma * settings.NormalSigma);
+
+    uint32_t source = 0;
+    for (uint32_t iteration = 0; iteration < settings.IterationNum; iteration++)
+    {
+        const float step = float(1u << iteration);
+        const float colorSigma = settings.ColorSigma / step;
+        const float depthSigma = settings.DepthSigma * step;
+
+        pass.Step = (int32_t)(1u << iteration);
+        pass.ColorScale = Log2E / (colorSigma * colorSigma);
+        pass.DepthScale = Log2E / (depthSigma * depthSigma);
+        for (uint32_t c = 0; c < ColorChannelNum; c++)
+        {
+            pass.Colors[c] = _colors[source].data() + c * pixelNum;
+            pass.Output[c] = _colors[1 - source].data() + c * pixelNum;
+        }
+
+        taskPool.ParallelFor(height, RowGrainSize, [&pass](uint32_t begin, uint32_t end, uint32_t)
+        {
+            for (uint32_t y = begin; y < end; y++)
+            {
+                FilterRow(pass, y);
+            }
+        });
+        source = 1 - source;
+    }
+
+    taskPool.ParallelFor(height, RowGrainSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (size_t i = size_t(begin) * width; i < size_t(end) * width; i++)
+        {
+            for (uint32_t c = 0; c < ColorChannelNum; c++)
+            {
+                output[i * 3 + c] = _colors[source][c * pixelNum + i];
+            }
+        }
+    });
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+class TaskPool;
+
+// Edge-avoiding à-trous wavelet filter of Dammertz et al., for images traced with
+// one or a few samples per pixel. Every iteration blurs with a 5x5 B3 spline
+// kernel whose taps are twice as far apart as in the one before, and weights each
+// tap by how close its color and guides are to those of the center pixel, so the
+// blur stops at the edges of geometry and textures instead of smearing them.
+
+struct CpuDenoiserSettings
+{
+    uint32_t IterationNum = 5; // the filter reaches 4 * (2^IterationNum - 1) pixels across
+    float ColorSigma = 2.0f; // halved every iteration, like the noise that's left
+    float AlbedoSigma = 0.1f;
+    float NormalSigma = 0.15f;
+    float DepthSigma = 0.02f; // per pixel between the taps
+};
+
+// Per pixel, rows top to bottom. The guides are what the closest hit shaders
+// write next to the color: the albedo, the world space normal and the hit
+// distance, the latter two 0 where the ray missed.
+struct CpuDenoiserInput
+{
+    uint32_t Width = 0;
+    uint32_t Height = 0;
+    const float* Color = nullptr; // rgb
+    const float* Albedo = nullptr; // rgb
+    const float* Normal = nullptr; // xyz
+    const float* Depth = nullptr;
+};
+
+class CpuDenoiser
+{
+private:
+    std::vector<float> _guides; // one plane per channel, albedo rgb, normal xyz and depth
+    std::vector<float> _colors[2]; // rgb planes, iterations read one and write the other
+
+public:
+    // Writes rgb to output, three floats per pixel, which may be input.Color.
+    // Rows are split between the threads of the pool, the taps of four pixels are
+    // weighted at a time with SSE2. The buffers are kept for the next image.
+    void Denoise(TaskPool& taskPool, const CpuDenoiserInput& input, const CpuDenoiserSettings& settings, float* output);
+};
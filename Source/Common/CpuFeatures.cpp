@@ -0,0 +1,76 @@
+#include "CpuFeatures.h"
+
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+namespace
+{
+    void Cpuid(uint32_t leaf, uint32_t subleaf, uint32_t registers[4])
+    {
+#if defined(_MSC_VER)
+        __cpuidex((int*)registers, (int)leaf, (int)subleaf);
+#else
+        __cpuid_count(leaf, subleaf, registers[0], registers[1], registers[2], registers[3]);
+#endif
+    }
+
+    uint64_t ReadXcr0()
+    {
+#if defined(_MSC_VER)
+        return _xgetbv(0);
+#else
+        uint32_t eax, edx;
+        __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+        return ((uint64_t)edx << 32) | eax;
+#endif
+    }
+
+    CpuFeatures Detect()
+    {
+        CpuFeatures features;
+
+        uint32_t registers[4] = { };
+        Cpuid(0, 0, registers);
+        const uint32_t maxLeaf = registers[0];
+        if (maxLeaf < 1)
+        {
+            return features;
+        }
+
+        Cpuid(1, 0, registers);
+        const uint32_t ecx1 = registers[2];
+        features.SSE41 = (ecx1 & (1u << 19)) != 0;
+
+        // AVX state has to be enabled by the OS as well, not just present in the CPU
+        const bool osxsave = (ecx1 & (1u << 27)) != 0;
+        const uint64_t xcr0 = osxsave ? ReadXcr0() : 0;
+        const bool avxState = (xcr0 & 0x6) == 0x6;
+        const bool avx512State = (xcr0 & 0xE6) == 0xE6;
+
+        features.AVX = avxState && (ecx1 & (1u << 28)) != 0;
+        features.FMA = features.AVX && (ecx1 & (1u << 12)) != 0;
+        features.F16C = features.AVX && (ecx1 & (1u << 29)) != 0;
+
+        if (maxLeaf >= 7)
+        {
+            Cpuid(7, 0, registers);
+            const uint32_t ebx7 = registers[1];
+            features.AVX2 = features.AVX && (ebx7 & (1u << 5)) != 0;
+            features.AVX512F = avx512State && (ebx7 & (1u << 16)) != 0;
+            features.AVX512VL = features.AVX512F && (ebx7 & (1u << 31)) != 0;
+        }
+
+        return features;
+    }
+}
+
+const CpuFeatures& CpuFeatures::Get()
+{
+    static const CpuFeatures features = Detect();
+    return features;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+// Instruction set extensions reported by CPUID. Code that uses them is compiled
+// for the extension with NVVK_TARGET_* and only called after checking here.
+struct CpuFeatures
+{
+    bool SSE41 = false;
+    bool AVX = false;
+    bool AVX2 = false;
+    bool FMA = false;
+    bool F16C = false;
+    bool AVX512F = false;
+    bool AVX512VL = false;
+
+    static const CpuFeatures& Get();
+};
+
+#if defined(_MSC_VER)
+// MSVC emits any intrinsic regardless of /arch
+#define NVVK_TARGET_SSE41
+#define NVVK_TARGET_F16C
+#define NVVK_TARGET_AVX2
+#define NVVK_TARGET_AVX512
+#else
+#define NVVK_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define NVVK_TARGET_F16C __attribute__((target("f16c")))
+#define NVVK_TARGET_AVX2 __attribute__((target("avx2,fma,f16c")))
+#define NVVK_TARGET_AVX512 __attribute__((target("avx512f,avx512vl,avx2,fma")))
+#endif
+
+// AVX-512 intrinsics arrived with Visual Studio 2017 15.3, older toolsets only get
+// the kernels below it
+#if !defined(_MSC_VER) || _MSC_VER >= 1911
+#define NVVK_AVX512_INTRINSICS
+#endif
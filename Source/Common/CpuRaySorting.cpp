@@ -0,0 +1,280 @@
+#include "CpuRaySorting.h"
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <emmintrin.h>
+#include <limits>
+#include <utility>
+
+namespace
+{
+    const uint32_t RadixBits = 8;
+    const uint32_t RadixBinNum = 1 << RadixBits;
+    const uint32_t RadixPassNum = 4;
+    const uint32_t SortBlockSize = 16384; // rays per task
+
+    // 512 cells per axis, the keys have 30 bits
+    const uint32_t MortonAxisBits = 9;
+    const float MortonCellMax = float((1 << MortonAxisBits) - 1);
+    const uint32_t OctantBits = 3;
+
+    // Two zero bits after each of the low 10 bits, so three of them interleave
+    uint32_t SpreadBits3(uint32_t value)
+    {
+        value = (value | (value << 16)) & 0x030000FF;
+        value = (value | (value << 8)) & 0x0300F00F;
+        value = (value | (value << 4)) & 0x030C30C3;
+        value = (value | (value << 2)) & 0x09249249;
+        return value;
+    }
+
+    __m128i SpreadBits3(__m128i value)
+    {
+        value = _mm_and_si128(_mm_or_si128(value, _mm_slli_epi32(value, 16)), _mm_set1_epi32(0x030000FF));
+        value = _mm_and_si128(_mm_or_si128(value, _mm_slli_epi32(value, 8)), _mm_set1_epi32(0x0300F00F));
+        value = _mm_and_si128(_mm_or_si128(value, _mm_slli_epi32(value, 4)), _mm_set1_epi32(0x030C30C3));
+        value = _mm_and_si128(_mm_or_si128(value, _mm_slli_epi32(value, 2)), _mm_set1_epi32(0x09249249));
+        return value;
+    }
+
+    // The Morton code of the origin's cell above the octant of the direction, whose
+    // bit n is the sign of direction component n. Origins outside the bounds, or
+    // NaN, land in the border cells.
+    uint32_t ComputeKey(const CpuRay& ray, const float* boundsMin, const float* scale)
+    {
+        uint32_t key = 0;
+        for (uint32_t axis = 0; axis < 3; axis++)
+        {
+            const float cell = std::min(std::max(0.0f, (ray.Origin[axis] - boundsMin[axis]) * scale[axis]), MortonCellMax);
+            key |= SpreadBits3((uint32_t)cell) << (OctantBits + axis);
+            key |= (std::signbit(ray.Direction[axis]) ? 1u : 0u) << axis;
+        }
+        return key;
+    }
+
+    // Entries are the key in the high half and the ray index in the low one, so a
+    // single 64 bit store moves both
+    uint64_t GetEntry(uint32_t key, uint32_t index)
+    {
+        return (uint64_t(key) << 32) | index;
+    }
+
+    void ComputeEntries(const CpuRay* rays, uint32_t begin, uint32_t end, const float* boundsMin, const float* scale, uint64_t* entries)
+    {
+        const __m128 minX = _mm_set1_ps(boundsMin[0]);
+        const __m128 minY = _mm_set1_ps(boundsMin[1]);
+        const __m128 minZ = _mm_set1_ps(boundsMin[2]);
+        const __m128 scaleX = _mm_set1_ps(scale[0]);
+        const __m128 scaleY = _mm_set1_ps(scale[1]);
+        const __m128 scaleZ = _mm_set1_ps(scale[2]);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 cellMax = _mm_set1_ps(MortonCellMax);
+        const __m128i indexStep = _mm_set1_epi32(4);
+        __m128i indices = _mm_setr_epi32((int)begin, (int)begin + 1, (int)begin + 2, (int)begin + 3);
+
+        uint32_t i = begin;
+        for (; i + 4 <= end; i += 4)
+        {
+            // Origin and TMin, Direction and TMax of four rays, transposed to one axis per register
+            __m128 x = _mm_loadu_ps(rays[i].Origin);
+            __m128 y = _mm_loadu_ps(rays[i + 1].Origin);
+            __m128 z = _mm_loadu_ps(rays[i + 2].Origin);
+            __m128 tmin = _mm_loadu_ps(rays[i + 3].Origin);
+            _MM_TRANSPOSE4_PS(x, y, z, tmin);
+            __m128 dx = _mm_loadu_ps(rays[i].Direction);
+            __m128 dy = _mm_loadu_ps(rays[i + 1].Direction);
+            __m128 dz = _mm_loadu_ps(rays[i + 2].Direction);
+            __m128 tmax = _mm_loadu_ps(rays[i + 3].Direction);
+            _MM_TRANSPOSE4_PS(dx, dy, dz, tmax);
+
+            // max returns its second operand for NaN
+            const __m128i cellX = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(x, minX), scaleX), zero), cellMax));
+            const __m128i cellY = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(y, minY), scaleY), zero), cellMax));
+            const __m128i cellZ = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_sub_ps(z, minZ), scaleZ), zero), cellMax));
+            const __m128i morton = _mm_or_si128(SpreadBits3(cellX),
+                _mm_or_si128(_mm_slli_epi32(SpreadBits3(cellY), 1), _mm_slli_epi32(SpreadBits3(cellZ), 2)));
+
+            const __m128i octant = _mm_or_si128(_mm_srli_epi32(_mm_castps_si128(dx), 31),
+                _mm_or_si128(_mm_slli_epi32(_mm_srli_epi32(_mm_castps_si128(dy), 31), 1), _mm_slli_epi32(_mm_srli_epi32(_mm_castps_si128(dz), 31), 2)));
+
+            const __m128i keys = _mm_or_si128(_mm_slli_epi32(morton, OctantBits), octant);
+            _mm_storeu_si128((__m128i*)(entries + i), _mm_unpacklo_epi32(indices, keys));
+            _mm_storeu_si128((__m128i*)(entries + i + 2), _mm_unpackhi_epi32(indices, keys));
+            indices = _mm_add_epi32(indices, indexStep);
+        }
+
+        for (; i < end; i++)
+        {
+            entries[i] = GetEntry(ComputeKey(rays[i], boundsMin, scale), i);
+        }
+    }
+
+    uint32_t GetDigit(uint64_t entry, uint32_t shift)
+    {
+        return uint32_t(entry >> (32 + shift)) & (RadixBinNum - 1);
+    }
+
+    // Digits of four keys per step go to four tables, so runs of the same digit,
+    // common once the keys are partly sorted, don't wait on each other's increments.
+    // The tables are summed with SSE2.
+    void CountDigits(const uint64_t* entries, uint32_t entryNum, uint32_t shift, uint32_t* histogram)
+    {
+        uint32_t counts[4][RadixBinNum] = { };
+        const __m128i digitMask = _mm_set1_epi32(RadixBinNum - 1);
+        const __m128i shiftCount = _mm_cvtsi32_si128((int)shift);
+
+        uint32_t i = 0;
+        for (; i + 4 <= entryNum; i += 4)
+        {
+            // The keys of four entries
+            const __m128 low = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(entries + i)));
+            const __m128 high = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(entries + i + 2)));
+            const __m128i keys = _mm_castps_si128(_mm_shuffle_ps(low, high, _MM_SHUFFLE(3, 1, 3, 1)));
+
+            uint32_t digits[4];
+            _mm_storeu_si128((__m128i*)digits, _mm_and_si128(_mm_srl_epi32(keys, shiftCount), digitMask));
+            counts[0][digits[0]]++;
+            counts[1][digits[1]]++;
+            counts[2][digits[2]]++;
+            counts[3][digits[3]]++;
+        }
+
+        for (; i < entryNum; i++)
+        {
+            counts[0][GetDigit(entries[i], shift)]++;
+        }
+
+        for (uint32_t bin = 0; bin < RadixBinNum; bin += 4)
+        {
+            const __m128i sum01 = _mm_add_epi32(_mm_loadu_si128((const __m128i*)&counts[0][bin]), _mm_loadu_si128((const __m128i*)&counts[1][bin]));
+            const __m128i sum23 = _mm_add_epi32(_mm_loadu_si128((const __m128i*)&counts[2][bin]), _mm_loadu_si128((const __m128i*)&counts[3][bin]));
+            _mm_storeu_si128((__m128i*)(histogram + bin), _mm_add_epi32(sum01, sum23));
+        }
+    }
+}
+
+void CpuRaySorter::Sort(TaskPool& taskPool, const CpuRay* rays, uint32_t rayNum)
+{
+    _entries.resize(rayNum);
+    _tempEntries.resize(rayNum);
+    _order.resize(rayNum);
+    if (rayNum == 0)
+    {
+        return;
+    }
+
+    const uint32_t blockNum = (rayNum + SortBlockSize - 1) / SortBlockSize;
+    _blockHistograms.resize(blockNum * RadixBinNum);
+    _blockBounds.resize(blockNum * 6);
+
+    // Origin bounds, lane 3 of the loads is TMin and ignored. min and max return
+    // their second operand for NaN, so NaN origins don't spread into the bounds.
+    taskPool.Run(blockNum, [&](uint32_t block, uint32_t)
+    {
+        const float maxFloat = std::numeric_limits<float>::max();
+        __m128 boundsMin = _mm_set1_ps(maxFloat);
+        __m128 boundsMax = _mm_set1_ps(-maxFloat);
+        const uint32_t end = std::min(rayNum, (block + 1) * SortBlockSize);
+        for (uint32_t i = block * SortBlockSize; i < end; i++)
+        {
+            const __m128 origin = _mm_loadu_ps(rays[i].Origin);
+            boundsMin = _mm_min_ps(origin, boundsMin);
+            boundsMax = _mm_max_ps(origin, boundsMax);
+        }
+
+        float lanes[4];
+        _mm_storeu_ps(lanes, boundsMin);
+        std::copy(lanes, lanes + 3, &_blockBounds[block * 6]);
+        _mm_storeu_ps(lanes, boundsMax);
+        std::copy(lanes, lanes + 3, &_blockBounds[block * 6 + 3]);
+    });
+
+    float boundsMin[3];
+    float scale[3];
+    for (uint32_t axis = 0; axis < 3; axis++)
+    {
+        float axisMin = _blockBounds[axis];
+        float axisMax = _blockBounds[3 + axis];
+        for (uint32_t block = 1; block < blockNum; block++)
+        {
+            axisMin = std::min(axisMin, _blockBounds[block * 6 + axis]);
+            axisMax = std::max(axisMax, _blockBounds[block * 6 + 3 + axis]);
+        }
+
+        const float extent = axisMax - axisMin;
+        boundsMin[axis] = axisMin;
+        scale[axis] = extent > 0.0f ? MortonCellMax / extent : 0.0f;
+    }
+
+    taskPool.Run(blockNum, [&](uint32_t block, uint32_t)
+    {
+        const uint32_t begin = block * SortBlockSize;
+        const uint32_t end = std::min(rayNum, begin + SortBlockSize);
+        ComputeEntries(rays, begin, end, boundsMin, scale, _entries.data());
+    });
+
+    for (uint32_t pass = 0; pass < RadixPassNum; pass++)
+    {
+        const uint32_t shift = pass * RadixBits;
+
+        taskPool.Run(blockNum, [&](uint32_t block, uint32_t)
+        {
+            const uint32_t begin = block * SortBlockSize;
+            const uint32_t end = std::min(rayNum, begin + SortBlockSize);
+            CountDigits(&_entries[begin], end - begin, shift, &_blockHistograms[block * RadixBinNum]);
+        });
+
+        // Nothing moves when all keys share the digit
+        bool sorted = false;
+        for (uint32_t bin = 0; bin < RadixBinNum && !sorted; bin++)
+        {
+            uint32_t binTotal = 0;
+            for (uint32_t block = 0; block < blockNum; block++)
+            {
+                binTotal += _blockHistograms[block * RadixBinNum + bin];
+            }
+            sorted = binTotal == rayNum;
+        }
+        if (sorted)
+        {
+            continue;
+        }
+
+        // Counts to the first output position of each block's keys with a digit,
+        // by digit and then by block, which keeps the sort stable
+        uint32_t offset = 0;
+        for (uint32_t bin = 0; bin < RadixBinNum; bin++)
+        {
+            for (uint32_t block = 0; block < blockNum; block++)
+            {
+                uint32_t& count = _blockHistograms[block * RadixBinNum + bin];
+                const uint32_t first = offset;
+                offset += count;
+                count = first;
+            }
+        }
+
+        taskPool.Run(blockNum, [&](uint32_t block, uint32_t)
+        {
+            uint32_t* offsets = &_blockHistograms[block * RadixBinNum];
+            const uint32_t end = std::min(rayNum, (block + 1) * SortBlockSize);
+            for (uint32_t i = block * SortBlockSize; i < end; i++)
+            {
+                const uint64_t entry = _entries[i];
+                _tempEntries[offsets[GetDigit(entry, shift)]++] = entry;
+            }
+        });
+
+        std::swap(_entries, _tempEntries);
+    }
+
+    taskPool.Run(blockNum, [&](uint32_t block, uint32_t)
+    {
+        const uint32_t end = std::min(rayNum, (block + 1) * SortBlockSize);
+        for (uint32_t i = block * SortBlockSize; i < end; i++)
+        {
+            _order[i] = (uint32_t)_entries[i];
+        }
+    });
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "CpuRayTracing.h"
+#include <cstdint>
+#include <vector>
+
+class TaskPool;
+
+// Reordering of incoherent rays, like bounce rays or shadow rays gathered for a
+// whole launch, before they are traced. In pixel order neighbouring rays of such
+// sets go anywhere and every one of them pulls other BVH nodes into the cache.
+// Sorted, rays that are traced after each other start close together and head
+// into the same direction octant, so they mostly visit the nodes the previous
+// ones just loaded. Rays that are coherent already, like shadow rays towards a
+// light in pixel order, gain nothing from it.
+class CpuRaySorter
+{
+private:
+    std::vector<uint64_t> _entries; // sort key and ray index
+    std::vector<uint64_t> _tempEntries;
+    std::vector<uint32_t> _order;
+    std::vector<uint32_t> _blockHistograms; // RadixBinNum counts per block of rays
+    std::vector<float> _blockBounds; // origin bounds per block of rays, min and max xyz
+
+public:
+    // 30 bit keys, a Morton code of the origin within the bounds of all origins,
+    // with 9 bits per axis, and the direction octant in the low bits. Binning by
+    // the octant first would split up rays that start at the same place, which
+    // costs more than it gains. Keys are computed four rays at a time with SSE2
+    // and sorted with an LSD radix sort of 8 bit digits on all threads, passes
+    // where all keys share the digit are skipped. Rays with equal keys keep their
+    // order.
+    void Sort(TaskPool& taskPool, const CpuRay* rays, uint32_t rayNum);
+
+    // Ray indices of the last Sort in tracing order
+    const std::vector<uint32_t>& GetOrder() const { return _order; }
+};
@@ -0,0 +1,1005 @@
+#include "CpuRayTracing.h"
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+    // VkGeometryInstanceFlagBitsNV
+    const uint32_t InstanceTriangleCullDisable = 0x1;
+    const uint32_t InstanceTriangleFrontCounterclockwise = 0x2;
+
+    // Instances per task of the top level build
+    const uint32_t InstanceGrainSize = 4096;
+
+    void TransformPoint(const float* transform, const float* point, float* result)
+    {
+        for (int row = 0; row < 3; row++)
+        {
+            const float* m = transform + row * 4;
+            result[row] = m[0] * point[0] + m[1] * point[1] + m[2] * point[2] + m[3];
+        }
+    }
+
+    void TransformVector(const float* transform, const float* vector, float* result)
+    {
+        for (int row = 0; row < 3; row++)
+        {
+            const float* m = transform + row * 4;
+            result[row] = m[0] * vector[0] + m[1] * vector[1] + m[2] * vector[2];
+        }
+    }
+
+    // World bounds from the corners of the BLAS bounds
+    void ComputeInstanceBox(const float* transform, const BvhNode& root, BvhBox& box)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            box.Min[axis] = std::numeric_limits<float>::max();
+            box.Max[axis] = -std::numeric_limits<float>::max();
+        }
+        for (int corner = 0; corner < 8; corner++)
+        {
+            const float point[3] =
+            {
+                (corner & 1) ? root.BoundsMax[0] : root.BoundsMin[0],
+                (corner & 2) ? root.BoundsMax[1] : root.BoundsMin[1],
+                (corner & 4) ? root.BoundsMax[2] : root.BoundsMin[2],
+            };
+            float world[3];
+            TransformPoint(transform, point, world);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                box.Min[axis] = std::min(box.Min[axis], world[axis]);
+                box.Max[axis] = std::max(box.Max[axis], world[axis]);
+            }
+        }
+    }
+
+    bool InvertTransform(const float* transform, float* inverse)
+    {
+        const float* m = transform;
+        const float c00 = m[5] * m[10] - m[6] * m[9];
+        const float c01 = m[6] * m[8] - m[4] * m[10];
+        const float c02 = m[4] * m[9] - m[5] * m[8];
+        const float determinant = m[0] * c00 + m[1] * c01 + m[2] * c02;
+        if (determinant == 0.0f || !std::isfinite(determinant))
+        {
+            return false;
+        }
+
+        const float s = 1.0f / determinant;
+        inverse[0] = c00 * s;
+        inverse[1] = (m[2] * m[9] - m[1] * m[10]) * s;
+        inverse[2] = (m[1] * m[6] - m[2] * m[5]) * s;
+        inverse[4] = c01 * s;
+        inverse[5] = (m[0] * m[10] - m[2] * m[8]) * s;
+        inverse[6] = (m[2] * m[4] - m[0] * m[6]) * s;
+        inverse[8] = c02 * s;
+        inverse[9] = (m[1] * m[8] - m[0] * m[9]) * s;
+        inverse[10] = (m[0] * m[5] - m[1] * m[4]) * s;
+
+        const float translation[3] = { m[3], m[7], m[11] };
+        for (int row = 0; row < 3; row++)
+        {
+            const float* r = inverse + row * 4;
+            inverse[row * 4 + 3] = -(r[0] * translation[0] + r[1] * translation[1] + r[2] * translation[2]);
+        }
+        return true;
+    }
+
+    // World space ray for the instance box tests
+    struct TraversalRay
+    {
+        float Origin[3];
+        float InverseDirection[3];
+        float TMin;
+        float TMax; // shrinks with every closer hit
+    };
+
+    void SetupTraversalRay(const float* origin, const float* direction, float tmin, float tmax, TraversalRay& ray)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            ray.Origin[axis] = origin[axis];
+            // Zero components give infinities, which the slab test handles
+            ray.InverseDirection[axis] = 1.0f / direction[axis];
+        }
+        ray.TMin = tmin;
+        ray.TMax = tmax;
+    }
+
+    // Entry distance of the ray into the box, or infinity when it misses
+    float IntersectBox(const TraversalRay& ray, const float* boundsMin, const float* boundsMax)
+    {
+        float tnear = ray.TMin;
+        float tfar = ray.TMax;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            float t0 = (boundsMin[axis] - ray.Origin[axis]) * ray.InverseDirection[axis];
+            float t1 = (boundsMax[axis] - ray.Origin[axis]) * ray.InverseDirection[axis];
+            if (t0 > t1)
+            {
+                std::swap(t0, t1);
+            }
+            // NaN from 0 * infinity fails both comparisons and leaves the interval alone
+            tnear = t0 > tnear ? t0 : tnear;
+            tfar = t1 < tfar ? t1 : tfar;
+        }
+        return tnear <= tfar ? tnear : std::numeric_limits<float>::infinity();
+    }
+
+    // Bounds of a packet of rays with a common origin and direction signs: the
+    // distance of every ray to a plane lies between the distances along the
+    // smallest and the largest inverse direction
+    struct PacketFrustum
+    {
+        float Origin[3];
+        float InverseMin[3];
+        float InverseMax[3];
+        float TMin;
+        float TMax;
+    };
+
+    // Returns false when the rays don't share the origin and direction signs or
+    // have zero direction components
+    bool SetupPacketFrustum(const TraversalRay* rays, uint32_t rayNum, PacketFrustum& frustum)
+    {
+        for (int axis = 0; axis < 3; axis++)
+        {
+            frustum.Origin[axis] = rays[0].Origin[axis];
+            frustum.InverseMin[axis] = rays[0].InverseDirection[axis];
+            frustum.InverseMax[axis] = rays[0].InverseDirection[axis];
+        }
+        frustum.TMin = rays[0].TMin;
+        frustum.TMax = rays[0].TMax;
+
+        for (uint32_t i = 0; i < rayNum; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                const float inverseDirection = rays[i].InverseDirection[axis];
+                if (rays[i].Origin[axis] != frustum.Origin[axis] || !std::isfinite(inverseDirection) ||
+                    (inverseDirection < 0.0f) != (frustum.InverseMin[axis] < 0.0f))
+                {
+                    return false;
+                }
+                frustum.InverseMin[axis] = std::min(frustum.InverseMin[axis], inverseDirection);
+                frustum.InverseMax[axis] = std::max(frustum.InverseMax[axis], inverseDirection);
+            }
+            frustum.TMin = std::min(frustum.TMin, rays[i].TMin);
+            frustum.TMax = std::max(frustum.TMax, rays[i].TMax);
+        }
+        return true;
+    }
+
+    // Lower bound of the entry distances of the rays of the packet into the box,
+    // infinity when none of them can hit it
+    float IntersectPacketBox(const PacketFrustum& frustum, const float* boundsMin, const float* boundsMax)
+    {
+        float tnear = frustum.TMin;
+        float tfar = frustum.TMax;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const bool positive = frustum.InverseMin[axis] >= 0.0f;
+            const float nearDistance = (positive ? boundsMin[axis] : boundsMax[axis]) - frustum.Origin[axis];
+            const float farDistance = (positive ? boundsMax[axis] : boundsMin[axis]) - frustum.Origin[axis];
+            tnear = std::max(tnear, std::min(nearDistance * frustum.InverseMin[axis], nearDistance * frustum.InverseMax[axis]));
+            tfar = std::min(tfar, std::max(farDistance * frustum.InverseMin[axis], farDistance * frustum.InverseMax[axis]));
+        }
+        return tnear <= tfar ? tnear : std::numeric_limits<float>::infinity();
+    }
+
+    // Entry distance of the nearest ray of the packet into the box, or infinity
+    // when all of them miss. Coherent packets take the conservative one of their
+    // frustum instead of testing every ray.
+    float IntersectPacketNode(bool coherent, const PacketFrustum& frustum, const TraversalRay* rays, uint32_t rayNum,
+        const BvhNode& node)
+    {
+        if (coherent)
+        {
+            return IntersectPacketBox(frustum, node.BoundsMin, node.BoundsMax);
+        }
+
+        float distance = std::numeric_limits<float>::infinity();
+        for (uint32_t i = 0; i < rayNum; i++)
+        {
+            distance = std::min(distance, IntersectBox(rays[i], node.BoundsMin, node.BoundsMax));
+        }
+        return distance;
+    }
+
+    // The top level is traversed near child first, the far one waits on the
+    // stack, so there is at most one entry per level
+    struct TopLevelStackEntry
+    {
+        uint32_t NodeIndex;
+        float Distance; // entry distance of the ray or packet
+    };
+
+    const uint32_t TopLevelStackSize = BvhMaxDepth + 1;
+
+    // Front faces are clockwise unless the instance says otherwise
+    uint32_t GetWindingCullFlags(const VkGeometryInstance& instance, uint32_t rayFlags)
+    {
+        const bool frontCounterclockwise = (instance.flags & InstanceTriangleFrontCounterclockwise) != 0;
+        uint32_t windingCullFlags = BVH8_CULL_NONE;
+        if ((instance.flags & InstanceTriangleCullDisable) == 0)
+        {
+            if ((rayFlags & CPU_RAY_FLAG_CULL_FRONT_FACING_TRIANGLES) != 0)
+            {
+                windingCullFlags |= frontCounterclockwise ? BVH8_CULL_COUNTERCLOCKWISE : BVH8_CULL_CLOCKWISE;
+            }
+            if ((rayFlags & CPU_RAY_FLAG_CULL_BACK_FACING_TRIANGLES) != 0)
+            {
+                windingCullFlags |= frontCounterclockwise ? BVH8_CULL_CLOCKWISE : BVH8_CULL_COUNTERCLOCKWISE;
+            }
+        }
+        return windingCullFlags;
+    }
+
+    void SetHit(const VkGeometryInstance& instance, uint32_t instanceIndex, const Bvh8& bottomLevel, const Bvh8Hit& wideHit, float t,
+        CpuHit& hit)
+    {
+        const BvhTriangle& triangle = bottomLevel.Triangles[wideHit.TriangleIndex];
+        const bool frontCounterclockwise = (instance.flags & InstanceTriangleFrontCounterclockwise) != 0;
+        hit.T = t;
+        hit.Barycentrics[0] = wideHit.Barycentrics[0];
+        hit.Barycentrics[1] = wideHit.Barycentrics[1];
+        hit.InstanceIndex = instanceIndex;
+        hit.InstanceCustomIndex = instance.instanceId;
+        hit.GeometryIndex = triangle.GeometryIndex;
+        hit.PrimitiveIndex = triangle.PrimitiveIndex;
+        hit.HitKind = wideHit.Counterclockwise == frontCounterclockwise ? CpuHitKindFrontFacing : CpuHitKindBackFacing;
+        hit.ObjectToWorld = instance.transform;
+    }
+}
+
+bool CpuAccelerationStructure::SetBottomLevels(TaskPool& taskPool, const std::vector<const Bvh*>& bottomLevels, std::wstring& error)
+{
+    _bottomLevelSources = bottomLevels;
+    _bottomLevels.clear();
+    _bottomLevels.resize(bottomLevels.size());
+    _instances.clear();
+    _instancePositions.clear();
+    _nodes.clear();
+    _nodeMasks.clear();
+
+    std::vector<std::wstring> errors(bottomLevels.size());
+    taskPool.Run((uint32_t)bottomLevels.size(), [&](uint32_t index, uint32_t)
+    {
+        if (bottomLevels[index] != nullptr && !bottomLevels[index]->IsEmpty())
+        {
+            CollapseBvh8(*bottomLevels[index], _bottomLevels[index], errors[index]);
+        }
+    });
+
+    for (uint32_t i = 0; i < (uint32_t)errors.size(); i++)
+    {
+        if (!errors[i].empty())
+        {
+            error = L"BLAS " + std::to_wstring(i) + L": " + errors[i];
+            _bottomLevels.clear();
+            _bottomLevelSources.clear();
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool CpuAccelerationStructure::Build(TaskPool& taskPool, const VkGeometryInstance* instances, uint32_t instanceNum,
+    std::wstring& error)
+{
+    _instances.clear();
+    _instancePositions.clear();
+    _nodes.clear();
+    _nodeMasks.clear();
+
+    // Instances of empty bottom levels can't be hit and stay out of the tree
+    std::vector<uint32_t> treeInstances;
+    treeInstances.reserve(instanceNum);
+    for (uint32_t i = 0; i < instanceNum; i++)
+    {
+        const uint64_t handle = instances[i].accelerationStructureHandle;
+        if (handle >= _bottomLevelSources.size() || _bottomLevelSources[handle] == nullptr)
+        {
+            error = L"Instance " + std::to_wstring(i) + L" references the missing BLAS " + std::to_wstring(handle);
+            return false;
+        }
+        if (!_bottomLevels[handle].IsEmpty())
+        {
+            treeInstances.push_back(i);
+        }
+    }
+
+    const uint32_t treeInstanceNum = (uint32_t)treeInstances.size();
+    std::vector<Instance> unordered(treeInstanceNum);
+    std::vector<BvhBox> boxes(treeInstanceNum);
+    std::vector<uint8_t> invertible(treeInstanceNum);
+    taskPool.ParallelFor(treeInstanceNum, InstanceGrainSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            Instance& instance = unordered[i];
+            instance.Index = treeInstances[i];
+            instance.Source = instances[instance.Index];
+            instance.BottomLevel = &_bottomLevels[instance.Source.accelerationStructureHandle];
+            invertible[i] = InvertTransform(instance.Source.transform, instance.WorldToObject);
+
+            ComputeInstanceBox(instance.Source.transform, _bottomLevelSources[instance.Source.accelerationStructureHandle]->Nodes[0], boxes[i]);
+        }
+    });
+
+    for (uint32_t i = 0; i < treeInstanceNum; i++)
+    {
+        if (!invertible[i])
+        {
+            error = L"Instance " + std::to_wstring(unordered[i].Index) + L" has a transform that can't be inverted";
+            return false;
+        }
+    }
+
+    // One instance per leaf, the leaf box is the instance box
+    BvhBuildSettings settings;
+    settings.MaxLeafSize = 1;
+    std::vector<uint32_t> order;
+    if (_topLevelBuild == CpuTopLevelBuild::Morton)
+    {
+        BuildBoxBvhMorton(taskPool, boxes, settings, _nodes, order);
+    }
+    else
+    {
+        BuildBoxBvh(taskPool, boxes, settings, _nodes, order);
+    }
+
+    _instances.resize(instanceNum);
+    taskPool.ParallelFor(treeInstanceNum, InstanceGrainSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            _instances[i] = unordered[order[i]];
+        }
+    });
+    std::vector<Instance>().swap(unordered);
+
+    uint32_t position = treeInstanceNum;
+    for (uint32_t i = 0; i < instanceNum; i++)
+    {
+        const uint64_t handle = instances[i].accelerationStructureHandle;
+        if (_bottomLevels[handle].IsEmpty())
+        {
+            Instance& instance = _instances[position++];
+            instance = Instance();
+            instance.Source = instances[i];
+            instance.BottomLevel = nullptr;
+            instance.Index = i;
+        }
+    }
+
+    _instancePositions.resize(instanceNum);
+    taskPool.ParallelFor(instanceNum, InstanceGrainSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            _instancePositions[_instances[i].Index] = i;
+        }
+    });
+
+    // Children come after their parents, so one backwards pass combines the masks
+    _nodeMasks.resize(_nodes.size());
+    for (uint32_t i = (uint32_t)_nodes.size(); i-- > 0;)
+    {
+        const BvhNode& node = _nodes[i];
+        uint8_t mask = 0;
+        if (node.IsLeaf())
+        {
+            for (uint32_t instance = node.FirstChildOrTriangle; instance < node.FirstChildOrTriangle + node.TriangleNum; instance++)
+            {
+                mask |= (uint8_t)_instances[instance].Source.mask;
+            }
+        }
+        else
+        {
+            mask = _nodeMasks[node.FirstChildOrTriangle] | _nodeMasks[node.FirstChildOrTriangle + 1];
+        }
+        _nodeMasks[i] = mask;
+    }
+
+    return true;
+}
+
+bool CpuAccelerationStructure::UpdateBottomLevel(TaskPool& taskPool, uint32_t index, const Bvh& bottomLevel, bool rebuilt,
+    std::wstring& error)
+{
+    if (index >= _bottomLevels.size() || _bottomLevelSources[index] == nullptr)
+    {
+        error = L"BLAS " + std::to_wstring(index) + L" was not set";
+        return false;
+    }
+
+    // Instances of empty bottom levels are left out of the top level, it has to be built again
+    if (bottomLevel.IsEmpty() != _bottomLevels[index].IsEmpty())
+    {
+        error = L"BLAS " + std::to_wstring(index) + L" became " + (bottomLevel.IsEmpty() ? L"empty" : L"non-empty") + L", the top level has to be built again";
+        return false;
+    }
+
+    _bottomLevelSources[index] = &bottomLevel;
+    const bool updated = rebuilt ? CollapseBvh8(bottomLevel, _bottomLevels[index], error) : RefitBvh8(bottomLevel, _bottomLevels[index], error);
+    if (!updated)
+    {
+        error = L"BLAS " + std::to_wstring(index) + L": " + error;
+        return false;
+    }
+
+    RefitTopLevel(taskPool);
+    return true;
+}
+
+void CpuAccelerationStructure::RefitTopLevel(TaskPool& taskPool)
+{
+    // Leaves first, they index ranges of _instances
+    taskPool.ParallelFor((uint32_t)_nodes.size(), InstanceGrainSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        for (uint32_t i = begin; i < end; i++)
+        {
+            BvhNode& node = _nodes[i];
+            if (!node.IsLeaf())
+            {
+                continue;
+            }
+
+            for (int axis = 0; axis < 3; axis++)
+            {
+                node.BoundsMin[axis] = std::numeric_limits<float>::max();
+                node.BoundsMax[axis] = -std::numeric_limits<float>::max();
+            }
+            for (uint32_t position = node.FirstChildOrTriangle; position < node.FirstChildOrTriangle + node.TriangleNum; position++)
+            {
+                const Instance& instance = _instances[position];
+                BvhBox box;
+                ComputeInstanceBox(instance.Source.transform, _bottomLevelSources[instance.Source.accelerationStructureHandle]->Nodes[0], box);
+                for (int axis = 0; axis < 3; axis++)
+                {
+                    node.BoundsMin[axis] = std::min(node.BoundsMin[axis], box.Min[axis]);
+                    node.BoundsMax[axis] = std::max(node.BoundsMax[axis], box.Max[axis]);
+                }
+            }
+        }
+    });
+
+    // Children come after their parents, so one backwards pass merges the inner nodes
+    for (uint32_t i = (uint32_t)_nodes.size(); i-- > 0;)
+    {
+        BvhNode& node = _nodes[i];
+        if (node.IsLeaf())
+        {
+            continue;
+        }
+
+        const BvhNode& left = _nodes[node.FirstChildOrTriangle];
+        const BvhNode& right = _nodes[node.FirstChildOrTriangle + 1];
+        for (int axis = 0; axis < 3; axis++)
+        {
+            node.BoundsMin[axis] = std::min(left.BoundsMin[axis], right.BoundsMin[axis]);
+            node.BoundsMax[axis] = std::max(left.BoundsMax[axis], right.BoundsMax[axis]);
+        }
+    }
+}
+
+bool CpuAccelerationStructure::Build(TaskPool& taskPool, const std::vector<const Bvh*>& bottomLevels,
+    const VkGeometryInstance* instances, uint32_t instanceNum, std::wstring& error)
+{
+    return SetBottomLevels(taskPool, bottomLevels, error) && Build(taskPool, instances, instanceNum, error);
+}
+
+size_t CpuAccelerationStructure::GetTopLevelMemorySize() const
+{
+    return _instances.capacity() * sizeof(Instance) + _instancePositions.capacity() * sizeof(uint32_t) +
+        _nodes.capacity() * sizeof(BvhNode) + _nodeMasks.capacity() * sizeof(uint8_t);
+}
+
+void CpuAccelerationStructure::SetTraversalKernel(Bvh8Kernel kernel)
+{
+    _kernel = kernel;
+    _traverse = GetBvh8TraverseFunction(kernel);
+    _occluded = GetBvh8OccludedFunction(kernel);
+}
+
+bool CpuAccelerationStructure::Trace(const CpuRay& ray, uint32_t rayFlags, uint32_t cullMask, CpuHit& hit) const
+{
+    const float infinity = std::numeric_limits<float>::infinity();
+    const bool anyHit = (rayFlags & CPU_RAY_FLAG_TERMINATE_ON_FIRST_HIT) != 0;
+
+    TraversalRay worldRay;
+    SetupTraversalRay(ray.Origin, ray.Direction, ray.TMin, ray.TMax, worldRay);
+
+    if (_nodes.empty() || (_nodeMasks[0] & cullMask) == 0 || IntersectBox(worldRay, _nodes[0].BoundsMin, _nodes[0].BoundsMax) == infinity)
+    {
+        return false;
+    }
+
+    TopLevelStackEntry stack[TopLevelStackSize];
+    uint32_t stackSize = 0;
+    uint32_t nodeIndex = 0;
+    bool found = false;
+
+    for (;;)
+    {
+        const BvhNode& node = _nodes[nodeIndex];
+        if (node.IsLeaf())
+        {
+            for (uint32_t i = node.FirstChildOrTriangle; i < node.FirstChildOrTriangle + node.TriangleNum; i++)
+            {
+                const Instance& instance = _instances[i];
+                if ((instance.Source.mask & cullMask) == 0)
+                {
+                    continue;
+                }
+
+                // The object space direction isn't normalized, so t is the same in both spaces
+                Bvh8Ray objectRay;
+                TransformPoint(instance.WorldToObject, ray.Origin, objectRay.Origin);
+                TransformVector(instance.WorldToObject, ray.Direction, objectRay.Direction);
+                objectRay.TMin = ray.TMin;
+                objectRay.TMax = worldRay.TMax;
+
+                Bvh8Hit wideHit;
+                if (_traverse(*instance.BottomLevel, objectRay, GetWindingCullFlags(instance.Source, rayFlags), anyHit, wideHit))
+                {
+                    worldRay.TMax = objectRay.TMax;
+                    SetHit(instance.Source, instance.Index, *instance.BottomLevel, wideHit, objectRay.TMax, hit);
+                    found = true;
+                    if (anyHit)
+                    {
+                        return true;
+                    }
+                }
+            }
+        }
+        else
+        {
+            uint32_t nearIndex = node.FirstChildOrTriangle;
+            uint32_t farIndex = nearIndex + 1;
+            float nearDistance = (_nodeMasks[nearIndex] & cullMask) != 0 ?
+                IntersectBox(worldRay, _nodes[nearIndex].BoundsMin, _nodes[nearIndex].BoundsMax) : infinity;
+            float farDistance = (_nodeMasks[farIndex] & cullMask) != 0 ?
+                IntersectBox(worldRay, _nodes[farIndex].BoundsMin, _nodes[farIndex].BoundsMax) : infinity;
+            if (farDistance < nearDistance)
+            {
+                std::swap(nearIndex, farIndex);
+                std::swap(nearDistance, farDistance);
+            }
+
+            if (nearDistance != infinity)
+            {
+                if (farDistance != infinity)
+                {
+                    stack[stackSize].NodeIndex = farIndex;
+                    stack[stackSize].Distance = farDistance;
+                    stackSize++;
+                }
+                nodeIndex = nearIndex;
+                continue;
+            }
+        }
+
+        // Nodes that start behind the closest hit are skipped
+        for (;;)
+        {
+            if (stackSize == 0)
+            {
+                return found;
+            }
+            const TopLevelStackEntry& entry = stack[--stackSize];
+            if (entry.Distance <= worldRay.TMax)
+            {
+                nodeIndex = entry.NodeIndex;
+                break;
+            }
+        }
+    }
+}
+
+bool CpuAccelerationStructure::Occluded(const CpuRay& ray, uint32_t rayFlags, uint32_t cullMask) const
+{
+    const float infinity = std::numeric_limits<float>::infinity();
+
+    TraversalRay worldRay;
+    SetupTraversalRay(ray.Origin, ray.Direction, ray.TMin, ray.TMax, worldRay);
+
+    if (_nodes.empty() || (_nodeMasks[0] & cullMask) == 0 || IntersectBox(worldRay, _nodes[0].BoundsMin, _nodes[0].BoundsMax) == infinity)
+    {
+        return false;
+    }
+
+    uint32_t stack[TopLevelStackSize];
+    uint32_t stackSize = 0;
+    uint32_t nodeIndex = 0;
+
+    for (;;)
+    {
+        const BvhNode& node = _nodes[nodeIndex];
+        if (node.IsLeaf())
+        {
+            for (uint32_t i = node.FirstChildOrTriangle; i < node.FirstChildOrTriangle + node.TriangleNum; i++)
+            {
+                const Instance& instance = _instances[i];
+                if ((instance.Source.mask & cullMask) == 0)
+                {
+                    continue;
+                }
+
+                Bvh8Ray objectRay;
+                TransformPoint(instance.WorldToObject, ray.Origin, objectRay.Origin);
+                TransformVector(instance.WorldToObject, ray.Direction, objectRay.Direction);
+                objectRay.TMin = ray.TMin;
+                objectRay.TMax = ray.TMax;
+                if (_occluded(*instance.BottomLevel, objectRay, GetWindingCullFlags(instance.Source, rayFlags)))
+                {
+                    return true;
+                }
+            }
+        }
+        else
+        {
+            const uint32_t left = node.FirstChildOrTriangle;
+            const uint32_t right = left + 1;
+            const bool leftHit = (_nodeMasks[left] & cullMask) != 0 &&
+                IntersectBox(worldRay, _nodes[left].BoundsMin, _nodes[left].BoundsMax) != infinity;
+            const bool rightHit = (_nodeMasks[right] & cullMask) != 0 &&
+                IntersectBox(worldRay, _nodes[right].BoundsMin, _nodes[right].BoundsMax) != infinity;
+
+            if (leftHit || rightHit)
+            {
+                if (leftHit && rightHit)
+                {
+                    stack[stackSize++] = right;
+                }
+                nodeIndex = leftHit ? left : right;
+                continue;
+            }
+        }
+
+        if (stackSize == 0)
+        {
+            return false;
+        }
+        nodeIndex = stack[--stackSize];
+    }
+}
+
+uint64_t CpuAccelerationStructure::TracePacket(const CpuRay* rays, uint32_t rayNum, uint32_t rayFlags, uint32_t cullMask,
+    CpuHit* hits) const
+{
+    const float infinity = std::numeric_limits<float>::infinity();
+    rayNum = std::min(rayNum, Bvh8PacketMaxRayNum);
+    uint64_t found = 0;
+
+    // Any hit rays stop at different instances, they gain nothing from packets
+    if ((rayFlags & CPU_RAY_FLAG_TERMINATE_ON_FIRST_HIT) != 0)
+    {
+        for (uint32_t i = 0; i < rayNum; i++)
+        {
+            found |= Trace(rays[i], rayFlags, cullMask, hits[i]) ? 1ull << i : 0;
+        }
+        return found;
+    }
+
+    if (rayNum == 0 || _nodes.empty() || (_nodeMasks[0] & cullMask) == 0)
+    {
+        return 0;
+    }
+
+    TraversalRay worldRays[Bvh8PacketMaxRayNum];
+    for (uint32_t i = 0; i < rayNum; i++)
+    {
+        SetupTraversalRay(rays[i].Origin, rays[i].Direction, rays[i].TMin, rays[i].TMax, worldRays[i]);
+    }
+
+    // Nodes the whole packet misses are skipped with a single test, packets
+    // without a frustum test their rays until one hits
+    PacketFrustum frustum;
+    const bool coherent = SetupPacketFrustum(worldRays, rayNum, frustum);
+    frustum.TMin = worldRays[0].TMin;
+    frustum.TMax = worldRays[0].TMax;
+    for (uint32_t i = 1; i < rayNum; i++)
+    {
+        frustum.TMin = std::min(frustum.TMin, worldRays[i].TMin);
+        frustum.TMax = std::max(frustum.TMax, worldRays[i].TMax);
+    }
+
+    if (IntersectPacketNode(coherent, frustum, worldRays, rayNum, _nodes[0]) == infinity)
+    {
+        return 0;
+    }
+
+    TopLevelStackEntry stack[TopLevelStackSize];
+    uint32_t stackSize = 0;
+    uint32_t nodeIndex = 0;
+
+    for (;;)
+    {
+        const BvhNode& node = _nodes[nodeIndex];
+        if (node.IsLeaf())
+        {
+            for (uint32_t i = node.FirstChildOrTriangle; i < node.FirstChildOrTriangle + node.TriangleNum; i++)
+            {
+                const Instance& instance = _instances[i];
+                if ((instance.Source.mask & cullMask) == 0)
+                {
+                    continue;
+                }
+
+                // The packet is made of the rays that hit the instance box, which
+                // is the box of its leaf
+                Bvh8Ray objectRays[Bvh8PacketMaxRayNum];
+                uint32_t rayIndices[Bvh8PacketMaxRayNum];
+                uint32_t packetRayNum = 0;
+                for (uint32_t rayIndex = 0; rayIndex < rayNum; rayIndex++)
+                {
+                    if (IntersectBox(worldRays[rayIndex], node.BoundsMin, node.BoundsMax) == infinity)
+                    {
+                        continue;
+                    }
+
+                    Bvh8Ray& objectRay = objectRays[packetRayNum];
+                    TransformPoint(instance.WorldToObject, rays[rayIndex].Origin, objectRay.Origin);
+                    TransformVector(instance.WorldToObject, rays[rayIndex].Direction, objectRay.Direction);
+                    objectRay.TMin = rays[rayIndex].TMin;
+                    objectRay.TMax = worldRays[rayIndex].TMax;
+                    rayIndices[packetRayNum++] = rayIndex;
+                }
+                if (packetRayNum == 0)
+                {
+                    continue;
+                }
+
+                Bvh8Hit wideHits[Bvh8PacketMaxRayNum];
+                const uint64_t packetHits = TraverseBvh8Packet(*instance.BottomLevel, objectRays, packetRayNum,
+                    GetWindingCullFlags(instance.Source, rayFlags), _traverse, wideHits);
+                if (packetHits == 0)
+                {
+                    continue;
+                }
+
+                for (uint32_t packetIndex = 0; packetIndex < packetRayNum; packetIndex++)
+                {
+                    if ((packetHits & (1ull << packetIndex)) == 0)
+                    {
+                        continue;
+                    }
+
+                    const uint32_t rayIndex = rayIndices[packetIndex];
+                    worldRays[rayIndex].TMax = objectRays[packetIndex].TMax;
+                    SetHit(instance.Source, instance.Index, *instance.BottomLevel, wideHits[packetIndex], objectRays[packetIndex].TMax,
+                        hits[rayIndex]);
+                    found |= 1ull << rayIndex;
+                }
+
+                // The packet ends at the farthest closest hit
+                frustum.TMax = worldRays[0].TMax;
+                for (uint32_t rayIndex = 1; rayIndex < rayNum; rayIndex++)
+                {
+                    frustum.TMax = std::max(frustum.TMax, worldRays[rayIndex].TMax);
+                }
+            }
+        }
+        else
+        {
+            uint32_t nearIndex = node.FirstChildOrTriangle;
+            uint32_t farIndex = nearIndex + 1;
+            float nearDistance = (_nodeMasks[nearIndex] & cullMask) != 0 ?
+                IntersectPacketNode(coherent, frustum, worldRays, rayNum, _nodes[nearIndex]) : infinity;
+            float farDistance = (_nodeMasks[farIndex] & cullMask) != 0 ?
+                IntersectPacketNode(coherent, frustum, worldRays, rayNum, _nodes[farIndex]) : infinity;
+            if (farDistance < nearDistance)
+            {
+                std::swap(nearIndex, farIndex);
+                std::swap(nearDistance, farDistance);
+            }
+
+            if (nearDistance != infinity)
+            {
+                if (farDistance != infinity)
+                {
+                    stack[stackSize].NodeIndex = farIndex;
+                    stack[stackSize].Distance = farDistance;
+                    stackSize++;
+                }
+                nodeIndex = nearIndex;
+                continue;
+            }
+        }
+
+        for (;;)
+        {
+            if (stackSize == 0)
+            {
+                return found;
+            }
+            const TopLevelStackEntry& entry = stack[--stackSize];
+            if (entry.Distance <= frustum.TMax)
+            {
+                nodeIndex = entry.NodeIndex;
+                break;
+            }
+        }
+    }
+}
+
+void CpuShaderContext::TraceRay(uint32_t rayFlags, uint32_t cullMask, uint32_t sbtRecordOffset, uint32_t sbtRecordStride,
+    uint32_t missIndex, const CpuRay& ray, void* payload)
+{
+    RayNum++;
+
+    // Without closest hit shader only hit or miss matters. The primary ray of the
+    // pixel was traced with the packet of its block.
+    const bool occlusion = (rayFlags & CPU_RAY_FLAG_SKIP_CLOSEST_HIT_SHADER) != 0;
+    bool found;
+    CpuHit hit;
+    const uint32_t packetX = LaunchId[0] - _packetBegin[0];
+    const uint32_t packetY = LaunchId[1] - _packetBegin[1];
+    const uint32_t packetIndex = packetY * _packetSize[0] + packetX;
+    if (occlusion)
+    {
+        OcclusionRayNum++;
+        found = _topLevel->Occluded(ray, rayFlags, cullMask);
+    }
+    else if (_packetRays != nullptr && packetX < _packetSize[0] && packetY < _packetSize[1] && rayFlags == _pipeline->_primaryRayFlags &&
+        cullMask == _pipeline->_primaryCullMask && memcmp(&ray, &_packetRays[packetIndex], sizeof(CpuRay)) == 0)
+    {
+        found = (_packetHitMask & (1ull << packetIndex)) != 0;
+        hit = _packetHits[packetIndex];
+    }
+    else
+    {
+        found = _topLevel->Trace(ray, rayFlags, cullMask, hit);
+    }
+
+    if (!found)
+    {
+        if (missIndex < _pipeline->_missShaders.size() && _pipeline->_missShaders[missIndex])
+        {
+            _pipeline->_missShaders[missIndex](*this, ray, payload);
+        }
+        return;
+    }
+
+    if (occlusion)
+    {
+        return;
+    }
+
+    const VkGeometryInstance& instance = _topLevel->GetInstance(hit.InstanceIndex);
+    const uint32_t hitGroup = instance.instanceOffset + sbtRecordOffset + hit.GeometryIndex * sbtRecordStride;
+    if (hitGroup < _pipeline->_hitGroups.size() && _pipeline->_hitGroups[hitGroup])
+    {
+        _pipeline->_hitGroups[hitGroup](*this, ray, hit, payload);
+    }
+}
+
+uint32_t CpuRayTracingPipeline::AddMissShader(const MissShader& shader)
+{
+    _missShaders.push_back(shader);
+    return (uint32_t)_missShaders.size() - 1;
+}
+
+uint32_t CpuRayTracingPipeline::AddHitGroup(const ClosestHitShader& shader)
+{
+    _hitGroups.push_back(shader);
+    return (uint32_t)_hitGroups.size() - 1;
+}
+
+void CpuRayTracingPipeline::SetPrimaryRays(const PrimaryRayFunction& function, uint32_t rayFlags, uint32_t cullMask)
+{
+    _primaryRays = function;
+    _primaryRayFlags = rayFlags;
+    _primaryCullMask = cullMask;
+}
+
+void CpuRayTracingPipeline::Launch(TaskPool& taskPool, const CpuAccelerationStructure& topLevel, uint32_t width, uint32_t height,
+    CpuLaunchStats* stats) const
+{
+    LaunchTiles(taskPool, topLevel, width, height, nullptr, GetTileNum(width) * GetTileNum(height), stats);
+}
+
+void CpuRayTracingPipeline::LaunchTiles(TaskPool& taskPool, const CpuAccelerationStructure& topLevel, uint32_t width, uint32_t height,
+    const uint32_t* tiles, uint32_t tileNum, CpuLaunchStats* stats) const
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    // Without a list every tile is launched in order
+    const uint32_t tileNumX = GetTileNum(width);
+    std::vector<uint64_t> threadRayNums(taskPool.GetThreadNum(), 0);
+    std::vector<uint64_t> threadOcclusionRayNums(taskPool.GetThreadNum(), 0);
+
+    taskPool.Run(tileNum, [&](uint32_t task, uint32_t threadIndex)
+    {
+        const uint32_t tileIndex = tiles != nullptr ? tiles[task] : task;
+
+        CpuShaderContext context;
+        context._pipeline = this;
+        context._topLevel = &topLevel;
+        context.LaunchSize[0] = width;
+        context.LaunchSize[1] = height;
+        context.ThreadIndex = threadIndex;
+
+        const uint32_t beginX = (tileIndex % tileNumX) * TileSize;
+        const uint32_t beginY = (tileIndex / tileNumX) * TileSize;
+        const uint32_t endX = std::min(beginX + TileSize, width);
+        const uint32_t endY = std::min(beginY + TileSize, height);
+
+        if (!_primaryRays)
+        {
+            for (uint32_t y = beginY; y < endY; y++)
+            {
+                for (uint32_t x = beginX; x < endX; x++)
+                {
+                    context.LaunchId[0] = x;
+                    context.LaunchId[1] = y;
+                    _rayGenShader(context);
+                }
+            }
+        }
+        else
+        {
+            CpuRay packetRays[PacketSize * PacketSize];
+            CpuHit packetHits[PacketSize * PacketSize];
+            context._packetRays = packetRays;
+            context._packetHits = packetHits;
+
+            for (uint32_t blockY = beginY; blockY < endY; blockY += PacketSize)
+            {
+                for (uint32_t blockX = beginX; blockX < endX; blockX += PacketSize)
+                {
+                    context._packetBegin[0] = blockX;
+                    context._packetBegin[1] = blockY;
+                    context._packetSize[0] = std::min(blockX + PacketSize, endX) - blockX;
+                    context._packetSize[1] = std::min(blockY + PacketSize, endY) - blockY;
+
+                    uint32_t rayNum = 0;
+                    for (uint32_t y = blockY; y < blockY + context._packetSize[1]; y++)
+                    {
+                        for (uint32_t x = blockX; x < blockX + context._packetSize[0]; x++)
+                        {
+                            _primaryRays(x, y, width, height, packetRays[rayNum++]);
+                        }
+                    }
+                    context._packetHitMask = topLevel.TracePacket(packetRays, rayNum, _primaryRayFlags, _primaryCullMask, packetHits);
+
+                    for (uint32_t y = blockY; y < blockY + context._packetSize[1]; y++)
+                    {
+                        for (uint32_t x = blockX; x < blockX + context._packetSize[0]; x++)
+                        {
+                            context.LaunchId[0] = x;
+                            context.LaunchId[1] = y;
+                            _rayGenShader(context);
+                        }
+                    }
+                }
+            }
+        }
+
+        threadRayNums[threadIndex] += context.RayNum;
+        threadOcclusionRayNums[threadIndex] += context.OcclusionRayNum;
+    });
+
+    if (stats != nullptr)
+    {
+        stats->Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        stats->ThreadNum = taskPool.GetThreadNum();
+        stats->RayNum = 0;
+        stats->OcclusionRayNum = 0;
+        for (uint32_t thread = 0; thread < (uint32_t)threadRayNums.size(); thread++)
+        {
+            stats->RayNum += threadRayNums[thread];
+            stats->OcclusionRayNum += threadOcclusionRayNums[thread];
+        }
+    }
+}
@@ -0,0 +1,247 @@
+#pragma once
+
+#include "Bvh.h"
+#include "Bvh8.h"
+#include "GeometryInstance.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+class TaskPool;
+
+// CPU backend of the VK_NV_ray_tracing model the samples use: a top level
+// structure over VkGeometryInstance records that reference bottom level BVHs,
+// and a pipeline of raygen, miss and closest hit functions with an SBT like
+// hit group selection. Samples port their shaders to C++ functions and get the
+// same images on machines without a ray tracing capable GPU.
+
+// Values of the gl_RayFlags*NV constants
+enum CpuRayFlags : uint32_t
+{
+    CPU_RAY_FLAG_NONE = 0,
+    CPU_RAY_FLAG_OPAQUE = 1,
+    CPU_RAY_FLAG_TERMINATE_ON_FIRST_HIT = 4,
+    CPU_RAY_FLAG_SKIP_CLOSEST_HIT_SHADER = 8,
+    CPU_RAY_FLAG_CULL_BACK_FACING_TRIANGLES = 16,
+    CPU_RAY_FLAG_CULL_FRONT_FACING_TRIANGLES = 32,
+};
+
+// gl_HitKindFrontFacingTriangleNV and gl_HitKindBackFacingTriangleNV
+const uint32_t CpuHitKindFrontFacing = 0xFE;
+const uint32_t CpuHitKindBackFacing = 0xFF;
+
+struct CpuRay
+{
+    float Origin[3];
+    float TMin;
+    float Direction[3];
+    float TMax;
+};
+
+// What a closest hit shader sees through its built-in variables
+struct CpuHit
+{
+    float T = 0.0f; // gl_HitTNV
+    float Barycentrics[2] = { }; // hitAttributeNV vec2, weights of the second and third vertex
+    uint32_t InstanceIndex = 0; // gl_InstanceID
+    uint32_t InstanceCustomIndex = 0; // gl_InstanceCustomIndexNV, VkGeometryInstance::instanceId
+    uint32_t GeometryIndex = 0; // index of the VkGeometryNV in the BLAS build
+    uint32_t PrimitiveIndex = 0; // gl_PrimitiveID
+    uint32_t HitKind = 0; // gl_HitKindNV
+    const float* ObjectToWorld = nullptr; // gl_ObjectToWorldNV, row-major 3x4
+};
+
+// How CpuAccelerationStructure::Build makes the top level
+enum class CpuTopLevelBuild
+{
+    Sah, // binned SAH like the bottom levels, about 0.75 M instances/s on one thread, the best tree
+    Morton, // linear BVH, see BuildBoxBvhMorton, about 3 times faster but traced about 40% slower
+};
+
+// Top level acceleration structure. accelerationStructureHandle of an instance
+// is the index of its BLAS in the bottom level array, which has to stay alive.
+// The bottom levels are collapsed to wide BVHs and traversed with the best SIMD
+// kernel the CPU supports. Like on the GPU the two levels are built separately:
+// the instances get a binary BVH over their world bounds of their own, which can
+// be rebuilt when they move while the bottom levels stay as they are. The SAH
+// build takes over a second for a million instances, scenes that move that many
+// every frame should use CpuTopLevelBuild::Morton.
+class CpuAccelerationStructure
+{
+private:
+    // 128 bytes, the top level costs little more than that per instance
+    struct Instance
+    {
+        VkGeometryInstance Source;
+        float WorldToObject[12];
+        const Bvh8* BottomLevel; // null for an empty BLAS, such instances are in no leaf
+        uint32_t Index; // into the instances of the build, gl_InstanceID
+    };
+
+    std::vector<const Bvh*> _bottomLevelSources;
+    std::vector<Bvh8> _bottomLevels;
+    std::vector<Instance> _instances; // in leaf order, instances of empty bottom levels last
+    std::vector<uint32_t> _instancePositions; // in _instances, by instance index
+    std::vector<BvhNode> _nodes; // one instance per leaf
+    std::vector<uint8_t> _nodeMasks; // masks of all instances below a node combined
+    CpuTopLevelBuild _topLevelBuild = CpuTopLevelBuild::Sah;
+    Bvh8Kernel _kernel = GetBestBvh8Kernel();
+    Bvh8TraverseFunction _traverse = GetBvh8TraverseFunction(GetBestBvh8Kernel());
+    Bvh8OccludedFunction _occluded = GetBvh8OccludedFunction(GetBestBvh8Kernel());
+
+private:
+    void RefitTopLevel(TaskPool& taskPool);
+
+public:
+    // Collapses the bottom levels on all threads. Returns false with error when
+    // one of them can't be collapsed.
+    bool SetBottomLevels(TaskPool& taskPool, const std::vector<const Bvh*>& bottomLevels, std::wstring& error);
+
+    // Builds the top level over instances of the bottom levels set before.
+    // Returns false with error when an instance references a missing BLAS or has
+    // a transform that can't be inverted.
+    bool Build(TaskPool& taskPool, const VkGeometryInstance* instances, uint32_t instanceNum, std::wstring& error);
+
+    // Both of the above
+    bool Build(TaskPool& taskPool, const std::vector<const Bvh*>& bottomLevels, const VkGeometryInstance* instances,
+        uint32_t instanceNum, std::wstring& error);
+
+    // After UpdateBvh of one bottom level, bottomLevel can be the same Bvh or a
+    // new one. A refit BLAS has its wide BVH refit in place, a rebuilt one (see
+    // BvhRefitStats::Rebuilt) is collapsed again, the others are left alone. The
+    // top level boxes are then refit to the new BLAS bounds, the instances keep
+    // their tree. Returns false with error when the BLAS can't be updated, or when
+    // it became empty or non-empty, which needs Build.
+    bool UpdateBottomLevel(TaskPool& taskPool, uint32_t index, const Bvh& bottomLevel, bool rebuilt, std::wstring& error);
+
+    // Closest hit within [TMin, TMax] of instances whose mask shares a bit with
+    // cullMask, or any hit with CPU_RAY_FLAG_TERMINATE_ON_FIRST_HIT
+    bool Trace(const CpuRay& ray, uint32_t rayFlags, uint32_t cullMask, CpuHit& hit) const;
+
+    // Whether Trace would find a hit, for rays that only ask that, like shadow
+    // rays. Stops at the first hit without keeping anything about it, and visits
+    // children in storage order instead of near to far.
+    bool Occluded(const CpuRay& ray, uint32_t rayFlags, uint32_t cullMask) const;
+
+    // Trace for up to Bvh8PacketMaxRayNum coherent rays, like the camera rays of a
+    // block of pixels. The top level is traversed once for the whole packet, the
+    // rays that hit an instance box go through its BLAS as one packet, see
+    // TraverseBvh8Packet. Returns the mask of the rays that hit, hits
+    // of the others are left alone.
+    uint64_t TracePacket(const CpuRay* rays, uint32_t rayNum, uint32_t rayFlags, uint32_t cullMask, CpuHit* hits) const;
+
+    // Used by the next Build
+    void SetTopLevelBuild(CpuTopLevelBuild build) { _topLevelBuild = build; }
+    CpuTopLevelBuild GetTopLevelBuild() const { return _topLevelBuild; }
+
+    // kernel has to be supported, see IsBvh8KernelSupported
+    void SetTraversalKernel(Bvh8Kernel kernel);
+    Bvh8Kernel GetTraversalKernel() const { return _kernel; }
+
+    uint32_t GetInstanceNum() const { return (uint32_t)_instances.size(); }
+    const VkGeometryInstance& GetInstance(uint32_t index) const { return _instances[_instancePositions[index]].Source; }
+    uint32_t GetTopLevelNodeNum() const { return (uint32_t)_nodes.size(); }
+
+    // Of the top level, without the bottom levels
+    size_t GetTopLevelMemorySize() const;
+};
+
+class CpuRayTracingPipeline;
+
+// Per-invocation state of a launch, what gl_LaunchIDNV, gl_LaunchSizeNV and
+// traceNV are in the shaders
+class CpuShaderContext
+{
+private:
+    friend class CpuRayTracingPipeline;
+
+    const CpuRayTracingPipeline* _pipeline = nullptr;
+    const CpuAccelerationStructure* _topLevel = nullptr;
+
+    // Primary rays of the current packet block and their results
+    const CpuRay* _packetRays = nullptr;
+    const CpuHit* _packetHits = nullptr;
+    uint64_t _packetHitMask = 0;
+    uint32_t _packetBegin[2] = { };
+    uint32_t _packetSize[2] = { };
+
+public:
+    uint32_t LaunchId[2] = { };
+    uint32_t LaunchSize[2] = { };
+    uint32_t ThreadIndex = 0;
+    uint64_t RayNum = 0;
+    uint64_t OcclusionRayNum = 0; // the part of RayNum traced with Occluded
+
+public:
+    // payload is passed through to the closest hit or miss shader, like a
+    // rayPayloadNV location. Hit groups are selected like on the GPU:
+    // instanceOffset + sbtRecordOffset + geometryIndex * sbtRecordStride.
+    // With CPU_RAY_FLAG_SKIP_CLOSEST_HIT_SHADER only hit or miss matters, such
+    // rays are occlusion queries, see CpuAccelerationStructure::Occluded.
+    void TraceRay(uint32_t rayFlags, uint32_t cullMask, uint32_t sbtRecordOffset, uint32_t sbtRecordStride, uint32_t missIndex,
+        const CpuRay& ray, void* payload);
+};
+
+struct CpuLaunchStats
+{
+    double Milliseconds = 0.0;
+    uint64_t RayNum = 0;
+    uint64_t OcclusionRayNum = 0; // of RayNum
+    uint32_t ThreadNum = 0;
+
+    double GetMegaRaysPerSecond() const { return Milliseconds > 0.0 ? RayNum / (Milliseconds * 1000.0) : 0.0; }
+};
+
+// Shaders and the shader binding table in one, hit groups and miss shaders are
+// indexed in the order they were added
+class CpuRayTracingPipeline
+{
+public:
+    typedef std::function<void(CpuShaderContext& context)> RayGenShader;
+    typedef std::function<void(CpuShaderContext& context, const CpuRay& ray, void* payload)> MissShader;
+    typedef std::function<void(CpuShaderContext& context, const CpuRay& ray, const CpuHit& hit, void* payload)> ClosestHitShader;
+
+    // The ray the raygen shader traces first for pixel (x, y) of a width x height launch
+    typedef std::function<void(uint32_t x, uint32_t y, uint32_t width, uint32_t height, CpuRay& ray)> PrimaryRayFunction;
+
+    static constexpr uint32_t TileSize = 16;
+    static constexpr uint32_t PacketSize = 8; // tiles are traced in PacketSize x PacketSize blocks in packet mode
+
+private:
+    friend class CpuShaderContext;
+
+    RayGenShader _rayGenShader;
+    std::vector<MissShader> _missShaders;
+    std::vector<ClosestHitShader> _hitGroups;
+
+    PrimaryRayFunction _primaryRays;
+    uint32_t _primaryRayFlags = 0;
+    uint32_t _primaryCullMask = 0;
+
+public:
+    void SetRayGenShader(const RayGenShader& shader) { _rayGenShader = shader; }
+    uint32_t AddMissShader(const MissShader& shader);
+    uint32_t AddHitGroup(const ClosestHitShader& shader); // an empty function is a hit group without closest hit shader
+
+    // Packet mode: before the raygen shader runs for a block of pixels, their
+    // primary rays are generated with function and traced together with
+    // TracePacket. TraceRay hands out the packet results when the shader traces
+    // exactly the ray the function made with rayFlags and cullMask, everything
+    // else is traced as usual, so the image doesn't change. An empty function
+    // turns packet mode off.
+    void SetPrimaryRays(const PrimaryRayFunction& function, uint32_t rayFlags, uint32_t cullMask);
+
+    // vkCmdTraceRaysNV: calls the raygen shader once per pixel. The image is split
+    // into TileSize x TileSize tiles that the threads of the pool take in turn.
+    void Launch(TaskPool& taskPool, const CpuAccelerationStructure& topLevel, uint32_t width, uint32_t height,
+        CpuLaunchStats* stats = nullptr) const;
+
+    // Tiles along one side of a launch, tiles are numbered row by row
+    static uint32_t GetTileNum(uint32_t size) { return (size + TileSize - 1) / TileSize; }
+
+    // Launch of only the given tiles, for schedulers that spend more samples on
+    // some parts of the image. LaunchId and LaunchSize are those of the whole
+    // width x height launch. Tiles are taken in the given order.
+    void LaunchTiles(TaskPool& taskPool, const CpuAccelerationStructure& topLevel, uint32_t width, uint32_t height,
+        const uint32_t* tiles, uint32_t tileNum, CpuLaunchStats* stats = nullptr) const;
+};
@@ -0,0 +1,57 @@
+#include "DescriptorUpdateTemplate.h"
+
+DescriptorUpdateTemplate::~DescriptorUpdateTemplate()
+{
+    Cleanup();
+}
+
+VkResult DescriptorUpdateTemplate::Create(VkDescriptorSetLayout layout, const std::vector<VkDescriptorUpdateTemplateEntry>& entries)
+{
+    Cleanup();
+
+    VkDescriptorUpdateTemplateCreateInfo createInfo;
+    createInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO;
+    createInfo.pNext = nullptr;
+    createInfo.flags = 0;
+    createInfo.descriptorUpdateEntryCount = (uint32_t)entries.size();
+    createInfo.pDescriptorUpdateEntries = entries.data();
+    createInfo.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET;
+    createInfo.descriptorSetLayout = layout;
+    createInfo.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS; // only used for push descriptors
+    createInfo.pipelineLayout = VK_NULL_HANDLE;
+    createInfo.set = 0;
+
+    VkResult code = vkCreateDescriptorUpdateTemplate(_device, &createInfo, nullptr, &Template);
+    if (code != VK_SUCCESS)
+    {
+        Template = VK_NULL_HANDLE;
+    }
+    return code;
+}
+
+void DescriptorUpdateTemplate::Cleanup()
+{
+    if (Template)
+    {
+        vkDestroyDescriptorUpdateTemplate(_device, Template, nullptr);
+        Template = VK_NULL_HANDLE;
+    }
+}
+
+void DescriptorUpdateTemplate::Update(VkDescriptorSet descriptorSet, const void* data) const
+{
+    vkUpdateDescriptorSetWithTemplate(_device, descriptorSet, Template, data);
+}
+
+VkDescriptorUpdateTemplateEntry DescriptorUpdateTemplate::Entry(uint32_t binding, VkDescriptorType type, uint32_t descriptorCount,
+    size_t offset, size_t stride, uint32_t arrayElement)
+{
+    VkDescriptorUpdateTemplateEntry entry;
+    entry.dstBinding = binding;
+    entry.dstArrayElement = arrayElement;
+    entry.descriptorCount = descriptorCount;
+    entry.descriptorType = type;
+    entry.offset = offset;
+    entry.stride = stride;
+    return entry;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "Application.h"
+
+// Wraps a VkDescriptorUpdateTemplate for one descriptor set layout. The entries
+// describe where each binding lives in a packed, application defined struct, so
+// the descriptor set is updated from that struct with a single call instead of
+// building VkWriteDescriptorSet arrays every time.
+class DescriptorUpdateTemplate : public ResourceBase
+{
+public:
+    VkDescriptorUpdateTemplate Template = VK_NULL_HANDLE;
+
+public:
+    ~DescriptorUpdateTemplate();
+
+public:
+    VkResult Create(VkDescriptorSetLayout layout, const std::vector<VkDescriptorUpdateTemplateEntry>& entries);
+    void Cleanup();
+
+    // data must match the offsets and strides of the entries passed to Create
+    void Update(VkDescriptorSet descriptorSet, const void* data) const;
+
+    // offset and stride are in bytes inside the packed struct. Stride is ignored
+    // for single descriptors.
+    static VkDescriptorUpdateTemplateEntry Entry(uint32_t binding, VkDescriptorType type, uint32_t descriptorCount,
+        size_t offset, size_t stride = 0, uint32_t arrayElement = 0);
+};
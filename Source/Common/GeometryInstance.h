@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstdint>
+
+// Instance layout of VK_NV_ray_tracing top level builds. Kept apart from
+// RayTracingApplication so the CPU tracer can use it without a window or device.
+struct VkGeometryInstance
+{
+    float transform[12];
+    uint32_t instanceId : 24;
+    uint32_t mask : 8;
+    uint32_t instanceOffset : 24;
+    uint32_t flags : 8;
+    uint64_t accelerationStructureHandle;
+};
@@ -0,0 +1,59 @@
+#include "GeometryRegistry.h"
+#include "MeshProcessing.h"
+
+void GeometryKey::AddStream(const void* data, size_t size)
+{
+    Hash = ChecksumBytes(data, size, Hash);
+}
+
+bool GeometryKey::operator==(const GeometryKey& other) const
+{
+    return Hash == other.Hash && Layout == other.Layout && VertexNum == other.VertexNum && IndexNum == other.IndexNum;
+}
+
+uint32_t GeometryRegistry::Acquire(const GeometryKey& key, bool& created)
+{
+    auto it = _indices.find(key);
+    if (it != _indices.end())
+    {
+        created = false;
+        _referenceNums[it->second]++;
+        return it->second;
+    }
+
+    uint32_t index;
+    if (!_freeIndices.empty())
+    {
+        index = _freeIndices.back();
+        _freeIndices.pop_back();
+        _keys[index] = key;
+    }
+    else
+    {
+        index = (uint32_t)_keys.size();
+        _keys.push_back(key);
+        _referenceNums.push_back(0);
+    }
+
+    created = true;
+    _referenceNums[index] = 1;
+    _indices[key] = index;
+    return index;
+}
+
+bool GeometryRegistry::Release(uint32_t index)
+{
+    if (index >= _referenceNums.size() || _referenceNums[index] == 0)
+    {
+        return false;
+    }
+
+    if (--_referenceNums[index] > 0)
+    {
+        return false;
+    }
+
+    _indices.erase(_keys[index]);
+    _freeIndices.push_back(index);
+    return true;
+}
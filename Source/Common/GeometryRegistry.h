@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Identifies geometry by its content: the 64-bit hash of every stream it is
+// created from, plus the sizes and a caller defined layout. Two keys are only
+// equal when all of them match, a hash collision between meshes of the same
+// size and layout is accepted as practically impossible.
+struct GeometryKey
+{
+    uint64_t Hash = 0;
+    uint32_t Layout = 0; // what the streams mean, geometries with different layouts never match
+    uint32_t VertexNum = 0;
+    uint32_t IndexNum = 0;
+
+    // Chains the stream into the hash, streams must be added in the same order for every key
+    void AddStream(const void* data, size_t size);
+
+    bool operator==(const GeometryKey& other) const;
+};
+
+// Deduplicates geometry across render objects. Objects that only differ in their
+// material acquire the same index and share one set of vertex and index buffers
+// and one BLAS; the material stays with the object and reaches the hit shaders
+// through instanceId and the object's hit records. The registry only hands out
+// indices and counts references, the geometry itself is owned by the caller.
+class GeometryRegistry
+{
+public:
+    static constexpr uint32_t InvalidIndex = ~0u;
+
+private:
+    struct KeyHasher
+    {
+        size_t operator()(const GeometryKey& key) const { return (size_t)key.Hash; }
+    };
+
+    std::unordered_map<GeometryKey, uint32_t, KeyHasher> _indices;
+    std::vector<GeometryKey> _keys;
+    std::vector<uint32_t> _referenceNums; // 0 for free indices
+    std::vector<uint32_t> _freeIndices;
+
+public:
+    // Returns the index of the geometry with this key and adds a reference to it.
+    // created is set when the key is new, the caller then has to create the
+    // geometry under the returned index.
+    uint32_t Acquire(const GeometryKey& key, bool& created);
+
+    // Returns true when the last reference is gone, the caller then destroys the
+    // geometry and the index is reused by a later Acquire
+    bool Release(uint32_t index);
+
+    uint32_t GetGeometryNum() const { return (uint32_t)_indices.size(); }
+    uint32_t GetReferenceNum(uint32_t index) const { return _referenceNums[index]; }
+    uint32_t GetIndexCapacity() const { return (uint32_t)_keys.size(); } // highest index + 1
+};
@@ -0,0 +1,226 @@
+#include "MappedFile.h"
+
+#include <cstring>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+MappedFile::~MappedFile()
+{
+    Close();
+}
+
+#if defined(_WIN32)
+
+bool MappedFile::Open(const std::wstring& path)
+{
+    Close();
+
+    HANDLE file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return false;
+    }
+    _file = file;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size))
+    {
+        Close();
+        return false;
+    }
+    _size = (size_t)size.QuadPart;
+
+    // Empty files can't be mapped, they are valid but have no data
+    if (_size == 0)
+    {
+        return true;
+    }
+
+    _mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (_mapping == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    _data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+    if (_data == nullptr)
+    {
+        Close();
+        return false;
+    }
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data)
+    {
+        UnmapViewOfFile(_data);
+    }
+    if (_mapping)
+    {
+        CloseHandle(_mapping);
+    }
+    if (_file)
+    {
+        CloseHandle(_file);
+    }
+    _data = nullptr;
+    _mapping = nullptr;
+    _file = nullptr;
+    _size = 0;
+}
+
+bool GetFileTimestamp(const std::wstring& path, uint64_t& timestamp)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!GetFileAttributesExW(path.c_str(), GetFileExInfoStandard, &attributes))
+    {
+        return false;
+    }
+
+    timestamp = ((uint64_t)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+    return true;
+}
+
+FILE* OpenFile(const std::wstring& path, const char* mode)
+{
+    const std::wstring wideMode(mode, mode + strlen(mode));
+    FILE* file = nullptr;
+    return _wfopen_s(&file, path.c_str(), wideMode.c_str()) == 0 ? file : nullptr;
+}
+
+bool SeekFile(FILE* file, uint64_t offset)
+{
+    return _fseeki64(file, (__int64)offset, SEEK_SET) == 0;
+}
+
+std::string NarrowPath(const std::wstring& path)
+{
+    const int length = WideCharToMultiByte(CP_UTF8, 0, path.c_str(), (int)path.size(), nullptr, 0, nullptr, nullptr);
+    std::string result(length, '\0');
+    WideCharToMultiByte(CP_UTF8, 0, path.c_str(), (int)path.size(), &result[0], length, nullptr, nullptr);
+    return result;
+}
+
+#else
+
+bool MappedFile::Open(const std::wstring& path)
+{
+    Close();
+
+    _file = open(NarrowPath(path).c_str(), O_RDONLY);
+    if (_file < 0)
+    {
+        return false;
+    }
+
+    struct stat status;
+    if (fstat(_file, &status) != 0)
+    {
+        Close();
+        return false;
+    }
+    _size = (size_t)status.st_size;
+
+    if (_size == 0)
+    {
+        return true;
+    }
+
+    void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, _file, 0);
+    if (data == MAP_FAILED)
+    {
+        Close();
+        return false;
+    }
+    madvise(data, _size, MADV_SEQUENTIAL);
+    _data = (const uint8_t*)data;
+
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if (_data)
+    {
+        munmap((void*)_data, _size);
+    }
+    if (_file >= 0)
+    {
+        close(_file);
+    }
+    _data = nullptr;
+    _file = -1;
+    _size = 0;
+}
+
+bool GetFileTimestamp(const std::wstring& path, uint64_t& timestamp)
+{
+    struct stat status;
+    if (stat(NarrowPath(path).c_str(), &status) != 0)
+    {
+        return false;
+    }
+
+    timestamp = (uint64_t)status.st_mtime;
+    return true;
+}
+
+FILE* OpenFile(const std::wstring& path, const char* mode)
+{
+    return fopen(NarrowPath(path).c_str(), mode);
+}
+
+bool SeekFile(FILE* file, uint64_t offset)
+{
+    return fseeko(file, (off_t)offset, SEEK_SET) == 0;
+}
+
+std::string NarrowPath(const std::wstring& path)
+{
+    // Code points to UTF-8, wchar_t is 32-bit here
+    std::string result;
+    for (wchar_t c : path)
+    {
+        const uint32_t codePoint = (uint32_t)c;
+        if (codePoint < 0x80)
+        {
+            result += (char)codePoint;
+        }
+        else if (codePoint < 0x800)
+        {
+            result += (char)(0xC0 | (codePoint >> 6));
+            result += (char)(0x80 | (codePoint & 0x3F));
+        }
+        else if (codePoint < 0x10000)
+        {
+            result += (char)(0xE0 | (codePoint >> 12));
+            result += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+            result += (char)(0x80 | (codePoint & 0x3F));
+        }
+        else
+        {
+            result += (char)(0xF0 | (codePoint >> 18));
+            result += (char)(0x80 | ((codePoint >> 12) & 0x3F));
+            result += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+            result += (char)(0x80 | (codePoint & 0x3F));
+        }
+    }
+    return result;
+}
+
+#endif
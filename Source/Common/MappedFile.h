@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Read-only memory mapping of a whole file. The pages are loaded on first access,
+// so parsers can work on the data in place without copying it into buffers.
+class MappedFile
+{
+private:
+    const uint8_t* _data = nullptr;
+    size_t _size = 0;
+#if defined(_WIN32)
+    void* _file = nullptr;
+    void* _mapping = nullptr;
+#else
+    int _file = -1;
+#endif
+
+public:
+    MappedFile() = default;
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+public:
+    bool Open(const std::wstring& path);
+    void Close();
+
+    const uint8_t* GetData() const { return _data; }
+    size_t GetSize() const { return _size; }
+};
+
+// Paths are wide strings on Windows, other platforms get them as UTF-8
+std::string NarrowPath(const std::wstring& path);
+
+// Last write time in platform units, only meant for comparisons
+bool GetFileTimestamp(const std::wstring& path, uint64_t& timestamp);
+
+// fopen for wide paths, null on failure
+FILE* OpenFile(const std::wstring& path, const char* mode);
+
+// fseek from the start of the file with 64-bit offsets, long is 32 bits on Windows
+bool SeekFile(FILE* file, uint64_t offset);
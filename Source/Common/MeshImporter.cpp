@@ -0,0 +1,2072 @@
+#include "MeshImporter.h"
+#include "MappedFile.h"
+#include "MeshProcessing.h"
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <cwctype>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+
+namespace
+{
+
+// ============================================================
+// Shared helpers
+// ============================================================
+
+std::wstring Widen(const std::string& text)
+{
+    return std::wstring(text.begin(), text.end());
+}
+
+std::wstring GetDirectory(const std::wstring& path)
+{
+    const size_t separator = path.find_last_of(L"/\\");
+    return separator == std::wstring::npos ? std::wstring() : path.substr(0, separator + 1);
+}
+
+std::wstring GetExtension(const std::wstring& path)
+{
+    const size_t dot = path.find_last_of(L'.');
+    if (dot == std::wstring::npos)
+    {
+        return std::wstring();
+    }
+
+    std::wstring extension = path.substr(dot + 1);
+    for (auto& c : extension)
+    {
+        c = (wchar_t)std::towlower(c);
+    }
+    return extension;
+}
+
+inline bool IsSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+const char* SkipSpaces(const char* p, const char* end)
+{
+    while (p < end && IsSpace(*p))
+    {
+        p++;
+    }
+    return p;
+}
+
+double Pow10(int exponent)
+{
+    static const double table[] =
+    {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    return exponent <= 22 ? table[exponent] : std::pow(10.0, exponent);
+}
+
+// Locale independent and a lot faster than strtof, which dominates OBJ parsing
+// otherwise. Exact to within an ulp for the precision OBJ exporters write.
+const char* ParseFloat(const char* p, const char* end, float& value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    int digitNum = 0;
+    bool anyDigit = false;
+
+    for (; p < end && IsDigit(*p); p++)
+    {
+        anyDigit = true;
+        if (digitNum < 19)
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            digitNum += mantissa != 0 ? 1 : 0;
+        }
+        else
+        {
+            exponent++;
+        }
+    }
+
+    if (p < end && *p == '.')
+    {
+        for (p++; p < end && IsDigit(*p); p++)
+        {
+            anyDigit = true;
+            if (digitNum < 19)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                digitNum += mantissa != 0 ? 1 : 0;
+                exponent--;
+            }
+        }
+    }
+
+    if (!anyDigit)
+    {
+        return nullptr;
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E'))
+    {
+        const char* exponentStart = p++;
+        bool negativeExponent = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negativeExponent = *p == '-';
+            p++;
+        }
+
+        if (p < end && IsDigit(*p))
+        {
+            int explicitExponent = 0;
+            for (; p < end && IsDigit(*p); p++)
+            {
+                explicitExponent = std::min(explicitExponent * 10 + (*p - '0'), 1000);
+            }
+            exponent += negativeExponent ? -explicitExponent : explicitExponent;
+        }
+        else
+        {
+            p = exponentStart; // not an exponent after all
+        }
+    }
+
+    double result = (double)mantissa;
+    if (exponent < 0)
+    {
+        result /= Pow10(-exponent);
+    }
+    else if (exponent > 0)
+    {
+        result *= Pow10(exponent);
+    }
+
+    value = (float)(negative ? -result : result);
+    return p;
+}
+
+const char* ParseInt(const char* p, const char* end, int64_t& value)
+{
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+'))
+    {
+        negative = *p == '-';
+        p++;
+    }
+
+    if (p == end || !IsDigit(*p))
+    {
+        return nullptr;
+    }
+
+    int64_t result = 0;
+    for (; p < end && IsDigit(*p); p++)
+    {
+        result = std::min<int64_t>(result * 10 + (*p - '0'), INT64_C(1) << 40);
+    }
+
+    value = negative ? -result : result;
+    return p;
+}
+
+std::string TrimmedLine(const char* p, const char* end)
+{
+    p = SkipSpaces(p, end);
+    while (end > p && IsSpace(end[-1]))
+    {
+        end--;
+    }
+    return std::string(p, end);
+}
+
+bool StartsWithKeyword(const char* p, const char* end, const char* keyword)
+{
+    const size_t length = strlen(keyword);
+    return (size_t)(end - p) > length && memcmp(p, keyword, length) == 0 && IsSpace(p[length]);
+}
+
+// ============================================================
+// Vertex deduplication. Corners are (position, texcoord, normal)
+// index triples, every distinct triple becomes one vertex. The
+// hash table is split into partitions by hash, each partition is
+// filled by one task, so no locking is needed.
+// ============================================================
+
+const uint32_t MissingIndex = 0x7FFFFFFF;
+
+inline uint32_t HashCorner(const uint32_t* corner)
+{
+    uint64_t hash = corner[0] * 0x9E3779B97F4A7C15ull;
+    hash ^= corner[1] * 0xC2B2AE3D27D4EB4Full;
+    hash ^= corner[2] * 0x165667B19E3779F9ull;
+    hash ^= hash >> 29;
+    hash *= 0xBF58476D1CE4E5B9ull;
+    hash ^= hash >> 32;
+    return (uint32_t)hash;
+}
+
+inline uint32_t GetPartition(uint32_t hash, uint32_t partitionNum)
+{
+    return (uint32_t)(((uint64_t)hash * partitionNum) >> 32);
+}
+
+// cornerVertex receives the vertex of every corner, uniqueCorners the triple of
+// every vertex. Vertices are numbered in the order of first use.
+void DeduplicateCorners(TaskPool& taskPool, const std::vector<uint32_t>& corners, std::vector<uint32_t>& cornerVertex,
+    std::vector<uint32_t>& uniqueCorners)
+{
+    const uint32_t cornerNum = (uint32_t)(corners.size() / 3);
+    const uint32_t partitionNum = taskPool.GetThreadNum();
+    const uint32_t grainSize = 1 << 16;
+    const uint32_t rangeNum = (cornerNum + grainSize - 1) / grainSize;
+
+    std::vector<uint32_t> hashes(cornerNum);
+    std::vector<uint32_t> rangePartitionCounts((size_t)rangeNum * partitionNum, 0);
+
+    taskPool.ParallelFor(cornerNum, grainSize, [&](uint32_t begin, uint32_t end, uint32_t)
+    {
+        uint32_t* counts = &rangePartitionCounts[(size_t)(begin / grainSize) * partitionNum];
+        for (uint32_t i = begin; i < end; i++)
+        {
+            hashes[i] = HashCorner(&corners[(size_t)i * 3]);
+            counts[GetPartition(hashes[i], partitionNum)]++;
+        }
+    });
+
+    std::vector<uint32_t> partitionCounts(partitionNum, 0);
+    for (uint32_t range = 0; range < rangeNum; range++)
+    {
+        for (uint32_t partition = 0; partition < partitionNum; partition++)
+        {
+            partitionCounts[partition] += rangePartitionCounts[(size_t)range * partitionNum + partition];
+        }
+    }
+
+    std::vector<uint32_t> localVertex(cornerNum);
+    std::vector<std::vector<uint32_t>> partitionCorners(partitionNum); // first corner of every local vertex
+
+    taskPool.Run(partitionNum, [&](uint32_t partition, uint32_t)
+    {
+        uint32_t tableSize = 16;
+        while (tableSize < partitionCounts[partition] * 2)
+        {
+            tableSize *= 2;
+        }
+
+        // Keys are stored in the table, so a probe touches a single cache line
+        struct Entry
+        {
+            uint32_t Corner[3];
+            uint32_t Vertex;
+        };
+
+        const uint32_t mask = tableSize - 1;
+        std::vector<Entry> table(tableSize);
+        for (auto& entry : table)
+        {
+            entry.Vertex = ~0u;
+        }
+        std::vector<uint32_t>& firstCorners = partitionCorners[partition];
+
+        for (uint32_t i = 0; i < cornerNum; i++)
+        {
+            if (GetPartition(hashes[i], partitionNum) != partition)
+            {
+                continue;
+            }
+
+            const uint32_t* corner = &corners[(size_t)i * 3];
+            uint32_t slot = hashes[i] & mask;
+            for (;;)
+            {
+                Entry& entry = table[slot];
+                if (entry.Vertex == ~0u)
+                {
+                    memcpy(entry.Corner, corner, sizeof(entry.Corner));
+                    entry.Vertex = (uint32_t)firstCorners.size();
+                    localVertex[i] = entry.Vertex;
+                    firstCorners.push_back(i);
+                    break;
+                }
+
+                if (entry.Corner[0] == corner[0] && entry.Corner[1] == corner[1] && entry.Corner[2] == corner[2])
+                {
+                    localVertex[i] = entry.Vertex;
+                    break;
+                }
+                slot = (slot + 1) & mask;
+            }
+        }
+    });
+
+    std::vector<uint32_t> partitionBases(partitionNum, 0);
+    uint32_t vertexNum = 0;
+    for (uint32_t partition = 0; partition < partitionNum; partition++)
+    {
+        partitionBases[partition] = vertexNum;
+        vertexNum += (uint32_t)partitionCorners[partition].size();
+    }
+
+    // Renumber in order of first use, partitions would scatter neighbouring
+    // vertices all over the buffer otherwise
+    std::vector<uint32_t> remap(vertexNum, ~0u);
+    cornerVertex.resize(cornerNum);
+    uint32_t nextVertex = 0;
+    for (uint32_t i = 0; i < cornerNum; i++)
+    {
+        const uint32_t vertex = partitionBases[GetPartition(hashes[i], partitionNum)] + localVertex[i];
+        if (remap[vertex] == ~0u)
+        {
+            remap[vertex] = nextVertex++;
+        }
+        cornerVertex[i] = remap[vertex];
+    }
+
+    uniqueCorners.resize((size_t)vertexNum * 3);
+    taskPool.Run(partitionNum, [&](uint32_t partition, uint32_t)
+    {
+        const std::vector<uint32_t>& firstCorners = partitionCorners[partition];
+        for (uint32_t local = 0; local < (uint32_t)firstCorners.size(); local++)
+        {
+            const uint32_t vertex = remap[partitionBases[partition] + local];
+            memcpy(&uniqueCorners[(size_t)vertex * 3], &corners[(size_t)firstCorners[local] * 3], sizeof(uint32_t) * 3);
+        }
+    });
+}
+
+// ============================================================
+// OBJ. The file is cut into chunks at line boundaries and every
+// chunk is parsed by its own task. Relative (negative) indices
+// depend on the number of elements in the preceding chunks, so
+// they are stored relative to the chunk and fixed up once all
+// chunks are done.
+// ============================================================
+
+const uint32_t RelativeIndexFlag = 0x80000000;
+
+enum ObjAttribute : uint32_t
+{
+    OBJ_POSITION = 0,
+    OBJ_TEXCOORD = 1,
+    OBJ_NORMAL = 2,
+};
+
+struct ObjMaterialSwitch
+{
+    uint32_t FirstTriangle; // within the chunk
+    std::string Material;
+};
+
+struct ObjChunk
+{
+    const char* Begin = nullptr;
+    const char* End = nullptr;
+
+    std::vector<float> Positions;
+    std::vector<float> Texcoords;
+    std::vector<float> Normals;
+    std::vector<uint32_t> Corners; // three corners per triangle, three indices per corner
+    std::vector<ObjMaterialSwitch> MaterialSwitches;
+    std::vector<std::string> MaterialLibraries;
+
+    std::vector<uint32_t> PolygonCorners; // scratch
+    std::string Error;
+    uint32_t ElementBases[3] = { }; // sum of the preceding chunks
+    uint32_t FirstTriangle = 0;
+
+    uint32_t GetElementNum(uint32_t attribute) const
+    {
+        const size_t sizes[3] = { Positions.size() / 3, Texcoords.size() / 2, Normals.size() / 3 };
+        return (uint32_t)sizes[attribute];
+    }
+};
+
+bool EncodeObjIndex(int64_t index, uint32_t localNum, uint32_t& encoded)
+{
+    if (index > 0 && index < MissingIndex)
+    {
+        encoded = (uint32_t)(index - 1);
+        return true;
+    }
+
+    if (index < 0 && index >= -(int64_t)MissingIndex)
+    {
+        // Stored as a 31 bit signed offset from the start of the chunk, it can
+        // point into the previous chunks
+        encoded = RelativeIndexFlag | ((uint32_t)((int64_t)localNum + index) & ~RelativeIndexFlag);
+        return true;
+    }
+
+    return false;
+}
+
+bool ParseObjFace(const char* p, const char* end, ObjChunk& chunk)
+{
+    chunk.PolygonCorners.clear();
+
+    const uint32_t localNums[3] = { chunk.GetElementNum(OBJ_POSITION), chunk.GetElementNum(OBJ_TEXCOORD), chunk.GetElementNum(OBJ_NORMAL) };
+
+    for (;;)
+    {
+        p = SkipSpaces(p, end);
+        if (p == end)
+        {
+            break;
+        }
+
+        uint32_t corner[3] = { MissingIndex, MissingIndex, MissingIndex };
+        for (uint32_t attribute = 0; attribute < 3; attribute++)
+        {
+            if (attribute > 0)
+            {
+                if (p == end || *p != '/')
+                {
+                    break;
+                }
+                p++;
+                if (p < end && (*p == '/' || IsSpace(*p)))
+                {
+                    continue; // v//vn
+                }
+            }
+
+            int64_t index;
+            p = ParseInt(p, end, index);
+            if (p == nullptr || !EncodeObjIndex(index, localNums[attribute], corner[attribute]))
+            {
+                return false;
+            }
+        }
+
+        chunk.PolygonCorners.insert(chunk.PolygonCorners.end(), corner, corner + 3);
+    }
+
+    const size_t cornerNum = chunk.PolygonCorners.size() / 3;
+    if (cornerNum < 3)
+    {
+        return false;
+    }
+
+    const uint32_t* corners = chunk.PolygonCorners.data();
+    for (size_t i = 1; i + 1 < cornerNum; i++)
+    {
+        chunk.Corners.insert(chunk.Corners.end(), corners, corners + 3);
+        chunk.Corners.insert(chunk.Corners.end(), corners + i * 3, corners + i * 3 + 6);
+    }
+
+    return true;
+}
+
+template<uint32_t componentNum>
+bool ParseObjFloats(const char* p, const char* end, std::vector<float>& values)
+{
+    float parsed[componentNum];
+    for (uint32_t i = 0; i < componentNum; i++)
+    {
+        p = ParseFloat(SkipSpaces(p, end), end, parsed[i]);
+        if (p == nullptr)
+        {
+            // vt with a single coordinate is legal
+            if (i == 0)
+            {
+                return false;
+            }
+            parsed[i] = 0.0f;
+            break;
+        }
+    }
+
+    values.insert(values.end(), parsed, parsed + componentNum);
+    return true;
+}
+
+void ParseObjChunk(ObjChunk& chunk)
+{
+    const char* p = chunk.Begin;
+    while (p < chunk.End && chunk.Error.empty())
+    {
+        const char* lineEnd = (const char*)memchr(p, '\n', chunk.End - p);
+        if (lineEnd == nullptr)
+        {
+            lineEnd = chunk.End;
+        }
+
+        const char* line = SkipSpaces(p, lineEnd);
+        const size_t length = lineEnd - line;
+        bool valid = true;
+
+        if (length >= 2 && line[0] == 'v' && IsSpace(line[1]))
+        {
+            valid = ParseObjFloats<3>(line + 2, lineEnd, chunk.Positions);
+        }
+        else if (length >= 3 && line[0] == 'v' && line[1] == 't' && IsSpace(line[2]))
+        {
+            valid = ParseObjFloats<2>(line + 3, lineEnd, chunk.Texcoords);
+            if (valid)
+            {
+                // OBJ has the origin in the bottom left corner
+                chunk.Texcoords.back() = 1.0f - chunk.Texcoords.back();
+            }
+        }
+        else if (length >= 3 && line[0] == 'v' && line[1] == 'n' && IsSpace(line[2]))
+        {
+            valid = ParseObjFloats<3>(line + 3, lineEnd, chunk.Normals);
+        }
+        else if (length >= 2 && line[0] == 'f' && IsSpace(line[1]))
+        {
+            valid = ParseObjFace(line + 2, lineEnd, chunk);
+        }
+        else if (StartsWithKeyword(line, lineEnd, "usemtl"))
+        {
+            chunk.MaterialSwitches.push_back({ (uint32_t)(chunk.Corners.size() / 9), TrimmedLine(line + 6, lineEnd) });
+        }
+        else if (StartsWithKeyword(line, lineEnd, "mtllib"))
+        {
+            chunk.MaterialLibraries.push_back(TrimmedLine(line + 6, lineEnd));
+        }
+
+        if (!valid)
+        {
+            chunk.Error = "malformed line \"" + TrimmedLine(line, lineEnd) + "\"";
+        }
+
+        p = lineEnd + 1;
+    }
+}
+
+bool ResolveObjChunkIndices(ObjChunk& chunk, const uint32_t totals[3])
+{
+    for (size_t i = 0; i < chunk.Corners.size(); i++)
+    {
+        const uint32_t attribute = (uint32_t)(i % 3);
+        uint32_t& index = chunk.Corners[i];
+        if (index == MissingIndex)
+        {
+            continue;
+        }
+
+        int64_t resolved = index;
+        if (index & RelativeIndexFlag)
+        {
+            const int32_t offset = (int32_t)(index << 1) >> 1; // sign extend 31 bits
+            resolved = (int64_t)chunk.ElementBases[attribute] + offset;
+        }
+
+        if (resolved < 0 || resolved >= totals[attribute])
+        {
+            return false;
+        }
+        index = (uint32_t)resolved;
+    }
+    return true;
+}
+
+void ParseMtl(const std::wstring& path, ImportedScene& scene, std::unordered_map<std::string, uint32_t>& materialIndices)
+{
+    MappedFile file;
+    if (!file.Open(path))
+    {
+        return; // materials are optional, the geometry is still usable
+    }
+
+    const std::wstring directory = GetDirectory(path);
+    const char* p = (const char*)file.GetData();
+    const char* end = p + file.GetSize();
+    ImportedMaterial* material = nullptr;
+
+    while (p < end)
+    {
+        const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+        if (lineEnd == nullptr)
+        {
+            lineEnd = end;
+        }
+
+        const char* line = SkipSpaces(p, lineEnd);
+        if (StartsWithKeyword(line, lineEnd, "newmtl"))
+        {
+            const std::string name = TrimmedLine(line + 6, lineEnd);
+            materialIndices[name] = (uint32_t)scene.Materials.size();
+            scene.Materials.emplace_back();
+            material = &scene.Materials.back();
+            material->Name = Widen(name);
+        }
+        else if (material != nullptr && StartsWithKeyword(line, lineEnd, "Kd"))
+        {
+            std::vector<float> color;
+            if (ParseObjFloats<3>(line + 2, lineEnd, color))
+            {
+                std::copy(color.begin(), color.end(), material->BaseColor);
+            }
+        }
+        else if (material != nullptr && StartsWithKeyword(line, lineEnd, "map_Kd"))
+        {
+            // Options like -s or -o come first, the file name is the last token
+            const std::string arguments = TrimmedLine(line + 6, lineEnd);
+            const size_t separator = arguments.find_last_of(" \t");
+            const std::string fileName = separator == std::string::npos ? arguments : arguments.substr(separator + 1);
+            material->BaseColorTexture = directory + Widen(fileName);
+        }
+
+        p = lineEnd + 1;
+    }
+}
+
+// ============================================================
+// glTF. The JSON part is small compared to the buffers, so it's
+// parsed into a tree on one thread; accessors are read in place
+// from the mapped buffers, one primitive per task.
+// ============================================================
+
+struct JsonValue
+{
+    enum Type
+    {
+        TYPE_NULL,
+        TYPE_BOOL,
+        TYPE_NUMBER,
+        TYPE_STRING,
+        TYPE_ARRAY,
+        TYPE_OBJECT,
+    };
+
+    Type ValueType = TYPE_NULL;
+    double Number = 0.0;
+    std::string String;
+    std::vector<JsonValue> Elements; // array elements or object members
+    std::vector<std::string> Keys; // object member names
+
+    const JsonValue* Find(const char* key) const
+    {
+        for (size_t i = 0; i < Keys.size(); i++)
+        {
+            if (Keys[i] == key)
+            {
+                return &Elements[i];
+            }
+        }
+        return nullptr;
+    }
+
+    double GetNumber(const char* key, double defaultValue) const
+    {
+        const JsonValue* value = Find(key);
+        return value != nullptr && value->ValueType == TYPE_NUMBER ? value->Number : defaultValue;
+    }
+
+    int64_t GetIndex(const char* key) const
+    {
+        return (int64_t)GetNumber(key, -1.0);
+    }
+
+    const std::vector<JsonValue>& GetArray(const char* key) const
+    {
+        static const std::vector<JsonValue> empty;
+        const JsonValue* value = Find(key);
+        return value != nullptr && value->ValueType == TYPE_ARRAY ? value->Elements : empty;
+    }
+
+    std::string GetString(const char* key) const
+    {
+        const JsonValue* value = Find(key);
+        return value != nullptr && value->ValueType == TYPE_STRING ? value->String : std::string();
+    }
+};
+
+class JsonParser
+{
+private:
+    const char* _p;
+    const char* _end;
+    uint32_t _depth = 0;
+
+public:
+    JsonParser(const char* begin, const char* end) : _p(begin), _end(end) { }
+
+    bool Parse(JsonValue& value)
+    {
+        return ParseValue(value) && (SkipWhitespace(), _p == _end);
+    }
+
+private:
+    void SkipWhitespace()
+    {
+        while (_p < _end && (*_p == ' ' || *_p == '\t' || *_p == '\r' || *_p == '\n'))
+        {
+            _p++;
+        }
+    }
+
+    bool Expect(const char* literal)
+    {
+        const size_t length = strlen(literal);
+        if ((size_t)(_end - _p) < length || memcmp(_p, literal, length) != 0)
+        {
+            return false;
+        }
+        _p += length;
+        return true;
+    }
+
+    bool ParseValue(JsonValue& value)
+    {
+        SkipWhitespace();
+        if (_p == _end || _depth > 256)
+        {
+            return false;
+        }
+
+        switch (*_p)
+        {
+        case '{':
+            return ParseObject(value);
+        case '[':
+            return ParseArray(value);
+        case '"':
+            value.ValueType = JsonValue::TYPE_STRING;
+            return ParseString(value.String);
+        case 't':
+            value.ValueType = JsonValue::TYPE_BOOL;
+            value.Number = 1.0;
+            return Expect("true");
+        case 'f':
+            value.ValueType = JsonValue::TYPE_BOOL;
+            return Expect("false");
+        case 'n':
+            return Expect("null");
+        default:
+        {
+            float number;
+            const char* next = ParseFloat(_p, _end, number);
+            if (next == nullptr)
+            {
+                return false;
+            }
+
+            // Integers are parsed again so that large byte offsets stay exact
+            int64_t integer;
+            const char* integerEnd = ParseInt(_p, _end, integer);
+            value.Number = integerEnd == next ? (double)integer : (double)number;
+            value.ValueType = JsonValue::TYPE_NUMBER;
+            _p = next;
+            return true;
+        }
+        }
+    }
+
+    bool ParseObject(JsonValue& value)
+    {
+        value.ValueType = JsonValue::TYPE_OBJECT;
+        _p++;
+        _depth++;
+
+        SkipWhitespace();
+        if (_p < _end && *_p == '}')
+        {
+            _p++;
+            _depth--;
+            return true;
+        }
+
+        for (;;)
+        {
+            SkipWhitespace();
+            std::string key;
+            if (_p == _end || *_p != '"' || !ParseString(key))
+            {
+                return false;
+            }
+
+            SkipWhitespace();
+            if (!Expect(":"))
+            {
+                return false;
+            }
+
+            value.Keys.push_back(key);
+            value.Elements.emplace_back();
+            if (!ParseValue(value.Elements.back()))
+            {
+                return false;
+            }
+
+            SkipWhitespace();
+            if (Expect(","))
+            {
+                continue;
+            }
+            if (Expect("}"))
+            {
+                _depth--;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    bool ParseArray(JsonValue& value)
+    {
+        value.ValueType = JsonValue::TYPE_ARRAY;
+        _p++;
+        _depth++;
+
+        SkipWhitespace();
+        if (_p < _end && *_p == ']')
+        {
+            _p++;
+            _depth--;
+            return true;
+        }
+
+        for (;;)
+        {
+            value.Elements.emplace_back();
+            if (!ParseValue(value.Elements.back()))
+            {
+                return false;
+            }
+
+            SkipWhitespace();
+            if (Expect(","))
+            {
+                continue;
+            }
+            if (Expect("]"))
+            {
+                _depth--;
+                return true;
+            }
+            return false;
+        }
+    }
+
+    bool ParseString(std::string& result)
+    {
+        _p++; // opening quote
+        while (_p < _end && *_p != '"')
+        {
+            if (*_p != '\\')
+            {
+                result += *_p++;
+                continue;
+            }
+
+            if (++_p == _end)
+            {
+                return false;
+            }
+
+            const char escaped = *_p++;
+            switch (escaped)
+            {
+            case 'b': result += '\b'; break;
+            case 'f': result += '\f'; break;
+            case 'n': result += '\n'; break;
+            case 'r': result += '\r'; break;
+            case 't': result += '\t'; break;
+            case 'u':
+            {
+                if (_end - _p < 4)
+                {
+                    return false;
+                }
+
+                uint32_t codePoint = 0;
+                for (int i = 0; i < 4; i++)
+                {
+                    const char c = *_p++;
+                    const uint32_t digit = IsDigit(c) ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : (c >= 'A' && c <= 'F') ? c - 'A' + 10 : 16;
+                    if (digit > 15)
+                    {
+                        return false;
+                    }
+                    codePoint = codePoint * 16 + digit;
+                }
+
+                // UTF-8, surrogate pairs are kept as two separate sequences
+                if (codePoint < 0x80)
+                {
+                    result += (char)codePoint;
+                }
+                else if (codePoint < 0x800)
+                {
+                    result += (char)(0xC0 | (codePoint >> 6));
+                    result += (char)(0x80 | (codePoint & 0x3F));
+                }
+                else
+                {
+                    result += (char)(0xE0 | (codePoint >> 12));
+                    result += (char)(0x80 | ((codePoint >> 6) & 0x3F));
+                    result += (char)(0x80 | (codePoint & 0x3F));
+                }
+                break;
+            }
+            default:
+                result += escaped; // quote, backslash and slash
+                break;
+            }
+        }
+
+        if (_p == _end)
+        {
+            return false;
+        }
+        _p++; // closing quote
+        return true;
+    }
+};
+
+bool DecodeBase64(const std::string& text, size_t begin, std::vector<uint8_t>& result)
+{
+    uint32_t accumulator = 0;
+    int bitNum = 0;
+
+    for (size_t i = begin; i < text.size(); i++)
+    {
+        const char c = text[i];
+        uint32_t value;
+        if (c >= 'A' && c <= 'Z') value = c - 'A';
+        else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') value = c - '0' + 52;
+        else if (c == '+') value = 62;
+        else if (c == '/') value = 63;
+        else if (c == '=') break;
+        else return false;
+
+        accumulator = (accumulator << 6) | value;
+        bitNum += 6;
+        if (bitNum >= 8)
+        {
+            bitNum -= 8;
+            result.push_back((uint8_t)(accumulator >> bitNum));
+        }
+    }
+    return true;
+}
+
+struct GltfBuffer
+{
+    const uint8_t* Data = nullptr;
+    size_t Size = 0;
+};
+
+enum GltfComponentType : uint32_t
+{
+    GLTF_UNSIGNED_BYTE = 5121,
+    GLTF_UNSIGNED_SHORT = 5123,
+    GLTF_UNSIGNED_INT = 5125,
+    GLTF_FLOAT = 5126,
+};
+
+enum GltfPrimitiveMode : uint32_t
+{
+    GLTF_MODE_TRIANGLES = 4,
+};
+
+class GltfDocument
+{
+public:
+    JsonValue Root;
+    std::wstring Directory;
+    std::vector<GltfBuffer> Buffers;
+
+private:
+    std::vector<std::unique_ptr<MappedFile>> _mappedFiles;
+    std::vector<std::vector<uint8_t>> _decodedBuffers;
+
+public:
+    bool LoadBuffers(const GltfBuffer& binaryChunk, std::wstring& error)
+    {
+        const std::vector<JsonValue>& buffers = Root.GetArray("buffers");
+        Buffers.resize(buffers.size());
+
+        for (size_t i = 0; i < buffers.size(); i++)
+        {
+            const std::string uri = buffers[i].GetString("uri");
+            const size_t byteLength = (size_t)buffers[i].GetNumber("byteLength", 0.0);
+
+            if (uri.empty())
+            {
+                // GLB binary chunk
+                Buffers[i] = binaryChunk;
+            }
+            else if (uri.compare(0, 5, "data:") == 0)
+            {
+                const size_t comma = uri.find(";base64,");
+                std::vector<uint8_t> decoded;
+                if (comma == std::string::npos || !DecodeBase64(uri, comma + 8, decoded))
+                {
+                    error = L"unsupported data URI in buffer " + std::to_wstring(i);
+                    return false;
+                }
+                _decodedBuffers.push_back(std::move(decoded));
+                Buffers[i].Data = _decodedBuffers.back().data();
+                Buffers[i].Size = _decodedBuffers.back().size();
+            }
+            else
+            {
+                std::unique_ptr<MappedFile> file(new MappedFile());
+                if (!file->Open(Directory + Widen(uri)))
+                {
+                    error = L"failed to open buffer " + Widen(uri);
+                    return false;
+                }
+                Buffers[i].Data = file->GetData();
+                Buffers[i].Size = file->GetSize();
+                _mappedFiles.push_back(std::move(file));
+            }
+
+            if (Buffers[i].Size < byteLength)
+            {
+                error = L"buffer " + std::to_wstring(i) + L" is shorter than its byteLength";
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Reads componentNum components per element as floats, integer types are normalized
+    bool ReadFloats(int64_t accessorIndex, uint32_t componentNum, std::vector<float>& values, std::wstring& error) const
+    {
+        const uint8_t* data;
+        size_t stride;
+        size_t count;
+        uint32_t componentType;
+        if (!GetAccessorData(accessorIndex, componentNum, data, stride, count, componentType, error))
+        {
+            return false;
+        }
+
+        values.resize(count * componentNum);
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint8_t* element = data + i * stride;
+            float* destination = &values[i * componentNum];
+
+            switch (componentType)
+            {
+            case GLTF_FLOAT:
+                memcpy(destination, element, sizeof(float) * componentNum);
+                break;
+            case GLTF_UNSIGNED_BYTE:
+                for (uint32_t c = 0; c < componentNum; c++)
+                {
+                    destination[c] = element[c] / 255.0f;
+                }
+                break;
+            case GLTF_UNSIGNED_SHORT:
+                for (uint32_t c = 0; c < componentNum; c++)
+                {
+                    uint16_t value;
+                    memcpy(&value, element + c * sizeof(uint16_t), sizeof(value));
+                    destination[c] = value / 65535.0f;
+                }
+                break;
+            default:
+                error = L"unsupported component type in accessor " + std::to_wstring(accessorIndex);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool ReadIndices(int64_t accessorIndex, std::vector<uint32_t>& indices, std::wstring& error) const
+    {
+        const uint8_t* data;
+        size_t stride;
+        size_t count;
+        uint32_t componentType;
+        if (!GetAccessorData(accessorIndex, 1, data, stride, count, componentType, error))
+        {
+            return false;
+        }
+
+        indices.resize(count);
+        for (size_t i = 0; i < count; i++)
+        {
+            const uint8_t* element = data + i * stride;
+            switch (componentType)
+            {
+            case GLTF_UNSIGNED_BYTE:
+                indices[i] = *element;
+                break;
+            case GLTF_UNSIGNED_SHORT:
+            {
+                uint16_t value;
+                memcpy(&value, element, sizeof(value));
+                indices[i] = value;
+                break;
+            }
+            case GLTF_UNSIGNED_INT:
+                memcpy(&indices[i], element, sizeof(uint32_t));
+                break;
+            default:
+                error = L"unsupported index type in accessor " + std::to_wstring(accessorIndex);
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    bool GetAccessorData(int64_t accessorIndex, uint32_t componentNum, const uint8_t*& data, size_t& stride, size_t& count,
+        uint32_t& componentType, std::wstring& error) const
+    {
+        const std::vector<JsonValue>& accessors = Root.GetArray("accessors");
+        const std::vector<JsonValue>& bufferViews = Root.GetArray("bufferViews");
+        if (accessorIndex < 0 || accessorIndex >= (int64_t)accessors.size())
+        {
+            error = L"invalid accessor " + std::to_wstring(accessorIndex);
+            return false;
+        }
+
+        const JsonValue& accessor = accessors[(size_t)accessorIndex];
+        const int64_t viewIndex = accessor.GetIndex("bufferView");
+        componentType = (uint32_t)accessor.GetNumber("componentType", 0.0);
+        count = (size_t)accessor.GetNumber("count", 0.0);
+
+        const uint32_t componentSize = componentType == GLTF_UNSIGNED_BYTE ? 1 : componentType == GLTF_UNSIGNED_SHORT ? 2 : 4;
+        const size_t elementSize = (size_t)componentSize * componentNum;
+
+        if (viewIndex < 0 || viewIndex >= (int64_t)bufferViews.size())
+        {
+            error = L"accessor " + std::to_wstring(accessorIndex) + L" has no buffer view";
+            return false;
+        }
+
+        const JsonValue& view = bufferViews[(size_t)viewIndex];
+        const int64_t bufferIndex = view.GetIndex("buffer");
+        if (bufferIndex < 0 || bufferIndex >= (int64_t)Buffers.size())
+        {
+            error = L"invalid buffer in buffer view " + std::to_wstring(viewIndex);
+            return false;
+        }
+
+        const GltfBuffer& buffer = Buffers[(size_t)bufferIndex];
+        const size_t viewOffset = (size_t)view.GetNumber("byteOffset", 0.0);
+        const size_t viewLength = (size_t)view.GetNumber("byteLength", 0.0);
+        const size_t accessorOffset = (size_t)accessor.GetNumber("byteOffset", 0.0);
+        stride = (size_t)view.GetNumber("byteStride", 0.0);
+        if (stride == 0)
+        {
+            stride = elementSize;
+        }
+
+        const size_t requiredLength = count == 0 ? 0 : accessorOffset + stride * (count - 1) + elementSize;
+        if (viewOffset + viewLength > buffer.Size || requiredLength > viewLength)
+        {
+            error = L"accessor " + std::to_wstring(accessorIndex) + L" is out of bounds";
+            return false;
+        }
+
+        data = buffer.Data + viewOffset + accessorOffset;
+        return true;
+    }
+};
+
+// Column-major 4x4, as stored in glTF
+struct Matrix4
+{
+    float M[16];
+
+    static Matrix4 Identity()
+    {
+        Matrix4 result = { { 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1 } };
+        return result;
+    }
+
+    Matrix4 operator*(const Matrix4& other) const
+    {
+        Matrix4 result;
+        for (int column = 0; column < 4; column++)
+        {
+            for (int row = 0; row < 4; row++)
+            {
+                float sum = 0.0f;
+                for (int k = 0; k < 4; k++)
+                {
+                    sum += M[k * 4 + row] * other.M[column * 4 + k];
+                }
+                result.M[column * 4 + row] = sum;
+            }
+        }
+        return result;
+    }
+};
+
+Matrix4 GetNodeMatrix(const JsonValue& node)
+{
+    Matrix4 result = Matrix4::Identity();
+
+    const std::vector<JsonValue>& matrix = node.GetArray("matrix");
+    if (matrix.size() == 16)
+    {
+        for (int i = 0; i < 16; i++)
+        {
+            result.M[i] = (float)matrix[i].Number;
+        }
+        return result;
+    }
+
+    float t[3] = { 0.0f, 0.0f, 0.0f };
+    float r[4] = { 0.0f, 0.0f, 0.0f, 1.0f };
+    float s[3] = { 1.0f, 1.0f, 1.0f };
+
+    const std::vector<JsonValue>& translation = node.GetArray("translation");
+    const std::vector<JsonValue>& rotation = node.GetArray("rotation");
+    const std::vector<JsonValue>& scale = node.GetArray("scale");
+    for (size_t i = 0; i < 3 && translation.size() == 3; i++) t[i] = (float)translation[i].Number;
+    for (size_t i = 0; i < 4 && rotation.size() == 4; i++) r[i] = (float)rotation[i].Number;
+    for (size_t i = 0; i < 3 && scale.size() == 3; i++) s[i] = (float)scale[i].Number;
+
+    // T * R * S
+    const float x = r[0], y = r[1], z = r[2], w = r[3];
+    const float rotationMatrix[9] =
+    {
+        1 - 2 * (y * y + z * z), 2 * (x * y + z * w), 2 * (x * z - y * w),
+        2 * (x * y - z * w), 1 - 2 * (x * x + z * z), 2 * (y * z + x * w),
+        2 * (x * z + y * w), 2 * (y * z - x * w), 1 - 2 * (x * x + y * y),
+    };
+
+    for (int column = 0; column < 3; column++)
+    {
+        for (int row = 0; row < 3; row++)
+        {
+            result.M[column * 4 + row] = rotationMatrix[column * 3 + row] * s[column];
+        }
+    }
+    result.M[12] = t[0];
+    result.M[13] = t[1];
+    result.M[14] = t[2];
+    return result;
+}
+
+// File normals aren't necessarily unit length, zero ones point along z
+void NormalizeNormals(std::vector<float>& normals)
+{
+    for (size_t i = 0; i + 2 < normals.size(); i += 3)
+    {
+        float* normal = &normals[i];
+        const float length = std::sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+        if (length > 0.0f)
+        {
+            normal[0] /= length;
+            normal[1] /= length;
+            normal[2] /= length;
+        }
+        else
+        {
+            normal[2] = 1.0f;
+        }
+    }
+}
+
+} // namespace
+
+// ============================================================
+// Public functions
+// ============================================================
+
+bool SceneView::GetBounds(float boundsMin[3], float boundsMax[3]) const
+{
+    bool empty = true;
+
+    for (const auto& instance : Instances)
+    {
+        const MeshView& mesh = Meshes[instance.MeshIndex];
+        if (mesh.VertexNum == 0)
+        {
+            continue;
+        }
+
+        float localMin[3] = { mesh.Positions[0], mesh.Positions[1], mesh.Positions[2] };
+        float localMax[3] = { mesh.Positions[0], mesh.Positions[1], mesh.Positions[2] };
+        for (size_t i = 0; i < (size_t)mesh.VertexNum * 3; i++)
+        {
+            localMin[i % 3] = std::min(localMin[i % 3], mesh.Positions[i]);
+            localMax[i % 3] = std::max(localMax[i % 3], mesh.Positions[i]);
+        }
+
+        // Transformed corners of the local box
+        for (uint32_t corner = 0; corner < 8; corner++)
+        {
+            const float local[3] =
+            {
+                corner & 1 ? localMax[0] : localMin[0],
+                corner & 2 ? localMax[1] : localMin[1],
+                corner & 4 ? localMax[2] : localMin[2],
+            };
+
+            for (int row = 0; row < 3; row++)
+            {
+                const float* m = &instance.Transform[row * 4];
+                const float world = m[0] * local[0] + m[1] * local[1] + m[2] * local[2] + m[3];
+                boundsMin[row] = empty ? world : std::min(boundsMin[row], world);
+                boundsMax[row] = empty ? world : std::max(boundsMax[row], world);
+            }
+            empty = false;
+        }
+    }
+
+    return !empty;
+}
+
+void SceneView::FitToSize(float size)
+{
+    float boundsMin[3];
+    float boundsMax[3];
+    if (!GetBounds(boundsMin, boundsMax))
+    {
+        return;
+    }
+
+    const float extent = std::max(std::max(boundsMax[0] - boundsMin[0], boundsMax[1] - boundsMin[1]), boundsMax[2] - boundsMin[2]);
+    const float scale = extent > 0.0f ? size / extent : 1.0f;
+
+    for (ImportedInstance& instance : Instances)
+    {
+        for (int row = 0; row < 3; row++)
+        {
+            const float center = (boundsMin[row] + boundsMax[row]) * 0.5f;
+            for (int column = 0; column < 3; column++)
+            {
+                instance.Transform[row * 4 + column] *= scale;
+            }
+            instance.Transform[row * 4 + 3] = (instance.Transform[row * 4 + 3] - center) * scale;
+        }
+    }
+}
+
+SceneView ImportedScene::GetView() const
+{
+    SceneView view;
+    view.Materials = Materials;
+    view.Instances = Instances;
+
+    view.Meshes.resize(Meshes.size());
+    for (size_t i = 0; i < Meshes.size(); i++)
+    {
+        const ImportedMesh& mesh = Meshes[i];
+        MeshView& meshView = view.Meshes[i];
+        meshView.Name = mesh.Name;
+        meshView.Positions = mesh.Positions.data();
+        meshView.Normals = mesh.Normals.data();
+        meshView.Texcoords = mesh.Texcoords.empty() ? nullptr : mesh.Texcoords.data();
+        meshView.Indices = mesh.Indices.data();
+        meshView.VertexNum = mesh.GetVertexNum();
+        meshView.IndexNum = (uint32_t)mesh.Indices.size();
+        meshView.MaterialIndex = mesh.MaterialIndex;
+    }
+    return view;
+}
+
+double ImportStats::GetTrianglesPerSecond() const
+{
+    return Milliseconds > 0.0 ? TriangleNum * 1000.0 / Milliseconds : 0.0;
+}
+
+void GenerateNormals(ImportedMesh& mesh)
+{
+    const uint32_t vertexNum = mesh.GetVertexNum();
+    mesh.Normals.assign((size_t)vertexNum * 3, 0.0f);
+
+    const float* positions = mesh.Positions.data();
+    float* normals = mesh.Normals.data();
+
+    // The cross product length is twice the triangle area, so large
+    // triangles get a larger say without any extra work
+    for (size_t i = 0; i + 2 < mesh.Indices.size(); i += 3)
+    {
+        const uint32_t* triangle = &mesh.Indices[i];
+        const float* p0 = positions + triangle[0] * 3;
+        const float* p1 = positions + triangle[1] * 3;
+        const float* p2 = positions + triangle[2] * 3;
+
+        const float e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+        const float e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+        const float n[3] = { e1[1] * e2[2] - e1[2] * e2[1], e1[2] * e2[0] - e1[0] * e2[2], e1[0] * e2[1] - e1[1] * e2[0] };
+
+        for (int corner = 0; corner < 3; corner++)
+        {
+            float* normal = normals + triangle[corner] * 3;
+            normal[0] += n[0];
+            normal[1] += n[1];
+            normal[2] += n[2];
+        }
+    }
+
+    NormalizeNormals(mesh.Normals); // unreferenced and degenerate vertices end up along z
+}
+
+void OptimizeMeshLocality(ImportedMesh& mesh)
+{
+    SortTrianglesMorton(mesh.Positions.data(), mesh.GetVertexNum(), mesh.Indices);
+
+    const std::vector<uint32_t> newToOld = SortVerticesByFirstUse(mesh.GetVertexNum(), mesh.Indices);
+    PermuteVertexStream(newToOld, 3, mesh.Positions);
+    PermuteVertexStream(newToOld, 3, mesh.Normals);
+    PermuteVertexStream(newToOld, 2, mesh.Texcoords);
+}
+
+bool ImportObj(const std::wstring& path, TaskPool& taskPool, ImportedScene& scene, std::wstring& error)
+{
+    MappedFile file;
+    if (!file.Open(path))
+    {
+        error = L"failed to open " + path;
+        return false;
+    }
+
+    // ============================================================
+    // 1. PARSE CHUNKS
+    // ============================================================
+
+    const char* data = (const char*)file.GetData();
+    const char* dataEnd = data + file.GetSize();
+
+    const size_t chunkSize = std::max<size_t>(file.GetSize() / (taskPool.GetThreadNum() * 8) + 1, 1 << 20);
+    std::vector<ObjChunk> chunks;
+    for (const char* begin = data; begin < dataEnd;)
+    {
+        const char* end = begin + std::min<size_t>(chunkSize, dataEnd - begin);
+        const char* lineEnd = end < dataEnd ? (const char*)memchr(end, '\n', dataEnd - end) : nullptr;
+        end = lineEnd != nullptr ? lineEnd + 1 : dataEnd;
+
+        chunks.emplace_back();
+        chunks.back().Begin = begin;
+        chunks.back().End = end;
+        begin = end;
+    }
+
+    taskPool.Run((uint32_t)chunks.size(), [&](uint32_t chunkIndex, uint32_t)
+    {
+        ParseObjChunk(chunks[chunkIndex]);
+    });
+
+    for (const auto& chunk : chunks)
+    {
+        if (!chunk.Error.empty())
+        {
+            error = Widen(chunk.Error);
+            return false;
+        }
+    }
+
+    // ============================================================
+    // 2. MERGE ATTRIBUTES AND RESOLVE INDICES
+    // ============================================================
+
+    uint32_t totals[3] = { };
+    uint32_t triangleNum = 0;
+    for (auto& chunk : chunks)
+    {
+        for (uint32_t attribute = 0; attribute < 3; attribute++)
+        {
+            chunk.ElementBases[attribute] = totals[attribute];
+            totals[attribute] += chunk.GetElementNum(attribute);
+        }
+        chunk.FirstTriangle = triangleNum;
+        triangleNum += (uint32_t)(chunk.Corners.size() / 9);
+    }
+
+    if (triangleNum == 0)
+    {
+        error = L"no faces in " + path;
+        return false;
+    }
+
+    std::vector<float> positions((size_t)totals[OBJ_POSITION] * 3);
+    std::vector<float> texcoords((size_t)totals[OBJ_TEXCOORD] * 2);
+    std::vector<float> normals((size_t)totals[OBJ_NORMAL] * 3);
+    std::vector<uint8_t> resolved(chunks.size(), 0);
+
+    taskPool.Run((uint32_t)chunks.size(), [&](uint32_t chunkIndex, uint32_t)
+    {
+        ObjChunk& chunk = chunks[chunkIndex];
+        std::copy(chunk.Positions.begin(), chunk.Positions.end(), positions.begin() + (size_t)chunk.ElementBases[OBJ_POSITION] * 3);
+        std::copy(chunk.Texcoords.begin(), chunk.Texcoords.end(), texcoords.begin() + (size_t)chunk.ElementBases[OBJ_TEXCOORD] * 2);
+        std::copy(chunk.Normals.begin(), chunk.Normals.end(), normals.begin() + (size_t)chunk.ElementBases[OBJ_NORMAL] * 3);
+        resolved[chunkIndex] = ResolveObjChunkIndices(chunk, totals) ? 1 : 0;
+
+        std::vector<float>().swap(chunk.Positions);
+        std::vector<float>().swap(chunk.Texcoords);
+        std::vector<float>().swap(chunk.Normals);
+    });
+
+    if (std::find(resolved.begin(), resolved.end(), 0) != resolved.end())
+    {
+        error = L"face index out of range in " + path;
+        return false;
+    }
+
+    NormalizeNormals(normals);
+
+    // ============================================================
+    // 3. SPLIT BY MATERIAL
+    // usemtl applies until the next one, even across chunks.
+    // ============================================================
+
+    std::unordered_map<std::string, uint32_t> materialIndices;
+    const std::wstring directory = GetDirectory(path);
+    for (const auto& chunk : chunks)
+    {
+        for (const auto& library : chunk.MaterialLibraries)
+        {
+            ParseMtl(directory + Widen(library), scene, materialIndices);
+        }
+    }
+
+    struct TriangleRange
+    {
+        uint32_t Chunk;
+        uint32_t FirstTriangle; // within the chunk
+        uint32_t TriangleNum;
+        uint32_t Mesh;
+    };
+
+    std::vector<TriangleRange> ranges;
+    std::vector<std::string> meshMaterials;
+    std::unordered_map<std::string, uint32_t> meshIndices;
+    std::string currentMaterial;
+
+    auto GetMeshIndex = [&](const std::string& material)
+    {
+        auto found = meshIndices.find(material);
+        if (found != meshIndices.end())
+        {
+            return found->second;
+        }
+        meshIndices[material] = (uint32_t)meshMaterials.size();
+        meshMaterials.push_back(material);
+        return (uint32_t)(meshMaterials.size() - 1);
+    };
+
+    for (uint32_t chunkIndex = 0; chunkIndex < (uint32_t)chunks.size(); chunkIndex++)
+    {
+        const ObjChunk& chunk = chunks[chunkIndex];
+        const uint32_t chunkTriangleNum = (uint32_t)(chunk.Corners.size() / 9);
+
+        uint32_t first = 0;
+        for (size_t i = 0; i <= chunk.MaterialSwitches.size(); i++)
+        {
+            const uint32_t last = i < chunk.MaterialSwitches.size() ? chunk.MaterialSwitches[i].FirstTriangle : chunkTriangleNum;
+            if (last > first)
+            {
+                ranges.push_back({ chunkIndex, first, last - first, GetMeshIndex(currentMaterial) });
+            }
+            if (i < chunk.MaterialSwitches.size())
+            {
+                currentMaterial = chunk.MaterialSwitches[i].Material;
+            }
+            first = last;
+        }
+    }
+
+    const uint32_t meshNum = (uint32_t)meshMaterials.size();
+    std::vector<std::vector<uint32_t>> meshCorners(meshNum);
+    {
+        std::vector<size_t> meshCornerNums(meshNum, 0);
+        for (const auto& range : ranges)
+        {
+            meshCornerNums[range.Mesh] += (size_t)range.TriangleNum * 9;
+        }
+        for (uint32_t mesh = 0; mesh < meshNum; mesh++)
+        {
+            meshCorners[mesh].reserve(meshCornerNums[mesh]);
+        }
+        for (const auto& range : ranges)
+        {
+            const uint32_t* corners = chunks[range.Chunk].Corners.data() + (size_t)range.FirstTriangle * 9;
+            meshCorners[range.Mesh].insert(meshCorners[range.Mesh].end(), corners, corners + (size_t)range.TriangleNum * 9);
+        }
+    }
+    chunks.clear();
+
+    // ============================================================
+    // 4. DEDUPLICATE VERTICES AND BUILD THE ATTRIBUTE STREAMS
+    // ============================================================
+
+    const uint32_t firstMesh = (uint32_t)scene.Meshes.size();
+    scene.Meshes.resize(firstMesh + meshNum);
+
+    for (uint32_t meshIndex = 0; meshIndex < meshNum; meshIndex++)
+    {
+        ImportedMesh& mesh = scene.Meshes[firstMesh + meshIndex];
+        const std::string& material = meshMaterials[meshIndex];
+        auto foundMaterial = materialIndices.find(material);
+        mesh.MaterialIndex = foundMaterial != materialIndices.end() ? foundMaterial->second : ~0u;
+        mesh.Name = material.empty() ? std::wstring(L"OBJ mesh") : Widen(material);
+
+        std::vector<uint32_t> uniqueCorners;
+        DeduplicateCorners(taskPool, meshCorners[meshIndex], mesh.Indices, uniqueCorners);
+        std::vector<uint32_t>().swap(meshCorners[meshIndex]);
+
+        const uint32_t vertexNum = (uint32_t)(uniqueCorners.size() / 3);
+        bool hasTexcoords = false;
+        bool hasAllNormals = true;
+        for (uint32_t i = 0; i < vertexNum; i++)
+        {
+            hasTexcoords |= uniqueCorners[i * 3 + OBJ_TEXCOORD] != MissingIndex;
+            hasAllNormals &= uniqueCorners[i * 3 + OBJ_NORMAL] != MissingIndex;
+        }
+
+        mesh.Positions.resize((size_t)vertexNum * 3);
+        mesh.Texcoords.resize(hasTexcoords ? (size_t)vertexNum * 2 : 0);
+        mesh.Normals.resize(hasAllNormals ? (size_t)vertexNum * 3 : 0);
+
+        taskPool.ParallelFor(vertexNum, 1 << 16, [&](uint32_t begin, uint32_t end, uint32_t)
+        {
+            for (uint32_t i = begin; i < end; i++)
+            {
+                const uint32_t* corner = &uniqueCorners[(size_t)i * 3];
+                memcpy(&mesh.Positions[(size_t)i * 3], &positions[(size_t)corner[OBJ_POSITION] * 3], sizeof(float) * 3);
+
+                if (hasTexcoords)
+                {
+                    const bool present = corner[OBJ_TEXCOORD] != MissingIndex;
+                    mesh.Texcoords[(size_t)i * 2] = present ? texcoords[(size_t)corner[OBJ_TEXCOORD] * 2] : 0.0f;
+                    mesh.Texcoords[(size_t)i * 2 + 1] = present ? texcoords[(size_t)corner[OBJ_TEXCOORD] * 2 + 1] : 0.0f;
+                }
+
+                if (hasAllNormals)
+                {
+                    memcpy(&mesh.Normals[(size_t)i * 3], &normals[(size_t)corner[OBJ_NORMAL] * 3], sizeof(float) * 3);
+                }
+            }
+        });
+
+        if (!hasAllNormals)
+        {
+            GenerateNormals(mesh);
+        }
+
+        ImportedInstance instance;
+        instance.MeshIndex = firstMesh + meshIndex;
+        instance.Transform[0] = instance.Transform[5] = instance.Transform[10] = 1.0f;
+        scene.Instances.push_back(instance);
+    }
+
+    return true;
+}
+
+bool ImportGltf(const std::wstring& path, TaskPool& taskPool, ImportedScene& scene, std::wstring& error)
+{
+    MappedFile file;
+    if (!file.Open(path))
+    {
+        error = L"failed to open " + path;
+        return false;
+    }
+
+    GltfDocument document;
+    document.Directory = GetDirectory(path);
+
+    // ============================================================
+    // 1. CONTAINER AND JSON
+    // ============================================================
+
+    const uint8_t* data = file.GetData();
+    const size_t size = file.GetSize();
+    const char* json = (const char*)data;
+    const char* jsonEnd = json + size;
+    GltfBuffer binaryChunk;
+
+    const uint32_t glbMagic = 0x46546C67; // "glTF"
+    const uint32_t jsonChunkType = 0x4E4F534A; // "JSON"
+    const uint32_t binaryChunkType = 0x004E4942; // "BIN\0"
+
+    uint32_t header[3] = { };
+    if (size >= sizeof(uint32_t))
+    {
+        memcpy(header, data, std::min(size, sizeof(header)));
+    }
+
+    if (header[0] == glbMagic)
+    {
+        // Sizes first, a cut off file would otherwise look like an unknown version
+        if (size < sizeof(header))
+        {
+            error = L"truncated GLB file " + path + L", the header is incomplete";
+            return false;
+        }
+        if (header[2] > size)
+        {
+            error = L"truncated GLB file " + path + L", " + std::to_wstring(size) + L" of " + std::to_wstring(header[2]) + L" bytes";
+            return false;
+        }
+        if (header[1] != 2)
+        {
+            error = L"unsupported GLB container version " + std::to_wstring(header[1]);
+            return false;
+        }
+
+        json = nullptr;
+        for (size_t offset = sizeof(header); offset + 8 <= header[2];)
+        {
+            uint32_t chunkHeader[2];
+            memcpy(chunkHeader, data + offset, sizeof(chunkHeader));
+            const size_t chunkBegin = offset + 8;
+            if (chunkBegin + chunkHeader[0] > header[2])
+            {
+                error = L"truncated GLB file " + path + L", chunk at byte " + std::to_wstring(offset) + L" ends past the end of the file";
+                return false;
+            }
+
+            if (chunkHeader[1] == jsonChunkType && json == nullptr)
+            {
+                json = (const char*)data + chunkBegin;
+                jsonEnd = json + chunkHeader[0];
+            }
+            else if (chunkHeader[1] == binaryChunkType && binaryChunk.Data == nullptr)
+            {
+                binaryChunk.Data = data + chunkBegin;
+                binaryChunk.Size = chunkHeader[0];
+            }
+            offset = chunkBegin + ((chunkHeader[0] + 3) & ~3u);
+        }
+
+        if (json == nullptr)
+        {
+            error = L"GLB file without a JSON chunk";
+            return false;
+        }
+    }
+
+    // The JSON chunk is padded with spaces, a trailing NUL is tolerated too
+    while (jsonEnd > json && (jsonEnd[-1] == '\0' || jsonEnd[-1] == ' '))
+    {
+        jsonEnd--;
+    }
+
+    JsonParser parser(json, jsonEnd);
+    if (!parser.Parse(document.Root) || document.Root.ValueType != JsonValue::TYPE_OBJECT)
+    {
+        error = L"invalid glTF JSON in " + path;
+        return false;
+    }
+
+    const JsonValue* asset = document.Root.Find("asset");
+    if (asset == nullptr || asset->GetString("version").compare(0, 2, "2.") != 0)
+    {
+        error = L"only glTF 2.0 is supported";
+        return false;
+    }
+
+    if (!document.LoadBuffers(binaryChunk, error))
+    {
+        return false;
+    }
+
+    // ============================================================
+    // 2. MATERIALS
+    // ============================================================
+
+    const uint32_t firstMaterial = (uint32_t)scene.Materials.size();
+    const std::vector<JsonValue>& textures = document.Root.GetArray("textures");
+    const std::vector<JsonValue>& images = document.Root.GetArray("images");
+
+    for (const auto& gltfMaterial : document.Root.GetArray("materials"))
+    {
+        ImportedMaterial material;
+        material.Name = Widen(gltfMaterial.GetString("name"));
+
+        const JsonValue* pbr = gltfMaterial.Find("pbrMetallicRoughness");
+        if (pbr != nullptr)
+        {
+            const std::vector<JsonValue>& factor = pbr->GetArray("baseColorFactor");
+            for (size_t i = 0; i < 4 && factor.size() == 4; i++)
+            {
+                material.BaseColor[i] = (float)factor[i].Number;
+            }
+
+            const JsonValue* baseColorTexture = pbr->Find("baseColorTexture");
+            const int64_t textureIndex = baseColorTexture != nullptr ? baseColorTexture->GetIndex("index") : -1;
+            if (textureIndex >= 0 && textureIndex < (int64_t)textures.size())
+            {
+                const int64_t imageIndex = textures[(size_t)textureIndex].GetIndex("source");
+                const std::string uri = imageIndex >= 0 && imageIndex < (int64_t)images.size() ? images[(size_t)imageIndex].GetString("uri") : std::string();
+                if (!uri.empty() && uri.compare(0, 5, "data:") != 0)
+                {
+                    material.BaseColorTexture = document.Directory + Widen(uri);
+                }
+            }
+        }
+
+        scene.Materials.push_back(material);
+    }
+
+    // ============================================================
+    // 3. PRIMITIVES, ONE TASK EACH
+    // ============================================================
+
+    const std::vector<JsonValue>& gltfMeshes = document.Root.GetArray("meshes");
+    std::vector<std::vector<uint32_t>> meshPrimitives(gltfMeshes.size()); // gltf mesh -> imported meshes
+    std::vector<const JsonValue*> primitives;
+    std::vector<std::wstring> primitiveNames;
+
+    for (size_t meshIndex = 0; meshIndex < gltfMeshes.size(); meshIndex++)
+    {
+        const std::vector<JsonValue>& meshPrimitiveList = gltfMeshes[meshIndex].GetArray("primitives");
+        for (size_t i = 0; i < meshPrimitiveList.size(); i++)
+        {
+            if ((uint32_t)meshPrimitiveList[i].GetNumber("mode", GLTF_MODE_TRIANGLES) != GLTF_MODE_TRIANGLES)
+            {
+                continue; // points and lines can't be ray traced as triangles
+            }
+
+            meshPrimitives[meshIndex].push_back((uint32_t)(scene.Meshes.size() + primitives.size()));
+            primitives.push_back(&meshPrimitiveList[i]);
+
+            std::wstring name = Widen(gltfMeshes[meshIndex].GetString("name"));
+            if (name.empty())
+            {
+                name = L"glTF mesh " + std::to_wstring(meshIndex);
+            }
+            primitiveNames.push_back(meshPrimitiveList.size() > 1 ? name + L"/" + std::to_wstring(i) : name);
+        }
+    }
+
+    const uint32_t firstMesh = (uint32_t)scene.Meshes.size();
+    scene.Meshes.resize(firstMesh + primitives.size());
+    std::vector<std::wstring> primitiveErrors(primitives.size());
+
+    taskPool.Run((uint32_t)primitives.size(), [&](uint32_t primitiveIndex, uint32_t)
+    {
+        const JsonValue& primitive = *primitives[primitiveIndex];
+        ImportedMesh& mesh = scene.Meshes[firstMesh + primitiveIndex];
+        std::wstring& primitiveError = primitiveErrors[primitiveIndex];
+        mesh.Name = primitiveNames[primitiveIndex];
+
+        const int64_t materialIndex = primitive.GetIndex("material");
+        mesh.MaterialIndex = materialIndex >= 0 ? firstMaterial + (uint32_t)materialIndex : ~0u;
+
+        const JsonValue* attributes = primitive.Find("attributes");
+        if (attributes == nullptr || !document.ReadFloats(attributes->GetIndex("POSITION"), 3, mesh.Positions, primitiveError))
+        {
+            if (primitiveError.empty())
+            {
+                primitiveError = L"primitive without positions";
+            }
+            return;
+        }
+
+        const uint32_t vertexNum = mesh.GetVertexNum();
+        if (attributes->GetIndex("NORMAL") >= 0 && !document.ReadFloats(attributes->GetIndex("NORMAL"), 3, mesh.Normals, primitiveError))
+        {
+            return;
+        }
+        if (attributes->GetIndex("TEXCOORD_0") >= 0 && !document.ReadFloats(attributes->GetIndex("TEXCOORD_0"), 2, mesh.Texcoords, primitiveError))
+        {
+            return;
+        }
+
+        if (primitive.GetIndex("indices") >= 0)
+        {
+            if (!document.ReadIndices(primitive.GetIndex("indices"), mesh.Indices, primitiveError))
+            {
+                return;
+            }
+        }
+        else
+        {
+            mesh.Indices.resize(vertexNum);
+            std::iota(mesh.Indices.begin(), mesh.Indices.end(), 0u);
+        }
+
+        mesh.Indices.resize(mesh.Indices.size() / 3 * 3);
+        for (uint32_t index : mesh.Indices)
+        {
+            if (index >= vertexNum)
+            {
+                primitiveError = L"index out of range in " + mesh.Name;
+                return;
+            }
+        }
+
+        if (mesh.Normals.size() != mesh.Positions.size())
+        {
+            GenerateNormals(mesh);
+        }
+        else
+        {
+            NormalizeNormals(mesh.Normals);
+        }
+        if (mesh.Texcoords.size() != (size_t)vertexNum * 2)
+        {
+            mesh.Texcoords.clear();
+        }
+    });
+
+    for (const auto& primitiveError : primitiveErrors)
+    {
+        if (!primitiveError.empty())
+        {
+            error = primitiveError;
+            return false;
+        }
+    }
+
+    // ============================================================
+    // 4. NODE HIERARCHY
+    // ============================================================
+
+    const std::vector<JsonValue>& nodes = document.Root.GetArray("nodes");
+    std::vector<int64_t> roots;
+
+    const std::vector<JsonValue>& scenes = document.Root.GetArray("scenes");
+    const int64_t sceneIndex = (int64_t)document.Root.GetNumber("scene", 0.0);
+    if (sceneIndex >= 0 && sceneIndex < (int64_t)scenes.size())
+    {
+        for (const auto& node : scenes[(size_t)sceneIndex].GetArray("nodes"))
+        {
+            roots.push_back((int64_t)node.Number);
+        }
+    }
+    else
+    {
+        // No scene, every node that isn't a child is a root
+        std::vector<uint8_t> isChild(nodes.size(), 0);
+        for (const auto& node : nodes)
+        {
+            for (const auto& child : node.GetArray("children"))
+            {
+                if (child.Number >= 0 && child.Number < nodes.size())
+                {
+                    isChild[(size_t)child.Number] = 1;
+                }
+            }
+        }
+        for (size_t i = 0; i < nodes.size(); i++)
+        {
+            if (!isChild[i])
+            {
+                roots.push_back((int64_t)i);
+            }
+        }
+    }
+
+    std::vector<std::pair<int64_t, Matrix4>> stack;
+    for (int64_t root : roots)
+    {
+        stack.push_back(std::make_pair(root, Matrix4::Identity()));
+    }
+
+    // glTF requires the hierarchy to be disjoint strict trees, so every node is reached
+    // at most once. Reaching one again means a cycle or a node with two parents.
+    std::vector<uint8_t> visited(nodes.size(), 0);
+    while (!stack.empty())
+    {
+        const int64_t nodeIndex = stack.back().first;
+        const Matrix4 parent = stack.back().second;
+        stack.pop_back();
+
+        if (nodeIndex < 0 || nodeIndex >= (int64_t)nodes.size())
+        {
+            continue;
+        }
+        if (visited[(size_t)nodeIndex])
+        {
+            error = L"node " + std::to_wstring(nodeIndex) + L" is reached twice, the node hierarchy of " + path + L" is not a tree";
+            return false;
+        }
+        visited[(size_t)nodeIndex] = 1;
+
+        const JsonValue& node = nodes[(size_t)nodeIndex];
+        const Matrix4 world = parent * GetNodeMatrix(node);
+
+        const int64_t meshIndex = node.GetIndex("mesh");
+        if (meshIndex >= 0 && meshIndex < (int64_t)meshPrimitives.size())
+        {
+            for (uint32_t importedMesh : meshPrimitives[(size_t)meshIndex])
+            {
+                ImportedInstance instance;
+                instance.MeshIndex = importedMesh;
+                for (int row = 0; row < 3; row++)
+                {
+                    for (int column = 0; column < 4; column++)
+                    {
+                        instance.Transform[row * 4 + column] = world.M[column * 4 + row];
+                    }
+                }
+                scene.Instances.push_back(instance);
+            }
+        }
+
+        for (const auto& child : node.GetArray("children"))
+        {
+            stack.push_back(std::make_pair((int64_t)child.Number, world));
+        }
+    }
+
+    return true;
+}
+
+bool ImportScene(const std::wstring& path, TaskPool& taskPool, ImportedScene& scene, ImportStats& stats, std::wstring& error,
+    bool optimizeLocality)
+{
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    const std::wstring extension = GetExtension(path);
+    bool result;
+    if (extension == L"obj")
+    {
+        result = ImportObj(path, taskPool, scene, error);
+    }
+    else if (extension == L"gltf" || extension == L"glb")
+    {
+        result = ImportGltf(path, taskPool, scene, error);
+    }
+    else
+    {
+        error = L"unknown scene format " + path;
+        return false;
+    }
+
+    const auto optimizeStart = std::chrono::high_resolution_clock::now();
+    if (result && optimizeLocality)
+    {
+        taskPool.Run((uint32_t)scene.Meshes.size(), [&scene](uint32_t meshIndex, uint32_t)
+        {
+            OptimizeMeshLocality(scene.Meshes[meshIndex]);
+        });
+    }
+
+    const auto end = std::chrono::high_resolution_clock::now();
+
+    stats = ImportStats();
+    stats.Milliseconds = std::chrono::duration<double, std::milli>(end - start).count();
+    stats.OptimizeMilliseconds = std::chrono::duration<double, std::milli>(end - optimizeStart).count();
+    stats.ThreadNum = taskPool.GetThreadNum();
+
+    MappedFile file;
+    if (file.Open(path))
+    {
+        stats.SourceBytes = file.GetSize();
+    }
+
+    for (const auto& mesh : scene.Meshes)
+    {
+        stats.TriangleNum += mesh.GetTriangleNum();
+        stats.VertexNum += mesh.GetVertexNum();
+    }
+
+    return result;
+}
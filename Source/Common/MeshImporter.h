@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class TaskPool;
+
+// Imported geometry is kept as separate attribute streams (structure of arrays),
+// which is what the vertex buffers and the compression routines consume
+struct ImportedMesh
+{
+    std::wstring Name;
+    std::vector<float> Positions; // xyz
+    std::vector<float> Normals; // xyz, generated from the triangles when the file has none
+    std::vector<float> Texcoords; // uv with the origin in the top left corner, empty when the file has none
+    std::vector<uint32_t> Indices;
+    uint32_t MaterialIndex = ~0u;
+
+    uint32_t GetVertexNum() const { return (uint32_t)(Positions.size() / 3); }
+    uint32_t GetTriangleNum() const { return (uint32_t)(Indices.size() / 3); }
+};
+
+struct ImportedMaterial
+{
+    std::wstring Name;
+    float BaseColor[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    std::wstring BaseColorTexture; // full path, empty when there is none
+};
+
+struct ImportedInstance
+{
+    uint32_t MeshIndex = 0;
+    float Transform[12] = { }; // row-major 3x4, same layout as VkGeometryInstance::transform
+};
+
+// Read-only access to mesh data that lives elsewhere, either in an ImportedMesh
+// or in a mapped scene cache file
+struct MeshView
+{
+    std::wstring Name;
+    const float* Positions = nullptr;
+    const float* Normals = nullptr;
+    const float* Texcoords = nullptr; // null when the mesh has none
+    const uint32_t* Indices = nullptr;
+    uint32_t VertexNum = 0;
+    uint32_t IndexNum = 0;
+    uint32_t MaterialIndex = ~0u;
+};
+
+struct SceneView
+{
+    std::vector<MeshView> Meshes;
+    std::vector<ImportedMaterial> Materials;
+    std::vector<ImportedInstance> Instances;
+
+    // World space bounds over all instances, false for an empty scene
+    bool GetBounds(float boundsMin[3], float boundsMax[3]) const;
+
+    // Scales and centers the instances so the largest extent of the scene is size
+    void FitToSize(float size);
+};
+
+struct ImportedScene
+{
+    std::vector<ImportedMesh> Meshes;
+    std::vector<ImportedMaterial> Materials;
+    std::vector<ImportedInstance> Instances;
+
+    SceneView GetView() const; // valid while the scene is alive and unchanged
+};
+
+struct ImportStats
+{
+    double Milliseconds = 0.0;
+    uint64_t SourceBytes = 0;
+    uint64_t TriangleNum = 0;
+    uint64_t VertexNum = 0; // after deduplication
+    uint32_t ThreadNum = 0;
+    double OptimizeMilliseconds = 0.0; // part of Milliseconds
+
+    double GetTrianglesPerSecond() const;
+};
+
+// The format is picked from the extension: .obj, .gltf or .glb. Files are memory
+// mapped and parsed on the task pool threads, then every mesh goes through
+// OptimizeMeshLocality unless optimizeLocality is false. Returns false with a message
+// in error when the file can't be read or uses something that isn't supported.
+bool ImportScene(const std::wstring& path, TaskPool& taskPool, ImportedScene& scene, ImportStats& stats, std::wstring& error,
+    bool optimizeLocality = true);
+
+// Wavefront OBJ with MTL materials. Polygons are triangulated as fans, one mesh
+// is created per material and vertices are deduplicated on their v/vt/vn triple.
+bool ImportObj(const std::wstring& path, TaskPool& taskPool, ImportedScene& scene, std::wstring& error);
+
+// glTF 2.0, both the JSON and the binary container. Every triangle primitive
+// becomes a mesh, nodes become instances. Sparse accessors, morph targets and
+// skins are ignored, embedded images aren't loaded.
+bool ImportGltf(const std::wstring& path, TaskPool& taskPool, ImportedScene& scene, std::wstring& error);
+
+// Area weighted vertex normals, used when a mesh comes without them
+void GenerateNormals(ImportedMesh& mesh);
+
+// Sorts the triangles in Morton order of their centroids and then the vertices in
+// the order the triangles use them, so neighbouring hits fetch neighbouring attributes
+void OptimizeMeshLocality(ImportedMesh& mesh);
@@ -0,0 +1,406 @@
+#include "MeshProcessing.h"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <numeric>
+
+namespace
+{
+    struct TriangleCentroid
+    {
+        std::array<float, 3> Position;
+        uint32_t Triangle;
+    };
+
+    void SplitRange(std::vector<TriangleCentroid>& centroids, uint32_t first, uint32_t count,
+        uint32_t maxClusterTriangles, std::vector<MeshCluster>& clusters)
+    {
+        if (count <= maxClusterTriangles)
+        {
+            clusters.push_back({ first, count });
+            return;
+        }
+
+        std::array<float, 3> boundsMin = centroids[first].Position;
+        std::array<float, 3> boundsMax = centroids[first].Position;
+        for (uint32_t i = first + 1; i < first + count; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                boundsMin[axis] = std::min(boundsMin[axis], centroids[i].Position[axis]);
+                boundsMax[axis] = std::max(boundsMax[axis], centroids[i].Position[axis]);
+            }
+        }
+
+        int splitAxis = 0;
+        for (int axis = 1; axis < 3; axis++)
+        {
+            if (boundsMax[axis] - boundsMin[axis] > boundsMax[splitAxis] - boundsMin[splitAxis])
+            {
+                splitAxis = axis;
+            }
+        }
+
+        // Splitting at a multiple of the cluster size keeps the clusters full
+        const uint32_t clusterNum = (count + maxClusterTriangles - 1) / maxClusterTriangles;
+        const uint32_t leftCount = (clusterNum / 2) * maxClusterTriangles;
+
+        auto begin = centroids.begin() + first;
+        std::nth_element(begin, begin + leftCount, begin + count,
+            [splitAxis](const TriangleCentroid& a, const TriangleCentroid& b) { return a.Position[splitAxis] < b.Position[splitAxis]; });
+
+        SplitRange(centroids, first, leftCount, maxClusterTriangles, clusters);
+        SplitRange(centroids, first + leftCount, count - leftCount, maxClusterTriangles, clusters);
+    }
+
+    inline uint64_t RotateLeft(uint64_t value, int shift)
+    {
+        return (value << shift) | (value >> (64 - shift));
+    }
+
+    inline uint64_t ReadWord(const uint8_t* data)
+    {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        return word;
+    }
+
+    // Spreads the lower 10 bits of value to every third bit
+    uint32_t ExpandBits(uint32_t value)
+    {
+        value = (value | (value << 16)) & 0x030000FF;
+        value = (value | (value << 8)) & 0x0300F00F;
+        value = (value | (value << 4)) & 0x030C30C3;
+        value = (value | (value << 2)) & 0x09249249;
+        return value;
+    }
+
+    void ComputeBounds(const float* positions, uint32_t vertexNum, std::array<float, 3>& boundsMin, std::array<float, 3>& boundsMax)
+    {
+        boundsMin = { positions[0], positions[1], positions[2] };
+        boundsMax = boundsMin;
+        for (uint32_t i = 1; i < vertexNum; i++)
+        {
+            for (int axis = 0; axis < 3; axis++)
+            {
+                boundsMin[axis] = std::min(boundsMin[axis], positions[i * 3 + axis]);
+                boundsMax[axis] = std::max(boundsMax[axis], positions[i * 3 + axis]);
+            }
+        }
+    }
+
+    // Set associative cache with LRU replacement, ages count accesses
+    class CacheSimulator
+    {
+    private:
+        static const uint32_t WayNum = 4;
+
+        std::vector<uint64_t> _tags;
+        std::vector<uint64_t> _ages;
+        uint32_t _setNum;
+        uint64_t _time = 0;
+
+    public:
+        explicit CacheSimulator(uint32_t lineNum)
+            : _setNum(std::max(lineNum / WayNum, 1u))
+        {
+            _tags.assign((size_t)_setNum * WayNum, ~0ull);
+            _ages.assign((size_t)_setNum * WayNum, 0);
+        }
+
+        // Returns true on a miss
+        bool Access(uint64_t line)
+        {
+            const size_t set = (size_t)(line % _setNum) * WayNum;
+            _time++;
+
+            size_t oldest = set;
+            for (size_t way = set; way < set + WayNum; way++)
+            {
+                if (_tags[way] == line)
+                {
+                    _ages[way] = _time;
+                    return false;
+                }
+                if (_ages[way] < _ages[oldest])
+                {
+                    oldest = way;
+                }
+            }
+
+            _tags[oldest] = line;
+            _ages[oldest] = _time;
+            return true;
+        }
+    };
+}
+
+std::vector<MeshCluster> SplitMeshIntoClusters(const float* positions, std::vector<uint32_t>& indices,
+    uint32_t maxClusterTriangles)
+{
+    const uint32_t triangleNum = (uint32_t)(indices.size() / 3);
+
+    std::vector<MeshCluster> clusters;
+    if (triangleNum <= maxClusterTriangles)
+    {
+        clusters.push_back({ 0, triangleNum });
+        return clusters;
+    }
+
+    std::vector<TriangleCentroid> centroids(triangleNum);
+    for (uint32_t triangle = 0; triangle < triangleNum; triangle++)
+    {
+        TriangleCentroid& centroid = centroids[triangle];
+        centroid.Triangle = triangle;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            centroid.Position[axis] = (positions[indices[triangle * 3] * 3 + axis] +
+                positions[indices[triangle * 3 + 1] * 3 + axis] +
+                positions[indices[triangle * 3 + 2] * 3 + axis]) * (1.0f / 3.0f);
+        }
+    }
+
+    SplitRange(centroids, 0, triangleNum, maxClusterTriangles, clusters);
+
+    // The partitioning shuffles the triangles, restoring their order inside every
+    // cluster keeps an earlier locality sort
+    for (const MeshCluster& cluster : clusters)
+    {
+        auto begin = centroids.begin() + cluster.FirstTriangle;
+        std::sort(begin, begin + cluster.TriangleNum,
+            [](const TriangleCentroid& a, const TriangleCentroid& b) { return a.Triangle < b.Triangle; });
+    }
+
+    std::vector<uint32_t> reordered(indices.size());
+    for (uint32_t i = 0; i < triangleNum; i++)
+    {
+        const uint32_t triangle = centroids[i].Triangle;
+        reordered[i * 3] = indices[triangle * 3];
+        reordered[i * 3 + 1] = indices[triangle * 3 + 1];
+        reordered[i * 3 + 2] = indices[triangle * 3 + 2];
+    }
+    indices.swap(reordered);
+
+    return clusters;
+}
+
+void SortTrianglesMorton(const float* positions, uint32_t vertexNum, std::vector<uint32_t>& indices)
+{
+    const uint32_t triangleNum = (uint32_t)(indices.size() / 3);
+    if (triangleNum < 2 || vertexNum == 0)
+    {
+        return;
+    }
+
+    std::array<float, 3> boundsMin;
+    std::array<float, 3> boundsMax;
+    ComputeBounds(positions, vertexNum, boundsMin, boundsMax);
+
+    // 10 bits per axis over the mesh bounds, finer cells don't change the order of real meshes
+    std::array<float, 3> scale;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        const float extent = boundsMax[axis] - boundsMin[axis];
+        scale[axis] = extent > 0.0f ? 1023.0f / extent : 0.0f;
+    }
+
+    // Code in the upper half and triangle in the lower half, so one integer sort does it
+    std::vector<uint64_t> keys(triangleNum);
+    for (uint32_t triangle = 0; triangle < triangleNum; triangle++)
+    {
+        uint32_t code = 0;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            const float centroid = (positions[indices[triangle * 3] * 3 + axis] +
+                positions[indices[triangle * 3 + 1] * 3 + axis] +
+                positions[indices[triangle * 3 + 2] * 3 + axis]) * (1.0f / 3.0f);
+            const uint32_t cell = (uint32_t)std::min(std::max((centroid - boundsMin[axis]) * scale[axis], 0.0f), 1023.0f);
+            code |= ExpandBits(cell) << axis;
+        }
+        keys[triangle] = ((uint64_t)code << 32) | triangle;
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<uint32_t> reordered(indices.size());
+    for (uint32_t i = 0; i < triangleNum; i++)
+    {
+        const uint32_t triangle = (uint32_t)keys[i];
+        reordered[i * 3] = indices[triangle * 3];
+        reordered[i * 3 + 1] = indices[triangle * 3 + 1];
+        reordered[i * 3 + 2] = indices[triangle * 3 + 2];
+    }
+    indices.swap(reordered);
+}
+
+std::vector<uint32_t> SortVerticesByFirstUse(uint32_t vertexNum, std::vector<uint32_t>& indices)
+{
+    std::vector<uint32_t> oldToNew(vertexNum, ~0u);
+    std::vector<uint32_t> newToOld;
+    newToOld.reserve(vertexNum);
+
+    for (uint32_t& index : indices)
+    {
+        if (oldToNew[index] == ~0u)
+        {
+            oldToNew[index] = (uint32_t)newToOld.size();
+            newToOld.push_back(index);
+        }
+        index = oldToNew[index];
+    }
+
+    for (uint32_t vertex = 0; vertex < vertexNum; vertex++)
+    {
+        if (oldToNew[vertex] == ~0u)
+        {
+            newToOld.push_back(vertex);
+        }
+    }
+
+    return newToOld;
+}
+
+void PermuteVertexStream(const std::vector<uint32_t>& newToOld, uint32_t componentNum, std::vector<float>& stream)
+{
+    if (stream.empty())
+    {
+        return;
+    }
+
+    std::vector<float> permuted(stream.size());
+    for (size_t vertex = 0; vertex < newToOld.size(); vertex++)
+    {
+        const float* source = &stream[(size_t)newToOld[vertex] * componentNum];
+        std::copy(source, source + componentNum, &permuted[vertex * componentNum]);
+    }
+    stream.swap(permuted);
+}
+
+VertexFetchStats SimulateVertexFetch(const float* positions, const std::vector<uint32_t>& indices, uint32_t vertexStride,
+    uint32_t cacheSize)
+{
+    const uint32_t lineSize = 64;
+    const uint32_t gridSize = 256;
+    const uint32_t tileSize = 8;
+    const uint32_t tilesPerRow = gridSize / tileSize;
+
+    VertexFetchStats stats;
+    stats.TriangleNum = indices.size() / 3;
+    if (stats.TriangleNum == 0)
+    {
+        return stats;
+    }
+
+    // The bounds of the referenced vertices are enough for the projection
+    const uint32_t vertexNum = *std::max_element(indices.begin(), indices.end()) + 1;
+    std::array<float, 3> boundsMin;
+    std::array<float, 3> boundsMax;
+    ComputeBounds(positions, vertexNum, boundsMin, boundsMax);
+
+    // Counting sort by tile keeps the index order inside every tile
+    const uint32_t triangleNum = (uint32_t)stats.TriangleNum;
+    std::vector<uint32_t> tiles(triangleNum);
+    std::vector<uint32_t> tileStarts(tilesPerRow * tilesPerRow + 1, 0);
+    for (uint32_t triangle = 0; triangle < triangleNum; triangle++)
+    {
+        uint32_t cell[2];
+        for (int axis = 0; axis < 2; axis++)
+        {
+            const float extent = boundsMax[axis] - boundsMin[axis];
+            const float centroid = (positions[indices[triangle * 3] * 3 + axis] +
+                positions[indices[triangle * 3 + 1] * 3 + axis] +
+                positions[indices[triangle * 3 + 2] * 3 + axis]) * (1.0f / 3.0f);
+            const float normalized = extent > 0.0f ? (centroid - boundsMin[axis]) / extent : 0.0f;
+            cell[axis] = std::min((uint32_t)(std::max(normalized, 0.0f) * gridSize), gridSize - 1);
+        }
+        tiles[triangle] = (cell[1] / tileSize) * tilesPerRow + cell[0] / tileSize;
+        tileStarts[tiles[triangle] + 1]++;
+    }
+    std::partial_sum(tileStarts.begin(), tileStarts.end(), tileStarts.begin());
+
+    std::vector<uint32_t> visitOrder(triangleNum);
+    for (uint32_t triangle = 0; triangle < triangleNum; triangle++)
+    {
+        visitOrder[tileStarts[tiles[triangle]]++] = triangle;
+    }
+
+    CacheSimulator cache(cacheSize / lineSize);
+    std::vector<uint64_t> lines;
+    for (uint32_t triangle : visitOrder)
+    {
+        lines.clear();
+        for (int corner = 0; corner < 3; corner++)
+        {
+            const uint64_t address = (uint64_t)indices[triangle * 3 + corner] * vertexStride;
+            for (uint64_t line = address / lineSize; line <= (address + vertexStride - 1) / lineSize; line++)
+            {
+                if (std::find(lines.begin(), lines.end(), line) == lines.end())
+                {
+                    lines.push_back(line);
+                }
+            }
+        }
+
+        stats.LineTouchNum += lines.size();
+        for (uint64_t line : lines)
+        {
+            stats.MissNum += cache.Access(line) ? 1 : 0;
+        }
+    }
+
+    return stats;
+}
+
+uint64_t ChecksumBytes(const void* data, size_t size, uint64_t seed)
+{
+    // xxHash64 style: four independent lanes over 32 byte blocks, so the
+    // multiplies pipeline, then a scalar tail
+    const uint64_t prime1 = 0x9E3779B185EBCA87ull;
+    const uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+    const uint64_t prime3 = 0x165667B19E3779F9ull;
+
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + size;
+
+    uint64_t lanes[4] = { seed + prime1 + prime2, seed + prime2, seed, seed - prime1 };
+    for (; end - p >= 32; p += 32)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            lanes[i] = RotateLeft(lanes[i] + ReadWord(p + i * 8) * prime2, 31) * prime1;
+        }
+    }
+
+    uint64_t hash = RotateLeft(lanes[0], 1) + RotateLeft(lanes[1], 7) + RotateLeft(lanes[2], 12) + RotateLeft(lanes[3], 18);
+    hash += size;
+
+    for (; end - p >= 8; p += 8)
+    {
+        hash ^= RotateLeft(ReadWord(p) * prime2, 31) * prime1;
+        hash = RotateLeft(hash, 27) * prime1 + prime3;
+    }
+    for (; p < end; p++)
+    {
+        hash ^= *p * prime3;
+        hash = RotateLeft(hash, 11) * prime1;
+    }
+
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+bool CanUse16BitIndices(uint32_t vertexNum)
+{
+    return vertexNum <= 0x10000;
+}
+
+std::vector<uint16_t> NarrowIndicesTo16Bit(const std::vector<uint32_t>& indices)
+{
+    std::vector<uint16_t> result(indices.size());
+    std::transform(indices.begin(), indices.end(), result.begin(), [](uint32_t index) { return (uint16_t)index; });
+    return result;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// CPU side processing of indexed triangle meshes. Positions are tightly packed
+// float triples, indices are 32-bit until they are narrowed for upload.
+
+struct MeshCluster
+{
+    uint32_t FirstTriangle;
+    uint32_t TriangleNum;
+};
+
+// Reorders the triangles so that every cluster is a contiguous, spatially coherent
+// index range of at most maxClusterTriangles triangles. Uses median splits of the
+// triangle centroids along the longest axis, the clusters are returned in index order.
+std::vector<MeshCluster> SplitMeshIntoClusters(const float* positions, std::vector<uint32_t>& indices,
+    uint32_t maxClusterTriangles);
+
+// Sorts the triangles along a Morton curve through their centroids, so triangles that
+// are close in space are close in the index buffer. That is the input order BLAS builds
+// like best, and it keeps the triangles coherent rays hit in the same part of memory.
+void SortTrianglesMorton(const float* positions, uint32_t vertexNum, std::vector<uint32_t>& indices);
+
+// Renumbers the vertices in the order the triangles first reference them, unreferenced
+// vertices go last. Returns the old vertex of every new one, see PermuteVertexStream.
+std::vector<uint32_t> SortVerticesByFirstUse(uint32_t vertexNum, std::vector<uint32_t>& indices);
+void PermuteVertexStream(const std::vector<uint32_t>& newToOld, uint32_t componentNum, std::vector<float>& stream);
+
+struct VertexFetchStats
+{
+    uint64_t TriangleNum = 0;
+    uint64_t LineTouchNum = 0; // distinct cache lines per triangle, summed over all triangles
+    uint64_t MissNum = 0;
+
+    double GetLinesPerTriangle() const { return TriangleNum > 0 ? (double)LineTouchNum / TriangleNum : 0.0; }
+    double GetMissesPerTriangle() const { return TriangleNum > 0 ? (double)MissNum / TriangleNum : 0.0; }
+};
+
+// Replays the attribute fetches of the hit shaders for a vertex stream with
+// vertexStride bytes per vertex on a 4-way set associative LRU cache with 64 byte
+// lines. Triangles are visited in 8x8 tiles of a 256x256 grid over their centroids
+// projected along z, in index order inside a tile, which approximates coherent
+// primary rays hitting neighbouring triangles.
+VertexFetchStats SimulateVertexFetch(const float* positions, const std::vector<uint32_t>& indices, uint32_t vertexStride,
+    uint32_t cacheSize = 16 * 1024);
+
+// Word-wise 64-bit hash, several GB/s, for checksums and content keys
+uint64_t ChecksumBytes(const void* data, size_t size, uint64_t seed = 0);
+
+// True if all indices of a mesh with vertexNum vertices fit into 16 bits
+bool CanUse16BitIndices(uint32_t vertexNum);
+std::vector<uint16_t> NarrowIndicesTo16Bit(const std::vector<uint32_t>& indices);
@@ -0,0 +1,183 @@
+#include "ProceduralScene.h"
+
+#include <cmath>
+#include <cstring>
+
+namespace
+{
+    ImportedMesh CreateBoxMesh()
+    {
+        const float h = 0.25f; // half size
+
+        ImportedMesh mesh;
+        mesh.Name = L"Box";
+        mesh.Positions =
+        {
+            -h, -h, -h, -h, -h,  h, -h,  h, -h, -h,  h,  h,
+             h, -h, -h,  h, -h,  h,  h,  h, -h,  h,  h,  h,
+            -h, -h, -h, -h, -h,  h,  h, -h, -h,  h, -h,  h,
+            -h,  h, -h, -h,  h,  h,  h,  h, -h,  h,  h,  h,
+            -h, -h, -h, -h,  h, -h,  h, -h, -h,  h,  h, -h,
+            -h, -h,  h, -h,  h,  h,  h, -h,  h,  h,  h,  h,
+        };
+
+        // Every face repeats its texture twice in both directions
+        for (int face = 0; face < 6; face++)
+        {
+            mesh.Texcoords.insert(mesh.Texcoords.end(), { 0.0f, 0.0f, 2.0f, 0.0f, 0.0f, 2.0f, 2.0f, 2.0f });
+        }
+
+        const float faceNormals[6][3] =
+        {
+            { -1.0f, 0.0f, 0.0f }, { 1.0f, 0.0f, 0.0f },
+            { 0.0f, -1.0f, 0.0f }, { 0.0f, 1.0f, 0.0f },
+            { 0.0f, 0.0f, -1.0f }, { 0.0f, 0.0f, 1.0f },
+        };
+        for (int face = 0; face < 6; face++)
+        {
+            for (int vertex = 0; vertex < 4; vertex++)
+            {
+                mesh.Normals.insert(mesh.Normals.end(), faceNormals[face], faceNormals[face] + 3);
+            }
+        }
+
+        for (uint32_t face = 0; face < 6; face++)
+        {
+            const uint32_t first = face * 4;
+            mesh.Indices.insert(mesh.Indices.end(), { first, first + 1, first + 2, first + 1, first + 2, first + 3 });
+        }
+
+        return mesh;
+    }
+
+    ImportedMesh CreateIcosahedronMesh()
+    {
+        const float scale = 0.25f;
+        const float d = (1.0f + sqrtf(5.0f)) * 0.5f * scale;
+
+        ImportedMesh mesh;
+        mesh.Name = L"Icosahedron";
+        mesh.Positions =
+        {
+            -scale, +d, 0,
+            +scale, +d, 0,
+            -scale, -d, 0,
+            +scale, -d, 0,
+            +0, -scale, +d,
+            +0, +scale, +d,
+            +0, -scale, -d,
+            +0, +scale, -d,
+            +d, 0, -scale,
+            +d, 0, +scale,
+            -d, 0, -scale,
+            -d, 0, +scale,
+        };
+
+        // The vertices lie on a sphere, their normals point away from the center
+        mesh.Normals.resize(mesh.Positions.size());
+        for (size_t i = 0; i < mesh.Positions.size(); i += 3)
+        {
+            const float* position = &mesh.Positions[i];
+            const float invLength = 1.0f / sqrtf(position[0] * position[0] + position[1] * position[1] + position[2] * position[2]);
+            for (int axis = 0; axis < 3; axis++)
+            {
+                mesh.Normals[i + axis] = position[axis] * invLength;
+            }
+        }
+
+        mesh.Indices =
+        {
+            0, 11, 5, 0, 5, 1, 0, 1, 7, 0, 7, 10, 0, 10, 11,
+            1, 5, 9, 5, 11, 4, 11, 10, 2, 10, 7, 6, 7, 1, 8,
+            3, 9, 4, 3, 4, 2, 3, 2, 6, 3, 6, 8, 3, 8, 9,
+            4, 9, 5, 2, 4, 11, 6, 2, 10, 8, 6, 7, 9, 8, 1
+        };
+
+        return mesh;
+    }
+}
+
+void GenerateProceduralScene(const std::wstring& textureFolder, ImportedScene& scene)
+{
+    scene = ImportedScene();
+
+    // One mesh per object, the boxes only differ in their material
+    const uint32_t objectNum = 5;
+    const wchar_t* textures[objectNum] = { L"cb0.bmp", nullptr, L"cb1.bmp", L"cb2.bmp", nullptr };
+
+    for (uint32_t i = 0; i < objectNum; i++)
+    {
+        if (textures[i] == nullptr)
+        {
+            scene.Meshes.push_back(CreateIcosahedronMesh());
+            continue;
+        }
+
+        ImportedMaterial material;
+        material.Name = textures[i];
+        material.BaseColorTexture = textureFolder + textures[i];
+        scene.Materials.push_back(material);
+
+        scene.Meshes.push_back(CreateBoxMesh());
+        scene.Meshes.back().MaterialIndex = (uint32_t)scene.Materials.size() - 1;
+    }
+
+    const float width = 4.0f;
+    const float height = 0.75f;
+    const float depth = 0.75f;
+    const float stepX = width / objectNum;
+    const float stepY = height / objectNum;
+    const float stepZ = depth / objectNum;
+    const float biasX = -stepX * float(objectNum - 1.0f) * 0.5f;
+    const float biasY = -stepY * float(objectNum - 1.0f) * 0.5f - 0.75f;
+    const float biasZ = -stepZ * float(objectNum - 1.0f) * 0.5f;
+
+    scene.Instances.resize(objectNum);
+    for (uint32_t i = 0; i < objectNum; i++)
+    {
+        const float transform[12] =
+        {
+            1.0f, 0.0f, 0.0f, biasX + stepX * i,
+            0.0f, 1.0f, 0.0f, biasY + stepY * i,
+            0.0f, 0.0f, 1.0f, biasZ + stepZ * i,
+        };
+
+        scene.Instances[i].MeshIndex = i;
+        memcpy(scene.Instances[i].Transform, transform, sizeof(transform));
+    }
+}
+
+void GenerateSecondaryRaysScene(ImportedScene& scene)
+{
+    scene = ImportedScene();
+
+    ImportedMesh mesh = CreateIcosahedronMesh();
+    mesh.Name = L"Icosahedron and plane";
+
+    const float planeBiasX = -1.5f;
+    const float planeBiasY = -1.85f;
+    const uint32_t first = mesh.GetVertexNum();
+    mesh.Positions.insert(mesh.Positions.end(),
+    {
+        -1.0f + planeBiasX, planeBiasY, +1.0f,
+        +1.0f + planeBiasX, planeBiasY, +1.0f,
+        +1.0f + planeBiasX, planeBiasY, -1.0f,
+        -1.0f + planeBiasX, planeBiasY, -1.0f,
+    });
+    for (int vertex = 0; vertex < 4; vertex++)
+    {
+        mesh.Normals.insert(mesh.Normals.end(), { 0.0f, 1.0f, 0.0f });
+    }
+    mesh.Indices.insert(mesh.Indices.end(), { first, first + 1, first + 2, first, first + 2, first + 3 });
+    scene.Meshes.push_back(mesh);
+
+    const float transform[12] =
+    {
+        1.0f, 0.0f, 0.0f, 1.0f,
+        0.0f, 1.0f, 0.0f, 1.0f,
+        0.0f, 0.0f, 1.0f, 0.0f,
+    };
+    scene.Instances.resize(1);
+    scene.Instances[0].MeshIndex = 0;
+    memcpy(scene.Instances[0].Transform, transform, sizeof(transform));
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "MeshImporter.h"
+#include <string>
+
+// The scene sample 11 shows without a -scene file: three textured boxes and two
+// icosahedrons on a diagonal in front of the camera. The boxes use cb0.bmp to
+// cb2.bmp from textureFolder. Both the Vulkan sample and the CPU tracer create
+// their objects from it, so they render the same thing.
+void GenerateProceduralScene(const std::wstring& textureFolder, ImportedScene& scene);
+
+// The scene of sample 09: an icosahedron above a plane in one mesh, with the
+// vertices and indices of its CreateAccelerationStructures and a single instance
+// moved by (1, 1, 0) like there. No materials.
+void GenerateSecondaryRaysScene(ImportedScene& scene);
@@ -32,15 +32,15 @@ void RayTracingApplication::CreateDevice()
         deviceQueueCreateInfos.push_back(deviceQueueCreateInfo);
     }
 
-    VkPhysicalDeviceDescriptorIndexingFeaturesEXT descriptorIndexing = { };
-    descriptorIndexing.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+    _descriptorIndexingFeatures = { };
+    _descriptorIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
 
     VkPhysicalDeviceFeatures2 features2 = { };
     features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
 
     auto found = std::find(_deviceExtensions.begin(), _deviceExtensions.end(), VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
     if (found != _deviceExtensions.end())
-        features2.pNext = &descriptorIndexing;
+        features2.pNext = &_descriptorIndexingFeatures;
 
     vkGetPhysicalDeviceFeatures2( _physicalDevice, &features2 );
 
@@ -1,18 +1,9 @@
 #pragma once
 
 #include "Application.h"
+#include "GeometryInstance.h"
 #include "vulkan/vulkan.h"
 
-struct VkGeometryInstance
-{
-    float transform[12];
-    uint32_t instanceId : 24;
-    uint32_t mask : 8;
-    uint32_t instanceOffset : 24;
-    uint32_t flags : 8;
-    uint64_t accelerationStructureHandle;
-};
-
 class RayTracingApplication : public Application
 {
 public:
@@ -33,6 +24,7 @@ protected:
     PFN_vkGetAccelerationStructureHandleNV vkGetAccelerationStructureHandleNV = VK_NULL_HANDLE;
 
     VkPhysicalDeviceRayTracingPropertiesNV _rayTracingProperties = { };
+    VkPhysicalDeviceDescriptorIndexingFeaturesEXT _descriptorIndexingFeatures = { }; // everything supported is enabled
 
     void InitRayTracing();
     virtual void CreateDevice() override; // Tutorial 01
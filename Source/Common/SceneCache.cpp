@@ -0,0 +1,442 @@
+#include "SceneCache.h"
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+
+namespace
+{
+
+const char SceneCacheMagic[8] = { 'V', 'K', 'R', 'S', 'C', 'E', 'N', 'E' };
+const uint64_t StreamAlignment = 64;
+
+uint64_t AlignUp(uint64_t value, uint64_t alignment)
+{
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+std::string ToUtf8(const std::wstring& text)
+{
+    return NarrowPath(text);
+}
+
+// The inverse of ToUtf8 for the code points that fit into a wchar_t
+std::wstring FromUtf8(const char* text, size_t length)
+{
+    std::wstring result;
+    for (size_t i = 0; i < length;)
+    {
+        const uint8_t c = (uint8_t)text[i];
+        uint32_t codePoint = c;
+        size_t continuationNum = 0;
+        if (c >= 0xF0) { codePoint = c & 0x07; continuationNum = 3; }
+        else if (c >= 0xE0) { codePoint = c & 0x0F; continuationNum = 2; }
+        else if (c >= 0xC0) { codePoint = c & 0x1F; continuationNum = 1; }
+
+        i++;
+        for (size_t k = 0; k < continuationNum && i < length; k++, i++)
+        {
+            codePoint = (codePoint << 6) | ((uint8_t)text[i] & 0x3F);
+        }
+        result += (wchar_t)codePoint;
+    }
+    return result;
+}
+
+uint64_t HashHeader(const SceneCacheHeader& header)
+{
+    return ChecksumBytes(&header, offsetof(SceneCacheHeader, HeaderChecksum));
+}
+
+uint64_t HashMeshStreams(const SceneCacheMesh& mesh, const uint8_t* base)
+{
+    uint64_t hash = ChecksumBytes(base + mesh.PositionsOffset, (size_t)mesh.VertexNum * 3 * sizeof(float));
+    hash = ChecksumBytes(base + mesh.NormalsOffset, (size_t)mesh.VertexNum * 3 * sizeof(float), hash);
+    if (mesh.TexcoordsOffset != 0)
+    {
+        hash = ChecksumBytes(base + mesh.TexcoordsOffset, (size_t)mesh.VertexNum * 2 * sizeof(float), hash);
+    }
+    return ChecksumBytes(base + mesh.IndicesOffset, (size_t)mesh.IndexNum * sizeof(uint32_t), hash);
+}
+
+bool IsRangeValid(uint64_t offset, uint64_t size, uint64_t fileSize)
+{
+    return offset <= fileSize && size <= fileSize - offset;
+}
+
+class StringBlock
+{
+private:
+    std::string _data;
+
+public:
+    void Add(const std::wstring& text, uint32_t& offset, uint32_t& length)
+    {
+        const std::string utf8 = ToUtf8(text);
+        offset = (uint32_t)_data.size();
+        length = (uint32_t)utf8.size();
+        _data += utf8;
+    }
+
+    const std::string& GetData() const { return _data; }
+};
+
+// Narrow paths are UTF-8 only outside of Windows
+int RemoveFile(const std::wstring& path)
+{
+#ifdef _WIN32
+    return _wremove(path.c_str());
+#else
+    return remove(NarrowPath(path).c_str());
+#endif
+}
+
+int RenameFile(const std::wstring& from, const std::wstring& to)
+{
+#ifdef _WIN32
+    return _wrename(from.c_str(), to.c_str());
+#else
+    return rename(NarrowPath(from).c_str(), NarrowPath(to).c_str());
+#endif
+}
+
+bool WriteAll(FILE* file, const void* data, size_t size)
+{
+    return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+bool WritePadding(FILE* file, uint64_t& position, uint64_t alignment)
+{
+    static const uint8_t zeros[StreamAlignment] = { };
+    const uint64_t aligned = AlignUp(position, alignment);
+    const bool result = WriteAll(file, zeros, (size_t)(aligned - position));
+    position = aligned;
+    return result;
+}
+
+} // namespace
+
+bool WriteSceneCache(const std::wstring& path, const SceneView& scene, const std::wstring& sourcePath, std::wstring& error)
+{
+    // ============================================================
+    // 1. LAYOUT
+    // ============================================================
+
+    SceneCacheHeader header = { };
+    memcpy(header.Magic, SceneCacheMagic, sizeof(header.Magic));
+    header.Version = SceneCacheHeader::CurrentVersion;
+    header.MeshNum = (uint32_t)scene.Meshes.size();
+    header.MaterialNum = (uint32_t)scene.Materials.size();
+    header.InstanceNum = (uint32_t)scene.Instances.size();
+
+    if (!sourcePath.empty())
+    {
+        MappedFile source;
+        if (source.Open(sourcePath))
+        {
+            header.SourceSize = source.GetSize();
+        }
+        GetFileTimestamp(sourcePath, header.SourceTimestamp);
+    }
+
+    StringBlock strings;
+    std::vector<SceneCacheMesh> meshes(scene.Meshes.size());
+    std::vector<SceneCacheMaterial> materials(scene.Materials.size());
+    std::vector<SceneCacheInstance> instances(scene.Instances.size());
+
+    for (size_t i = 0; i < materials.size(); i++)
+    {
+        const ImportedMaterial& source = scene.Materials[i];
+        SceneCacheMaterial& material = materials[i];
+        memcpy(material.BaseColor, source.BaseColor, sizeof(material.BaseColor));
+        strings.Add(source.Name, material.NameOffset, material.NameLength);
+        strings.Add(source.BaseColorTexture, material.TextureOffset, material.TextureLength);
+    }
+
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+        instances[i].MeshIndex = scene.Instances[i].MeshIndex;
+        memcpy(instances[i].Transform, scene.Instances[i].Transform, sizeof(instances[i].Transform));
+    }
+
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        strings.Add(scene.Meshes[i].Name, meshes[i].NameOffset, meshes[i].NameLength);
+    }
+
+    header.TablesOffset = sizeof(SceneCacheHeader);
+    header.TablesSize = meshes.size() * sizeof(SceneCacheMesh) + materials.size() * sizeof(SceneCacheMaterial) +
+        instances.size() * sizeof(SceneCacheInstance) + strings.GetData().size();
+
+    uint64_t offset = AlignUp(header.TablesOffset + header.TablesSize, StreamAlignment);
+    for (size_t i = 0; i < meshes.size(); i++)
+    {
+        const MeshView& source = scene.Meshes[i];
+        SceneCacheMesh& mesh = meshes[i];
+        mesh.VertexNum = source.VertexNum;
+        mesh.IndexNum = source.IndexNum;
+        mesh.MaterialIndex = source.MaterialIndex;
+
+        mesh.PositionsOffset = offset;
+        offset = AlignUp(offset + (uint64_t)source.VertexNum * 3 * sizeof(float), StreamAlignment);
+        mesh.NormalsOffset = offset;
+        offset = AlignUp(offset + (uint64_t)source.VertexNum * 3 * sizeof(float), StreamAlignment);
+        if (source.Texcoords != nullptr)
+        {
+            mesh.TexcoordsOffset = offset;
+            offset = AlignUp(offset + (uint64_t)source.VertexNum * 2 * sizeof(float), StreamAlignment);
+        }
+        mesh.IndicesOffset = offset;
+        offset = AlignUp(offset + (uint64_t)source.IndexNum * sizeof(uint32_t), StreamAlignment);
+
+        // Same hash as HashMeshStreams, computed from the source pointers
+        uint64_t hash = ChecksumBytes(source.Positions, (size_t)source.VertexNum * 3 * sizeof(float));
+        hash = ChecksumBytes(source.Normals, (size_t)source.VertexNum * 3 * sizeof(float), hash);
+        if (source.Texcoords != nullptr)
+        {
+            hash = ChecksumBytes(source.Texcoords, (size_t)source.VertexNum * 2 * sizeof(float), hash);
+        }
+        mesh.Checksum = ChecksumBytes(source.Indices, (size_t)source.IndexNum * sizeof(uint32_t), hash);
+    }
+    header.FileSize = offset;
+
+    // Tables are hashed as one block, the way Load sees them
+    std::vector<uint8_t> tables((size_t)header.TablesSize);
+    uint8_t* tablesEnd = tables.data();
+    const auto Append = [&tablesEnd](const void* data, size_t size)
+    {
+        if (size != 0)
+        {
+            memcpy(tablesEnd, data, size);
+            tablesEnd += size;
+        }
+    };
+    Append(meshes.data(), meshes.size() * sizeof(SceneCacheMesh));
+    Append(materials.data(), materials.size() * sizeof(SceneCacheMaterial));
+    Append(instances.data(), instances.size() * sizeof(SceneCacheInstance));
+    Append(strings.GetData().data(), strings.GetData().size());
+
+    header.TablesChecksum = ChecksumBytes(tables.data(), tables.size());
+    header.HeaderChecksum = HashHeader(header);
+
+    // ============================================================
+    // 2. WRITE
+    // Into a temporary file first, so a failed conversion never
+    // leaves a cache behind that looks valid.
+    // ============================================================
+
+    const std::wstring temporaryPath = path + L".tmp";
+    FILE* file = OpenFile(temporaryPath, "wb");
+    if (file == nullptr)
+    {
+        error = L"failed to create " + temporaryPath;
+        return false;
+    }
+
+    bool written = WriteAll(file, &header, sizeof(header)) && WriteAll(file, tables.data(), tables.size());
+
+    uint64_t position = header.TablesOffset + header.TablesSize;
+    for (size_t i = 0; i < meshes.size() && written; i++)
+    {
+        const MeshView& source = scene.Meshes[i];
+        written = WritePadding(file, position, StreamAlignment) &&
+            WriteAll(file, source.Positions, (size_t)source.VertexNum * 3 * sizeof(float)) &&
+            (position += (uint64_t)source.VertexNum * 3 * sizeof(float), WritePadding(file, position, StreamAlignment)) &&
+            WriteAll(file, source.Normals, (size_t)source.VertexNum * 3 * sizeof(float));
+        position += (uint64_t)source.VertexNum * 3 * sizeof(float);
+
+        if (written && source.Texcoords != nullptr)
+        {
+            written = WritePadding(file, position, StreamAlignment) &&
+                WriteAll(file, source.Texcoords, (size_t)source.VertexNum * 2 * sizeof(float));
+            position += (uint64_t)source.VertexNum * 2 * sizeof(float);
+        }
+
+        written = written && WritePadding(file, position, StreamAlignment) &&
+            WriteAll(file, source.Indices, (size_t)source.IndexNum * sizeof(uint32_t));
+        position += (uint64_t)source.IndexNum * sizeof(uint32_t);
+    }
+    written = written && WritePadding(file, position, StreamAlignment) && position == header.FileSize;
+
+    written = fclose(file) == 0 && written;
+    if (!written)
+    {
+        RemoveFile(temporaryPath);
+        error = L"failed to write " + temporaryPath;
+        return false;
+    }
+
+    RemoveFile(path);
+    if (RenameFile(temporaryPath, path) != 0)
+    {
+        error = L"failed to rename " + temporaryPath + L" to " + path;
+        return false;
+    }
+
+    return true;
+}
+
+bool SceneCache::Load(const std::wstring& path, TaskPool& taskPool, bool verifyStreams, std::wstring& error)
+{
+    _view = SceneView();
+    _header = nullptr;
+
+    if (!_file.Open(path))
+    {
+        error = L"failed to open " + path;
+        return false;
+    }
+
+    const uint8_t* base = _file.GetData();
+    const uint64_t fileSize = _file.GetSize();
+
+    // ============================================================
+    // 1. HEADER AND TABLES
+    // ============================================================
+
+    if (fileSize < sizeof(SceneCacheHeader) || memcmp(base, SceneCacheMagic, sizeof(SceneCacheMagic)) != 0)
+    {
+        error = path + L" is not a scene cache";
+        return false;
+    }
+
+    // The mapping is page aligned, so the header and the tables can be used in place
+    const SceneCacheHeader& header = *(const SceneCacheHeader*)base;
+    if (header.Version != SceneCacheHeader::CurrentVersion)
+    {
+        error = path + L" has version " + std::to_wstring(header.Version) + L", expected " + std::to_wstring(SceneCacheHeader::CurrentVersion);
+        return false;
+    }
+
+    const uint64_t tablesSize = (uint64_t)header.MeshNum * sizeof(SceneCacheMesh) + (uint64_t)header.MaterialNum * sizeof(SceneCacheMaterial) +
+        (uint64_t)header.InstanceNum * sizeof(SceneCacheInstance);
+    if (HashHeader(header) != header.HeaderChecksum || header.FileSize != fileSize || header.TablesOffset % 8 != 0 ||
+        !IsRangeValid(header.TablesOffset, header.TablesSize, fileSize) || tablesSize > header.TablesSize)
+    {
+        error = path + L" has a damaged header";
+        return false;
+    }
+
+    if (ChecksumBytes(base + header.TablesOffset, (size_t)header.TablesSize) != header.TablesChecksum)
+    {
+        error = path + L" has damaged tables";
+        return false;
+    }
+
+    const SceneCacheMesh* meshes = (const SceneCacheMesh*)(base + header.TablesOffset);
+    const SceneCacheMaterial* materials = (const SceneCacheMaterial*)(meshes + header.MeshNum);
+    const SceneCacheInstance* instances = (const SceneCacheInstance*)(materials + header.MaterialNum);
+    const char* strings = (const char*)(instances + header.InstanceNum);
+    const uint64_t stringsSize = header.TablesSize - tablesSize;
+
+    auto IsStringValid = [&](uint32_t offset, uint32_t length)
+    {
+        return IsRangeValid(offset, length, stringsSize);
+    };
+
+    // ============================================================
+    // 2. VALIDATE AND BUILD THE VIEW
+    // ============================================================
+
+    _view.Materials.resize(header.MaterialNum);
+    for (uint32_t i = 0; i < header.MaterialNum; i++)
+    {
+        const SceneCacheMaterial& source = materials[i];
+        if (!IsStringValid(source.NameOffset, source.NameLength) || !IsStringValid(source.TextureOffset, source.TextureLength))
+        {
+            error = path + L": invalid material " + std::to_wstring(i);
+            return false;
+        }
+
+        ImportedMaterial& material = _view.Materials[i];
+        memcpy(material.BaseColor, source.BaseColor, sizeof(material.BaseColor));
+        material.Name = FromUtf8(strings + source.NameOffset, source.NameLength);
+        material.BaseColorTexture = FromUtf8(strings + source.TextureOffset, source.TextureLength);
+    }
+
+    _view.Meshes.resize(header.MeshNum);
+    for (uint32_t i = 0; i < header.MeshNum; i++)
+    {
+        const SceneCacheMesh& source = meshes[i];
+        const uint64_t vectorSize = (uint64_t)source.VertexNum * 3 * sizeof(float);
+
+        const bool valid = IsStringValid(source.NameOffset, source.NameLength) &&
+            (source.MaterialIndex < header.MaterialNum || source.MaterialIndex == ~0u) &&
+            source.PositionsOffset % StreamAlignment == 0 && IsRangeValid(source.PositionsOffset, vectorSize, fileSize) &&
+            source.NormalsOffset % StreamAlignment == 0 && IsRangeValid(source.NormalsOffset, vectorSize, fileSize) &&
+            source.TexcoordsOffset % StreamAlignment == 0 && IsRangeValid(source.TexcoordsOffset, (uint64_t)source.VertexNum * 2 * sizeof(float), fileSize) &&
+            source.IndicesOffset % StreamAlignment == 0 && IsRangeValid(source.IndicesOffset, (uint64_t)source.IndexNum * sizeof(uint32_t), fileSize) &&
+            source.IndexNum % 3 == 0;
+        if (!valid)
+        {
+            error = path + L": invalid mesh " + std::to_wstring(i);
+            return false;
+        }
+
+        MeshView& mesh = _view.Meshes[i];
+        mesh.Name = FromUtf8(strings + source.NameOffset, source.NameLength);
+        mesh.Positions = (const float*)(base + source.PositionsOffset);
+        mesh.Normals = (const float*)(base + source.NormalsOffset);
+        mesh.Texcoords = source.TexcoordsOffset != 0 ? (const float*)(base + source.TexcoordsOffset) : nullptr;
+        mesh.Indices = (const uint32_t*)(base + source.IndicesOffset);
+        mesh.VertexNum = source.VertexNum;
+        mesh.IndexNum = source.IndexNum;
+        mesh.MaterialIndex = source.MaterialIndex;
+    }
+
+    _view.Instances.resize(header.InstanceNum);
+    for (uint32_t i = 0; i < header.InstanceNum; i++)
+    {
+        if (instances[i].MeshIndex >= header.MeshNum)
+        {
+            error = path + L": invalid instance " + std::to_wstring(i);
+            return false;
+        }
+
+        _view.Instances[i].MeshIndex = instances[i].MeshIndex;
+        memcpy(_view.Instances[i].Transform, instances[i].Transform, sizeof(_view.Instances[i].Transform));
+    }
+
+    // ============================================================
+    // 3. STREAM CHECKSUMS
+    // This touches every page of the file, which also gets the data
+    // into memory before the upload needs it.
+    // ============================================================
+
+    if (verifyStreams)
+    {
+        std::atomic<uint32_t> damagedMesh { ~0u };
+        taskPool.Run(header.MeshNum, [&](uint32_t meshIndex, uint32_t)
+        {
+            if (HashMeshStreams(meshes[meshIndex], base) != meshes[meshIndex].Checksum)
+            {
+                damagedMesh = meshIndex;
+            }
+        });
+
+        if (damagedMesh != ~0u)
+        {
+            error = path + L": mesh " + std::to_wstring(damagedMesh.load()) + L" is damaged";
+            _view = SceneView();
+            return false;
+        }
+    }
+
+    _header = &header;
+    return true;
+}
+
+bool SceneCache::IsUpToDate(const std::wstring& sourcePath) const
+{
+    if (_header == nullptr)
+    {
+        return false;
+    }
+
+    MappedFile source;
+    uint64_t timestamp;
+    return source.Open(sourcePath) && source.GetSize() == _header->SourceSize &&
+        GetFileTimestamp(sourcePath, timestamp) && timestamp == _header->SourceTimestamp;
+}
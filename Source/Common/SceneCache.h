@@ -0,0 +1,89 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "MeshImporter.h"
+#include "MeshProcessing.h" // ChecksumBytes
+
+// ============================================================
+// Binary scene cache. Everything the importers produce, laid out
+// so that the file can be mapped and the attribute streams copied
+// straight into upload buffers:
+//
+// | header | mesh, material and instance tables | strings | streams ... |
+//
+// Streams are 64 byte aligned and stored in little endian, native
+// float and uint32 layout. The header, the tables and every mesh
+// carry a checksum, so a truncated or damaged file is rejected
+// instead of being uploaded.
+// ============================================================
+
+struct SceneCacheHeader
+{
+    static constexpr uint32_t CurrentVersion = 2; // 2: meshes are sorted for locality
+
+    char Magic[8]; // "VKRSCENE"
+    uint32_t Version;
+    uint32_t MeshNum;
+    uint32_t MaterialNum;
+    uint32_t InstanceNum;
+    uint64_t FileSize;
+    uint64_t SourceSize; // of the file the cache was converted from, to detect stale caches
+    uint64_t SourceTimestamp;
+    uint64_t TablesOffset;
+    uint64_t TablesSize; // tables and strings
+    uint64_t TablesChecksum;
+    uint64_t HeaderChecksum; // all previous fields
+};
+
+struct SceneCacheMesh
+{
+    uint64_t PositionsOffset; // float xyz
+    uint64_t NormalsOffset; // float xyz
+    uint64_t TexcoordsOffset; // float uv, 0 when the mesh has none
+    uint64_t IndicesOffset; // uint32
+    uint64_t Checksum; // over the four streams
+    uint32_t VertexNum;
+    uint32_t IndexNum;
+    uint32_t MaterialIndex;
+    uint32_t NameOffset; // UTF-8 in the string block
+    uint32_t NameLength;
+    uint32_t Padding;
+};
+
+struct SceneCacheMaterial
+{
+    float BaseColor[4];
+    uint32_t NameOffset;
+    uint32_t NameLength;
+    uint32_t TextureOffset; // full path, empty when there is no texture
+    uint32_t TextureLength;
+};
+
+struct SceneCacheInstance
+{
+    uint32_t MeshIndex;
+    float Transform[12];
+};
+
+// sourcePath only provides the size and timestamp stored for staleness checks,
+// it can be empty
+bool WriteSceneCache(const std::wstring& path, const SceneView& scene, const std::wstring& sourcePath, std::wstring& error);
+
+class SceneCache
+{
+private:
+    MappedFile _file;
+    SceneView _view;
+    const SceneCacheHeader* _header = nullptr;
+
+public:
+    // Checksums of the streams are verified on the task pool when verifyStreams is set
+    bool Load(const std::wstring& path, TaskPool& taskPool, bool verifyStreams, std::wstring& error);
+
+    // True when sourcePath still has the size and timestamp the cache was made from
+    bool IsUpToDate(const std::wstring& sourcePath) const;
+
+    // Mesh data points into the mapping, valid as long as the cache is loaded
+    const SceneView& GetView() const { return _view; }
+    uint64_t GetFileSize() const { return _file.GetSize(); }
+};
@@ -0,0 +1,225 @@
+#include "ShaderHotReloader.h"
+
+#include <chrono>
+
+namespace
+{
+    bool GetLastWriteTime(const std::wstring& filePath, FILETIME& lastWriteTime)
+    {
+        WIN32_FILE_ATTRIBUTE_DATA attributes;
+        if (!GetFileAttributesEx(filePath.c_str(), GetFileExInfoStandard, &attributes))
+        {
+            return false;
+        }
+        lastWriteTime = attributes.ftLastWriteTime;
+        return true;
+    }
+}
+
+ShaderHotReloader::~ShaderHotReloader()
+{
+    Stop();
+}
+
+bool ShaderHotReloader::Start(const std::wstring& sourceFolder, const std::wstring& outputFolder, const std::wstring& compilerPath,
+    const std::vector<std::wstring>& sourceFileNames, std::wstring& error)
+{
+    Stop();
+
+    if (!PathFileExists(compilerPath.c_str()))
+    {
+        error = L"can't find " + compilerPath;
+        return false;
+    }
+
+    _sourceFolder = sourceFolder;
+    _outputFolder = outputFolder;
+    _compilerPath = compilerPath;
+    _watchedFiles.clear();
+
+    for (const std::wstring& fileName : sourceFileNames)
+    {
+        FILETIME lastWriteTime;
+        if (!GetLastWriteTime(_sourceFolder + fileName, lastWriteTime))
+        {
+            error = L"can't find " + _sourceFolder + fileName;
+            return false;
+        }
+        _watchedFiles[fileName] = lastWriteTime;
+    }
+
+    _stopRequested = false;
+    _thread = std::thread(&ShaderHotReloader::WatchLoop, this);
+
+    std::wcout << L"Shader hot reload: watching " << _watchedFiles.size() << L" files in " << _sourceFolder << L"\n";
+    return true;
+}
+
+void ShaderHotReloader::Stop()
+{
+    if (_thread.joinable())
+    {
+        _stopRequested = true;
+        _thread.join();
+    }
+}
+
+std::vector<ShaderHotReloader::CompiledShader> ShaderHotReloader::TakeCompiledShaders()
+{
+    std::vector<CompiledShader> result;
+    std::vector<Message> messages;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        result.swap(_compiledShaders);
+        messages.swap(_messages);
+    }
+
+    for (const Message& message : messages)
+    {
+        if (message.IsError)
+        {
+            LogError(message.Text, true);
+        }
+        else
+        {
+            std::wcout << message.Text << L"\n";
+        }
+    }
+    return result;
+}
+
+void ShaderHotReloader::QueueMessage(const std::wstring& text, bool isError)
+{
+    // The console streams aren't synchronized, only the render thread prints
+    std::lock_guard<std::mutex> lock(_mutex);
+    _messages.push_back({ text, isError });
+}
+
+void ShaderHotReloader::WatchLoop()
+{
+    const HANDLE notification = FindFirstChangeNotification(_sourceFolder.c_str(), FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE);
+    if (notification == INVALID_HANDLE_VALUE)
+    {
+        QueueMessage(L"Shader hot reload: can't watch " + _sourceFolder, true);
+        return;
+    }
+
+    while (!_stopRequested)
+    {
+        // Wake up periodically to check for the stop request
+        if (WaitForSingleObject(notification, 100) != WAIT_OBJECT_0)
+        {
+            continue;
+        }
+
+        // Editors tend to write in several steps, give them a moment to finish
+        Sleep(50);
+
+        for (auto& item : _watchedFiles)
+        {
+            FILETIME lastWriteTime;
+            if (!GetLastWriteTime(_sourceFolder + item.first, lastWriteTime) ||
+                CompareFileTime(&lastWriteTime, &item.second) == 0)
+            {
+                continue;
+            }
+            item.second = lastWriteTime;
+
+            CompiledShader shader;
+            if (Compile(item.first, shader))
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _compiledShaders.push_back(std::move(shader));
+            }
+        }
+
+        FindNextChangeNotification(notification);
+    }
+
+    FindCloseChangeNotification(notification);
+}
+
+bool ShaderHotReloader::Compile(const std::wstring& sourceFileName, CompiledShader& result)
+{
+    result.SpirvFileName = sourceFileName + L".spv";
+    const std::wstring outputPath = _outputFolder + result.SpirvFileName;
+
+    // Same invocation as compile.bat
+    std::wstring commandLine = L"\"" + _compilerPath + L"\" -V \"" + _sourceFolder + sourceFileName + L"\" -o \"" + outputPath + L"\"";
+
+    // The compiler's stdout and stderr go to a pipe, its errors name the file and line
+    SECURITY_ATTRIBUTES pipeAttributes = { };
+    pipeAttributes.nLength = sizeof(pipeAttributes);
+    pipeAttributes.bInheritHandle = TRUE;
+
+    HANDLE outputRead = nullptr;
+    HANDLE outputWrite = nullptr;
+    if (!CreatePipe(&outputRead, &outputWrite, &pipeAttributes, 0))
+    {
+        QueueMessage(L"Shader hot reload: CreatePipe failed", true);
+        return false;
+    }
+    SetHandleInformation(outputRead, HANDLE_FLAG_INHERIT, 0); // only the write end goes to the child
+
+    STARTUPINFO startupInfo = { };
+    startupInfo.cb = sizeof(startupInfo);
+    startupInfo.dwFlags = STARTF_USESTDHANDLES;
+    startupInfo.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    startupInfo.hStdOutput = outputWrite;
+    startupInfo.hStdError = outputWrite;
+    PROCESS_INFORMATION processInfo = { };
+
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    const BOOL created = CreateProcess(nullptr, &commandLine[0], nullptr, nullptr, TRUE, CREATE_NO_WINDOW, nullptr, nullptr, &startupInfo, &processInfo);
+
+    // Closed here so ReadFile sees the end of the pipe once the compiler exits
+    CloseHandle(outputWrite);
+
+    if (!created)
+    {
+        CloseHandle(outputRead);
+        QueueMessage(L"Shader hot reload: failed to launch " + _compilerPath, true);
+        return false;
+    }
+
+    // Drained before waiting, a full pipe would block the compiler
+    std::string output;
+    char buffer[4096];
+    DWORD readSize = 0;
+    while (ReadFile(outputRead, buffer, sizeof(buffer), &readSize, nullptr) && readSize > 0)
+    {
+        output.append(buffer, readSize);
+    }
+    CloseHandle(outputRead);
+
+    WaitForSingleObject(processInfo.hProcess, INFINITE);
+
+    DWORD exitCode = 1;
+    GetExitCodeProcess(processInfo.hProcess, &exitCode);
+    CloseHandle(processInfo.hThread);
+    CloseHandle(processInfo.hProcess);
+
+    result.CompileMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+    if (exitCode != 0)
+    {
+        QueueMessage(L"Shader hot reload: " + sourceFileName + L" failed to compile, keeping the previous version\n" +
+            std::wstring(output.begin(), output.end()), true);
+        return false;
+    }
+
+    std::ifstream fileStream(outputPath, std::ios::binary | std::ios::in | std::ios::ate);
+    if (!fileStream.is_open())
+    {
+        QueueMessage(L"Shader hot reload: can't read " + outputPath, true);
+        return false;
+    }
+    const size_t shaderSize = fileStream.tellg();
+    fileStream.seekg(0, std::ios::beg);
+    result.Bytecode.resize(shaderSize / sizeof(uint32_t));
+    fileStream.read((char*)result.Bytecode.data(), result.Bytecode.size() * sizeof(uint32_t));
+
+    QueueMessage(L"Shader hot reload: " + sourceFileName + L" compiled in " + std::to_wstring(result.CompileMilliseconds) + L" ms", false);
+    return true;
+}
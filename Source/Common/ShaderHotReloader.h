@@ -0,0 +1,60 @@
+#pragma once
+
+#include "Application.h"
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <thread>
+
+// Watches GLSL ray tracing shader sources, recompiles changed files with
+// glslangValidator on a background thread and hands the new SPIR-V over
+// to the render thread, which swaps pipelines at a frame boundary.
+class ShaderHotReloader
+{
+public:
+    struct CompiledShader
+    {
+        std::wstring SpirvFileName; // e.g. rt_11_box.rchit.spv, same name ShaderResource::LoadFromFile uses
+        std::vector<uint32_t> Bytecode;
+        double CompileMilliseconds = 0.0;
+    };
+
+private:
+    struct Message
+    {
+        std::wstring Text;
+        bool IsError = false;
+    };
+
+private:
+    std::wstring _sourceFolder;
+    std::wstring _outputFolder;
+    std::wstring _compilerPath;
+    std::map<std::wstring, FILETIME> _watchedFiles; // source file name -> last write time
+    std::thread _thread;
+    std::atomic<bool> _stopRequested { false };
+    std::mutex _mutex;
+    std::vector<CompiledShader> _compiledShaders;
+    std::vector<Message> _messages; // written by the watch thread, printed by TakeCompiledShaders
+
+public:
+    ~ShaderHotReloader();
+
+public:
+    // sourceFileNames are names of .rgen/.rchit/.rmiss/.rahit files inside sourceFolder.
+    // Returns false with the reason in error if the sources or the compiler can't be found,
+    // e.g. outside of the source tree.
+    bool Start(const std::wstring& sourceFolder, const std::wstring& outputFolder, const std::wstring& compilerPath,
+        const std::vector<std::wstring>& sourceFileNames, std::wstring& error);
+    void Stop();
+
+    // Returns shaders compiled since the previous call and prints the watch thread's messages,
+    // called from the render thread
+    std::vector<CompiledShader> TakeCompiledShaders();
+
+private:
+    void WatchLoop();
+    bool Compile(const std::wstring& sourceFileName, CompiledShader& result);
+    void QueueMessage(const std::wstring& text, bool isError);
+};
@@ -0,0 +1,120 @@
+#include "TaskPool.h"
+
+#include <algorithm>
+
+TaskPool::TaskPool(uint32_t threadNum)
+{
+    if (threadNum == 0)
+    {
+        threadNum = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // The calling thread takes part in Run, it is thread 0
+    for (uint32_t i = 1; i < threadNum; i++)
+    {
+        _workers.emplace_back(&TaskPool::WorkerLoop, this, i);
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopRequested = true;
+    }
+    _wakeCondition.notify_all();
+
+    for (auto& worker : _workers)
+    {
+        worker.join();
+    }
+}
+
+void TaskPool::Run(uint32_t taskNum, const TaskFunction& function)
+{
+    if (taskNum == 0)
+    {
+        return;
+    }
+
+    if (_workers.empty() || taskNum == 1)
+    {
+        for (uint32_t i = 0; i < taskNum; i++)
+        {
+            function(i, 0);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _function = &function;
+        _taskNum = taskNum;
+        _nextTask = 0;
+        _busyWorkerNum = (uint32_t)_workers.size();
+        _batch++;
+    }
+    _wakeCondition.notify_all();
+
+    ExecuteTasks(0);
+
+    std::unique_lock<std::mutex> lock(_mutex);
+    _doneCondition.wait(lock, [this]() { return _busyWorkerNum == 0; });
+    _function = nullptr;
+}
+
+void TaskPool::ParallelFor(uint32_t itemNum, uint32_t grainSize, const std::function<void(uint32_t begin, uint32_t end, uint32_t threadIndex)>& function)
+{
+    grainSize = std::max(grainSize, 1u);
+    const uint32_t taskNum = (itemNum + grainSize - 1) / grainSize;
+
+    Run(taskNum, [&](uint32_t taskIndex, uint32_t threadIndex)
+    {
+        const uint32_t begin = taskIndex * grainSize;
+        function(begin, std::min(begin + grainSize, itemNum), threadIndex);
+    });
+}
+
+uint32_t TaskPool::GetThreadNum() const
+{
+    return (uint32_t)_workers.size() + 1;
+}
+
+void TaskPool::WorkerLoop(uint32_t threadIndex)
+{
+    uint64_t lastBatch = 0;
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wakeCondition.wait(lock, [&]() { return _stopRequested || _batch != lastBatch; });
+            if (_stopRequested)
+            {
+                return;
+            }
+            lastBatch = _batch;
+        }
+
+        ExecuteTasks(threadIndex);
+
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _busyWorkerNum--;
+        }
+        _doneCondition.notify_one();
+    }
+}
+
+void TaskPool::ExecuteTasks(uint32_t threadIndex)
+{
+    for (;;)
+    {
+        const uint32_t task = _nextTask.fetch_add(1);
+        if (task >= _taskNum)
+        {
+            return;
+        }
+        (*_function)(task, threadIndex);
+    }
+}
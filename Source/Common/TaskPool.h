@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads for CPU side data processing. Run splits a batch of
+// independent tasks between the workers and the calling thread and returns once
+// all of them are done. Tasks are handed out one at a time through an atomic
+// counter, so uneven task sizes balance themselves.
+class TaskPool
+{
+public:
+    // thread index is in [0, GetThreadNum()), usable for per-thread scratch data
+    typedef std::function<void(uint32_t taskIndex, uint32_t threadIndex)> TaskFunction;
+
+private:
+    std::vector<std::thread> _workers;
+    std::mutex _mutex;
+    std::condition_variable _wakeCondition;
+    std::condition_variable _doneCondition;
+    const TaskFunction* _function = nullptr;
+    uint32_t _taskNum = 0;
+    std::atomic<uint32_t> _nextTask { 0 };
+    uint32_t _busyWorkerNum = 0;
+    uint64_t _batch = 0;
+    bool _stopRequested = false;
+
+public:
+    // 0 uses one thread per hardware thread
+    explicit TaskPool(uint32_t threadNum = 0);
+    ~TaskPool();
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+public:
+    void Run(uint32_t taskNum, const TaskFunction& function);
+
+    // Calls function(begin, end, threadIndex) on ranges of at most grainSize items
+    void ParallelFor(uint32_t itemNum, uint32_t grainSize, const std::function<void(uint32_t begin, uint32_t end, uint32_t threadIndex)>& function);
+
+    uint32_t GetThreadNum() const;
+
+private:
+    void WorkerLoop(uint32_t threadIndex);
+    void ExecuteTasks(uint32_t threadIndex);
+};
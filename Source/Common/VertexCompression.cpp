@@ -0,0 +1,353 @@
+#include "VertexCompression.h"
+#include "CpuFeatures.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <emmintrin.h>
+#include <immintrin.h>
+
+// ============================================================
+// Normals
+// ============================================================
+
+void EncodeNormalsOctahedral(const float* normals, size_t count, int16_t* encoded)
+{
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 snormScale = _mm_set1_ps(32767.0f);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        const float* n = normals + i * 3;
+        __m128 x = _mm_setr_ps(n[0], n[3], n[6], n[9]);
+        __m128 y = _mm_setr_ps(n[1], n[4], n[7], n[10]);
+        const __m128 z = _mm_setr_ps(n[2], n[5], n[8], n[11]);
+
+        // Project onto the octahedron |x| + |y| + |z| = 1
+        const __m128 absX = _mm_andnot_ps(signMask, x);
+        const __m128 absY = _mm_andnot_ps(signMask, y);
+        const __m128 absZ = _mm_andnot_ps(signMask, z);
+        const __m128 invL1 = _mm_div_ps(one, _mm_add_ps(_mm_add_ps(absX, absY), absZ));
+        x = _mm_mul_ps(x, invL1);
+        y = _mm_mul_ps(y, invL1);
+
+        // Fold the lower hemisphere over the diagonals, keeping the sign of x and y
+        const __m128 lower = _mm_cmplt_ps(z, _mm_setzero_ps());
+        const __m128 foldedX = _mm_or_ps(_mm_sub_ps(one, _mm_andnot_ps(signMask, y)), _mm_and_ps(signMask, x));
+        const __m128 foldedY = _mm_or_ps(_mm_sub_ps(one, _mm_andnot_ps(signMask, x)), _mm_and_ps(signMask, y));
+        x = _mm_or_ps(_mm_and_ps(lower, foldedX), _mm_andnot_ps(lower, x));
+        y = _mm_or_ps(_mm_and_ps(lower, foldedY), _mm_andnot_ps(lower, y));
+
+        // cvtps rounds to nearest, packs saturates to int16
+        const __m128i xi = _mm_cvtps_epi32(_mm_mul_ps(x, snormScale));
+        const __m128i yi = _mm_cvtps_epi32(_mm_mul_ps(y, snormScale));
+        const __m128i packed = _mm_packs_epi32(xi, yi); // x0..x3 y0..y3
+        const __m128i interleaved = _mm_unpacklo_epi16(packed, _mm_srli_si128(packed, 8));
+        _mm_storeu_si128((__m128i*)(encoded + i * 2), interleaved);
+    }
+
+    for (; i < count; i++)
+    {
+        const float* n = normals + i * 3;
+        const float invL1 = 1.0f / (std::fabs(n[0]) + std::fabs(n[1]) + std::fabs(n[2]));
+        float x = n[0] * invL1;
+        float y = n[1] * invL1;
+        if (n[2] < 0.0f)
+        {
+            const float foldedX = std::copysign(1.0f - std::fabs(y), x);
+            const float foldedY = std::copysign(1.0f - std::fabs(x), y);
+            x = foldedX;
+            y = foldedY;
+        }
+        encoded[i * 2] = (int16_t)std::lrint(std::min(std::max(x, -1.0f), 1.0f) * 32767.0f);
+        encoded[i * 2 + 1] = (int16_t)std::lrint(std::min(std::max(y, -1.0f), 1.0f) * 32767.0f);
+    }
+}
+
+void DecodeNormalOctahedral(const int16_t* encoded, float* normal)
+{
+    // Same as DecodeOctahedral in rt_11_*.rchit
+    const float x = std::max(encoded[0] / 32767.0f, -1.0f);
+    const float y = std::max(encoded[1] / 32767.0f, -1.0f);
+    float n[3] = { x, y, 1.0f - std::fabs(x) - std::fabs(y) };
+    const float t = std::max(-n[2], 0.0f);
+    n[0] += n[0] >= 0.0f ? -t : t;
+    n[1] += n[1] >= 0.0f ? -t : t;
+
+    const float invLength = 1.0f / std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+    normal[0] = n[0] * invLength;
+    normal[1] = n[1] * invLength;
+    normal[2] = n[2] * invLength;
+}
+
+// ============================================================
+// Half floats
+// ============================================================
+
+uint16_t FloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    const uint32_t sign = (bits >> 16) & 0x8000;
+    const uint32_t floatExponent = (bits >> 23) & 0xFF;
+    uint32_t mantissa = bits & 0x7FFFFF;
+
+    if (floatExponent == 0xFF)
+    {
+        return (uint16_t)(sign | 0x7C00 | (mantissa ? 0x200 : 0)); // inf, nan
+    }
+
+    const int32_t exponent = (int32_t)floatExponent - 127 + 15;
+    if (exponent >= 31)
+    {
+        return (uint16_t)(sign | 0x7C00); // overflow to inf
+    }
+
+    if (exponent <= 0)
+    {
+        if (exponent < -10)
+        {
+            return (uint16_t)sign; // underflow to zero
+        }
+
+        // Denormal, round to nearest even
+        mantissa |= 0x800000;
+        const uint32_t shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        const uint32_t remainder = mantissa & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (remainder > halfway || (remainder == halfway && (half & 1)))
+        {
+            half++;
+        }
+        return (uint16_t)(sign | half);
+    }
+
+    // Round to nearest even, a carry into the exponent is still correct
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    const uint32_t remainder = mantissa & 0x1FFF;
+    if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+    {
+        half++;
+    }
+    return (uint16_t)(sign | half);
+}
+
+float HalfToFloat(uint16_t value)
+{
+    const uint32_t sign = (uint32_t)(value & 0x8000) << 16;
+    const uint32_t exponent = (value >> 10) & 0x1F;
+    const uint32_t mantissa = value & 0x3FF;
+
+    if (exponent == 0)
+    {
+        const float magnitude = std::ldexp((float)mantissa, -24);
+        return sign ? -magnitude : magnitude;
+    }
+
+    uint32_t bits;
+    if (exponent == 31)
+    {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    }
+    else
+    {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+namespace
+{
+    NVVK_TARGET_F16C size_t EncodeHalfF16C(const float* values, size_t count, uint16_t* encoded)
+    {
+        size_t i = 0;
+        for (; i + 4 <= count; i += 4)
+        {
+            const __m128i half = _mm_cvtps_ph(_mm_loadu_ps(values + i), _MM_FROUND_TO_NEAREST_INT);
+            _mm_storel_epi64((__m128i*)(encoded + i), half);
+        }
+        return i;
+    }
+}
+
+void EncodeHalf(const float* values, size_t count, uint16_t* encoded)
+{
+    size_t i = 0;
+    if (CpuFeatures::Get().F16C)
+    {
+        i = EncodeHalfF16C(values, count, encoded);
+    }
+
+    for (; i < count; i++)
+    {
+        encoded[i] = FloatToHalf(values[i]);
+    }
+}
+
+// ============================================================
+// Unorm16
+// ============================================================
+
+void EncodeUnorm16(const float* values, size_t count, uint16_t* encoded)
+{
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 unormScale = _mm_set1_ps(65535.0f);
+    const __m128i bias = _mm_set1_epi32(32768);
+    const __m128i flip = _mm_set1_epi16((short)0x8000);
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        const __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(values + i), zero), one);
+        const __m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(values + i + 4), zero), one);
+
+        // SSE2 has no unsigned saturating pack, shift into the signed range and back
+        const __m128i ai = _mm_sub_epi32(_mm_cvtps_epi32(_mm_mul_ps(a, unormScale)), bias);
+        const __m128i bi = _mm_sub_epi32(_mm_cvtps_epi32(_mm_mul_ps(b, unormScale)), bias);
+        const __m128i packed = _mm_xor_si128(_mm_packs_epi32(ai, bi), flip);
+        _mm_storeu_si128((__m128i*)(encoded + i), packed);
+    }
+
+    for (; i < count; i++)
+    {
+        encoded[i] = (uint16_t)std::lrint(std::min(std::max(values[i], 0.0f), 1.0f) * 65535.0f);
+    }
+}
+
+bool IsUnitRange(const float* values, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!(values[i] >= 0.0f && values[i] <= 1.0f))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ============================================================
+// Positions
+// ============================================================
+
+PositionQuantization ComputePositionQuantization(const float* positions, size_t vertexNum)
+{
+    PositionQuantization quantization;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+        float boundsMin = vertexNum > 0 ? positions[axis] : 0.0f;
+        float boundsMax = boundsMin;
+        for (size_t i = 1; i < vertexNum; i++)
+        {
+            boundsMin = std::min(boundsMin, positions[i * 3 + axis]);
+            boundsMax = std::max(boundsMax, positions[i * 3 + axis]);
+        }
+
+        const float halfExtent = (boundsMax - boundsMin) * 0.5f;
+        quantization.Scale[axis] = halfExtent > 0.0f ? halfExtent : 1.0f;
+        quantization.Bias[axis] = (boundsMin + boundsMax) * 0.5f;
+    }
+
+    return quantization;
+}
+
+void EncodePositionsHalf(const float* positions, size_t vertexNum, const PositionQuantization& quantization, uint16_t* encoded)
+{
+    const float invScale[3] = { 1.0f / quantization.Scale[0], 1.0f / quantization.Scale[1], 1.0f / quantization.Scale[2] };
+
+    // Normalize in blocks so the half conversion still runs on full vectors
+    float block[3 * 256];
+    for (size_t first = 0; first < vertexNum; first += 256)
+    {
+        const size_t blockVertexNum = std::min<size_t>(256, vertexNum - first);
+        for (size_t i = 0; i < blockVertexNum * 3; i++)
+        {
+            const int axis = (int)(i % 3);
+            block[i] = (positions[first * 3 + i] - quantization.Bias[axis]) * invScale[axis];
+        }
+        EncodeHalf(block, blockVertexNum * 3, encoded + first * 3);
+    }
+}
+
+float ComputeShortestEdge(const float* positions, const uint32_t* indices, size_t indexNum)
+{
+    float shortestSquared = 0.0f;
+    for (size_t i = 0; i + 2 < indexNum; i += 3)
+    {
+        for (int edge = 0; edge < 3; edge++)
+        {
+            const float* a = positions + indices[i + edge] * 3;
+            const float* b = positions + indices[i + (edge + 1) % 3] * 3;
+            const float dx = a[0] - b[0];
+            const float dy = a[1] - b[1];
+            const float dz = a[2] - b[2];
+            const float lengthSquared = dx * dx + dy * dy + dz * dz;
+            if (lengthSquared > 0.0f && (shortestSquared == 0.0f || lengthSquared < shortestSquared))
+            {
+                shortestSquared = lengthSquared;
+            }
+        }
+    }
+    return std::sqrt(shortestSquared);
+}
+
+// ============================================================
+// Round trip checks
+// ============================================================
+
+float MeasureNormalError(const float* normals, const int16_t* encoded, size_t count)
+{
+    float maxError = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        float decoded[3];
+        DecodeNormalOctahedral(encoded + i * 2, decoded);
+
+        const float* n = normals + i * 3;
+        const float length = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        const float cosAngle = (n[0] * decoded[0] + n[1] * decoded[1] + n[2] * decoded[2]) / length;
+        maxError = std::max(maxError, std::acos(std::min(std::max(cosAngle, -1.0f), 1.0f)));
+    }
+    return maxError;
+}
+
+float MeasureHalfError(const float* values, const uint16_t* encoded, size_t count)
+{
+    float maxError = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        maxError = std::max(maxError, std::fabs(HalfToFloat(encoded[i]) - values[i]));
+    }
+    return maxError;
+}
+
+float MeasureUnorm16Error(const float* values, const uint16_t* encoded, size_t count)
+{
+    float maxError = 0.0f;
+    for (size_t i = 0; i < count; i++)
+    {
+        maxError = std::max(maxError, std::fabs(encoded[i] / 65535.0f - values[i]));
+    }
+    return maxError;
+}
+
+float MeasurePositionError(const float* positions, const uint16_t* encoded, size_t vertexNum, const PositionQuantization& quantization)
+{
+    float maxError = 0.0f;
+    for (size_t i = 0; i < vertexNum * 3; i++)
+    {
+        const int axis = (int)(i % 3);
+        const float decoded = HalfToFloat(encoded[i]) * quantization.Scale[axis] + quantization.Bias[axis];
+        maxError = std::max(maxError, std::fabs(decoded - positions[i]));
+    }
+    return maxError;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Encoders for compact vertex attribute formats. The outputs are laid out so the
+// hit shaders can read them through texel buffers of the listed formats, which
+// also do the unpacking. The streams are processed four values at a time with SSE2,
+// half floats use F16C when the CPU has it.
+
+// Unit normals to an octahedral mapping, 2 x snorm16 per normal (VK_FORMAT_R16G16_SNORM)
+void EncodeNormalsOctahedral(const float* normals, size_t count, int16_t* encoded);
+void DecodeNormalOctahedral(const int16_t* encoded, float* normal);
+
+// IEEE 754 half floats (VK_FORMAT_R16*_SFLOAT), count is the number of floats
+void EncodeHalf(const float* values, size_t count, uint16_t* encoded);
+uint16_t FloatToHalf(float value);
+float HalfToFloat(uint16_t value);
+
+// Values in [0, 1] to unorm16 (VK_FORMAT_R16*_UNORM), values outside are clamped
+void EncodeUnorm16(const float* values, size_t count, uint16_t* encoded);
+bool IsUnitRange(const float* values, size_t count);
+
+// Maps positions into [-1, 1] so they keep their precision as half floats.
+// The original position is encoded * Scale + Bias per axis.
+struct PositionQuantization
+{
+    float Scale[3];
+    float Bias[3];
+};
+
+PositionQuantization ComputePositionQuantization(const float* positions, size_t vertexNum);
+void EncodePositionsHalf(const float* positions, size_t vertexNum, const PositionQuantization& quantization, uint16_t* encoded);
+
+// Length of the shortest nonzero triangle edge, 0 if all triangles are degenerate.
+// Half positions only keep about 11 bits over the bounds, so the rounding error has
+// to be compared with this rather than with the mesh size.
+float ComputeShortestEdge(const float* positions, const uint32_t* indices, size_t indexNum);
+
+// Round trip checks, each decodes the stream and returns the largest error
+float MeasureNormalError(const float* normals, const int16_t* encoded, size_t count); // radians
+float MeasureHalfError(const float* values, const uint16_t* encoded, size_t count);
+float MeasureUnorm16Error(const float* values, const uint16_t* encoded, size_t count);
+float MeasurePositionError(const float* positions, const uint16_t* encoded, size_t vertexNum, const PositionQuantization& quantization);
@@ -11,4 +11,6 @@ for /r %%i in (*.rgen) do glslangValidator -V "%%i" -o "%OUT_DIR%%%~ni%%~xi.spv"
 for /r %%i in (*.rmiss) do glslangValidator -V "%%i" -o "%OUT_DIR%%%~ni%%~xi.spv"
 for /r %%i in (*.glsl) do glslangValidator -V "%%i" -o "%OUT_DIR%%%~ni%%~xi.spv"
 
+powershell -NoProfile -ExecutionPolicy Bypass -File "%~dp0embed_spirv.ps1"
+
 pause
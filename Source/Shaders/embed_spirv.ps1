@@ -0,0 +1,70 @@
+# Embeds every compiled SPIR-V binary from Bin\Assets\Shaders into a C++ header,
+# so the samples can create their shader modules without touching the file system.
+# Called by compile.bat and, when EmbedShaders is true in Projects\Shaders.props, before
+# every build of the samples, which then define NVVK_EMBED_SHADERS and use the header.
+
+$shaderDir = Join-Path $PSScriptRoot "..\..\Bin\Assets\Shaders"
+$outDir = Join-Path $PSScriptRoot "Generated"
+$outFile = Join-Path $outDir "EmbeddedShaders.h"
+
+New-Item -ItemType Directory -Force -Path $outDir | Out-Null
+
+$builder = New-Object System.Text.StringBuilder
+[void]$builder.AppendLine("// Generated by Source/Shaders/embed_spirv.ps1, do not edit")
+[void]$builder.AppendLine("#pragma once")
+[void]$builder.AppendLine("")
+[void]$builder.AppendLine("#include <cstddef>")
+[void]$builder.AppendLine("#include <cstdint>")
+[void]$builder.AppendLine("")
+[void]$builder.AppendLine("struct EmbeddedShader")
+[void]$builder.AppendLine("{")
+[void]$builder.AppendLine("    const wchar_t* Name;")
+[void]$builder.AppendLine("    const uint32_t* Code;")
+[void]$builder.AppendLine("    size_t Size; // in bytes")
+[void]$builder.AppendLine("};")
+[void]$builder.AppendLine("")
+
+$entries = @()
+foreach ($file in Get-ChildItem -Path $shaderDir -Filter *.spv | Sort-Object Name)
+{
+    $bytes = [System.IO.File]::ReadAllBytes($file.FullName)
+    if ($bytes.Length % 4 -ne 0)
+    {
+        Write-Error "$($file.Name) is not a valid SPIR-V binary"
+        exit 1
+    }
+
+    $arrayName = "SpirV_" + ($file.Name -replace '[^A-Za-z0-9]', '_')
+    [void]$builder.AppendLine("constexpr uint32_t $arrayName[] =")
+    [void]$builder.AppendLine("{")
+    for ($i = 0; $i -lt $bytes.Length; $i += 32)
+    {
+        $words = @()
+        for ($j = $i; $j -lt [Math]::Min($i + 32, $bytes.Length); $j += 4)
+        {
+            $words += ("0x{0:x8}" -f [BitConverter]::ToUInt32($bytes, $j))
+        }
+        [void]$builder.AppendLine("    " + ($words -join ", ") + ",")
+    }
+    [void]$builder.AppendLine("};")
+    [void]$builder.AppendLine("")
+
+    $entries += "    { L`"$($file.Name)`", $arrayName, sizeof($arrayName) },"
+}
+
+[void]$builder.AppendLine("constexpr EmbeddedShader EmbeddedShaders[] =")
+[void]$builder.AppendLine("{")
+foreach ($entry in $entries)
+{
+    [void]$builder.AppendLine($entry)
+}
+[void]$builder.AppendLine("};")
+
+# Keep the timestamp when nothing changed to avoid needless rebuilds
+$content = $builder.ToString()
+if ((Test-Path $outFile) -and ([System.IO.File]::ReadAllText($outFile) -eq $content))
+{
+    exit 0
+}
+[System.IO.File]::WriteAllText($outFile, $content)
+Write-Host "Generated $outFile"
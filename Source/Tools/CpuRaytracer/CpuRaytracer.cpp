@@ -0,0 +1,1842 @@
+#include "../../Common/Bvh.h"
+#include "../../Common/CpuDenoising.h"
+#include "../../Common/CpuRaySorting.h"
+#include "../../Common/CpuRayTracing.h"
+#include "../../Common/MappedFile.h"
+#include "../../Common/MeshImporter.h"
+#include "../../Common/MeshProcessing.h"
+#include "../../Common/ProceduralScene.h"
+#include "../../Common/SceneCache.h"
+#include "../../Common/TaskPool.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <queue>
+#include <random>
+#include <string>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb/stb_image.h"
+
+// Renders the scene of sample 11 on the CPU, for reference images and performance
+// regression runs on machines without a ray tracing capable GPU. The raygen, miss
+// and closest hit shaders of the sample are ported to C++ below and run through
+// the CPU pipeline with the same instances, hit group layout and materials.
+//
+// CpuRaytracer [scene.obj|.gltf|.glb|.vkscene] [-output image.bmp] [-width W] [-height H]
+//     [-threads N] [-frames N] [-shadows N] [-progressive N] [-adaptive N] [-converge E]
+//     [-tiled S] [-textures folder] [-benchmark] [-packets] [-sample09] [-denoise]
+//
+// Without a scene the procedural boxes and icosahedrons are rendered, with textures
+// from -textures, Assets/Textures/ next to the working directory by default.
+// -frames repeats the launch and reports the fastest one. -benchmark measures the
+// traversal alone with every BVH kernel the CPU supports, the top level with about
+// a million copies of the scene's instances and BLAS updates of the largest mesh
+// against full builds before rendering. -packets traces the camera rays in
+// packets of 8x8 pixels, the image stays the same. -sample09 renders the scene and
+// shaders of sample 09 instead, whose secondary rays are traced as occlusion queries;
+// the benchmark reports those separately from closest hit rays. -progressive
+// accumulates up to N jittered samples per pixel like the progressive permutation
+// of the sample, and stops tracing pixels once the standard error of their mean
+// luminance is below -converge, 0.002 by default; -frames is ignored then.
+// -adaptive does the same but launches only the tiles with the largest error
+// after a warmup. Both report when the error of the whole image fell below the
+// -converge target. -tiled renders the image in tiles of S x S pixels that are
+// written to the BMP as they finish, for stills larger than memory; -frames is
+// ignored and no checksum is computed then. -denoise filters the image with the
+// albedo, normal and depth the hit shaders write next to the color, -frames times
+// to report the throughput; -width 3840 -height 2160 gives the 4K figure.
+
+namespace
+{
+    struct Float3
+    {
+        float x, y, z;
+
+        Float3() : x(0.0f), y(0.0f), z(0.0f) { }
+        Float3(float x, float y, float z) : x(x), y(y), z(z) { }
+        explicit Float3(const float* v) : x(v[0]), y(v[1]), z(v[2]) { }
+
+        Float3 operator+(const Float3& b) const { return Float3(x + b.x, y + b.y, z + b.z); }
+        Float3 operator-(const Float3& b) const { return Float3(x - b.x, y - b.y, z - b.z); }
+        Float3 operator*(const Float3& b) const { return Float3(x * b.x, y * b.y, z * b.z); }
+        Float3 operator*(float s) const { return Float3(x * s, y * s, z * s); }
+        Float3 operator-() const { return Float3(-x, -y, -z); }
+    };
+
+    float Dot(const Float3& a, const Float3& b)
+    {
+        return a.x * b.x + a.y * b.y + a.z * b.z;
+    }
+
+    Float3 Cross(const Float3& a, const Float3& b)
+    {
+        return Float3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+    }
+
+    Float3 Normalize(const Float3& v)
+    {
+        return v * (1.0f / sqrtf(Dot(v, v)));
+    }
+
+    Float3 Mix(const Float3& a, const Float3& b, float t)
+    {
+        return a * (1.0f - t) + b * t;
+    }
+
+    float Mix(float a, float b, float t)
+    {
+        return a * (1.0f - t) + b * t;
+    }
+
+    float Clamp01(float value)
+    {
+        return std::min(std::max(value, 0.0f), 1.0f);
+    }
+
+    // R8G8B8A8_SRGB texture as the hit shaders see it: decoded to linear, sampled
+    // nearest with repeat like the magnification filter of the sample's sampler
+    struct Texture
+    {
+        uint32_t Width = 0;
+        uint32_t Height = 0;
+        std::vector<Float3> Texels;
+
+        bool Load(const std::wstring& path)
+        {
+            FILE* file = OpenFile(path, "rb");
+            if (file == nullptr)
+            {
+                return false;
+            }
+
+            int width, height, channels;
+            stbi_uc* pixels = stbi_load_from_file(file, &width, &height, &channels, STBI_rgb_alpha);
+            fclose(file);
+            if (pixels == nullptr)
+            {
+                return false;
+            }
+
+            float srgbToLinear[256];
+            for (int i = 0; i < 256; i++)
+            {
+                const float c = float(i) / 255.0f;
+                srgbToLinear[i] = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+            }
+
+            Width = (uint32_t)width;
+            Height = (uint32_t)height;
+            Texels.resize(Width * Height);
+            for (uint32_t i = 0; i < Width * Height; i++)
+            {
+                Texels[i] = Float3(srgbToLinear[pixels[i * 4]], srgbToLinear[pixels[i * 4 + 1]], srgbToLinear[pixels[i * 4 + 2]]);
+            }
+
+            stbi_image_free(pixels);
+            return true;
+        }
+
+        Float3 Sample(float u, float v) const
+        {
+            const float x = (u - floorf(u)) * float(Width);
+            const float y = (v - floorf(v)) * float(Height);
+            const uint32_t column = std::min((uint32_t)x, Width - 1);
+            const uint32_t row = std::min((uint32_t)y, Height - 1);
+            return Texels[row * Width + column];
+        }
+    };
+
+    // ShadingPermutation of the sample with its defaults
+    struct ShadingSettings
+    {
+        Float3 lightDirection = Float3(-0.85f, 0.5f, 1.0f);
+        float roughnessBase = 0.1f;
+        float roughnessAlbedoScale = 0.3f;
+        bool textureFetchEnabled = true;
+        uint32_t shadowRayCount = 0;
+        float shadowLightRadius = 0.05f;
+        float shadowTMin = 0.001f;
+        float shadowTMax = 100.0f;
+        float tmin = 0.001f;
+        float tmax = 100.0f;
+        bool progressive = false;
+        uint32_t maxSampleCount = 1024;
+        float convergenceError = 0.002f;
+    };
+
+    // FrameUniformContent of the sample
+    struct FrameUniforms
+    {
+        uint32_t accumulatedFrameNum = 0; // 0 discards the accumulated samples
+    };
+
+    // Where RayGen stores its pixels: the image of the whole launch, or the tile
+    // being traced in tiled rendering
+    struct OutputImage
+    {
+        uint8_t* Pixels = nullptr; // rgba8
+        uint32_t Origin[2] = { }; // launch position of the first pixel
+        uint32_t Width = 0;
+    };
+
+    // The accumulation and variance images of progressive rendering
+    struct AccumulationImages
+    {
+        std::vector<float> Accumulation; // rgba per pixel, rgb = mean color, a = sample count
+        std::vector<float> Variance; // summed squared luminance deviations from the mean
+    };
+
+    // What primary rays return, the color and what the denoiser is guided by.
+    // Mirrors PrimaryPayload of rt_11_shaders.rgen, which writes the same fields as AOVs.
+    struct PrimaryPayload
+    {
+        Float3 Color;
+        Float3 Albedo;
+        Float3 Normal; // world space, 0 where the ray missed
+        float Depth = 0.0f; // hit distance, 0 where the ray missed
+        uint32_t InstanceId = ~0u; // gl_InstanceCustomIndexNV, ~0 where the ray missed
+    };
+
+    // The unclamped color and the guides of every pixel for -denoise, left empty
+    // otherwise. Pixels that progressive rendering skips keep their last values.
+    struct DenoiserImages
+    {
+        std::vector<float> Color; // rgb
+        std::vector<float> Albedo; // rgb
+        std::vector<float> Normal; // xyz
+        std::vector<float> Depth;
+    };
+
+    // What the object data buffer and the bindless tables give the hit shaders of one object
+    struct RenderObject
+    {
+        const MeshView* mesh = nullptr;
+        const Texture* texture = nullptr; // null selects the untextured icosahedron shader
+    };
+
+    const uint32_t MissIndexPrimary = 0;
+    const uint32_t MissIndexShadow = 1;
+
+    // Hash and HashToFloat of rt_11_shaders.rgen and rt_11_*.rchit
+    uint32_t Hash(uint32_t value)
+    {
+        const uint32_t state = value * 747796405u + 2891336453u;
+        const uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+        return (word >> 22u) ^ word;
+    }
+
+    float HashToFloat(uint32_t hash)
+    {
+        return float(hash >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // rt_11_shaders.rgen
+    const uint32_t MinSampleCount = 16;
+
+    float Luminance(const Float3& color)
+    {
+        return color.x * 0.2126f + color.y * 0.7152f + color.z * 0.0722f;
+    }
+
+    bool IsConverged(const ShadingSettings& settings, float sampleCount, float m2)
+    {
+        if (sampleCount >= float(settings.maxSampleCount))
+        {
+            return true;
+        }
+        return sampleCount >= float(MinSampleCount) &&
+            m2 <= settings.convergenceError * settings.convergenceError * sampleCount * (sampleCount - 1.0f);
+    }
+
+    // The camera ray of RayGen, also the primary rays of packet mode. Progressive
+    // frames jitter it with GetSampleJitter of the shader.
+    const uint32_t PrimaryRayFlags = CPU_RAY_FLAG_OPAQUE;
+
+    void GetPrimaryRay(uint32_t x, uint32_t y, uint32_t width, uint32_t height, const ShadingSettings& settings, const FrameUniforms& frame,
+        CpuRay& ray)
+    {
+        float jitter[2] = { 0.5f, 0.5f };
+        if (settings.progressive)
+        {
+            const uint32_t hash = Hash(x + Hash(y));
+            const float shift[2] = { HashToFloat(hash), HashToFloat(Hash(hash)) };
+            const uint32_t r2[2] = { 3242174889u * frame.accumulatedFrameNum, 2447445413u * frame.accumulatedFrameNum };
+            for (int i = 0; i < 2; i++)
+            {
+                const float value = shift[i] + HashToFloat(r2[i]);
+                jitter[i] = value - floorf(value);
+            }
+        }
+
+        const float pixelCenter[2] = { float(x) + jitter[0], float(y) + jitter[1] };
+        const float dx = pixelCenter[0] / float(width) * 2.0f - 1.0f;
+        const float dy = pixelCenter[1] / float(height) * 2.0f - 1.0f;
+        const float aspectRatio = float(width) / float(height);
+
+        const Float3 direction = Normalize(Float3(dx * aspectRatio, -dy, 1.0f));
+        ray = { { 0.0f, 0.0f, -2.0f }, settings.tmin, { direction.x, direction.y, direction.z }, settings.tmax };
+    }
+
+    // imageStore to an rgba8 image
+    void StorePixel(const Float3& color, uint8_t* pixel)
+    {
+        pixel[0] = (uint8_t)(Clamp01(color.x) * 255.0f + 0.5f);
+        pixel[1] = (uint8_t)(Clamp01(color.y) * 255.0f + 0.5f);
+        pixel[2] = (uint8_t)(Clamp01(color.z) * 255.0f + 0.5f);
+        pixel[3] = 0;
+    }
+
+    void RayGen(CpuShaderContext& context, const ShadingSettings& settings, const FrameUniforms& frame, AccumulationImages& accumulation,
+        DenoiserImages& denoiserImages, const OutputImage& output)
+    {
+        const uint32_t pixelIndex = context.LaunchId[1] * context.LaunchSize[0] + context.LaunchId[0];
+
+        float* accumulated = nullptr;
+        float* m2 = nullptr;
+        Float3 hitValue;
+        if (settings.progressive)
+        {
+            // The first frame after a reset overwrites whatever was accumulated before
+            accumulated = accumulation.Accumulation.data() + pixelIndex * 4;
+            m2 = accumulation.Variance.data() + pixelIndex;
+            if (frame.accumulatedFrameNum == 0)
+            {
+                accumulated[0] = accumulated[1] = accumulated[2] = accumulated[3] = 0.0f;
+                *m2 = 0.0f;
+            }
+
+            hitValue = Float3(accumulated);
+        }
+
+        if (!settings.progressive || !IsConverged(settings, accumulated[3], *m2))
+        {
+            CpuRay ray;
+            GetPrimaryRay(context.LaunchId[0], context.LaunchId[1], context.LaunchSize[0], context.LaunchSize[1], settings, frame, ray);
+            PrimaryPayload payload;
+            context.TraceRay(PrimaryRayFlags, 0xff, 0, 1, MissIndexPrimary, ray, &payload);
+            hitValue = payload.Color;
+
+            if (!denoiserImages.Depth.empty())
+            {
+                memcpy(denoiserImages.Albedo.data() + pixelIndex * 3, &payload.Albedo, sizeof(Float3));
+                memcpy(denoiserImages.Normal.data() + pixelIndex * 3, &payload.Normal, sizeof(Float3));
+                denoiserImages.Depth[pixelIndex] = payload.Depth;
+            }
+
+            if (settings.progressive)
+            {
+                // Welford's update of the running mean and of the luminance variance
+                const float sampleCount = accumulated[3] + 1.0f;
+                const Float3 previousMean(accumulated);
+                const Float3 mean = previousMean + (hitValue - previousMean) * (1.0f / sampleCount);
+
+                const float luminance = Luminance(hitValue);
+                *m2 += (luminance - Luminance(previousMean)) * (luminance - Luminance(mean));
+
+                accumulated[0] = mean.x;
+                accumulated[1] = mean.y;
+                accumulated[2] = mean.z;
+                accumulated[3] = sampleCount;
+                hitValue = mean;
+            }
+        }
+
+        if (!denoiserImages.Color.empty())
+        {
+            memcpy(denoiserImages.Color.data() + pixelIndex * 3, &hitValue, sizeof(Float3));
+        }
+        StorePixel(hitValue, output.Pixels + (size_t(context.LaunchId[1] - output.Origin[1]) * output.Width + context.LaunchId[0] - output.Origin[0]) * 4);
+    }
+
+    // rt_11_shaders.rmiss, the sky is its own albedo so the denoiser keeps the
+    // silhouettes against it
+    void Miss(void* payload)
+    {
+        PrimaryPayload& primaryPayload = *(PrimaryPayload*)payload;
+        primaryPayload.Color = Float3(0.0f, 0.1f, 0.3f);
+        primaryPayload.Albedo = primaryPayload.Color;
+    }
+
+    // rt_11_shadow.rmiss
+    void ShadowMiss(void* payload)
+    {
+        *(float*)payload = 0.0f;
+    }
+
+    // CalculateShadow of rt_11_*.rchit
+    float CalculateShadow(CpuShaderContext& context, const ShadingSettings& settings, const FrameUniforms& frame, const Float3& origin,
+        const Float3& L)
+    {
+        if (settings.shadowRayCount == 0)
+        {
+            return 1.0f;
+        }
+
+        const Float3 up = fabsf(L.y) < 0.99f ? Float3(0.0f, 1.0f, 0.0f) : Float3(1.0f, 0.0f, 0.0f);
+        const Float3 tangent = Normalize(Cross(up, L));
+        const Float3 bitangent = Cross(L, tangent);
+
+        const uint32_t rayFlags = CPU_RAY_FLAG_OPAQUE | CPU_RAY_FLAG_TERMINATE_ON_FIRST_HIT | CPU_RAY_FLAG_SKIP_CLOSEST_HIT_SHADER;
+
+        float angleOffset = 0.0f;
+        float radiusOffset = 0.5f;
+        if (settings.progressive)
+        {
+            const uint32_t hash = Hash(context.LaunchId[0] + Hash(context.LaunchId[1] + Hash(frame.accumulatedFrameNum)));
+            angleOffset = HashToFloat(hash) * 6.28318531f;
+            radiusOffset = HashToFloat(Hash(hash));
+        }
+
+        float visibility = 0.0f;
+        for (uint32_t i = 0; i < settings.shadowRayCount; i++)
+        {
+            const float radius = settings.shadowLightRadius * sqrtf((float(i) + radiusOffset) / float(settings.shadowRayCount));
+            const float angle = float(i) * 2.39996323f + angleOffset;
+            const Float3 direction = Normalize(L + (tangent * cosf(angle) + bitangent * sinf(angle)) * radius);
+
+            float shadowed = 1.0f;
+            const CpuRay ray = { { origin.x, origin.y, origin.z }, settings.shadowTMin, { direction.x, direction.y, direction.z }, settings.shadowTMax };
+            context.TraceRay(rayFlags, 0xff, 0, 1, MissIndexShadow, ray, &shadowed);
+            visibility += 1.0f - shadowed;
+        }
+
+        return visibility / float(settings.shadowRayCount);
+    }
+
+    // CalculateLighting of rt_11_*.rchit
+    Float3 CalculateLighting(const ShadingSettings& settings, const Float3& N, const Float3& L, const Float3& V, const Float3& albedo,
+        const Float3& lightColor)
+    {
+        Float3 directLighting;
+
+        float dotNL = Dot(N, L);
+        if (dotNL > 0.0f)
+        {
+            const Float3 H = Normalize(V + L);
+
+            dotNL = Clamp01(dotNL);
+            const float dotNV = Clamp01(Dot(N, V));
+            const float dotNH = Clamp01(Dot(N, H));
+            const float dotLH = Clamp01(Dot(L, H));
+            const float dotVH = Clamp01(Dot(V, H));
+
+            const float roughness = settings.roughnessBase + Dot(albedo, albedo) * settings.roughnessAlbedoScale;
+            const float F0 = 0.15f - Dot(albedo, albedo) * 0.05f;
+
+            // Direct diffuse
+            const float f = 2.0f * dotVH * dotVH * roughness - 0.5f;
+            const float FdV = f * powf(dotNV, 5.0f) + 1.0f;
+            const float FdL = f * powf(dotNL, 5.0f) + 1.0f;
+            const Float3 diffuse = albedo * lightColor * (FdV * FdL * dotNL);
+
+            // Direct specular
+            const float alpha = roughness * roughness;
+            const float alphaSqr = alpha * alpha;
+            const float denom = dotNH * dotNH * (alphaSqr - 1.0f) + 1.0f;
+            const float D = alphaSqr / (denom * denom);
+            const float F_a = 1.0f;
+            const float F_b = powf(1.0f - dotLH, 5.0f);
+            const float F = Mix(F_b, F_a, F0);
+            const float k = (alpha + 2.0f * roughness + 1.0f) / 8.0f;
+            const float G = dotNL / (Mix(dotNL, 1.0f, k) * Mix(dotNV, 1.0f, k));
+            const Float3 specular = lightColor * (D * F * G * 0.25f);
+
+            directLighting = diffuse + specular;
+        }
+
+        // Indirect diffuse
+        const Float3 colorBottom = Float3(0.0f, 0.5f, 1.0f) * 0.005f;
+        const Float3 colorTop = Float3(0.25f, 0.75f, 1.0f) * 0.05f;
+        const Float3 indirectLighting = albedo * Mix(colorBottom, colorTop, N.y * 0.5f + 0.5f);
+
+        return directLighting + indirectLighting;
+    }
+
+    // rt_11_box.rchit and rt_11_icosahedron.rchit, the object's texture decides which one
+    void ClosestHit(CpuShaderContext& context, const ShadingSettings& settings, const FrameUniforms& frame, const RenderObject& object,
+        const CpuRay& ray, const CpuHit& hit, void* payload)
+    {
+        const MeshView& mesh = *object.mesh;
+        const uint32_t* indices = mesh.Indices + hit.PrimitiveIndex * 3;
+
+        const float barycentrics[3] = { 1.0f - hit.Barycentrics[0] - hit.Barycentrics[1], hit.Barycentrics[0], hit.Barycentrics[1] };
+
+        Float3 normal;
+        for (int i = 0; i < 3; i++)
+        {
+            normal = normal + Float3(mesh.Normals + indices[i] * 3) * barycentrics[i];
+        }
+        normal = Normalize(normal);
+
+        // mat3(gl_ObjectToWorldNV) * normal
+        const float* m = hit.ObjectToWorld;
+        const Float3 N(Dot(Float3(m), normal), Dot(Float3(m + 4), normal), Dot(Float3(m + 8), normal));
+        const Float3 L = Normalize(settings.lightDirection);
+        const Float3 direction(ray.Direction);
+        const Float3 V = Normalize(-direction);
+
+        Float3 albedo(0.75f, 0.75f, 0.75f);
+        if (object.texture != nullptr && settings.textureFetchEnabled)
+        {
+            float texcoords[2] = { };
+            for (int i = 0; i < 3; i++)
+            {
+                texcoords[0] += mesh.Texcoords[indices[i] * 2] * barycentrics[i];
+                texcoords[1] += mesh.Texcoords[indices[i] * 2 + 1] * barycentrics[i];
+            }
+            albedo = object.texture->Sample(texcoords[0], texcoords[1]);
+        }
+
+        const Float3 origin = Float3(ray.Origin) + direction * hit.T;
+        const Float3 lightColor = Float3(1.0f, 1.0f, 0.6f) * (1.5f * CalculateShadow(context, settings, frame, origin, L));
+        const Float3 lighting = CalculateLighting(settings, N, L, V, albedo, lightColor);
+
+        const float gamma = 1.0f / 2.2f;
+        PrimaryPayload& primaryPayload = *(PrimaryPayload*)payload;
+        primaryPayload.Color = Float3(powf(lighting.x, gamma), powf(lighting.y, gamma), powf(lighting.z, gamma));
+        primaryPayload.Albedo = albedo;
+        primaryPayload.Normal = N;
+        primaryPayload.Depth = hit.T;
+        primaryPayload.InstanceId = hit.InstanceCustomIndex;
+    }
+
+    // rt_09_first.rchit, the icosahedron and plane of sample 09 with barycentrics as
+    // colors, darkened where the secondary ray towards the light hits something
+    const Float3 Sample09LightDirection = Float3(0.8f, 1.0f, 0.0f);
+
+    void ClosestHit09(CpuShaderContext& context, const CpuRay& ray, const CpuHit& hit, void* payload)
+    {
+        const Float3 barycentrics(1.0f - hit.Barycentrics[0] - hit.Barycentrics[1], hit.Barycentrics[0], hit.Barycentrics[1]);
+
+        // The sample only compares the gl_HitTNV of rt_09_secondary.rchit with tmax,
+        // so the ray skips it and becomes an occlusion query. A hit leaves the
+        // payload below tmax, rt_09_secondary.rmiss sets it to tmax.
+        const Float3 origin = Float3(ray.Origin) + Float3(ray.Direction) * hit.T;
+        const Float3 direction = Normalize(Sample09LightDirection);
+        const uint32_t rayFlags = CPU_RAY_FLAG_OPAQUE | CPU_RAY_FLAG_TERMINATE_ON_FIRST_HIT | CPU_RAY_FLAG_SKIP_CLOSEST_HIT_SHADER;
+        const CpuRay secondaryRay = { { origin.x, origin.y, origin.z }, 0.001f, { direction.x, direction.y, direction.z }, 100.0f };
+
+        float secondaryRayHitValue = 0.0f;
+        context.TraceRay(rayFlags, 0xff, 1, 0, 1, secondaryRay, &secondaryRayHitValue);
+
+        PrimaryPayload& primaryPayload = *(PrimaryPayload*)payload;
+        primaryPayload.Color = barycentrics * (secondaryRayHitValue < secondaryRay.TMax ? 0.25f : 1.0f);
+        primaryPayload.Albedo = barycentrics;
+        primaryPayload.Depth = hit.T;
+        primaryPayload.InstanceId = hit.InstanceCustomIndex;
+    }
+
+    // rt_09_secondary.rchit
+    void SecondaryClosestHit09(const CpuHit& hit, void* payload)
+    {
+        *(float*)payload = hit.T;
+    }
+
+    // rt_09_secondary.rmiss
+    void SecondaryMiss09(const CpuRay& ray, void* payload)
+    {
+        *(float*)payload = ray.TMax;
+    }
+
+    struct RaySet
+    {
+        const wchar_t* Name;
+        uint32_t RayFlags;
+        bool Occlusion; // traced with Occluded instead of Trace
+        bool Sorted; // traced in the order of CpuRaySorter, the sort counts into the time
+        std::vector<CpuRay> Rays;
+        std::vector<uint32_t> PacketOffsets; // first ray of every packet and the ray count, traced ray by ray when empty
+    };
+
+    // Traversal without shading. The camera rays of RayGen, traced one by one and
+    // in the blocks of packet mode, shadow rays towards the light from their hits,
+    // once as any hit traces and once as occlusion queries, rays in random
+    // directions from the same hits and a second bounce from their hits, each set
+    // traced with every kernel. The two bounces are also traced after sorting them
+    // with CpuRaySorter. Rays are generated once, so all kernels trace exactly the
+    // same ones.
+    void RunTraversalBenchmark(TaskPool& taskPool, CpuAccelerationStructure& topLevel, uint32_t width, uint32_t height,
+        const ShadingSettings& settings)
+    {
+        RaySet primary = { L"primary", PrimaryRayFlags, false, false, std::vector<CpuRay>(width * height), { } };
+        for (uint32_t y = 0; y < height; y++)
+        {
+            for (uint32_t x = 0; x < width; x++)
+            {
+                GetPrimaryRay(x, y, width, height, settings, FrameUniforms(), primary.Rays[y * width + x]);
+            }
+        }
+
+        // Blocks of the same size and order as Launch makes them
+        const uint32_t tileSize = CpuRayTracingPipeline::TileSize;
+        const uint32_t packetSize = CpuRayTracingPipeline::PacketSize;
+        RaySet packets = { L"primary packets", PrimaryRayFlags, false, false, { }, { } };
+        for (uint32_t tileY = 0; tileY < height; tileY += tileSize)
+        {
+            for (uint32_t tileX = 0; tileX < width; tileX += tileSize)
+            {
+                const uint32_t tileEndX = std::min(tileX + tileSize, width);
+                const uint32_t tileEndY = std::min(tileY + tileSize, height);
+                for (uint32_t blockY = tileY; blockY < tileEndY; blockY += packetSize)
+                {
+                    for (uint32_t blockX = tileX; blockX < tileEndX; blockX += packetSize)
+                    {
+                        packets.PacketOffsets.push_back((uint32_t)packets.Rays.size());
+                        for (uint32_t y = blockY; y < std::min(blockY + packetSize, tileEndY); y++)
+                        {
+                            for (uint32_t x = blockX; x < std::min(blockX + packetSize, tileEndX); x++)
+                            {
+                                packets.Rays.push_back(primary.Rays[y * width + x]);
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        packets.PacketOffsets.push_back((uint32_t)packets.Rays.size());
+
+        std::vector<float> hitDistances(primary.Rays.size());
+        taskPool.ParallelFor((uint32_t)primary.Rays.size(), 1024, [&](uint32_t begin, uint32_t end, uint32_t)
+        {
+            for (uint32_t i = begin; i < end; i++)
+            {
+                CpuHit hit;
+                hitDistances[i] = topLevel.Trace(primary.Rays[i], primary.RayFlags, 0xff, hit) ? hit.T : -1.0f;
+            }
+        });
+
+        const uint32_t shadowRayFlags = CPU_RAY_FLAG_OPAQUE | CPU_RAY_FLAG_TERMINATE_ON_FIRST_HIT | CPU_RAY_FLAG_SKIP_CLOSEST_HIT_SHADER;
+        RaySet shadow = { L"shadow", shadowRayFlags, false, false, { }, { } };
+        RaySet incoherent = { L"incoherent", CPU_RAY_FLAG_OPAQUE, false, false, { }, { } };
+        const Float3 L = Normalize(settings.lightDirection);
+        std::mt19937 random(1);
+        std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+        auto getRandomDirection = [&]()
+        {
+            // Uniform on the sphere by rejection
+            Float3 direction;
+            do
+            {
+                direction = Float3(uniform(random), uniform(random), uniform(random));
+            } while (Dot(direction, direction) > 1.0f || Dot(direction, direction) < 1e-6f);
+            return Normalize(direction);
+        };
+
+        for (size_t i = 0; i < primary.Rays.size(); i++)
+        {
+            if (hitDistances[i] < 0.0f)
+            {
+                continue;
+            }
+
+            const CpuRay& ray = primary.Rays[i];
+            const Float3 origin = Float3(ray.Origin) + Float3(ray.Direction) * hitDistances[i];
+            const CpuRay shadowRay = { { origin.x, origin.y, origin.z }, settings.shadowTMin, { L.x, L.y, L.z }, settings.shadowTMax };
+            shadow.Rays.push_back(shadowRay);
+
+            const Float3 direction = getRandomDirection();
+            const CpuRay incoherentRay = { { origin.x, origin.y, origin.z }, settings.tmin, { direction.x, direction.y, direction.z }, settings.tmax };
+            incoherent.Rays.push_back(incoherentRay);
+        }
+        const RaySet occluded = { L"occluded", shadowRayFlags, true, false, shadow.Rays, { } };
+        const RaySet incoherentSorted = { L"incoherent sorted", incoherent.RayFlags, false, true, incoherent.Rays, { } };
+
+        // Unlike the first bounce, whose rays start next to each other in pixel
+        // order, these start anywhere in the scene
+        std::vector<float> bounceDistances(incoherent.Rays.size());
+        taskPool.ParallelFor((uint32_t)incoherent.Rays.size(), 1024, [&](uint32_t begin, uint32_t end, uint32_t)
+        {
+            for (uint32_t i = begin; i < end; i++)
+            {
+                CpuHit hit;
+                bounceDistances[i] = topLevel.Trace(incoherent.Rays[i], incoherent.RayFlags, 0xff, hit) ? hit.T : -1.0f;
+            }
+        });
+
+        RaySet bounce = { L"second bounce", CPU_RAY_FLAG_OPAQUE, false, false, { }, { } };
+        for (size_t i = 0; i < incoherent.Rays.size(); i++)
+        {
+            if (bounceDistances[i] < 0.0f)
+            {
+                continue;
+            }
+
+            const CpuRay& ray = incoherent.Rays[i];
+            const Float3 origin = Float3(ray.Origin) + Float3(ray.Direction) * bounceDistances[i];
+            const Float3 direction = getRandomDirection();
+            const CpuRay bounceRay = { { origin.x, origin.y, origin.z }, settings.tmin, { direction.x, direction.y, direction.z }, settings.tmax };
+            bounce.Rays.push_back(bounceRay);
+        }
+        const RaySet bounceSorted = { L"second bounce sorted", bounce.RayFlags, false, true, bounce.Rays, { } };
+
+        std::wcout << L"Traversal benchmark on " << taskPool.GetThreadNum() << L" threads, Mrays/s\n";
+        const RaySet* raySets[] = { &primary, &packets, &shadow, &occluded, &incoherent, &incoherentSorted, &bounce, &bounceSorted };
+        CpuRaySorter sorter;
+        const Bvh8Kernel defaultKernel = topLevel.GetTraversalKernel();
+        const Bvh8Kernel kernels[] = { Bvh8Kernel::Scalar, Bvh8Kernel::SSE41, Bvh8Kernel::AVX2, Bvh8Kernel::AVX512 };
+        for (Bvh8Kernel kernel : kernels)
+        {
+            if (!IsBvh8KernelSupported(kernel))
+            {
+                continue;
+            }
+
+            topLevel.SetTraversalKernel(kernel);
+            std::wcout << L"    " << GetBvh8KernelName(kernel) << L":";
+            for (const RaySet* raySet : raySets)
+            {
+                // Best of three, the first one also warms the caches
+                double bestMilliseconds = 0.0;
+                uint32_t hitNum = 0;
+                for (int repeat = 0; repeat < 3; repeat++)
+                {
+                    std::vector<uint32_t> threadHitNums(taskPool.GetThreadNum(), 0);
+                    const auto start = std::chrono::high_resolution_clock::now();
+                    const uint32_t* order = nullptr;
+                    if (raySet->Sorted)
+                    {
+                        sorter.Sort(taskPool, raySet->Rays.data(), (uint32_t)raySet->Rays.size());
+                        order = sorter.GetOrder().data();
+                    }
+
+                    if (raySet->Occlusion)
+                    {
+                        taskPool.ParallelFor((uint32_t)raySet->Rays.size(), 1024, [&](uint32_t begin, uint32_t end, uint32_t threadIndex)
+                        {
+                            for (uint32_t i = begin; i < end; i++)
+                            {
+                                const CpuRay& ray = raySet->Rays[order != nullptr ? order[i] : i];
+                                threadHitNums[threadIndex] += topLevel.Occluded(ray, raySet->RayFlags, 0xff) ? 1 : 0;
+                            }
+                        });
+                    }
+                    else if (raySet->PacketOffsets.empty())
+                    {
+                        taskPool.ParallelFor((uint32_t)raySet->Rays.size(), 1024, [&](uint32_t begin, uint32_t end, uint32_t threadIndex)
+                        {
+                            for (uint32_t i = begin; i < end; i++)
+                            {
+                                CpuHit hit;
+                                const CpuRay& ray = raySet->Rays[order != nullptr ? order[i] : i];
+                                threadHitNums[threadIndex] += topLevel.Trace(ray, raySet->RayFlags, 0xff, hit) ? 1 : 0;
+                            }
+                        });
+                    }
+                    else
+                    {
+                        taskPool.ParallelFor((uint32_t)raySet->PacketOffsets.size() - 1, 16, [&](uint32_t begin, uint32_t end, uint32_t threadIndex)
+                        {
+                            for (uint32_t i = begin; i < end; i++)
+                            {
+                                const uint32_t first = raySet->PacketOffsets[i];
+                                CpuHit hits[Bvh8PacketMaxRayNum];
+                                uint64_t hitMask = topLevel.TracePacket(&raySet->Rays[first], raySet->PacketOffsets[i + 1] - first,
+                                    raySet->RayFlags, 0xff, hits);
+                                for (; hitMask != 0; hitMask &= hitMask - 1)
+                                {
+                                    threadHitNums[threadIndex]++;
+                                }
+                            }
+                        });
+                    }
+                    const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                    bestMilliseconds = repeat == 0 ? milliseconds : std::min(bestMilliseconds, milliseconds);
+
+                    hitNum = 0;
+                    for (uint32_t threadHitNum : threadHitNums)
+                    {
+                        hitNum += threadHitNum;
+                    }
+                }
+
+                const double megaRaysPerSecond = bestMilliseconds > 0.0 ? raySet->Rays.size() / (bestMilliseconds * 1000.0) : 0.0;
+                std::wcout << L" " << raySet->Name << L" " << megaRaysPerSecond << L" (" << raySet->Rays.size() << L" rays, " << hitNum
+                    << L" hits)";
+            }
+            std::wcout << L"\n";
+        }
+        topLevel.SetTraversalKernel(defaultKernel);
+    }
+
+    // The VkGeometryNV the sample fills in for a mesh
+    BvhGeometryInput GetGeometryInput(const MeshView& mesh)
+    {
+        BvhGeometryInput input;
+        input.Geometry.sType = VK_STRUCTURE_TYPE_GEOMETRY_NV;
+        input.Geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_NV;
+        input.Geometry.flags = VK_GEOMETRY_OPAQUE_BIT_NV;
+        VkGeometryTrianglesNV& triangles = input.Geometry.geometry.triangles;
+        triangles.sType = VK_STRUCTURE_TYPE_GEOMETRY_TRIANGLES_NV;
+        triangles.vertexCount = mesh.VertexNum;
+        triangles.vertexStride = sizeof(float) * 3;
+        triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+        triangles.indexCount = mesh.IndexNum;
+        triangles.indexType = VK_INDEX_TYPE_UINT32;
+        input.VertexData = mesh.Positions;
+        input.IndexData = mesh.Indices;
+        return input;
+    }
+
+    // BLAS updates like sample 08 makes them every frame. The largest mesh gets
+    // the scale and shift of its FillVertexBuffer plus a twist around the y axis
+    // that grows with time, so the tree of the first build fits worse and worse.
+    // Each frame is updated with UpdateBvh, built from scratch for comparison and
+    // handed to the tracer with UpdateBottomLevel, which refits the wide BVH in
+    // place unless UpdateBvh rebuilt.
+    void RunRefitBenchmark(TaskPool& taskPool, const SceneView& scene)
+    {
+        const MeshView* mesh = nullptr;
+        for (const MeshView& candidate : scene.Meshes)
+        {
+            if (mesh == nullptr || candidate.IndexNum > mesh->IndexNum)
+            {
+                mesh = &candidate;
+            }
+        }
+        if (mesh == nullptr || mesh->IndexNum == 0)
+        {
+            return;
+        }
+
+        std::vector<float> positions(mesh->Positions, mesh->Positions + mesh->VertexNum * 3);
+        std::vector<BvhGeometryInput> geometries(1, GetGeometryInput(*mesh));
+        geometries[0].VertexData = positions.data();
+
+        const BvhBuildSettings settings;
+        Bvh bvh;
+        std::wstring error;
+        if (!BuildBvh(taskPool, geometries, settings, bvh, error))
+        {
+            std::wcerr << mesh->Name << L": " << error << L"\n";
+            return;
+        }
+
+        // One instance of the mesh, the tracer follows the BLAS through UpdateBottomLevel
+        VkGeometryInstance instance = { };
+        instance.transform[0] = instance.transform[5] = instance.transform[10] = 1.0f;
+        instance.mask = 0xff;
+        instance.accelerationStructureHandle = 0;
+        CpuAccelerationStructure topLevel;
+        if (!topLevel.Build(taskPool, std::vector<const Bvh*>(1, &bvh), &instance, 1, error))
+        {
+            std::wcerr << mesh->Name << L": " << error << L"\n";
+            return;
+        }
+
+        std::wcout << L"Refit benchmark on " << taskPool.GetThreadNum() << L" threads, " << mesh->Name << L" with " << bvh.Triangles.size()
+            << L" triangles, rebuilt beyond " << settings.RebuildSahRatio << L" times the SAH cost of the build\n";
+        for (uint32_t frame = 1; frame <= 8; frame++)
+        {
+            const float time = (float)frame * 0.1f;
+            const float scale = sinf(time * 5.0f) * 0.5f + 1.0f;
+            const float bias = sinf(time * 3.0f) * 0.5f;
+            for (uint32_t vertex = 0; vertex < mesh->VertexNum; vertex++)
+            {
+                const float* source = mesh->Positions + vertex * 3;
+                float* target = &positions[vertex * 3];
+                const float angle = time * source[1] * 4.0f;
+                target[0] = (source[0] * cosf(angle) - source[2] * sinf(angle)) * scale + bias;
+                target[1] = source[1] * scale;
+                target[2] = (source[0] * sinf(angle) + source[2] * cosf(angle)) * scale;
+            }
+
+            BvhRefitStats refitStats;
+            BvhStats buildStats;
+            Bvh reference;
+            if (!UpdateBvh(taskPool, geometries, settings, bvh, error, &refitStats) ||
+                !BuildBvh(taskPool, geometries, settings, reference, error, &buildStats))
+            {
+                std::wcerr << mesh->Name << L": " << error << L"\n";
+                return;
+            }
+            const auto tracerStart = std::chrono::high_resolution_clock::now();
+            if (!topLevel.UpdateBottomLevel(taskPool, 0, bvh, refitStats.Rebuilt, error))
+            {
+                std::wcerr << mesh->Name << L": " << error << L"\n";
+                return;
+            }
+            const double tracerMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tracerStart).count();
+
+            const double million = (double)bvh.Triangles.size() / 1000000.0;
+            std::wcout << L"    frame " << frame << L": " << (refitStats.Rebuilt ? L"rebuilt " : L"refit ") << refitStats.Milliseconds << L" ms ("
+                << refitStats.Milliseconds / million << L" ms per M triangles), SAH " << refitStats.SahRatio << L" times the last build and "
+                << refitStats.SahCost / buildStats.SahCost << L" times a fresh one, full build "
+                << buildStats.BuildMilliseconds << L" ms (" << buildStats.BuildMilliseconds / million << L" ms per M triangles), tracer update "
+                << tracerMilliseconds << L" ms (" << (refitStats.Rebuilt ? L"collapsed" : L"wide BVH refit") << L")\n";
+        }
+    }
+
+    // The top level alone: the instances of the scene repeated on a grid receding
+    // from the camera until there are about a million, built and traced with the
+    // camera rays. The copies share the bottom levels, so only the top level grows.
+    void RunInstancingBenchmark(TaskPool& taskPool, const std::vector<const Bvh*>& bottomLevels,
+        const std::vector<VkGeometryInstance>& instances, uint32_t width, uint32_t height, const ShadingSettings& settings)
+    {
+        if (instances.empty())
+        {
+            return;
+        }
+
+        const uint32_t targetInstanceNum = 1u << 20;
+        const uint32_t gridSize = (uint32_t)ceil(sqrt((double)targetInstanceNum / (double)instances.size()));
+        const float spacing = 2.5f; // the scene is fitted to a size of 2
+        std::vector<VkGeometryInstance> copies;
+        copies.reserve((size_t)gridSize * gridSize * instances.size());
+        for (uint32_t z = 0; z < gridSize; z++)
+        {
+            for (uint32_t x = 0; x < gridSize; x++)
+            {
+                for (const VkGeometryInstance& instance : instances)
+                {
+                    VkGeometryInstance copy = instance;
+                    copy.transform[3] += ((float)x - (float)(gridSize / 2)) * spacing;
+                    copy.transform[11] += (float)z * spacing;
+                    copies.push_back(copy);
+                }
+            }
+        }
+
+        CpuAccelerationStructure topLevel;
+        std::wstring error;
+        auto start = std::chrono::high_resolution_clock::now();
+        if (!topLevel.SetBottomLevels(taskPool, bottomLevels, error))
+        {
+            std::wcerr << error << L"\n";
+            return;
+        }
+        const double bottomLevelMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+        std::wcout << L"Instancing benchmark: " << copies.size() << L" instances of " << bottomLevels.size() << L" BLAS, collapsed in "
+            << bottomLevelMilliseconds << L" ms\n";
+
+        // Both top level builds, the trace shows what the faster one costs in tree quality
+        const CpuTopLevelBuild builds[] = { CpuTopLevelBuild::Sah, CpuTopLevelBuild::Morton };
+        for (CpuTopLevelBuild build : builds)
+        {
+            topLevel.SetTopLevelBuild(build);
+
+            double buildMilliseconds = 0.0;
+            for (int repeat = 0; repeat < 3; repeat++)
+            {
+                start = std::chrono::high_resolution_clock::now();
+                if (!topLevel.Build(taskPool, copies.data(), (uint32_t)copies.size(), error))
+                {
+                    std::wcerr << error << L"\n";
+                    return;
+                }
+                const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+                buildMilliseconds = repeat == 0 ? milliseconds : std::min(buildMilliseconds, milliseconds);
+            }
+
+            std::vector<uint32_t> threadHitNums(taskPool.GetThreadNum(), 0);
+            start = std::chrono::high_resolution_clock::now();
+            taskPool.ParallelFor(width * height, 1024, [&](uint32_t begin, uint32_t end, uint32_t threadIndex)
+            {
+                for (uint32_t i = begin; i < end; i++)
+                {
+                    CpuRay ray;
+                    GetPrimaryRay(i % width, i / width, width, height, settings, FrameUniforms(), ray);
+                    CpuHit hit;
+                    threadHitNums[threadIndex] += topLevel.Trace(ray, PrimaryRayFlags, 0xff, hit) ? 1 : 0;
+                }
+            });
+            const double traceMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+            uint32_t hitNum = 0;
+            for (uint32_t threadHitNum : threadHitNums)
+            {
+                hitNum += threadHitNum;
+            }
+
+            std::wcout << L"    " << (build == CpuTopLevelBuild::Sah ? L"SAH" : L"Morton") << L" top level built in " << buildMilliseconds << L" ms ("
+                << (buildMilliseconds > 0.0 ? copies.size() / (buildMilliseconds * 1000.0) : 0.0) << L" M instances/s), "
+                << (double)topLevel.GetTopLevelMemorySize() / (double)copies.size() << L" bytes per instance, primary rays "
+                << (traceMilliseconds > 0.0 ? width * height / (traceMilliseconds * 1000.0) : 0.0) << L" Mrays/s (" << hitNum << L" hits)\n";
+        }
+    }
+
+    bool HasSceneCacheExtension(const std::wstring& path)
+    {
+        const std::wstring extension = L".vkscene";
+        return path.size() >= extension.size() && path.compare(path.size() - extension.size(), extension.size(), extension) == 0;
+    }
+
+    // The cache handling of LoadScene in sample 11, without writing a cache
+    bool LoadScene(const std::wstring& path, TaskPool& taskPool, SceneCache& cache, ImportedScene& importedScene, SceneView& scene,
+        std::wstring& error)
+    {
+        const bool isCache = HasSceneCacheExtension(path);
+        const std::wstring cachePath = isCache ? path : path + L".vkscene";
+
+        if (cache.Load(cachePath, taskPool, true, error) && (isCache || cache.IsUpToDate(path)))
+        {
+            scene = cache.GetView();
+            return true;
+        }
+        if (isCache)
+        {
+            return false;
+        }
+
+        ImportStats stats;
+        if (!ImportScene(path, taskPool, importedScene, stats, error))
+        {
+            return false;
+        }
+        scene = importedScene.GetView();
+        return true;
+    }
+
+    // Squared standard error of the mean luminance of a pixel, what IsConverged
+    // compares against convergenceError. Pixels with fewer than two samples have
+    // no estimate yet and count as 0.
+    float GetSquaredError(float sampleCount, float m2)
+    {
+        return sampleCount > 1.0f ? m2 / (sampleCount * (sampleCount - 1.0f)) : 0.0f;
+    }
+
+    // Error of the whole image, the RMS of the pixels' standard errors, against
+    // the time since rendering started. The first time it's below the target is
+    // what renders are compared by.
+    struct ErrorTracker
+    {
+        double TargetError = 0.0;
+        std::chrono::high_resolution_clock::time_point Start = std::chrono::high_resolution_clock::now();
+        double TargetMilliseconds = -1.0; // negative until the target is reached
+        uint64_t TargetSampleNum = 0; // pixel samples traced until then
+
+        double GetMilliseconds() const
+        {
+            return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - Start).count();
+        }
+
+        void Update(double squaredErrorSum, uint32_t pixelNum, uint64_t tracedPixelNum)
+        {
+            if (TargetMilliseconds < 0.0 && sqrt(squaredErrorSum / pixelNum) <= TargetError)
+            {
+                TargetMilliseconds = GetMilliseconds();
+                TargetSampleNum = tracedPixelNum;
+            }
+        }
+
+        std::wstring GetReport() const
+        {
+            if (TargetMilliseconds < 0.0)
+            {
+                return L"target error " + std::to_wstring(TargetError) + L" not reached";
+            }
+            return L"target error " + std::to_wstring(TargetError) + L" reached after " + std::to_wstring(TargetMilliseconds) + L" ms and " +
+                std::to_wstring(TargetSampleNum) + L" pixel samples";
+        }
+    };
+
+    // The frame loop of the sample in progressive mode, without anything changing
+    // between frames. Launches until every pixel has converged or has
+    // maxSampleCount samples, converged pixels cost a load and a store like in
+    // the raygen shader. Reports the pixels traced per frame and the work saved
+    // against tracing every pixel maxSampleCount times.
+    void RenderProgressive(TaskPool& taskPool, const CpuAccelerationStructure& topLevel, CpuRayTracingPipeline& pipeline,
+        const ShadingSettings& settings, FrameUniforms& frame, const AccumulationImages& accumulation, uint32_t width, uint32_t height)
+    {
+        const uint32_t pixelNum = width * height;
+        uint32_t convergedNum = 0;
+        uint64_t tracedPixelNum = 0;
+        uint64_t rayNum = 0;
+        double milliseconds = 0.0;
+        uint32_t threadNum = 0;
+
+        ErrorTracker errorTracker;
+        errorTracker.TargetError = settings.convergenceError;
+
+        for (frame.accumulatedFrameNum = 0; frame.accumulatedFrameNum < settings.maxSampleCount && convergedNum < pixelNum;)
+        {
+            CpuLaunchStats stats;
+            pipeline.Launch(taskPool, topLevel, width, height, &stats);
+            frame.accumulatedFrameNum++;
+
+            const uint32_t frameTracedNum = pixelNum - convergedNum;
+            tracedPixelNum += frameTracedNum;
+            rayNum += stats.RayNum;
+            milliseconds += stats.Milliseconds;
+            threadNum = stats.ThreadNum;
+
+            convergedNum = 0;
+            double squaredErrorSum = 0.0;
+            for (uint32_t i = 0; i < pixelNum; i++)
+            {
+                const float sampleCount = accumulation.Accumulation[i * 4 + 3];
+                convergedNum += IsConverged(settings, sampleCount, accumulation.Variance[i]) ? 1 : 0;
+                squaredErrorSum += GetSquaredError(sampleCount, accumulation.Variance[i]);
+            }
+
+            // Without the minimum sample count the first frames would have no error
+            if (frame.accumulatedFrameNum >= MinSampleCount)
+            {
+                errorTracker.Update(squaredErrorSum, pixelNum, tracedPixelNum);
+            }
+
+            // Every power of two and the last frame
+            const uint32_t frameNum = frame.accumulatedFrameNum;
+            if ((frameNum & (frameNum - 1)) == 0 || frameNum == settings.maxSampleCount || convergedNum == pixelNum)
+            {
+                std::wcout << L"Frame " << frameNum << L": " << frameTracedNum << L" pixels traced in " << stats.Milliseconds << L" ms, "
+                    << convergedNum * 100.0 / pixelNum << L"% converged, error " << sqrt(squaredErrorSum / pixelNum) << L"\n";
+            }
+        }
+
+        const uint64_t fullPixelNum = uint64_t(pixelNum) * settings.maxSampleCount;
+        std::wcout << width << L"x" << height << L" on " << threadNum << L" threads: " << frame.accumulatedFrameNum << L" frames in "
+            << milliseconds << L" ms, " << rayNum << L" rays, " << (milliseconds > 0.0 ? rayNum / (milliseconds * 1000.0) : 0.0)
+            << L" Mrays/s, " << tracedPixelNum << L" of " << fullPixelNum << L" pixel samples traced ("
+            << (fullPixelNum - tracedPixelNum) * 100.0 / fullPixelNum << L"% saved), " << errorTracker.GetReport() << L"\n";
+    }
+
+    // Tiles of the adaptive sampler by the RMS standard error of their pixels
+    struct TileError
+    {
+        float Error;
+        uint32_t Tile;
+
+        bool operator<(const TileError& other) const { return Error < other.Error; }
+    };
+
+    // Every pixel gets this many samples before the errors of the tiles are trusted
+    const uint32_t AdaptiveWarmupFrameNum = MinSampleCount;
+
+    // Up to this many of the worst tiles are launched together, enough to keep
+    // the threads busy without spending samples on tiles that have become better
+    // than others in the meantime
+    const uint32_t AdaptiveBatchTileNum = 64;
+
+    // Progressive rendering that spends samples where the error is. After a
+    // warmup of whole frames, tiles of CpuRayTracingPipeline wait in a priority
+    // queue by their error, and every round launches another sample of the worst
+    // ones with LaunchTiles. Tiles leave the queue once their error is below
+    // convergenceError or none of their pixels would be traced anymore, flat
+    // background after the warmup. Within launched tiles converged pixels are
+    // skipped like in progressive mode.
+    void RenderAdaptive(TaskPool& taskPool, const CpuAccelerationStructure& topLevel, CpuRayTracingPipeline& pipeline,
+        const ShadingSettings& settings, FrameUniforms& frame, const AccumulationImages& accumulation, uint32_t width, uint32_t height)
+    {
+        const uint32_t tileSize = CpuRayTracingPipeline::TileSize;
+        const uint32_t tileNumX = CpuRayTracingPipeline::GetTileNum(width);
+        const uint32_t tileNum = tileNumX * CpuRayTracingPipeline::GetTileNum(height);
+        const uint32_t pixelNum = width * height;
+
+        std::vector<double> tileErrorSums(tileNum, 0.0); // squared errors of the pixels
+        std::vector<uint32_t> tileActiveNums(tileNum, 0); // pixels the next launch of the tile traces
+        double squaredErrorSum = 0.0;
+
+        // Returns the RMS error of the tile, updates the sums
+        auto updateTile = [&](uint32_t tile) -> float
+        {
+            const uint32_t beginX = tile % tileNumX * tileSize;
+            const uint32_t beginY = tile / tileNumX * tileSize;
+            const uint32_t endX = std::min(beginX + tileSize, width);
+            const uint32_t endY = std::min(beginY + tileSize, height);
+
+            double errorSum = 0.0;
+            uint32_t activeNum = 0;
+            for (uint32_t y = beginY; y < endY; y++)
+            {
+                for (uint32_t x = beginX; x < endX; x++)
+                {
+                    const uint32_t i = y * width + x;
+                    const float sampleCount = accumulation.Accumulation[i * 4 + 3];
+                    errorSum += GetSquaredError(sampleCount, accumulation.Variance[i]);
+                    activeNum += IsConverged(settings, sampleCount, accumulation.Variance[i]) ? 0 : 1;
+                }
+            }
+
+            squaredErrorSum += errorSum - tileErrorSums[tile];
+            tileErrorSums[tile] = errorSum;
+            tileActiveNums[tile] = activeNum;
+            return (float)sqrt(errorSum / ((endX - beginX) * (endY - beginY)));
+        };
+
+        ErrorTracker errorTracker;
+        errorTracker.TargetError = settings.convergenceError;
+        uint64_t tracedPixelNum = 0;
+        uint64_t rayNum = 0;
+        uint32_t launchNum = 0;
+
+        const uint32_t warmupFrameNum = std::min(AdaptiveWarmupFrameNum, settings.maxSampleCount);
+        for (frame.accumulatedFrameNum = 0; frame.accumulatedFrameNum < warmupFrameNum; frame.accumulatedFrameNum++)
+        {
+            CpuLaunchStats stats;
+            pipeline.Launch(taskPool, topLevel, width, height, &stats);
+            tracedPixelNum += pixelNum;
+            rayNum += stats.RayNum;
+            launchNum++;
+        }
+
+        std::priority_queue<TileError> queue;
+        for (uint32_t tile = 0; tile < tileNum; tile++)
+        {
+            const float error = updateTile(tile);
+            if (tileActiveNums[tile] > 0 && error > settings.convergenceError)
+            {
+                queue.push({ error, tile });
+            }
+        }
+        errorTracker.Update(squaredErrorSum, pixelNum, tracedPixelNum);
+        std::wcout << L"Warmup: " << warmupFrameNum << L" frames, " << queue.size() << L" of " << tileNum << L" tiles above the target, error "
+            << sqrt(squaredErrorSum / pixelNum) << L", " << errorTracker.GetMilliseconds() << L" ms\n";
+
+        std::vector<uint32_t> batch;
+        for (uint32_t round = 1; !queue.empty(); round++)
+        {
+            batch.clear();
+            while (!queue.empty() && batch.size() < AdaptiveBatchTileNum)
+            {
+                batch.push_back(queue.top().Tile);
+                tracedPixelNum += tileActiveNums[queue.top().Tile];
+                queue.pop();
+            }
+
+            CpuLaunchStats stats;
+            pipeline.LaunchTiles(taskPool, topLevel, width, height, batch.data(), (uint32_t)batch.size(), &stats);
+            frame.accumulatedFrameNum++;
+            rayNum += stats.RayNum;
+            launchNum++;
+
+            for (uint32_t tile : batch)
+            {
+                const float error = updateTile(tile);
+                if (tileActiveNums[tile] > 0 && error > settings.convergenceError)
+                {
+                    queue.push({ error, tile });
+                }
+            }
+            errorTracker.Update(squaredErrorSum, pixelNum, tracedPixelNum);
+
+            if ((round & (round - 1)) == 0 || queue.empty())
+            {
+                std::wcout << L"Round " << round << L": " << queue.size() << L" tiles above the target, error " << sqrt(squaredErrorSum / pixelNum)
+                    << L", " << errorTracker.GetMilliseconds() << L" ms\n";
+            }
+        }
+
+        const double milliseconds = errorTracker.GetMilliseconds();
+        const uint64_t fullPixelNum = uint64_t(pixelNum) * settings.maxSampleCount;
+        std::wcout << width << L"x" << height << L" on " << taskPool.GetThreadNum() << L" threads: " << launchNum << L" launches in "
+            << milliseconds << L" ms, " << rayNum << L" rays, " << (milliseconds > 0.0 ? rayNum / (milliseconds * 1000.0) : 0.0)
+            << L" Mrays/s, " << tracedPixelNum << L" of " << fullPixelNum << L" pixel samples traced ("
+            << (fullPixelNum - tracedPixelNum) * 100.0 / fullPixelNum << L"% saved), " << errorTracker.GetReport() << L"\n";
+    }
+
+    // 24-bit BMP, bottom-up rows, written a tile at a time. Rows of a tile are
+    // placed with seeks, so tiles can come in any order and only the tile has to
+    // be in memory, whatever the size of the image.
+    class BmpTileWriter
+    {
+    private:
+        FILE* _file = nullptr;
+        uint32_t _width = 0;
+        uint32_t _height = 0;
+        uint64_t _rowSize = 0;
+        std::vector<uint8_t> _row;
+
+    public:
+        static const uint32_t HeaderSize = 54;
+
+        ~BmpTileWriter()
+        {
+            Close();
+        }
+
+        // The sizes in the header are 32 bits
+        static bool IsSizeSupported(uint32_t width, uint32_t height)
+        {
+            return width <= INT32_MAX && height <= INT32_MAX && HeaderSize + ((uint64_t(width) * 3 + 3) & ~3ull) * height <= UINT32_MAX;
+        }
+
+        bool Open(const std::wstring& path, uint32_t width, uint32_t height)
+        {
+            Close();
+            if (!IsSizeSupported(width, height))
+            {
+                return false;
+            }
+
+            _file = OpenFile(path, "wb");
+            if (_file == nullptr)
+            {
+                return false;
+            }
+
+            _width = width;
+            _height = height;
+            _rowSize = (uint64_t(width) * 3 + 3) & ~3ull;
+            const uint32_t imageSize = (uint32_t)(_rowSize * height);
+
+            uint8_t header[HeaderSize] = { 'B', 'M' };
+            auto write32 = [&](uint32_t offset, uint32_t value) { memcpy(header + offset, &value, sizeof(value)); };
+            write32(2, HeaderSize + imageSize);
+            write32(10, HeaderSize);
+            write32(14, 40);
+            write32(18, width);
+            write32(22, height);
+            header[26] = 1;
+            header[28] = 24;
+            write32(34, imageSize);
+
+            // The row padding is written along with the rows
+            if (fwrite(header, sizeof(header), 1, _file) != 1)
+            {
+                Close();
+                return false;
+            }
+            return true;
+        }
+
+        // rgba8 pixels of the tile at (x, y), rows of tileWidth pixels
+        bool WriteTile(const uint8_t* pixels, uint32_t x, uint32_t y, uint32_t tileWidth, uint32_t tileHeight)
+        {
+            const bool rowEnd = x + tileWidth == _width;
+            _row.assign(rowEnd ? (size_t)(_rowSize - uint64_t(x) * 3) : tileWidth * 3, 0);
+
+            for (uint32_t row = 0; row < tileHeight; row++)
+            {
+                const uint8_t* pixel = pixels + size_t(row) * tileWidth * 4;
+                for (uint32_t i = 0; i < tileWidth; i++, pixel += 4)
+                {
+                    _row[i * 3] = pixel[2];
+                    _row[i * 3 + 1] = pixel[1];
+                    _row[i * 3 + 2] = pixel[0];
+                }
+
+                const uint64_t offset = HeaderSize + (_height - 1 - (y + row)) * _rowSize + uint64_t(x) * 3;
+                if (!SeekFile(_file, offset) || fwrite(_row.data(), _row.size(), 1, _file) != 1)
+                {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        bool Close()
+        {
+            const bool closed = _file == nullptr || fclose(_file) == 0;
+            _file = nullptr;
+            return closed;
+        }
+    };
+
+    bool WriteBmp(const std::wstring& path, const std::vector<uint8_t>& image, uint32_t width, uint32_t height)
+    {
+        BmpTileWriter writer;
+        return writer.Open(path, width, height) && writer.WriteTile(image.data(), 0, 0, width, height) && writer.Close();
+    }
+
+    // Renders a still of any size in square tiles of tileSize pixels, a multiple
+    // of CpuRayTracingPipeline::TileSize, with two tile images that are reused:
+    // while one tile is traced on all threads with LaunchTiles, the previous one
+    // is written to the BMP. Memory for the image stays the same for any
+    // resolution.
+    bool RenderTiled(TaskPool& taskPool, const CpuAccelerationStructure& topLevel, CpuRayTracingPipeline& pipeline, OutputImage& output,
+        uint32_t width, uint32_t height, uint32_t tileSize, const std::wstring& outputPath)
+    {
+        BmpTileWriter writer;
+        if (!writer.Open(outputPath, width, height))
+        {
+            return false;
+        }
+
+        const uint32_t launchTileSize = CpuRayTracingPipeline::TileSize;
+        const uint32_t launchTileNumX = CpuRayTracingPipeline::GetTileNum(width);
+        const uint32_t tileNumX = (width + tileSize - 1) / tileSize;
+        const uint32_t tileNumY = (height + tileSize - 1) / tileSize;
+
+        std::vector<uint8_t> tileImages[2] = { std::vector<uint8_t>(tileSize * tileSize * 4), std::vector<uint8_t>(tileSize * tileSize * 4) };
+        std::vector<uint32_t> launchTiles;
+        std::future<bool> pendingWrite;
+        bool written = true;
+
+        const auto start = std::chrono::high_resolution_clock::now();
+        double traceMilliseconds = 0.0;
+        uint64_t rayNum = 0;
+
+        for (uint32_t tile = 0; tile < tileNumX * tileNumY; tile++)
+        {
+            const uint32_t beginX = tile % tileNumX * tileSize;
+            const uint32_t beginY = tile / tileNumX * tileSize;
+            const uint32_t tileWidth = std::min(tileSize, width - beginX);
+            const uint32_t tileHeight = std::min(tileSize, height - beginY);
+
+            // The launch tiles covering this one, numbered like in the whole launch
+            launchTiles.clear();
+            for (uint32_t y = beginY / launchTileSize; y < (beginY + tileHeight + launchTileSize - 1) / launchTileSize; y++)
+            {
+                for (uint32_t x = beginX / launchTileSize; x < (beginX + tileWidth + launchTileSize - 1) / launchTileSize; x++)
+                {
+                    launchTiles.push_back(y * launchTileNumX + x);
+                }
+            }
+
+            std::vector<uint8_t>& tileImage = tileImages[tile % 2];
+            output.Pixels = tileImage.data();
+            output.Origin[0] = beginX;
+            output.Origin[1] = beginY;
+            output.Width = tileWidth;
+
+            CpuLaunchStats stats;
+            pipeline.LaunchTiles(taskPool, topLevel, width, height, launchTiles.data(), (uint32_t)launchTiles.size(), &stats);
+            traceMilliseconds += stats.Milliseconds;
+            rayNum += stats.RayNum;
+
+            // The other tile image is free again once its write is done
+            if (pendingWrite.valid())
+            {
+                written = pendingWrite.get() && written;
+            }
+            pendingWrite = std::async(std::launch::async, [&writer, &tileImage, beginX, beginY, tileWidth, tileHeight]()
+            {
+                return writer.WriteTile(tileImage.data(), beginX, beginY, tileWidth, tileHeight);
+            });
+        }
+
+        if (pendingWrite.valid())
+        {
+            written = pendingWrite.get() && written;
+        }
+        written = writer.Close() && written;
+
+        const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        std::wcout << width << L"x" << height << L" in " << tileNumX * tileNumY << L" tiles of " << tileSize << L"x" << tileSize << L" on "
+            << taskPool.GetThreadNum() << L" threads: " << milliseconds << L" ms, " << traceMilliseconds << L" ms tracing, " << rayNum
+            << L" rays, " << (traceMilliseconds > 0.0 ? rayNum / (traceMilliseconds * 1000.0) : 0.0) << L" Mrays/s, "
+            << tileSize * tileSize * 4 * 2 / 1024 << L" KB of tile images for " << uint64_t(width) * height * 4 / 1024 << L" KB of pixels\n";
+        return written;
+    }
+
+    // Filters the traced colors with the guides the hit shaders wrote and stores
+    // the result to the image. Like launches it runs repeatNum times and reports
+    // the fastest.
+    void DenoiseImage(TaskPool& taskPool, const DenoiserImages& denoiserImages, uint32_t width, uint32_t height, uint32_t repeatNum,
+        std::vector<uint8_t>& image)
+    {
+        CpuDenoiserInput input;
+        input.Width = width;
+        input.Height = height;
+        input.Color = denoiserImages.Color.data();
+        input.Albedo = denoiserImages.Albedo.data();
+        input.Normal = denoiserImages.Normal.data();
+        input.Depth = denoiserImages.Depth.data();
+
+        CpuDenoiser denoiser;
+        const CpuDenoiserSettings settings;
+        std::vector<float> denoised(denoiserImages.Color.size());
+        double bestMilliseconds = 0.0;
+        for (uint32_t i = 0; i < repeatNum; i++)
+        {
+            const auto start = std::chrono::high_resolution_clock::now();
+            denoiser.Denoise(taskPool, input, settings, denoised.data());
+            const double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+            if (i == 0 || milliseconds < bestMilliseconds)
+            {
+                bestMilliseconds = milliseconds;
+            }
+        }
+
+        for (size_t i = 0; i < size_t(width) * height; i++)
+        {
+            StorePixel(Float3(denoised.data() + i * 3), image.data() + i * 4);
+        }
+
+        const double megapixels = double(width) * height / 1000000.0;
+        std::wcout << L"Denoised with " << settings.IterationNum << L" iterations on " << taskPool.GetThreadNum() << L" threads: "
+            << bestMilliseconds << L" ms, " << megapixels * 1000.0 / bestMilliseconds << L" Mpixels/s"
+            << (repeatNum > 1 ? L" (fastest of " + std::to_wstring(repeatNum) + L" runs)" : L"") << L"\n";
+    }
+}
+
+static int Render(int argc, const wchar_t* const* argv)
+{
+    std::wstring scenePath;
+    std::wstring outputPath = L"CpuRaytracer.bmp";
+    std::wstring textureFolder = L"Assets/Textures/";
+    uint32_t width = 1280;
+    uint32_t height = 720;
+    uint32_t threadNum = 0;
+    uint32_t frameNum = 1;
+    bool benchmark = false;
+    bool packets = false;
+    bool sample09 = false;
+    bool adaptive = false;
+    bool denoise = false;
+    uint32_t tileSize = 0;
+    ShadingSettings settings;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::wstring argument = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (argument == L"-output" && hasValue)
+        {
+            outputPath = argv[++i];
+        }
+        else if (argument == L"-width" && hasValue)
+        {
+            width = (uint32_t)std::stoul(argv[++i]);
+        }
+        else if (argument == L"-height" && hasValue)
+        {
+            height = (uint32_t)std::stoul(argv[++i]);
+        }
+        else if (argument == L"-threads" && hasValue)
+        {
+            threadNum = (uint32_t)std::stoul(argv[++i]);
+        }
+        else if (argument == L"-frames" && hasValue)
+        {
+            frameNum = std::max(1u, (uint32_t)std::stoul(argv[++i]));
+        }
+        else if (argument == L"-shadows" && hasValue)
+        {
+            settings.shadowRayCount = (uint32_t)std::stoul(argv[++i]);
+        }
+        else if (argument == L"-progressive" && hasValue)
+        {
+            settings.progressive = true;
+            settings.maxSampleCount = std::max(1u, (uint32_t)std::stoul(argv[++i]));
+        }
+        else if (argument == L"-adaptive" && hasValue)
+        {
+            settings.progressive = true;
+            settings.maxSampleCount = std::max(1u, (uint32_t)std::stoul(argv[++i]));
+            adaptive = true;
+        }
+        else if (argument == L"-tiled" && hasValue)
+        {
+            const uint32_t launchTileSize = CpuRayTracingPipeline::TileSize;
+            tileSize = (std::max(1u, (uint32_t)std::stoul(argv[++i])) + launchTileSize - 1) / launchTileSize * launchTileSize;
+        }
+        else if (argument == L"-converge" && hasValue)
+        {
+            settings.convergenceError = std::stof(argv[++i]);
+        }
+        else if (argument == L"-textures" && hasValue)
+        {
+            textureFolder = argv[++i];
+        }
+        else if (argument == L"-benchmark")
+        {
+            benchmark = true;
+        }
+        else if (argument == L"-denoise")
+        {
+            denoise = true;
+        }
+        else if (argument == L"-packets")
+        {
+            packets = true;
+        }
+        else if (argument == L"-sample09")
+        {
+            sample09 = true;
+        }
+        else if (scenePath.empty() && argument[0] != L'-')
+        {
+            scenePath = argument;
+        }
+        else
+        {
+            std::wcerr << L"Unexpected argument " << argument << L"\n"
+                << L"Usage: CpuRaytracer [scene] [-output image.bmp] [-width W] [-height H] [-threads N] [-frames N] [-shadows N] [-progressive N] [-adaptive N] [-converge E] [-tiled S] [-textures folder] [-benchmark] [-packets] [-sample09] [-denoise]\n";
+            return 1;
+        }
+    }
+
+    if (width == 0 || height == 0)
+    {
+        std::wcerr << L"The image must not be empty\n";
+        return 1;
+    }
+    if (!BmpTileWriter::IsSizeSupported(width, height))
+    {
+        std::wcerr << L"The image is too large for a BMP\n";
+        return 1;
+    }
+    if (tileSize > 0 && settings.progressive)
+    {
+        std::wcerr << L"-tiled renders a single sample per pixel\n";
+        return 1;
+    }
+    if (tileSize > 0 && denoise)
+    {
+        std::wcerr << L"-denoise needs the whole image\n";
+        return 1;
+    }
+
+    TaskPool taskPool(threadNum);
+    SceneCache cache;
+    ImportedScene importedScene;
+    SceneView scene;
+    std::wstring error;
+
+    if (sample09)
+    {
+        if (!scenePath.empty())
+        {
+            std::wcerr << L"-sample09 renders its own scene\n";
+            return 1;
+        }
+
+        // The benchmark's shadow rays go where the sample's secondary rays go
+        GenerateSecondaryRaysScene(importedScene);
+        scene = importedScene.GetView();
+        settings.lightDirection = Sample09LightDirection;
+    }
+    else if (scenePath.empty())
+    {
+        GenerateProceduralScene(textureFolder, importedScene);
+        scene = importedScene.GetView();
+    }
+    else
+    {
+        if (!LoadScene(scenePath, taskPool, cache, importedScene, scene, error))
+        {
+            std::wcerr << L"Failed to load " << scenePath << L": " << error << L"\n";
+            return 1;
+        }
+        scene.FitToSize(2.0f);
+    }
+
+    // One BLAS with a single geometry per mesh
+    const auto buildStart = std::chrono::high_resolution_clock::now();
+    std::vector<Bvh> bottomLevels(scene.Meshes.size());
+    uint64_t triangleNum = 0;
+    for (size_t i = 0; i < scene.Meshes.size(); i++)
+    {
+        const MeshView& mesh = scene.Meshes[i];
+
+        if (!BuildBvh(taskPool, std::vector<BvhGeometryInput>(1, GetGeometryInput(mesh)), BvhBuildSettings(), bottomLevels[i], error))
+        {
+            std::wcerr << mesh.Name << L": " << error << L"\n";
+            return 1;
+        }
+        triangleNum += bottomLevels[i].Triangles.size();
+    }
+
+    // Instances like CreateAccelerationStructures of the sample: instanceId selects
+    // the object, instanceOffset its hit group, the handle its BLAS
+    std::vector<const Bvh*> bottomLevelPointers;
+    for (const Bvh& bottomLevel : bottomLevels)
+    {
+        bottomLevelPointers.push_back(&bottomLevel);
+    }
+
+    std::vector<VkGeometryInstance> instances(scene.Instances.size());
+    for (size_t i = 0; i < scene.Instances.size(); i++)
+    {
+        VkGeometryInstance& instance = instances[i];
+        instance.instanceId = scene.Instances[i].MeshIndex;
+        instance.mask = 0xff;
+        instance.instanceOffset = scene.Instances[i].MeshIndex;
+        instance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_CULL_DISABLE_BIT_NV;
+        instance.accelerationStructureHandle = scene.Instances[i].MeshIndex;
+        memcpy(instance.transform, scene.Instances[i].Transform, sizeof(instance.transform));
+    }
+
+    CpuAccelerationStructure topLevel;
+    if (!topLevel.Build(taskPool, bottomLevelPointers, instances.data(), (uint32_t)instances.size(), error))
+    {
+        std::wcerr << error << L"\n";
+        return 1;
+    }
+
+    const double buildMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - buildStart).count();
+    std::wcout << scene.Meshes.size() << L" meshes, " << instances.size() << L" instances, " << triangleNum << L" triangles, BVHs built in "
+        << buildMilliseconds << L" ms, traversed with " << GetBvh8KernelName(topLevel.GetTraversalKernel()) << L"\n";
+
+    if (benchmark)
+    {
+        RunTraversalBenchmark(taskPool, topLevel, width, height, settings);
+        RunInstancingBenchmark(taskPool, bottomLevelPointers, instances, width, height, settings);
+        RunRefitBenchmark(taskPool, scene);
+    }
+
+    // Materials, textured meshes use the box shader like in CreateImportedObject
+    std::vector<Texture> textures(scene.Materials.size());
+    std::vector<RenderObject> objects(scene.Meshes.size());
+    for (size_t i = 0; i < scene.Meshes.size(); i++)
+    {
+        const MeshView& mesh = scene.Meshes[i];
+        objects[i].mesh = &mesh;
+
+        if (mesh.MaterialIndex < scene.Materials.size() && mesh.Texcoords != nullptr)
+        {
+            const ImportedMaterial& material = scene.Materials[mesh.MaterialIndex];
+            Texture& texture = textures[mesh.MaterialIndex];
+            if (!material.BaseColorTexture.empty() && (!texture.Texels.empty() || texture.Load(material.BaseColorTexture)))
+            {
+                objects[i].texture = &texture;
+            }
+            else if (!material.BaseColorTexture.empty())
+            {
+                std::wcout << mesh.Name << L": failed to load " << material.BaseColorTexture << L", drawn untextured\n";
+            }
+        }
+    }
+
+    // Tiled rendering only keeps tiles in memory
+    std::vector<uint8_t> image(tileSize == 0 ? size_t(width) * height * 4 : 0);
+    OutputImage output;
+    output.Pixels = image.data();
+    output.Width = width;
+
+    FrameUniforms frame;
+    AccumulationImages accumulation;
+    if (settings.progressive)
+    {
+        accumulation.Accumulation.resize(width * height * 4);
+        accumulation.Variance.resize(width * height);
+    }
+
+    DenoiserImages denoiserImages;
+    if (denoise)
+    {
+        denoiserImages.Color.resize(size_t(width) * height * 3);
+        denoiserImages.Albedo.resize(size_t(width) * height * 3);
+        denoiserImages.Normal.resize(size_t(width) * height * 3);
+        denoiserImages.Depth.resize(size_t(width) * height);
+    }
+
+    CpuRayTracingPipeline pipeline;
+    pipeline.SetRayGenShader([&](CpuShaderContext& context)
+    {
+        RayGen(context, settings, frame, accumulation, denoiserImages, output);
+    });
+    if (packets)
+    {
+        pipeline.SetPrimaryRays([&settings, &frame](uint32_t x, uint32_t y, uint32_t launchWidth, uint32_t launchHeight, CpuRay& ray)
+        {
+            GetPrimaryRay(x, y, launchWidth, launchHeight, settings, frame, ray);
+        }, PrimaryRayFlags, 0xff);
+    }
+    pipeline.AddMissShader([](CpuShaderContext&, const CpuRay&, void* payload)
+    {
+        Miss(payload);
+    });
+    if (sample09)
+    {
+        // Hit groups and miss shaders in the order of the sample's shader binding table
+        pipeline.AddMissShader([](CpuShaderContext&, const CpuRay& ray, void* payload)
+        {
+            SecondaryMiss09(ray, payload);
+        });
+        pipeline.AddHitGroup([](CpuShaderContext& context, const CpuRay& ray, const CpuHit& hit, void* payload)
+        {
+            ClosestHit09(context, ray, hit, payload);
+        });
+        pipeline.AddHitGroup([](CpuShaderContext&, const CpuRay&, const CpuHit& hit, void* payload)
+        {
+            SecondaryClosestHit09(hit, payload);
+        });
+    }
+    else
+    {
+        pipeline.AddMissShader([](CpuShaderContext&, const CpuRay&, void* payload)
+        {
+            ShadowMiss(payload);
+        });
+        for (const RenderObject& object : objects)
+        {
+            const RenderObject* objectPointer = &object;
+            pipeline.AddHitGroup([&settings, &frame, objectPointer](CpuShaderContext& context, const CpuRay& ray, const CpuHit& hit,
+                void* payload)
+            {
+                ClosestHit(context, settings, frame, *objectPointer, ray, hit, payload);
+            });
+        }
+    }
+
+    if (tileSize > 0)
+    {
+        if (!RenderTiled(taskPool, topLevel, pipeline, output, width, height, tileSize, outputPath))
+        {
+            std::wcerr << L"Failed to write " << outputPath << L"\n";
+            return 1;
+        }
+        std::wcout << L"Written to " << outputPath << L"\n";
+        return 0;
+    }
+    else if (adaptive)
+    {
+        RenderAdaptive(taskPool, topLevel, pipeline, settings, frame, accumulation, width, height);
+    }
+    else if (settings.progressive)
+    {
+        RenderProgressive(taskPool, topLevel, pipeline, settings, frame, accumulation, width, height);
+    }
+    else
+    {
+        CpuLaunchStats bestStats;
+        for (uint32_t frameIndex = 0; frameIndex < frameNum; frameIndex++)
+        {
+            CpuLaunchStats stats;
+            pipeline.Launch(taskPool, topLevel, width, height, &stats);
+            if (frameIndex == 0 || stats.Milliseconds < bestStats.Milliseconds)
+            {
+                bestStats = stats;
+            }
+        }
+
+        std::wcout << width << L"x" << height << L" on " << bestStats.ThreadNum << L" threads: " << bestStats.Milliseconds << L" ms, "
+            << bestStats.RayNum << L" rays (" << bestStats.RayNum - bestStats.OcclusionRayNum << L" closest hit, " << bestStats.OcclusionRayNum
+            << L" occlusion), " << bestStats.GetMegaRaysPerSecond() << L" Mrays/s"
+            << (frameNum > 1 ? L" (fastest of " + std::to_wstring(frameNum) + L" frames)" : L"") << L"\n";
+    }
+
+    if (denoise)
+    {
+        DenoiseImage(taskPool, denoiserImages, width, height, frameNum, image);
+    }
+
+    // Reference images are compared by their checksum first
+    wchar_t checksum[17];
+    swprintf(checksum, 17, L"%016llx", (unsigned long long)ChecksumBytes(image.data(), image.size()));
+    std::wcout << L"Image checksum " << checksum << L"\n";
+
+    if (!WriteBmp(outputPath, image, width, height))
+    {
+        std::wcerr << L"Failed to write " << outputPath << L"\n";
+        return 1;
+    }
+    std::wcout << L"Written to " << outputPath << L"\n";
+    return 0;
+}
+
+#ifdef _WIN32
+
+int wmain(int argc, wchar_t* argv[])
+{
+    return Render(argc, argv);
+}
+
+#else
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::wstring> arguments;
+    for (int i = 0; i < argc; i++)
+    {
+        const std::string argument = argv[i];
+        arguments.push_back(std::wstring(argument.begin(), argument.end()));
+    }
+
+    std::vector<const wchar_t*> pointers;
+    for (const std::wstring& argument : arguments)
+    {
+        pointers.push_back(argument.c_str());
+    }
+
+    return Render(argc, pointers.data());
+}
+
+#endif
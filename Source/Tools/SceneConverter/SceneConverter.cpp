@@ -0,0 +1,155 @@
+#include "../../Common/MeshImporter.h"
+#include "../../Common/MeshProcessing.h"
+#include "../../Common/SceneCache.h"
+#include "../../Common/TaskPool.h"
+#include <chrono>
+#include <iostream>
+#include <string>
+
+// Converts OBJ and glTF files into the binary scene cache that the samples map
+// at startup, and reports how much faster loading the cache is than importing.
+//
+// SceneConverter <input.obj|.gltf|.glb> [output.vkscene] [-threads N] [-verify] [-noreorder]
+//
+// -noreorder keeps the triangles and vertices in authoring order, to compare the
+// simulated attribute fetches against the locality sorted meshes.
+
+static double GetMilliseconds(std::chrono::high_resolution_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static int Convert(int argc, const wchar_t* const* argv)
+{
+    std::wstring inputPath;
+    std::wstring outputPath;
+    uint32_t threadNum = 0;
+    bool verify = false;
+    bool reorder = true;
+
+    for (int i = 1; i < argc; i++)
+    {
+        const std::wstring argument = argv[i];
+        if (argument == L"-threads" && i + 1 < argc)
+        {
+            threadNum = (uint32_t)std::stoul(argv[++i]);
+        }
+        else if (argument == L"-verify")
+        {
+            verify = true;
+        }
+        else if (argument == L"-noreorder")
+        {
+            reorder = false;
+        }
+        else if (inputPath.empty())
+        {
+            inputPath = argument;
+        }
+        else if (outputPath.empty())
+        {
+            outputPath = argument;
+        }
+        else
+        {
+            std::wcerr << L"Unexpected argument " << argument << L"\n";
+            return 1;
+        }
+    }
+
+    if (inputPath.empty())
+    {
+        std::wcerr << L"Usage: SceneConverter <input.obj|.gltf|.glb> [output.vkscene] [-threads N] [-verify] [-noreorder]\n";
+        return 1;
+    }
+    if (outputPath.empty())
+    {
+        // The name the samples look for next to the source
+        outputPath = inputPath + L".vkscene";
+    }
+
+    TaskPool taskPool(threadNum);
+    ImportedScene scene;
+    ImportStats stats;
+    std::wstring error;
+
+    if (!ImportScene(inputPath, taskPool, scene, stats, error, reorder))
+    {
+        std::wcerr << L"Failed to import " << inputPath << L": " << error << L"\n";
+        return 1;
+    }
+
+    std::wcout << inputPath << L": " << stats.TriangleNum << L" triangles, " << stats.VertexNum << L" vertices, "
+        << scene.Meshes.size() << L" meshes, " << scene.Instances.size() << L" instances imported in " << stats.Milliseconds
+        << L" ms on " << stats.ThreadNum << L" threads, " << stats.OptimizeMilliseconds << L" ms of that sorting for locality\n";
+
+    // 4 bytes is one quantized normal or texcoord, 12 a float position
+    for (uint32_t vertexStride : { 4u, 12u })
+    {
+        VertexFetchStats fetchStats;
+        for (const ImportedMesh& mesh : scene.Meshes)
+        {
+            const VertexFetchStats meshStats = SimulateVertexFetch(mesh.Positions.data(), mesh.Indices, vertexStride);
+            fetchStats.TriangleNum += meshStats.TriangleNum;
+            fetchStats.LineTouchNum += meshStats.LineTouchNum;
+            fetchStats.MissNum += meshStats.MissNum;
+        }
+
+        std::wcout << L"Simulated fetches with a " << vertexStride << L" byte stride: " << fetchStats.GetLinesPerTriangle()
+            << L" cache lines and " << fetchStats.GetMissesPerTriangle() << L" misses per triangle\n";
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+    if (!WriteSceneCache(outputPath, scene.GetView(), inputPath, error))
+    {
+        std::wcerr << L"Failed to write " << outputPath << L": " << error << L"\n";
+        return 1;
+    }
+    const double writeMilliseconds = GetMilliseconds(start);
+
+    // Loading the file back is what a sample does at startup, with and
+    // without touching every stream for the checksums
+    start = std::chrono::high_resolution_clock::now();
+    SceneCache cache;
+    if (!cache.Load(outputPath, taskPool, verify, error))
+    {
+        std::wcerr << L"Failed to load " << outputPath << L": " << error << L"\n";
+        return 1;
+    }
+    const double loadMilliseconds = GetMilliseconds(start);
+
+    std::wcout << outputPath << L": " << cache.GetFileSize() / (1024.0 * 1024.0) << L" MB written in " << writeMilliseconds
+        << L" ms, loaded in " << loadMilliseconds << (verify ? L" ms with" : L" ms without") << L" stream checksums ("
+        << stats.Milliseconds / loadMilliseconds << L"x faster than importing)\n";
+
+    return 0;
+}
+
+#ifdef _WIN32
+
+int wmain(int argc, wchar_t* argv[])
+{
+    return Convert(argc, argv);
+}
+
+#else
+
+int main(int argc, char* argv[])
+{
+    std::vector<std::wstring> arguments;
+    for (int i = 0; i < argc; i++)
+    {
+        const std::string argument = argv[i];
+        arguments.push_back(std::wstring(argument.begin(), argument.end()));
+    }
+
+    std::vector<const wchar_t*> pointers;
+    for (const std::wstring& argument : arguments)
+    {
+        pointers.push_back(argument.c_str());
+    }
+
+    return Convert(argc, pointers.data());
+}
+
+#endif